@@ -2352,57 +2352,69 @@ public:
 
 		auto params = getParams();
 		assert(params->ndim() == 3);
+		const int64_t dim[3] = {(int64_t)params->dim(0),
+			(int64_t)params->dim(1), (int64_t)params->dim(2)};
+
+		// Each thread integrates over a range of knot planes, partial sums are
+		// added in a fixed order so the result does not depend on scheduling
+		size_t nchunk = std::min<size_t>(numThreads(), dim[0]);
+		std::vector<double> sums(6*nchunk, 0);
+		nchunk = parallelFor(0, dim[0], [&](size_t chunk, size_t x0, size_t x1)
+		{
+			double& dphi2_dx2 = sums[6*chunk];
+			double& dphi2_dy2 = sums[6*chunk+1];
+			double& dphi2_dz2 = sums[6*chunk+2];
+			double& dphi2_dxy = sums[6*chunk+3];
+			double& dphi2_dyz = sums[6*chunk+4];
+			double& dphi2_dxz = sums[6*chunk+5];
+
+			// We use NN interpolator because it is fast and handles boundary
+			// conditions
+			NNInterpNDView<double> dvw(params);
+			double ind[3];
+			int64_t pos[3];
+
+			// Create a counter to iterate over [0,4] ie [-2,2] in 6 directions
+			Counter<int, 3> counter(3);
+			for(size_t dd=0; dd<3;dd++)
+				counter.sz[dd] = 9;
+
+			//integrate over the knots in the slab
+			for(pos[0] = x0; pos[0] < (int64_t)x1; pos[0]++) {
+			for(pos[1] = 0; pos[1] < dim[1]; pos[1]++) {
+			for(pos[2] = 0; pos[2] < dim[2]; pos[2]++) {
+				double phi_ijk = dvw.get(3, pos);
+				do {
+					for(size_t dd=0; dd<3; dd++)
+						ind[dd] = pos[dd] + counter.pos[dd] - 4;
+					double phi_lmn = dvw.get(3, ind);
+
+					double xv = U200[counter.pos[0]][counter.pos[1]][counter.pos[2]];
+					double yv = U200[counter.pos[1]][counter.pos[0]][counter.pos[2]];
+					double zv = U200[counter.pos[2]][counter.pos[1]][counter.pos[0]];
+					double xyv = U110[counter.pos[0]][counter.pos[1]][counter.pos[2]];
+					double xzv = U110[counter.pos[0]][counter.pos[2]][counter.pos[1]];
+					double yzv = U110[counter.pos[1]][counter.pos[2]][counter.pos[0]];
+
+					dphi2_dx2 += phi_ijk*phi_lmn*xv;
+					dphi2_dy2 += phi_ijk*phi_lmn*yv;
+					dphi2_dz2 += phi_ijk*phi_lmn*zv;
+					dphi2_dxy += phi_ijk*phi_lmn*xyv;
+					dphi2_dyz += phi_ijk*phi_lmn*yzv;
+					dphi2_dxz += phi_ijk*phi_lmn*xzv;
+				} while(counter.advance());
+			}
+			}
+			}
+		}, nchunk);
 
-		double dphi2_dx2 = 0;
-		double dphi2_dy2 = 0;
-		double dphi2_dz2 = 0;
-		double dphi2_dxz = 0;
-		double dphi2_dxy = 0;
-		double dphi2_dyz = 0;
-
-		// We use NN interpolator because it is fast and handles boundary
-		// conditions
-		NNInterpNDView<double> dvw(params);
-		double ind[3];
-
-		// Create a counter to iterate over [0,4] ie [-2,2] in 6 directions
-		Counter<int, 3> counter(3);
-		for(size_t dd=0; dd<3;dd++)
-			counter.sz[dd] = 9;
-
-		//integrate over all the knots
-		Counter<int64_t, 3> it(3, (int64_t*)params->dim());
-		do {
-			double phi_ijk = dvw.get(3, it.pos);
-			do {
-				for(size_t dd=0; dd<3; dd++)
-					ind[dd] = it.pos[dd] + counter.pos[dd] - 4;
-				double phi_lmn = dvw.get(3, ind);
-
-				double xv = U200[counter.pos[0]][counter.pos[1]][counter.pos[2]];
-				double yv = U200[counter.pos[1]][counter.pos[0]][counter.pos[2]];
-				double zv = U200[counter.pos[2]][counter.pos[1]][counter.pos[0]];
-				double xyv = U110[counter.pos[0]][counter.pos[1]][counter.pos[2]];
-				double xzv = U110[counter.pos[0]][counter.pos[2]][counter.pos[1]];
-				double yzv = U110[counter.pos[1]][counter.pos[2]][counter.pos[0]];
-
-				dphi2_dx2 += phi_ijk*phi_lmn*xv;
-				dphi2_dy2 += phi_ijk*phi_lmn*yv;
-				dphi2_dz2 += phi_ijk*phi_lmn*zv;
-				dphi2_dxy += phi_ijk*phi_lmn*xyv;
-				dphi2_dyz += phi_ijk*phi_lmn*yzv;
-				dphi2_dxz += phi_ijk*phi_lmn*xzv;
-			} while(counter.advance());
-		} while(it.advance());
-
-		double v = dphi2_dx2/pow(params->spacing(0),4) +
-			dphi2_dy2/pow(params->spacing(1),4) +
-			dphi2_dz2/pow(params->spacing(2),4) +
-			2*dphi2_dxy/(pow(params->spacing(0),2)*pow(params->spacing(1),2)) +
-			2*dphi2_dxz/(pow(params->spacing(0),2)*pow(params->spacing(2),2)) +
-			2*dphi2_dyz/(pow(params->spacing(1),2)*pow(params->spacing(2),2));
+		double dphi2[6] = {0, 0, 0, 0, 0, 0};
+		for(size_t cc=0; cc<nchunk; cc++) {
+			for(size_t tt=0; tt<6; tt++)
+				dphi2[tt] += sums[6*cc+tt];
+		}
 
-		return v;
+		return thinPlateSum(dphi2);
 	};
 
 	double thinPlateEnergy(size_t len, double* grad)
@@ -2414,87 +2426,86 @@ public:
 			throw INVALID_ARGUMENT("Incorrect length of grad array");
 
 		assert(params->ndim() == 3);
+		const int64_t dim[3] = {(int64_t)params->dim(0),
+			(int64_t)params->dim(1), (int64_t)params->dim(2)};
+
+		// Each thread integrates over a range of knot planes and writes the
+		// gradient of those knots, partial sums are added in a fixed order
+		size_t nchunk = std::min<size_t>(numThreads(), dim[0]);
+		std::vector<double> sums(6*nchunk, 0);
+		nchunk = parallelFor(0, dim[0], [&](size_t chunk, size_t x0, size_t x1)
+		{
+			double& dphi2_dx2 = sums[6*chunk];
+			double& dphi2_dy2 = sums[6*chunk+1];
+			double& dphi2_dz2 = sums[6*chunk+2];
+			double& dphi2_dxy = sums[6*chunk+3];
+			double& dphi2_dyz = sums[6*chunk+4];
+			double& dphi2_dxz = sums[6*chunk+5];
+
+			NNInterpNDView<double> dvw(params);
+			double ind[3];
+			int64_t pos[3];
+
+			// Create a counter to iterate over [0,4] ie [-2,2] in 6 directions
+			Counter<int, 3> counter(3);
+			for(size_t dd=0; dd<3;dd++)
+				counter.sz[dd] = 9;
+
+			//integrate over the knots in the slab
+			size_t ii = x0*dim[1]*dim[2];
+			for(pos[0] = x0; pos[0] < (int64_t)x1; pos[0]++) {
+			for(pos[1] = 0; pos[1] < dim[1]; pos[1]++) {
+			for(pos[2] = 0; pos[2] < dim[2]; pos[2]++) {
+				// iterate through abc
+				double tmp[6] = {0, 0, 0, 0, 0, 0};
+				double phi_ijk = dvw.get(3, pos);
+
+				// for all the neighbors of abc, get
+				do {
+					for(size_t dd=0; dd<3; dd++)
+						ind[dd] = pos[dd] + (counter.pos[dd] - 4);
+					double phi_lmn = dvw.get(3, ind);
 
-		double dphi2_dx2 = 0;
-		double dphi2_dy2 = 0;
-		double dphi2_dz2 = 0;
-		double dphi2_dxz = 0;
-		double dphi2_dxy = 0;
-		double dphi2_dyz = 0;
-		double reg = 0;
-
-		NNInterpNDView<double> dvw(params);
-		double ind[3];
-
-		// Create a counter to iterate over [0,4] ie [-2,2] in 6 directions
-		Counter<int, 3> counter(3);
-		for(size_t dd=0; dd<3;dd++)
-			counter.sz[dd] = 9;
+					for(size_t dd=0; dd<3; dd++)
+						ind[dd] = pos[dd] - (counter.pos[dd] - 4);
+					double phi_abc = dvw.get(3, ind);
+
+					double xv = U200[counter.pos[0]][counter.pos[1]][counter.pos[2]];
+					double yv = U200[counter.pos[1]][counter.pos[0]][counter.pos[2]];
+					double zv = U200[counter.pos[2]][counter.pos[1]][counter.pos[0]];
+					double xyv = U110[counter.pos[0]][counter.pos[1]][counter.pos[2]];
+					double xzv = U110[counter.pos[0]][counter.pos[2]][counter.pos[1]];
+					double yzv = U110[counter.pos[1]][counter.pos[2]][counter.pos[0]];
+
+					tmp[0] += phi_abc*xv  + phi_lmn*xv;
+					tmp[1] += phi_abc*yv  + phi_lmn*yv;
+					tmp[2] += phi_abc*zv  + phi_lmn*zv;
+					tmp[3] += phi_abc*xyv + phi_lmn*xyv;
+					tmp[4] += phi_abc*yzv + phi_lmn*yzv;
+					tmp[5] += phi_abc*xzv + phi_lmn*xzv;
+
+					dphi2_dx2 += phi_ijk*phi_lmn*xv;
+					dphi2_dy2 += phi_ijk*phi_lmn*yv;
+					dphi2_dz2 += phi_ijk*phi_lmn*zv;
+					dphi2_dxy += phi_ijk*phi_lmn*xyv;
+					dphi2_dyz += phi_ijk*phi_lmn*yzv;
+					dphi2_dxz += phi_ijk*phi_lmn*xzv;
+
+				} while(counter.advance());
+
+				grad[ii++] = thinPlateSum(tmp);
+			}
+			}
+			}
+		}, nchunk);
 
-		//integrate over all the knots
-		int ii = 0;
-		Counter<int64_t, 3> it(3, (int64_t*)params->dim());
-		ii = 0;
-		do {
-			// iterate through abc
-			double tmp_dphi2_dx2 = 0;
-			double tmp_dphi2_dy2 = 0;
-			double tmp_dphi2_dz2 = 0;
-			double tmp_dphi2_dxz = 0;
-			double tmp_dphi2_dxy = 0;
-			double tmp_dphi2_dyz = 0;
-			double phi_ijk = dvw.get(3, it.pos);
-
-			// for all the neighbors of abc, get
-			do {
-				for(size_t dd=0; dd<3; dd++)
-					ind[dd] = it.pos[dd] + (counter.pos[dd] - 4);
-				double phi_lmn = dvw.get(3, ind);
-
-				for(size_t dd=0; dd<3; dd++)
-					ind[dd] = it.pos[dd] - (counter.pos[dd] - 4);
-				double phi_abc = dvw.get(3, ind);
-
-				double xv = U200[counter.pos[0]][counter.pos[1]][counter.pos[2]];
-				double yv = U200[counter.pos[1]][counter.pos[0]][counter.pos[2]];
-				double zv = U200[counter.pos[2]][counter.pos[1]][counter.pos[0]];
-				double xyv = U110[counter.pos[0]][counter.pos[1]][counter.pos[2]];
-				double xzv = U110[counter.pos[0]][counter.pos[2]][counter.pos[1]];
-				double yzv = U110[counter.pos[1]][counter.pos[2]][counter.pos[0]];
-
-				tmp_dphi2_dx2 += phi_abc*xv  + phi_lmn*xv;
-				tmp_dphi2_dy2 += phi_abc*yv  + phi_lmn*yv;
-				tmp_dphi2_dz2 += phi_abc*zv  + phi_lmn*zv;
-				tmp_dphi2_dxy += phi_abc*xyv + phi_lmn*xyv;
-				tmp_dphi2_dyz += phi_abc*yzv + phi_lmn*yzv;
-				tmp_dphi2_dxz += phi_abc*xzv + phi_lmn*xzv;
-
-				dphi2_dx2 += phi_ijk*phi_lmn*xv;
-				dphi2_dy2 += phi_ijk*phi_lmn*yv;
-				dphi2_dz2 += phi_ijk*phi_lmn*zv;
-				dphi2_dxy += phi_ijk*phi_lmn*xyv;
-				dphi2_dyz += phi_ijk*phi_lmn*yzv;
-				dphi2_dxz += phi_ijk*phi_lmn*xzv;
-
-			} while(counter.advance());
-
-			reg = tmp_dphi2_dx2/pow(params->spacing(0),4) +
-				tmp_dphi2_dy2/pow(params->spacing(1),4) +
-				tmp_dphi2_dz2/pow(params->spacing(2),4) +
-				2*tmp_dphi2_dxy/(pow(params->spacing(0),2)*pow(params->spacing(1),2)) +
-				2*tmp_dphi2_dxz/(pow(params->spacing(0),2)*pow(params->spacing(2),2)) +
-				2*tmp_dphi2_dyz/(pow(params->spacing(1),2)*pow(params->spacing(2),2));
-			grad[ii++] = reg;
-		} while(it.advance());
-
-		double v = dphi2_dx2/pow(params->spacing(0),4) +
-			dphi2_dy2/pow(params->spacing(1),4) +
-			dphi2_dz2/pow(params->spacing(2),4) +
-			2*dphi2_dxy/(pow(params->spacing(0),2)*pow(params->spacing(1),2)) +
-			2*dphi2_dxz/(pow(params->spacing(0),2)*pow(params->spacing(2),2)) +
-			2*dphi2_dyz/(pow(params->spacing(1),2)*pow(params->spacing(2),2));
+		double dphi2[6] = {0, 0, 0, 0, 0, 0};
+		for(size_t cc=0; cc<nchunk; cc++) {
+			for(size_t tt=0; tt<6; tt++)
+				dphi2[tt] += sums[6*cc+tt];
+		}
 
-		return v;
+		return thinPlateSum(dphi2);
 	};
 
 	/**
@@ -2511,43 +2522,47 @@ public:
 
 		auto params = getParams();
 		assert(params->ndim() == 3);
+		const int64_t dim[3] = {(int64_t)params->dim(0),
+			(int64_t)params->dim(1), (int64_t)params->dim(2)};
+
+		// Each thread integrates over a range of knot planes, partial sums are
+		// added in a fixed order so the result does not depend on scheduling
+		size_t nchunk = std::min<size_t>(numThreads(), dim[0]);
+		std::vector<double> sums(nchunk, 0);
+		nchunk = parallelFor(0, dim[0], [&](size_t chunk, size_t x0, size_t x1)
+		{
+			// We use NN interpolator because it is fast and handles boundary
+			// conditions
+			NNInterpNDView<double> dvw(params);
+			double ind[3];
+			int64_t pos[3];
+			double reg = 0;
+
+			// Create a counter to iterate over [0,4] ie [-2,2] in 6 directions
+			Counter<int, 3> counter(3);
+			for(size_t dd=0; dd<3;dd++)
+				counter.sz[dd] = 9;
+
+			//integrate over the knots in the slab
+			for(pos[0] = x0; pos[0] < (int64_t)x1; pos[0]++) {
+			for(pos[1] = 0; pos[1] < dim[1]; pos[1]++) {
+			for(pos[2] = 0; pos[2] < dim[2]; pos[2]++) {
+				double phi_ijk = dvw.get(3, pos);
+				do {
+					for(size_t dd=0; dd<3; dd++)
+						ind[dd] = pos[dd] + counter.pos[dd] - 4;
+					double phi_lmn = dvw.get(3, ind);
+					reg += jacobianU(dir, counter.pos)*phi_ijk*phi_lmn;
+				} while(counter.advance());
+			}
+			}
+			}
+			sums[chunk] = reg;
+		}, nchunk);
 
-		// We use NN interpolator because it is fast and handles boundary
-		// conditions
-		NNInterpNDView<double> dvw(params);
-		double ind[3];
 		double reg = 0;
-
-		// Create a counter to iterate over [0,4] ie [-2,2] in 6 directions
-		Counter<int, 3> counter(3);
-		for(size_t dd=0; dd<3;dd++)
-			counter.sz[dd] = 9;
-
-		//integrate over all the knots
-		Counter<int64_t, 3> it(3, (int64_t*)params->dim());
-		do {
-			double phi_ijk = dvw.get(3, it.pos);
-			do {
-				for(size_t dd=0; dd<3; dd++)
-					ind[dd] = it.pos[dd] + counter.pos[dd] - 4;
-				double phi_lmn = dvw.get(3, ind);
-
-				switch(dir) {
-					case 0:
-						reg += U100[counter.pos[0]][counter.pos[1]][counter.pos[2]]*
-							phi_ijk*phi_lmn;
-						break;
-					case 1:
-						reg += U100[counter.pos[1]][counter.pos[0]][counter.pos[2]]*
-							phi_ijk*phi_lmn;
-						break;
-					case 2:
-						reg += U100[counter.pos[2]][counter.pos[1]][counter.pos[0]]*
-							phi_ijk*phi_lmn;
-						break;
-				}
-			} while(counter.advance());
-		} while(it.advance());
+		for(size_t cc=0; cc<nchunk; cc++)
+			reg += sums[cc];
 
 		return reg/pow(params->spacing(dir),2);
 	};
@@ -2570,53 +2585,58 @@ public:
 		assert(params->ndim() == 3);
 		if(len != getParams()->elements())
 			throw INVALID_ARGUMENT("Incorrect length of grad array");
+		const int64_t dim[3] = {(int64_t)params->dim(0),
+			(int64_t)params->dim(1), (int64_t)params->dim(2)};
+
+		// Each thread integrates over a range of knot planes and writes the
+		// gradient of those knots, partial sums are added in a fixed order
+		size_t nchunk = std::min<size_t>(numThreads(), dim[0]);
+		std::vector<double> sums(nchunk, 0);
+		nchunk = parallelFor(0, dim[0], [&](size_t chunk, size_t x0, size_t x1)
+		{
+			// We use NN interpolator because it is fast and handles boundary
+			// conditions
+			NNInterpNDView<double> dvw(params);
+			double ind[3];
+			int64_t pos[3];
+			double reg = 0;
+
+			// Create a counter to iterate over [0,4] ie [-2,2] in 6 directions
+			Counter<int, 3> counter(3);
+			for(size_t dd=0; dd<3;dd++)
+				counter.sz[dd] = 9;
+
+			//integrate over the knots in the slab
+			size_t ii = x0*dim[1]*dim[2];
+			for(pos[0] = x0; pos[0] < (int64_t)x1; pos[0]++) {
+			for(pos[1] = 0; pos[1] < dim[1]; pos[1]++) {
+			for(pos[2] = 0; pos[2] < dim[2]; pos[2]++) {
+				double dreg = 0;
+				double phi_ijk = dvw.get(3, pos);
+				do {
+					for(size_t dd=0; dd<3; dd++)
+						ind[dd] = pos[dd] + (counter.pos[dd] - 4);
+					double phi_lmn = dvw.get(3, ind);
 
-		// We use NN interpolator because it is fast and handles boundary
-		// conditions
-		NNInterpNDView<double> dvw(params);
-		double ind[3];
+					for(size_t dd=0; dd<3; dd++)
+						ind[dd] = pos[dd] - (counter.pos[dd] - 4);
+					double phi_abc = dvw.get(3, ind);
 
-		// Create a counter to iterate over [0,4] ie [-2,2] in 6 directions
-		Counter<int, 3> counter(3);
-		for(size_t dd=0; dd<3;dd++)
-			counter.sz[dd] = 9;
+					double uval = jacobianU(dir, counter.pos);
+					dreg += (phi_abc + phi_lmn)*uval;
+					reg += uval*phi_ijk*phi_lmn;
+				} while(counter.advance());
 
-		//integrate over all the knots
-		Counter<int64_t, 3> it(3, (int64_t*)params->dim());
+				grad[ii++] = dreg/pow(params->spacing(dir),2);
+			}
+			}
+			}
+			sums[chunk] = reg;
+		}, nchunk);
 
 		double reg = 0;
-		size_t ii=0;
-		do {
-			double dreg = 0;
-			double phi_ijk = dvw.get(3, it.pos);
-			do {
-				for(size_t dd=0; dd<3; dd++)
-					ind[dd] = it.pos[dd] + (counter.pos[dd] - 4);
-				double phi_lmn = dvw.get(3, ind);
-
-				for(size_t dd=0; dd<3; dd++)
-					ind[dd] = it.pos[dd] - (counter.pos[dd] - 4);
-				double phi_abc = dvw.get(3, ind);
-
-				double uval = 0;
-				switch(dir) {
-					case 0:
-						uval = U100[counter.pos[0]][counter.pos[1]][counter.pos[2]];
-						break;
-					case 1:
-						uval = U100[counter.pos[1]][counter.pos[0]][counter.pos[2]];
-						break;
-					case 2:
-						uval = U100[counter.pos[2]][counter.pos[1]][counter.pos[0]];
-						break;
-				}
-
-				dreg += (phi_abc + phi_lmn)*uval;
-				reg += uval*phi_ijk*phi_lmn;
-			} while(counter.advance());
-
-			grad[ii++] = dreg/pow(params->spacing(dir),2);
-		} while(it.advance());
+		for(size_t cc=0; cc<nchunk; cc++)
+			reg += sums[cc];
 
 		double v = reg/pow(params->spacing(dir),2);
 		return v;
@@ -4087,6 +4107,39 @@ double U100[9][9][9] =
   {0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0}}};
 
 
+private:
+	/**
+	 * @brief Combines the integrals of the squared second derivatives
+	 * (xx, yy, zz, xy, yz, xz) into the thin-plate energy
+	 */
+	double thinPlateSum(const double* dphi2)
+	{
+		using std::pow;
+		auto params = getParams();
+		return dphi2[0]/pow(params->spacing(0),4) +
+			dphi2[1]/pow(params->spacing(1),4) +
+			dphi2[2]/pow(params->spacing(2),4) +
+			2*dphi2[3]/(pow(params->spacing(0),2)*pow(params->spacing(1),2)) +
+			2*dphi2[5]/(pow(params->spacing(0),2)*pow(params->spacing(2),2)) +
+			2*dphi2[4]/(pow(params->spacing(1),2)*pow(params->spacing(2),2));
+	};
+
+	/**
+	 * @brief Returns the precomputed Jacobian integral (U100) for a knot
+	 * offset, with the derivative in direction dir
+	 */
+	double jacobianU(int dir, const int* off)
+	{
+		switch(dir) {
+			case 0:
+				return U100[off[0]][off[1]][off[2]];
+			case 1:
+				return U100[off[1]][off[0]][off[2]];
+			case 2:
+				return U100[off[2]][off[1]][off[0]];
+		}
+		return 0;
+	};
 };
 
 /**
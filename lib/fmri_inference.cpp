@@ -19,6 +19,15 @@
 #include <fstream>
 #include <string>
 #include <cstdio>
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <limits>
+#include <chrono>
+#include <functional>
 
 #include "fftw3.h"
 
@@ -28,8 +37,13 @@
 #include "mrimage.h"
 #include "nplio.h"
 #include "iterators.h"
+#include "accessors.h"
 #include "statistics.h"
 #include <signal.h>
+#include "zlib.h"
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -82,66 +96,71 @@ std::string E_name(std::string m_pref) {
  * the matrix is a wide matrix (which is generally a good assumption in
  * fMRI) and that it therefore is better to reduce the number of columns.
  *
- * To achieve this, we transpose the algorithm of 4.4 from
+ * To achieve this, we follow algorithm 4.3 from
  * Halko N, Martinsson P-G, Tropp J A. Finding structure with randomness:
  * Probabilistic algorithms for constructing approximate matrix decompositions.
  * 2009;1–74. Available from: http://arxiv.org/abs/0909.4061
+ * iterating on AA^T in the (short) row space. The basis is grown in blocks
+ * (see adaptiveRangeFinder()) until the remaining singular values are below
+ * varthresh times the largest, so memory and passes are only spent on the
+ * rank that is actually needed. Since the matrix is stored in blocks of
+ * columns, AA^TQ is accumulated block by block in a single pass, so each power
+ * iteration reads the data once rather than twice, and Q^TA for each block of
+ * the basis shares a pass with the first iteration of the next block. With
+ * gram set, AA^T is accumulated once and the iterations need no passes at all.
  *
  * @param A Input matrix (made up of many tall on disk matrices)
- * @param minrank Minimum rank to estimate
+ * @param maxrank Maximum rank to estimate, the first block of the basis has up
+ * to 16 columns
  * @param poweriters Number of power iterations to perform during computation
  * @param varthresh stop after the eigenvalues reach this ratio of the maximum
  * @param cvarthresh stop after the sum of eigenvalues reaches this ratio of total
  * @param U Output U matrix, if null then ignored
  * @param V Output V matrix, if null then ignored
+ * @param gram Form AA^T (rows x rows) in memory, rather than using one pass
+ * over the data per power iteration
  *
  * @return Vector of singular values
  */
-VectorXd onDiskSVD(const MatrixReorg& A, int minrank, size_t poweriters,
-		double varthresh, double cvarthresh, MatrixXd* U, MatrixXd* V)
+VectorXd onDiskSVD(const MatrixReorg& A, int maxrank, size_t poweriters,
+		double varthresh, double cvarthresh, MatrixXd* U, MatrixXd* V,
+		bool gram)
 {
-	// Algorithm 4.4
-	// From the Original Algorithm A -> At everywhere
-	cerr<<"Allocating 2x "<<A.cols()<<"x"<<minrank<<" and 3x "<<A.rows()<<"x"<<minrank<<endl;
-	MatrixXd Qtmp(A.cols(), minrank);
-
-	{
-	MatrixXd Yc(A.cols(), minrank);
-	MatrixXd Yhc(A.rows(), minrank);
-	MatrixXd Qhat(A.rows(), minrank);
-	MatrixXd Omega(A.rows(), minrank);
-	cerr<<"Done"<<endl;
-
 	if(varthresh < 0 || varthresh > 1)
 		varthresh = 0.1;
 	if(cvarthresh < 0 || cvarthresh > 1)
 		cvarthresh = 0.9;
 
-	cerr<<"Gaussian Projecting"<<endl;
-	fillGaussian<MatrixXd>(Omega);
-	A.postMult(Yc, Omega, true);
-	cerr<<"Done"<<endl;
-
-	Eigen::HouseholderQR<MatrixXd> qr(Yc);
-	Qtmp = qr.householderQ()*MatrixXd::Identity(A.cols(), minrank);
-	Eigen::HouseholderQR<MatrixXd> qrh;
-	cerr << "Power Iteration: ";
-	for(size_t ii=0; ii<poweriters; ii++) {
-		cerr<<ii<<" ";
-		A.postMult(Yhc, Qtmp);
-		qrh.compute(Yhc);
-		Qhat = qrh.householderQ()*MatrixXd::Identity(A.rows(), minrank);
-		A.postMult(Yc, Qhat, true);
-		qr.compute(Yc);
-		Qtmp = qr.householderQ()*MatrixXd::Identity(A.cols(), minrank);
-	}
-	cerr << "Done" << endl;
+	MatrixXd AAt;
+	if(gram) {
+		cerr<<"Computing AAt ("<<A.rows()<<" x "<<A.rows()<<")"<<endl;
+		AAt.resize(A.rows(), A.rows());
+		A.gram(AAt);
+		cerr<<"Done"<<endl;
 	}
 
-	// Form B = Q* x A
-	cerr<<"Making Low Rank Approximation ("<<Qtmp.cols()<<"x"<<A.rows()<<")"<<endl;
-	MatrixXd B(Qtmp.cols(), A.rows());;
-	A.preMult(B, Qtmp.transpose(), true);
+	// Grow the range of (AA^T)^(q+1) Omega until the remaining singular
+	// values are below varthresh, forming B = Q* x A along the way
+	cerr<<"Finding Range (up to "<<A.rows()<<"x"<<maxrank<<")"<<endl;
+	MatrixXd Qhat, B;
+	double err = adaptiveRangeFinder(A.rows(), A.cols(), [&](Ref<MatrixXd> Y,
+				const Ref<const MatrixXd> X, Ref<MatrixXd> Bi,
+				const Ref<const MatrixXd> P, double* sqnorm)
+	{
+		if(!gram) {
+			A.rangeMult(Y, X, Bi, P, sqnorm);
+			return;
+		}
+		if(X.cols() > 0)
+			Y.noalias() = AAt.selfadjointView<Eigen::Lower>()*X;
+		if(P.rows() > 0)
+			A.preMult(Bi, P);
+		if(sqnorm)
+			*sqnorm = AAt.trace();
+	}, varthresh, std::min(maxrank, 16), maxrank, poweriters, Qhat, B, true);
+	cerr<<"Low Rank Approximation ("<<B.rows()<<"x"<<B.cols()<<"), Relative "
+		"Error: "<<err<<endl;
+
 	Eigen::JacobiSVD<MatrixXd> smallsvd(B, Eigen::ComputeThinU | Eigen::ComputeThinV);
 	const auto& svals = smallsvd.singularValues();
 
@@ -166,9 +185,9 @@ VectorXd onDiskSVD(const MatrixReorg& A, int minrank, size_t poweriters,
 	VectorXd E(rank);
 	E = smallsvd.singularValues().head(rank);
 	if(V)
-		*V = Qtmp*smallsvd.matrixU().leftCols(rank);
+		*V = smallsvd.matrixV().leftCols(rank);
 	if(U)
-		*U = smallsvd.matrixV().leftCols(rank);
+		*U = Qhat*smallsvd.matrixU().leftCols(rank);
 
 	return E;
 }
@@ -213,21 +232,20 @@ MatrixXd icsToT(const MatrixReorg& A,
 	MatrixXd out = ics;
 	size_t oc = 0;
 	for(size_t cg = 0; cg < A.tallMatCols().size(); cg++) {
-		MatMap m(A.tallMatName(cg), false);
-		if(A.tallMatCols()[cg] != m.cols())
-			throw INVALID_ARGUMENT("Columns mismatch between read data and "
-					"previously written data");
-		for(size_t cc=0; cc<m.cols(); cc++, oc++) {
-			double ssres = (m.mat.col(cc)-U*E.asDiagonal()*V.row(oc).
-					transpose()).squaredNorm();
-			double sigmahat = ssres/(npoints-nreg);
-			for(size_t comp=0; comp < ics.cols(); comp++) {
-				double std_err = sqrt(sigmahat*Cinv[comp]);
-				double beta = ics(oc, comp);
-				double t = beta/std_err;
-				out(oc, comp) = t;
+		A.tallPanels(cg, [&](const Ref<const MatrixXd> m, size_t)
+		{
+			for(size_t cc=0; cc<m.cols(); cc++, oc++) {
+				double ssres = (m.col(cc)-U*E.asDiagonal()*V.row(oc).
+						transpose()).squaredNorm();
+				double sigmahat = ssres/(npoints-nreg);
+				for(size_t comp=0; comp < ics.cols(); comp++) {
+					double std_err = sqrt(sigmahat*Cinv[comp]);
+					double beta = ics(oc, comp);
+					double t = beta/std_err;
+					out(oc, comp) = t;
+				}
 			}
-		}
+		});
 	}
 	return out;
 }
@@ -261,12 +279,7 @@ VectorXd covSVD(const MatrixReorg& A, double varthresh, double cvarthresh,
 	// Create AA* matrix
 	cerr<<"Computing AAt ("<<A.rows()<<" x "<<A.rows()<<")"<<endl;
 	MatrixXd AAt(A.rows(), A.rows());
-	AAt.setZero();
-	for(size_t cc = 0; cc < A.ntall(); cc++) {
-		cerr<<cc<<"/"<<A.ntall()<<endl;
-		MatMap m(A.tallMatName(cc), false);
-		AAt += m.mat*m.mat.transpose();
-	}
+	A.gram(AAt);
 	cerr<<"Done"<<endl;
 
 	if(maxrank == 0) maxrank = AAt.rows();
@@ -330,13 +343,139 @@ VectorXd covSVD(const MatrixReorg& A, double varthresh, double cvarthresh,
 	return singvals;
 }
 
-MatrixReorg::MatrixReorg(std::string prefix, size_t maxdoubles, bool verbose)
+MatrixReorg::MatrixReorg(std::string prefix, size_t maxdoubles, bool verbose,
+		MatStorageT storage)
 {
 	m_prefix = prefix;
 	m_maxdoubles = maxdoubles;
 	m_verbose = verbose;
+	m_storage = storage;
+	m_nprocs = 1;
 };
 
+/**
+ * @brief Name of each storage type, as written in the information file
+ */
+static const char* storageName(MatStorageT storage)
+{
+	switch(storage) {
+		case STORE_FLOAT32:
+			return "float32";
+		case STORE_FLOAT32_GZ:
+			return "float32-gz";
+		default:
+			return "float64";
+	}
+}
+
+/**
+ * @brief Reads the rows and cols header of a compressed tall matrix
+ *
+ * @param filename File to read
+ * @param rows Output rows
+ * @param cols Output cols
+ */
+static void readTallGzSize(std::string filename, size_t& rows, size_t& cols)
+{
+	gzFile gz = gzopen(filename.c_str(), "rb");
+	if(!gz)
+		throw RUNTIME_ERROR("Error opening "+filename);
+	size_t head[2];
+	int ret = gzread(gz, head, sizeof(head));
+	gzclose(gz);
+	if(ret != sizeof(head))
+		throw RUNTIME_ERROR("Error reading header of "+filename);
+	rows = head[0];
+	cols = head[1];
+}
+
+/**
+ * @brief Opens a compressed tall matrix (rows and cols as size_t's, then
+ * column major floats) for streaming, leaving it positioned at the first
+ * column
+ *
+ * @param filename File to open
+ * @param rows Output rows
+ * @param cols Output cols
+ *
+ * @return Open file, to be closed with gzclose()
+ */
+static gzFile openTallGz(std::string filename, size_t& rows, size_t& cols)
+{
+	gzFile gz = gzopen(filename.c_str(), "rb");
+	if(!gz)
+		throw RUNTIME_ERROR("Error opening "+filename);
+#if ZLIB_VERNUM >= 0x1240
+	gzbuffer(gz, 1<<20);
+#endif
+	size_t head[2];
+	if(gzread(gz, head, sizeof(head)) != sizeof(head)) {
+		gzclose(gz);
+		throw RUNTIME_ERROR("Error reading header of "+filename);
+	}
+	rows = head[0];
+	cols = head[1];
+	return gz;
+}
+
+/**
+ * @brief Reads the next bytes of a compressed tall matrix
+ *
+ * @param gz File opened with openTallGz()
+ * @param filename Name of the file, for errors
+ * @param ptr Output buffer
+ * @param bytes Number of bytes to read
+ */
+static void readTallGz(gzFile gz, std::string filename, char* ptr,
+		size_t bytes)
+{
+	// gzread takes an unsigned int, so read large panels in pieces
+	while(bytes > 0) {
+		unsigned int len = std::min<size_t>(bytes, 1<<30);
+		if(gzread(gz, ptr, len) != (int)len)
+			throw RUNTIME_ERROR("Error reading "+filename);
+		ptr += len;
+		bytes -= len;
+	}
+}
+
+/**
+ * @brief Replaces a (memory mapped) float tall matrix with a compressed copy
+ *
+ * @param filename File to compress in place
+ */
+static void compressTall(std::string filename)
+{
+	string tmpname = filename+".tmp";
+	{
+		MatMap map(filename, false);
+		if(!map.single())
+			throw RUNTIME_ERROR("Only float matrices are compressed");
+
+		// favor speed, the data is read many times but written once
+		gzFile gz = gzopen(tmpname.c_str(), "wb1");
+		if(!gz)
+			throw RUNTIME_ERROR("Error opening "+tmpname);
+#if ZLIB_VERNUM >= 0x1240
+		gzbuffer(gz, 1<<20);
+#endif
+		size_t head[2] = {map.rows(), map.cols()};
+		bool ok = gzwrite(gz, head, sizeof(head)) == sizeof(head);
+		const char* ptr = (const char*)map.matf.data();
+		size_t remain = map.rows()*map.cols()*sizeof(float);
+		while(ok && remain > 0) {
+			unsigned int len = std::min<size_t>(remain, 1<<30);
+			ok = gzwrite(gz, ptr, len) == (int)len;
+			ptr += len;
+			remain -= len;
+		}
+		if(gzclose(gz) != Z_OK || !ok)
+			throw RUNTIME_ERROR("Error writing "+tmpname);
+	}
+	if(rename(tmpname.c_str(), filename.c_str()) != 0)
+		throw RUNTIME_ERROR("Error replacing "+filename);
+}
+
 /**
  * @brief Loads existing matrices by first reading ${prefix}_tall_0,
  * ${prefix}_wide_0, and ${prefix}_mask_*, and checking that all the dimensions
@@ -347,15 +486,28 @@ MatrixReorg::MatrixReorg(std::string prefix, size_t maxdoubles, bool verbose)
 int MatrixReorg::checkMats()
 {
 	m_outcols.clear();
+	m_blocks.clear();
 
+	// The storage type was added later, files without it hold doubles
 	ifstream ifs(info_name());
-	ifs >> m_totalrows >> m_totalcols;
+	string type;
+	ifs >> m_totalrows >> m_totalcols >> type;
+	if(type.empty() || type == storageName(STORE_FLOAT64))
+		m_storage = STORE_FLOAT64;
+	else if(type == storageName(STORE_FLOAT32))
+		m_storage = STORE_FLOAT32;
+	else if(type == storageName(STORE_FLOAT32_GZ))
+		m_storage = STORE_FLOAT32_GZ;
+	else
+		throw RUNTIME_ERROR("Unknown storage type "+type+" in "+info_name());
+
 	if(m_verbose) {
 		cerr << "Information File: " << info_name() << endl;
 		cerr << "First Tall Matrix: " << tall_name(0) << endl;
 		cerr << "First Mask:        " << mask_name(0) << endl;
 		cerr << "Total Rows/Timepoints: " << m_totalrows<< endl;
 		cerr << "Total Cols/Voxels:     " << m_totalcols << endl;
+		cerr << "Storage:               " << storageName(m_storage) << endl;
 	}
 	if(m_totalcols == 0 || m_totalrows == 0)
 		throw RUNTIME_ERROR("Error zero size input from "+info_name());
@@ -364,13 +516,23 @@ int MatrixReorg::checkMats()
 	MatMap map;
 	int cols = 0;
 	for(size_t bb=0; cols < m_totalcols; bb++) {
-		map.open(tall_name(bb), false);
-		if(m_totalrows != map.rows())
+		size_t brows, bcols;
+		if(m_storage == STORE_FLOAT32_GZ) {
+			readTallGzSize(tall_name(bb), brows, bcols);
+		} else {
+			map.open(tall_name(bb), false);
+			if(map.single() != (m_storage == STORE_FLOAT32))
+				throw RUNTIME_ERROR("Error, "+tall_name(bb)+" does not have "
+						"the storage type in "+info_name());
+			brows = map.rows();
+			bcols = map.cols();
+		}
+		if(m_totalrows != brows)
 			throw RUNTIME_ERROR("Error, mismatch in file size ("+
-					to_string(map.rows())+"x"+to_string(map.cols())+" vs "+
+					to_string(brows)+"x"+to_string(bcols)+" vs "+
 					to_string(m_totalrows)+"x"+to_string(m_totalcols)+")");
-		m_outcols.push_back(map.cols());
-		cols += map.cols();
+		m_outcols.push_back(bcols);
+		cols += bcols;
 	}
 	if(m_totalcols != cols)
 		throw RUNTIME_ERROR("Error, mismatch in number of cols from input "
@@ -407,6 +569,11 @@ int MatrixReorg::checkMats()
  * masknames. Note that if no mask is provided, one will be generated from the
  * set of non-zero variance timeseries in the first input image in the column.
  *
+ * Images are read, masked and normalized ahead by numThreads() loading
+ * threads while the calling thread writes them into the tall matrices.
+ * Images being loaded (at their full, unmasked size) and waiting to be
+ * written are together limited to maxd doubles.
+ *
  * This file writes matrices called /tall_# and /wide_#. Tall matrices have
  * the entire concatinated timeseries for a limited set of spacial locations,
  * Wide matrices have entire concatinated spacial signals for a limited number
@@ -430,6 +597,7 @@ int MatrixReorg::createMats(size_t timeblocks, size_t spaceblocks,
 {
 	vector<int> inrows;
 	vector<int> incols;
+	m_blocks.clear();
 
 	if(m_verbose) {
 		cerr << "Information File: " << info_name() << endl;
@@ -490,9 +658,11 @@ int MatrixReorg::createMats(size_t timeblocks, size_t spaceblocks,
 		cerr << "Col/Space Blocks: " << spaceblocks << endl;
 		cerr << "Total Rows/Timepoints: " << m_totalrows<< endl;
 		cerr << "Total Cols/Voxels:     " << m_totalcols << endl;
+		cerr << "Storage:               " << storageName(m_storage) << endl;
 	}
 	ofstream ofs(info_name());
-	ofs << m_totalrows << " " << m_totalcols << endl;
+	ofs << m_totalrows << " " << m_totalcols << " " << storageName(m_storage)
+		<< endl;
 	ofs.close();
 
 	/*
@@ -509,13 +679,16 @@ int MatrixReorg::createMats(size_t timeblocks, size_t spaceblocks,
 				"single full row!");
 	}
 
+	// Compressed matrices are written as floats, then compressed once each
+	// group of columns (mask) is complete
 	if(m_verbose) cerr << "Creating Blank Matrices"<<endl;
+	bool single = m_storage != STORE_FLOAT64;
 	MatMap datamap;
 	for(int cc=0; cc<m_totalcols; cc++) {
 		if(blockind == incols[blocknum]) {
 			// open file, create with proper size
 			datamap.create(tallMatName(m_outcols.size()-1), m_totalrows,
-					m_outcols.back());
+					m_outcols.back(), single);
 			// if the index in the block would put us in a different image, then
 			// start a new out block, and new in block
 			blockind = 0;
@@ -523,7 +696,7 @@ int MatrixReorg::createMats(size_t timeblocks, size_t spaceblocks,
 			m_outcols.push_back(0);
 		} else if((m_outcols.back()+1)*m_totalrows > m_maxdoubles) {
 			datamap.create(tallMatName(m_outcols.size()-1), m_totalrows,
-					m_outcols.back());
+					m_outcols.back(), single);
 			// If this col won't fit in the current block of cols, start a new one,
 			m_outcols.push_back(0);
 		}
@@ -532,147 +705,557 @@ int MatrixReorg::createMats(size_t timeblocks, size_t spaceblocks,
 	}
 	// Final File
 	datamap.create(tallMatName(m_outcols.size()-1), m_totalrows,
-			m_outcols.back());
+			m_outcols.back(), single);
 
 	/*
 	 * Fill tall matrices by breaking images along block cols specified
-	 * in m_outcols
+	 * in m_outcols. Reader threads load, mask and normalize images (in
+	 * filenames order) into slabs of tlen x incols[sb] doubles, while this
+	 * thread scatters finished slabs into the tall matrices. Images being
+	 * read (at their full, unmasked size) and slabs waiting to be written are
+	 * together limited to m_maxdoubles (but at least one image is always
+	 * allowed).
 	 */
 	if(m_verbose) {
 		cerr << "Filling Matrices"<<endl;
 		if(normts) cerr<<"Normalizing Individual Timeseries"<<endl;
 	}
-	int img_glob_row = 0;
-	int img_glob_col = 0;
-	int img_oblock_col = 0;
-	for(size_t sb = 0; sb<spaceblocks; sb++) {
-		if(m_verbose) cerr<<"Mask Group: "<<mask_name(sb)<<endl;
-		auto mask = readMRImage(mask_name(sb));
-
-		img_glob_row = 0;
-		for(size_t tb = 0; tb<timeblocks; tb++) {
-			if(m_verbose) cerr<<"Image: "<<filenames[sb*timeblocks+tb]<<endl;
-			auto img = readMRImage(filenames[sb*timeblocks+tb]);
-			if(m_verbose) cerr<<"Done Loading"<<endl;
-
-			if(!img->matchingOrient(mask, false, true))
-				throw INVALID_ARGUMENT("Mismatch in mask/image size in col:"+
-						to_string(sb)+", row:"+to_string(tb));
-			if(img->tlen() != inrows[tb])
-				throw INVALID_ARGUMENT("Mismatch in time-length in col:"+
-						to_string(sb)+", row:"+to_string(tb));
+	auto start = std::chrono::steady_clock::now();
+
+	vector<ptr<MRImage>> masks(spaceblocks);
+	for(size_t sb = 0; sb<spaceblocks; sb++)
+		masks[sb] = readMRImage(mask_name(sb));
+
+	// First row of each block of rows, and first tall matrix of each mask
+	vector<size_t> firstrow(timeblocks+1, 0);
+	for(size_t tb = 0; tb<timeblocks; tb++)
+		firstrow[tb+1] = firstrow[tb] + inrows[tb];
+	vector<size_t> firstblock(spaceblocks+1, 0);
+	for(size_t sb = 0, bb = 0; sb<spaceblocks; sb++) {
+		for(int ii=0; ii != incols[sb]; )
+			ii += m_outcols[bb++];
+		firstblock[sb+1] = bb;
+	}
 
+	// Read, mask and normalize image ii into a tlen x incols[sb] slab
+	auto prepare = [&](size_t ii, MatrixXd& slab)
+	{
+		size_t sb = ii/timeblocks;
+		size_t tb = ii%timeblocks;
+		if(m_verbose) cerr<<"Image: "<<filenames[ii]<<endl;
+		auto img = readMRImage(filenames[ii]);
+
+		if(!img->matchingOrient(masks[sb], false, true))
+			throw INVALID_ARGUMENT("Mismatch in mask/image size in col:"+
+					to_string(sb)+", row:"+to_string(tb));
+		if(img->tlen() != inrows[tb])
+			throw INVALID_ARGUMENT("Mismatch in time-length in col:"+
+					to_string(sb)+", row:"+to_string(tb));
+
+		int64_t tlen = img->tlen();
+		slab.resize(tlen, incols[sb]);
+		Vector3DConstIter<double> it(img);
+		NDConstIter<double> mit(masks[sb]);
+		for(size_t cc = 0; !it.eof(); ++it, ++mit) {
+			if(*mit == 0)
+				continue;
+
+			// Fill, Calculate Mean/SD and normalize
 			double mean = 0, sd = 0;
-			int cc, colbl;
-			int64_t tlen = img->tlen();
-			Vector3DIter<double> it(img);
-			NDIter<double> mit(mask);
-
-			/*
-			 * fill mat[img_glob_row:img_glob_row+tlen,0:bcols],
-			 * Start with invalid and load new columns as needed
-			 * cc iterates over the columns in the block, colbl indicates the
-			 * index of the block in the overall scheme
-			 * rows are global, cols are local to block
-			 */
-			for(cc=-1, colbl=img_oblock_col-1; !it.eof(); ++it, ++mit) {
-				if(*mit != 0) {
-					// If cc is invalid, open
-					if(cc < 0 || cc >= m_outcols[colbl]) {
-						cc = 0;
-						colbl++;
-						datamap.open(tall_name(colbl), true);
-						if(m_verbose) cerr<<"Writing to: "<<tall_name(colbl)
-								<<" at row "<<to_string(img_glob_row)<<endl;
-						if(datamap.rows() != m_totalrows ||
-								datamap.cols() != m_outcols[colbl]) {
-							throw INVALID_ARGUMENT("Unexpected size in input "
-									+ tall_name(colbl)+" expected "+
-									to_string(m_totalrows)+"x"+
-									to_string(m_outcols[colbl])+", found "+
-									to_string(datamap.rows())+"x"+
-									to_string(datamap.cols()));
-						}
-					}
+			for(size_t tt=0; tt<tlen; tt++) {
+				slab(tt, cc) = it[tt];
+				mean += it[tt];
+				sd += it[tt]*it[tt];
+			}
+			sd = sqrt(sample_var(tlen, mean, sd));
+			mean /= tlen;
+			if(normts) {
+				if(sd > 0)
+					slab.col(cc) = (slab.col(cc).array()-mean)/sd;
+				else
+					slab.col(cc).setZero();
+			}
+			cc++;
+		}
+	};
 
-					// Fill, Calculate Mean/SD and normalize
-					mean = 0;
-					sd = 0;
-//					if(m_verbose) cerr<<"Loading ["<<img_glob_row<<"-"
-//						<<(img_glob_row+tlen)<<","<<cc<<"]"<<endl;
-					for(size_t tt=0; tt<tlen; tt++) {
-						datamap.mat(tt+img_glob_row, cc) = it[tt];
-						mean += it[tt];
-						sd += it[tt]*it[tt];
-					}
-					sd = sqrt(sample_var(tlen, mean, sd));
-					mean /= tlen;
-					if(normts) {
-						if(sd > 0)
-							datamap.mat.block(img_glob_row, cc, tlen, 1) =
-								(datamap.mat.block(img_glob_row, cc, tlen, 1).array()-mean)/sd;
-						else
-							datamap.mat.block(img_glob_row, cc, tlen, 1).setZero();
-					}
-					cc++;
+	// Tall matrices of the current mask, these are complete (and can be
+	// compressed) once the last image of the mask has been written
+	vector<ptr<MatMap>> group;
+	size_t cursb = spaceblocks;
+	auto finishGroup = [&]()
+	{
+		group.clear();
+		for(size_t bb = firstblock[cursb]; m_storage == STORE_FLOAT32_GZ &&
+				bb < firstblock[cursb+1]; bb++) {
+			if(m_verbose) cerr<<"Compressing: "<<tall_name(bb)<<endl;
+			compressTall(tall_name(bb));
+		}
+		if(m_verbose) cerr<<"Mask Done: "<<mask_name(cursb)<<endl;
+	};
+
+	// Write the slab for image ii to rows firstrow[tb]:+tlen of the mask's
+	// tall matrices
+	auto scatter = [&](size_t ii, const MatrixXd& slab)
+	{
+		size_t sb = ii/timeblocks;
+		size_t tb = ii%timeblocks;
+		if(sb != cursb) {
+			if(cursb < spaceblocks)
+				finishGroup();
+			cursb = sb;
+			if(m_verbose) cerr<<"Mask Group: "<<mask_name(sb)<<endl;
+			for(size_t bb = firstblock[sb]; bb < firstblock[sb+1]; bb++) {
+				group.push_back(std::make_shared<MatMap>(tall_name(bb), true));
+				if(group.back()->rows() != m_totalrows ||
+						group.back()->cols() != m_outcols[bb]) {
+					throw INVALID_ARGUMENT("Unexpected size in input "
+							+ tall_name(bb)+" expected "+
+							to_string(m_totalrows)+"x"+
+							to_string(m_outcols[bb])+", found "+
+							to_string(group.back()->rows())+"x"+
+							to_string(group.back()->cols()));
+				}
+			}
+		}
+
+		for(size_t bb = 0, c0 = 0; bb < group.size(); bb++) {
+			MatMap& map = *group[bb];
+			if(single) {
+				map.matf.middleRows(firstrow[tb], slab.rows()) =
+					slab.middleCols(c0, map.cols()).cast<float>();
+			} else {
+				map.mat.middleRows(firstrow[tb], slab.rows()) =
+					slab.middleCols(c0, map.cols());
+			}
+			c0 += map.cols();
+		}
+		if(m_verbose) cerr<<"Image Done: "<<filenames[ii]<<endl;
+	};
+
+	size_t nimg = timeblocks*spaceblocks;
+	size_t nreaders = std::min<size_t>(numThreads(), nimg);
+	if(nreaders <= 1) {
+		MatrixXd slab;
+		for(size_t ii = 0; ii < nimg; ii++) {
+			prepare(ii, slab);
+			scatter(ii, slab);
+		}
+	} else {
+		// Images are handed to readers in order, and memory for the whole
+		// image and its slab is reserved at the same time, so the image the
+		// writer is waiting for always has its memory. The image's share is
+		// released once it has been reduced to a slab.
+		std::mutex mtx;
+		std::condition_variable cv;
+		vector<MatrixXd> slabs(nimg);
+		vector<char> ready(nimg, 0);
+		size_t next = 0;
+		size_t inflight = 0;
+		bool failed = false;
+		auto slabsize = [&](size_t ii)
+		{
+			return (size_t)inrows[ii%timeblocks]*incols[ii/timeblocks];
+		};
+		auto rawsize = [&](size_t ii)
+		{
+			return (size_t)inrows[ii%timeblocks]*
+				masks[ii/timeblocks]->elements();
+		};
+		auto fail = [&]()
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			failed = true;
+			cv.notify_all();
+		};
+
+		auto reader = [&]()
+		{
+			while(true) {
+				size_t ii;
+				{
+					std::unique_lock<std::mutex> lock(mtx);
+					cv.wait(lock, [&]() {
+						return failed || next >= nimg || inflight == 0 ||
+							inflight + rawsize(next) + slabsize(next) <=
+							m_maxdoubles; });
+					if(failed || next >= nimg)
+						return;
+					ii = next++;
+					inflight += rawsize(ii) + slabsize(ii);
+				}
+				try {
+					prepare(ii, slabs[ii]);
+				} catch(...) {
+					fail();
+					throw;
+				}
+				std::lock_guard<std::mutex> lock(mtx);
+				ready[ii] = 1;
+				inflight -= rawsize(ii);
+				cv.notify_all();
+			}
+		};
+
+		auto writer = [&]()
+		{
+			for(size_t ii = 0; ii < nimg; ii++) {
+				{
+					std::unique_lock<std::mutex> lock(mtx);
+					cv.wait(lock, [&]() { return failed || ready[ii]; });
+					if(failed)
+						return;
+				}
+				try {
+					scatter(ii, slabs[ii]);
+				} catch(...) {
+					fail();
+					throw;
 				}
+				slabs[ii] = MatrixXd();
+				std::lock_guard<std::mutex> lock(mtx);
+				inflight -= slabsize(ii);
+				cv.notify_all();
 			}
+		};
+
+		// Chunk 0 writes, the rest read. If we are already inside a
+		// parallelFor everything arrives as one chunk, so run serially.
+		parallelFor(0, nreaders+1, [&](size_t, size_t b, size_t e)
+		{
+			if(e-b > 1) {
+				MatrixXd slab;
+				for(size_t ii = 0; ii < nimg; ii++) {
+					prepare(ii, slab);
+					scatter(ii, slab);
+				}
+			} else if(b == 0) {
+				writer();
+			} else {
+				reader();
+			}
+		}, nreaders+1);
+	}
+	if(cursb < spaceblocks)
+		finishGroup();
 
-			assert(cc == m_outcols[colbl]);
-			datamap.close();
-			if(m_verbose) cerr<<"Image Done: "<<filenames[sb*timeblocks+tb]<<endl;
+	if(m_verbose) {
+		double secs = std::chrono::duration<double>(
+				std::chrono::steady_clock::now()-start).count();
+		double gb = (double)m_totalrows*m_totalcols/(1<<30)*
+			(single ? sizeof(float) : sizeof(double));
+		cerr << "createMats: " << gb << " GB in " << secs << " s ("
+			<< gb/secs << " GB/s, " << nreaders << " readers)" << endl;
+	}
 
-			// Increment Global Row by Input Block Size (same as image rows)
-			img_glob_row += inrows[tb];
+	return 0;
+}
+
+/**
+ * @brief Returns a read-only mapping of tall matrix ii. Mappings are
+ * opened on first use and kept until the matrices are recreated or
+ * re-checked, so repeated multiplies do not re-map the files. The first
+ * access of each block should not race with other accesses.
+ *
+ * @param ii Tall matrix to map
+ *
+ * @return Mapping of the tall matrix
+ */
+const MatMap& MatrixReorg::tallMat(size_t ii) const
+{
+	if(m_storage == STORE_FLOAT32_GZ)
+		throw INVALID_ARGUMENT("Compressed tall matrices cannot be mapped");
+	if(m_blocks.size() <= ii)
+		m_blocks.resize(ii+1);
+	if(!m_blocks[ii]) {
+		m_blocks[ii] = std::make_shared<MatMap>(tallMatName(ii), false);
+		m_blocks[ii]->advise(MADV_SEQUENTIAL);
+	}
+	return *m_blocks[ii];
+}
+
+/**
+ * @brief Calls func(panel, col) for consecutive panels of columns of tall
+ * matrix ii, in double precision. Double storage is passed as a single
+ * panel without copying, float storage is converted a few MB at a time.
+ * Compressed storage is decompressed one panel at a time, so the memory used
+ * does not depend on the size of the block.
+ *
+ * @param ii Tall matrix to read
+ * @param func Function called with each panel and the index (within tall
+ * matrix ii) of its first column
+ */
+void MatrixReorg::tallPanels(size_t ii, const std::function<void(
+			const Eigen::Ref<const MatrixXd>, size_t)>& func) const
+{
+	if(m_storage == STORE_FLOAT64) {
+		func(tallMat(ii).mat, 0);
+		return;
+	}
+
+	const float* data = NULL;
+	gzFile gz = NULL;
+	size_t ncols;
+	if(m_storage == STORE_FLOAT32) {
+		const MatMap& map = tallMat(ii);
+		data = map.matf.data();
+		ncols = map.cols();
+	} else {
+		size_t nrows;
+		gz = openTallGz(tallMatName(ii), nrows, ncols);
+		if(nrows != rows()) {
+			gzclose(gz);
+			throw RUNTIME_ERROR("Unexpected number of rows in "+
+					tallMatName(ii));
 		}
+	}
 
-		// Increment Global Col by Input Block Size (same as image cols)
-		img_glob_col += incols[sb];
+	// Convert about 8MB at a time, so that accumulation is in double
+	// precision but the copy stays in cache
+	size_t width = std::max<size_t>(1, (1<<20)/rows());
+	Eigen::MatrixXf buf;
+	MatrixXd panel;
+	try {
+		for(size_t c0=0; c0<ncols; c0+=width) {
+			size_t w = std::min(width, ncols-c0);
+			const float* src;
+			if(gz) {
+				buf.resize(rows(), w);
+				readTallGz(gz, tallMatName(ii), (char*)buf.data(),
+						buf.size()*sizeof(float));
+				src = buf.data();
+			} else {
+				src = data+c0*rows();
+			}
+			panel = Eigen::Map<const Eigen::MatrixXf>(src, rows(),
+					w).cast<double>();
+			func(panel, c0);
+		}
+	} catch(...) {
+		if(gz)
+			gzclose(gz);
+		throw;
+	}
+	if(gz)
+		gzclose(gz);
+}
 
-		// Increment Output block col to correspond to the next image
-		for(int ii=0; ii != incols[sb]; )
-			ii += m_outcols[img_oblock_col++];
-		if(m_verbose) cerr<<"Mask Done: "<<mask_name(sb)<<endl;
+/**
+ * @brief Reads all of tall matrix ii into memory, in double precision
+ *
+ * @param ii Tall matrix to read
+ * @param out Output matrix, resized to tallMatRows() x tallMatCols()[ii]
+ */
+void MatrixReorg::loadTall(size_t ii, MatrixXd& out) const
+{
+	out.resize(rows(), m_outcols[ii]);
+	tallPanels(ii, [&](const Eigen::Ref<const MatrixXd> panel, size_t c0)
+	{
+		out.middleCols(c0, panel.cols()) = panel;
+	});
+}
+
+/**
+ * @brief Runs func(panel, firstcol) over tall blocks [begin, end), splitting
+ * the blocks into contiguous runs, one per thread. Before each mapped block is
+ * used the following block in the run is prefetched. Blocks stored as floats
+ * arrive as several panels in double precision.
+ *
+ * @param A Matrix to run over
+ * @param begin First tall block
+ * @param end One past the last tall block
+ * @param func Function called as func(chunk, panel, firstcol)
+ *
+ * @return Number of chunks used, chunk ids are [0, return)
+ */
+static size_t forEachTall(const MatrixReorg& A, size_t begin, size_t end,
+		const std::function<void(size_t, const Ref<const MatrixXd>,
+			size_t)>& func)
+{
+	// Open mappings and find the first column of each block
+	bool mapped = A.storage() != STORE_FLOAT32_GZ;
+	vector<size_t> firstcol(A.ntall(), 0);
+	for(size_t bb=0; bb<A.ntall(); bb++) {
+		if(mapped && bb >= begin && bb < end)
+			A.tallMat(bb);
+		if(bb > 0)
+			firstcol[bb] = firstcol[bb-1]+A.tallMatCols()[bb-1];
 	}
 
-	return 0;
+	size_t nthreads = std::min<size_t>(numThreads(), end-begin);
+	return parallelFor(begin, end, [&](size_t chunk, size_t b, size_t e)
+	{
+		if(mapped && b < e)
+			A.tallMat(b).advise(MADV_WILLNEED);
+		for(size_t bb=b; bb<e; bb++) {
+			if(mapped && bb+1 < e)
+				A.tallMat(bb+1).advise(MADV_WILLNEED);
+			A.tallPanels(bb, [&](const Ref<const MatrixXd> panel, size_t cc)
+			{
+				func(chunk, panel, firstcol[bb]+cc);
+			});
+		}
+	}, nthreads);
+}
+
+/**
+ * @brief Runs op(begin, end, sum, fill) over contiguous runs of [0, nparts)
+ * (usually the tall blocks), one run per worker process (see
+ * MatrixReorg::setProcesses()). Each worker gets an equal share of the
+ * threads and writes its results into memory shared with this process. Each
+ * worker produces a full partial result for sum, and the partials are added in
+ * order, but only fills the part of fill that belongs to its run. With one
+ * process op just runs here. Reports throughput if verbose.
+ *
+ * The tall blocks are mapped here before forking, so the workers inherit the
+ * mappings and they are kept for later products. Forking from a worker thread
+ * is not safe, so this throws if called from inside parallelFor with more
+ * than one process.
+ *
+ * @param A Matrix to run over
+ * @param name Name of the operation, for reporting
+ * @param verbose Report achieved GB/s
+ * @param nparts Number of parts to split between the processes
+ * @param sum Output that is summed over parts (may be empty)
+ * @param fill Output that each part fills some of (may be empty)
+ * @param op Function called as op(firstpart, endpart, sum, fill)
+ */
+static void forEachProcess(const MatrixReorg& A, const char* name,
+		bool verbose, size_t nparts, Ref<MatrixXd> sum, Ref<MatrixXd> fill,
+		const std::function<void(size_t, size_t, Ref<MatrixXd>,
+			Ref<MatrixXd>)>& op)
+{
+	auto start = std::chrono::steady_clock::now();
+	size_t nprocs = std::max<size_t>(1, std::min<size_t>(A.processes(),
+				nparts));
+	size_t nthreads = std::max<size_t>(1, numThreads()/nprocs);
+	if(nprocs > 1 && inParallel()) {
+		throw RUNTIME_ERROR(string(name)+": cannot fork worker processes "
+				"from inside parallelFor");
+	}
+
+	for(size_t bb=0; A.storage() != STORE_FLOAT32_GZ && bb<A.ntall(); bb++)
+		A.tallMat(bb);
+
+	if(nprocs == 1) {
+		op(0, nparts, sum, fill);
+	} else {
+		// Anonymous shared memory is zeroed and visible to the children,
+		// there is one slot per process for sum then one for fill
+		size_t slot = sum.rows()*sum.cols();
+		size_t bytes = std::max<size_t>(1, slot*nprocs+fill.size())*
+			sizeof(double);
+		void* shared = mmap(NULL, bytes, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		if(shared == MAP_FAILED) {
+			throw RUNTIME_ERROR(string(name)+": failed to map "+
+					to_string(bytes)+" bytes of shared memory");
+		}
+		double* base = (double*)shared;
+
+		cout.flush();
+		vector<pid_t> pids;
+		for(size_t pp=0; pp<nprocs; pp++) {
+			pid_t pid = fork();
+			if(pid < 0)
+				break;
+			if(pid == 0) {
+				int ret = 0;
+				try {
+					setNumThreads(nthreads);
+					Eigen::Map<MatrixXd> part(base+pp*slot, sum.rows(),
+							sum.cols());
+					Eigen::Map<MatrixXd> shfill(base+nprocs*slot, fill.rows(),
+							fill.cols());
+					op(pp*nparts/nprocs, (pp+1)*nparts/nprocs, part, shfill);
+				} catch(std::exception& e) {
+					cerr << name << " process " << pp << ": " << e.what()
+						<< endl;
+					ret = 1;
+				}
+				_exit(ret);
+			}
+			pids.push_back(pid);
+		}
+
+		bool failed = pids.size() != nprocs;
+		for(pid_t pid : pids) {
+			int status;
+			if(waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+					WEXITSTATUS(status) != 0)
+				failed = true;
+		}
+		if(failed) {
+			munmap(shared, bytes);
+			throw RUNTIME_ERROR(string(name)+": worker process failed");
+		}
+
+		sum = Eigen::Map<MatrixXd>(base, sum.rows(), sum.cols());
+		for(size_t pp=1; pp<nprocs; pp++)
+			sum += Eigen::Map<MatrixXd>(base+pp*slot, sum.rows(), sum.cols());
+		fill = Eigen::Map<MatrixXd>(base+nprocs*slot, fill.rows(), fill.cols());
+		munmap(shared, bytes);
+	}
+
+	if(verbose) {
+		double secs = std::chrono::duration<double>(
+				std::chrono::steady_clock::now()-start).count();
+		double gb = (double)A.rows()*A.cols()/(1<<30)*
+			(A.storage() == STORE_FLOAT64 ? sizeof(double) : sizeof(float));
+		cerr << name << ": " << gb << " GB in " << secs << " s ("
+			<< gb/secs << " GB/s, " << nprocs << " processes x " << nthreads
+			<< " threads)" << endl;
+	}
 }
 
 void MatrixReorg::preMult(Eigen::Ref<MatrixXd> out,
 		const Eigen::Ref<const MatrixXd> in, bool transpose) const
 {
 	if(!transpose) {
-
 		// Q = BA, Q = [BA_0 BA_1 ... ]
 		if(out.rows() != in.rows() || out.cols() != cols() || rows() != in.cols()) {
 			throw INVALID_ARGUMENT("Input arguments are non-conformant for "
 					"matrix multiplication");
 		}
-		out.setZero();
-		for(size_t cc=0, bb=0; cc<cols(); bb++) {
-			// Load Block
-			MatMap block(tallMatName(bb), false);
 
-			// Multiply By Input
-			out.middleCols(cc, m_outcols[bb]) = in*block.mat;
-			cc += m_outcols[bb];
-		}
+		// Each block fills its own columns
+		MatrixXd none;
+		forEachProcess(*this, "preMult", m_verbose, ntall(), none, out,
+				[&](size_t b, size_t e, Ref<MatrixXd>, Ref<MatrixXd> out)
+		{
+			forEachTall(*this, b, e, [&](size_t, const Ref<const MatrixXd> block,
+						size_t cc)
+			{
+				out.middleCols(cc, block.cols()).noalias() = in*block;
+			});
+		});
 	} else {
-		// Q = BA^T, Q = [BA^T_1 ... ]
+		// Q = BA^T, Q = SUM(B_1A^T_1 B_2A^T_2 ... )
 		if(out.rows() != in.rows() || out.cols() != rows() || cols() != in.cols()) {
 			throw INVALID_ARGUMENT("Input arguments are non-conformant for "
 					"matrix multiplication");
 		}
-		out.resize(in.rows(), rows());
-		out.setZero();
-		for(size_t cc=0, bb=0; cc<cols(); bb++) {
-			// Load Block
-			MatMap block(tallMatName(bb), false);
 
-			// Multiply By Input
-			out += in.middleCols(cc, m_outcols[bb])*block.mat.transpose();
-			cc += m_outcols[bb];
-		}
+		// Sum per thread, then combine in order so the result does not
+		// depend on timing
+		MatrixXd none;
+		forEachProcess(*this, "preMult", m_verbose, ntall(), out, none,
+				[&](size_t b, size_t e, Ref<MatrixXd> out, Ref<MatrixXd>)
+		{
+			vector<MatrixXd> partial(numThreads());
+			size_t nchunks = forEachTall(*this, b, e, [&](size_t chunk,
+						const Ref<const MatrixXd> block, size_t cc)
+			{
+				if(partial[chunk].size() == 0)
+					partial[chunk].setZero(out.rows(), out.cols());
+				partial[chunk].noalias() += in.middleCols(cc, block.cols())*
+					block.transpose();
+			});
+
+			out.setZero();
+			for(size_t ii=0; ii<nchunks; ii++)
+				out += partial[ii];
+		});
 	}
 };
 
@@ -686,43 +1269,243 @@ void MatrixReorg::postMult(Eigen::Ref<MatrixXd> out,
 		}
 
 		// Q = AB, Q = SUM(A_1B_1 A_2B_2 ... )
-		out.setZero();
-		for(size_t cc=0, bb=0; cc<cols(); bb++) {
-			// Load Block
-			MatMap block(tallMatName(bb), false);
-
-			// Multiply By Input
-			out += block.mat*in.middleRows(cc, m_outcols[bb]);
-			cc += m_outcols[bb];
-		}
+		// Sum per thread, then combine in order so the result does not
+		// depend on timing
+		MatrixXd none;
+		forEachProcess(*this, "postMult", m_verbose, ntall(), out, none,
+				[&](size_t b, size_t e, Ref<MatrixXd> out, Ref<MatrixXd>)
+		{
+			vector<MatrixXd> partial(numThreads());
+			size_t nchunks = forEachTall(*this, b, e, [&](size_t chunk,
+						const Ref<const MatrixXd> block, size_t cc)
+			{
+				if(partial[chunk].size() == 0)
+					partial[chunk].setZero(out.rows(), out.cols());
+				partial[chunk].noalias() += block*in.middleRows(cc,
+						block.cols());
+			});
+
+			out.setZero();
+			for(size_t ii=0; ii<nchunks; ii++)
+				out += partial[ii];
+		});
 	} else {
 		if(out.rows() != cols() || out.cols() != in.cols() || rows() != in.rows()) {
 			throw INVALID_ARGUMENT("Input arguments are non-conformant for "
 					"matrix multiplication");
 		}
 
-		// Q = A^TB, Q = [A^T_1B ... ]
+		// Q = A^TB, Q = [A^T_1B ... ], each block fills its own rows
+		MatrixXd none;
+		forEachProcess(*this, "postMult", m_verbose, ntall(), none, out,
+				[&](size_t b, size_t e, Ref<MatrixXd>, Ref<MatrixXd> out)
+		{
+			forEachTall(*this, b, e, [&](size_t, const Ref<const MatrixXd> block,
+						size_t cc)
+			{
+				out.middleRows(cc, block.cols()).noalias() =
+					block.transpose()*in;
+			});
+		});
+	}
+};
+
+/**
+ * @brief Computes out = A*A^T*in in a single pass over the data. Since A is
+ * stored in blocks of columns, A*A^T*in = SUM(A_b*(A_b^T*in)), so each
+ * block is only read once. Blocks are split between processes and threads.
+ *
+ * @param out Output matrix, rows() x in.cols()
+ * @param in Input matrix, rows() x in.cols()
+ */
+void MatrixReorg::gramMult(Eigen::Ref<MatrixXd> out,
+		const Eigen::Ref<const MatrixXd> in) const
+{
+	if(out.rows() != rows() || out.cols() != in.cols() || rows() != in.rows()) {
+		throw INVALID_ARGUMENT("Input arguments are non-conformant for "
+				"matrix multiplication");
+	}
+
+	// Sum per thread, then combine in order so the result does not depend on
+	// timing
+	MatrixXd none;
+	forEachProcess(*this, "gramMult", m_verbose, ntall(), out, none,
+			[&](size_t b, size_t e, Ref<MatrixXd> out, Ref<MatrixXd>)
+	{
+		vector<MatrixXd> partial(numThreads());
+		size_t nchunks = forEachTall(*this, b, e, [&](size_t chunk,
+					const Ref<const MatrixXd> block, size_t)
+		{
+			if(partial[chunk].size() == 0)
+				partial[chunk].setZero(out.rows(), out.cols());
+			MatrixXd tmp = block.transpose()*in;
+			partial[chunk].noalias() += block*tmp;
+		});
+
 		out.setZero();
-		for(size_t cc=0, bb=0; cc<cols(); bb++) {
-			// Load Block
-			MatMap block(tallMatName(bb), false);
-			cerr<<"Multiplying "<<block.mat.rows()<<"x"<<block.mat.cols()<<" by "
-				<<in.rows()<<"x"<<in.cols()<<endl;
-
-			// Multiply By Input
-			out.middleRows(cc, m_outcols[bb]) = block.mat.transpose()*in;
-			cc += m_outcols[bb];
+		for(size_t ii=0; ii<nchunks; ii++)
+			out += partial[ii];
+	});
+}
+
+/**
+ * @brief Computes Y = A*A^T*X and B = P*A together in a single pass over the
+ * data, and the squared Frobenius norm of A if sqnorm is given. Either product
+ * is skipped if X has no columns or P has no rows. These are the products
+ * adaptiveRangeFinder() needs for each block of its basis.
+ *
+ * @param Y Output, rows() x X.cols()
+ * @param X Input, rows() x X.cols()
+ * @param B Output, P.rows() x cols()
+ * @param P Input, P.rows() x rows()
+ * @param sqnorm If not NULL, set to the squared Frobenius norm of A
+ */
+void MatrixReorg::rangeMult(Eigen::Ref<MatrixXd> Y,
+		const Eigen::Ref<const MatrixXd> X, Eigen::Ref<MatrixXd> B,
+		const Eigen::Ref<const MatrixXd> P, double* sqnorm) const
+{
+	if(Y.rows() != rows() || X.rows() != rows() || Y.cols() != X.cols() ||
+			(P.rows() > 0 && (P.cols() != rows() || B.cols() != cols() ||
+			B.rows() != P.rows()))) {
+		throw INVALID_ARGUMENT("Input arguments are non-conformant for "
+				"matrix multiplication");
+	}
+
+	// The extra column of the sum carries the squared norm (in its first
+	// element), so that it is reduced along with Y
+	size_t k = X.cols();
+	MatrixXd acc(rows(), k+1);
+	MatrixXd emptyB;
+	Ref<MatrixXd> fill = P.rows() > 0 ? B : Ref<MatrixXd>(emptyB);
+	forEachProcess(*this, "rangeMult", m_verbose, ntall(), acc, fill,
+			[&](size_t b, size_t e, Ref<MatrixXd> acc, Ref<MatrixXd> B)
+	{
+		vector<MatrixXd> partial(numThreads());
+		size_t nchunks = forEachTall(*this, b, e, [&](size_t chunk,
+					const Ref<const MatrixXd> block, size_t cc)
+		{
+			if(partial[chunk].size() == 0)
+				partial[chunk].setZero(acc.rows(), acc.cols());
+			if(k > 0) {
+				MatrixXd tmp = block.transpose()*X;
+				partial[chunk].leftCols(k).noalias() += block*tmp;
+			}
+			if(P.rows() > 0)
+				B.middleCols(cc, block.cols()).noalias() = P*block;
+			partial[chunk](0, k) += block.squaredNorm();
+		});
+
+		acc.setZero();
+		for(size_t ii=0; ii<nchunks; ii++)
+			acc += partial[ii];
+	});
+
+	Y = acc.leftCols(k);
+	if(sqnorm)
+		*sqnorm = acc(0, k);
+}
+
+/**
+ * @brief Computes the Gram matrix A*A^T (rows() x rows()), by accumulating
+ * A_b*A_b^T over the blocks. The lower triangle is split by output column
+ * into bands of about equal size, one per thread. If a rows() x rows()
+ * partial sum per process fits in the memory limit, each process gets a
+ * disjoint run of blocks and the partial sums are added. Otherwise the bands
+ * are divided between processes, each of which reads every block, so that
+ * only one rows() x rows() matrix is needed; compressed blocks would then be
+ * decompressed once per process, so they stay in a single process. Blocks are
+ * read in order (with the next block prefetched).
+ *
+ * @param out Output matrix, rows() x rows()
+ */
+void MatrixReorg::gram(Eigen::Ref<MatrixXd> out) const
+{
+	if(out.rows() != rows() || out.cols() != rows()) {
+		throw INVALID_ARGUMENT("Output of gram() should be rows() x "
+				"rows()");
+	}
+
+	// Columns are split so that each band has about the same part of the
+	// lower triangle, column c has rows()-c elements
+	auto bandSplit = [&](size_t nbands)
+	{
+		vector<size_t> split(nbands+1, rows());
+		for(size_t ii=0; ii<nbands; ii++) {
+			split[ii] = rows()-(size_t)round(rows()*
+					sqrt(1-(double)ii/nbands));
+		}
+		return split;
+	};
+
+	// Zero bands [band0, band1) of out then add blocks [begin, end) to them,
+	// with the bands split between threads
+	auto accumulate = [&](size_t begin, size_t end, const vector<size_t>& split,
+			size_t band0, size_t band1, Ref<MatrixXd> out)
+	{
+		bool mapped = m_storage != STORE_FLOAT32_GZ;
+		for(size_t ii=band0; ii<band1; ii++) {
+			out.block(split[ii], split[ii], rows()-split[ii],
+					split[ii+1]-split[ii]).setZero();
 		}
+
+		for(size_t bb=begin; bb<end; bb++) {
+			if(mapped && bb+1 < end)
+				tallMat(bb+1).advise(MADV_WILLNEED);
+
+			tallPanels(bb, [&](const Ref<const MatrixXd> block, size_t)
+			{
+				parallelFor(band0, band1, [&](size_t, size_t b, size_t e)
+				{
+					for(size_t ii=b; ii<e; ii++) {
+						size_t c0 = split[ii];
+						size_t w = split[ii+1]-c0;
+						if(w == 0)
+							continue;
+						out.block(c0, c0, rows()-c0, w).noalias() +=
+							block.bottomRows(rows()-c0)*
+							block.middleRows(c0, w).transpose();
+					}
+				});
+			});
+		}
+	};
+
+	MatrixXd none;
+	size_t nprocs = std::min<size_t>(processes(), ntall());
+	if(nprocs > 1 && nprocs*rows()*rows() <= m_maxdoubles) {
+		// Disjoint blocks per process, summed
+		forEachProcess(*this, "gram", m_verbose, ntall(), out, none,
+				[&](size_t begin, size_t end, Ref<MatrixXd> out, Ref<MatrixXd>)
+		{
+			size_t nbands = std::max<size_t>(1, std::min<size_t>(numThreads(),
+						rows()));
+			accumulate(begin, end, bandSplit(nbands), 0, nbands, out);
+		});
+	} else {
+		// Bands per process, at least one per process unless compressed
+		size_t nbands = std::max<size_t>(1, std::min<size_t>(rows(),
+					std::max(numThreads(), processes())));
+		size_t nparts = m_storage == STORE_FLOAT32_GZ ? 1 : nbands;
+		vector<size_t> split = bandSplit(nbands);
+		forEachProcess(*this, "gram", m_verbose, nparts, none, out,
+				[&](size_t begin, size_t end, Ref<MatrixXd>, Ref<MatrixXd> out)
+		{
+			accumulate(0, ntall(), split, begin*nbands/nparts,
+					end*nbands/nparts, out);
+		});
 	}
-};
+
+	// Fill the upper triangle
+	out.triangularView<Eigen::StrictlyUpper>() = out.transpose();
+}
 
 void gicaCreateMatrices(size_t tcat, size_t scat, vector<string> masks,
 		vector<string> inputs, std::string prefix, double maxmem, bool normts,
-		bool verbose)
+		bool verbose, MatStorageT storage)
 {
 	cerr << "Reorganizing data into matrices..."<<endl;
 	size_t ndoubles = (size_t)(0.5*maxmem*(1<<27));
-	MatrixReorg A(prefix, ndoubles, verbose);
+	MatrixReorg A(prefix, ndoubles, verbose, storage);
 	int status = A.createMats(tcat, scat, masks, inputs, normts);
 	if(status != 0)
 		throw RUNTIME_ERROR("Error while reorganizing data into 2D Matrices");
@@ -730,11 +1513,12 @@ void gicaCreateMatrices(size_t tcat, size_t scat, vector<string> masks,
 }
 
 void gicaReduceFull(std::string inpref, std::string outpref, double varthresh,
-		double cvarthresh, size_t maxrank, bool verbose)
+		double cvarthresh, size_t maxrank, bool verbose, size_t nprocs)
 {
 	MatrixXd U, E, V;
 	MatrixReorg A(inpref, -1, verbose);
 	A.checkMats();
+	A.setProcesses(nprocs);
 
 	cerr<<"Running XXt SVD"<<endl;
 	cerr<<"A = "<<A.rows()<<" x "<<A.cols()<<endl;
@@ -764,11 +1548,13 @@ void gicaReduceFull(std::string inpref, std::string outpref, double varthresh,
 }
 
 void gicaReduceProb(std::string inpref, std::string outpref, double varthresh,
-		double cvarthresh, size_t rank, size_t poweriters, bool verbose)
+		double cvarthresh, size_t rank, size_t poweriters, bool verbose,
+		size_t nprocs)
 {
 	MatrixXd U, E, V;
 	MatrixReorg A(inpref, -1, verbose);
 	A.checkMats();
+	A.setProcesses(nprocs);
 
 	cerr<<"Running On Disk SVD"<<endl;
 	cerr<<"A = "<<A.rows()<<" x "<<A.cols()<<endl;
@@ -881,7 +1667,8 @@ void gicaTemporalICA(std::string reorgpref, std::string reducepref,
 	size_t matn = 0; // matrix number (tall matrices)
 	size_t maskn = 0; // Mask number
 
-	MatMap tall(A.tallMatName(matn), false);
+	MatrixXd tall;
+	A.loadTall(matn, tall);
 	MatrixXd tvalues(A.cols(), ics.cols());
 	cerr<<"Regressing full dataset"<<endl;
 	for(size_t cc=0, tc=0; cc < A.cols(); maskn++) {
@@ -907,12 +1694,12 @@ void gicaTemporalICA(std::string reorgpref, std::string reducepref,
 			} else {
 				// Load the next block of columns as necessary
 				if(tc >= tall.cols()) {
-					tall.open(A.tallMatName(++matn));
+					A.loadTall(++matn, tall);
 					tc = 0;
 				}
 
 				// Perform regression
-				regress(&result, tall.mat.col(tc), ics, Cinv, Xinv, distrib);
+				regress(&result, tall.col(tc), ics, Cinv, Xinv, distrib);
 				for(size_t comp=0; comp<ics.cols(); comp++) {
 					size_t trcomp = sorted[comp];
 					tit.set(comp, result.t[trcomp]);
@@ -1091,7 +1878,59 @@ void gicaSpatialICA(std::string reorgpref, std::string reducepref,
 //}
 
 /**
- * @brief Performs general linear model analysis on a 4D image.
+ * @brief Returns voxels [v0, v0+nv) of a 4D image as a column-major tlen x nv
+ * matrix. Time is the fastest dimension, so FLOAT64 images are used in place,
+ * other types are cast into buf.
+ *
+ * @param fmri Input 4D image
+ * @param vw View of fmri, used for casting
+ * @param v0 First voxel
+ * @param nv Number of voxels
+ * @param buf Buffer to cast into
+ *
+ * @return Pointer to the first element of the tile
+ */
+static const double* glmTile(ptr<const MRImage> fmri,
+		NDConstView<double>& vw, size_t v0, size_t nv, MatrixXd& buf)
+{
+	size_t tlen = fmri->tlen();
+	if(fmri->type() == FLOAT64)
+		return (const double*)fmri->data() + v0*tlen;
+
+	buf.resize(tlen, nv);
+	for(size_t ii=0; ii<tlen*nv; ii++)
+		buf.data()[ii] = vw[v0*tlen+ii];
+	return buf.data();
+}
+
+/**
+ * @brief Writes a rows x nv block of values, for voxels starting at v0, to an
+ * image with rows elements per voxel. FLOAT64 images are written directly.
+ *
+ * @param img Output image
+ * @param vw View of img, used for casting
+ * @param vals Values, one column per voxel
+ * @param v0 First voxel
+ */
+static void glmStore(ptr<MRImage> img, NDView<double>& vw,
+		const Eigen::Ref<const MatrixXd>& vals, size_t v0)
+{
+	size_t len = vals.rows();
+	if(img->type() == FLOAT64) {
+		Eigen::Map<MatrixXd>((double*)img->data()+v0*len, len, vals.cols())
+			= vals;
+	} else {
+		for(size_t cc=0; cc<vals.cols(); cc++) {
+			for(size_t rr=0; rr<len; rr++)
+				vw.set((v0+cc)*len+rr, vals(rr, cc));
+		}
+	}
+}
+
+/**
+ * @brief Performs general linear model analysis on a 4D image. Voxels are
+ * regressed in tiles (as matrix-matrix products), with tiles split between
+ * threads.
  *
  * @param fmri Input 4D image.
  * @param Input X Regressors
@@ -1136,10 +1975,7 @@ void fmriGLM(ptr<const MRImage> fmri, const MatrixXd& X,
 		throw INVALID_ARGUMENT("T image must have matching orientation to fMRI!");
 
 	size_t tlen = fmri->tlen();
-	vector<size_t> osize(4);
-	for(size_t ii=0; ii<3; ii++)
-		osize[ii] = fmri->dim(ii);
-	osize[3] = X.cols();
+	const size_t P = X.cols();
 
     // Cache Reused Vectors
     MatrixXd Xinv = pseudoInverse(X);
@@ -1149,27 +1985,377 @@ void fmriGLM(ptr<const MRImage> fmri, const MatrixXd& X,
     const double STEP_T = 0.1;
     StudentsT student_cdf(X.rows()-1, STEP_T, MAX_T);
 
-    // regress each timesereies
-    Vector3DConstIter<double> it(fmri);
-    Eigen::VectorXd y(tlen);
-    vector<int64_t> ind(3);
-	RegrResult ret;
-    for(Vector3DIter<double> bit(bimg), tit(Timg), pit(pimg); !it.eof();
-			++tit, ++it, ++bit, ++pit) {
-
-        // copy to signal
-        for(size_t tt=0; tt<tlen; ++tt)
-            y[tt] = it[tt];
-
-		// perform regression
-		regress(&ret, y, X, covInv, Xinv, student_cdf);
-
-		for(size_t ii=0; ii<X.cols(); ii++) {
-			bit.set(ii, ret.bhat[ii]);
-			tit.set(ii, ret.t[ii]);
-			pit.set(ii, ret.p[ii]);
+	// Time is the fastest dimension, so a run of GLM_TILE voxels is a
+	// contiguous tlen x GLM_TILE matrix Y, and the regression of the whole
+	// tile is B = X^+ Y, R = Y - XB
+	const size_t GLM_TILE = 512;
+	const double dof = X.rows()-X.cols();
+	size_t nvox = fmri->elements()/tlen;
+	size_t ntiles = (nvox+GLM_TILE-1)/GLM_TILE;
+
+	parallelFor(0, ntiles, [&](size_t, size_t tile0, size_t tile1)
+	{
+		NDConstView<double> fmri_vw(fmri);
+		NDView<double> b_vw(bimg);
+		NDView<double> t_vw(Timg);
+		NDView<double> p_vw(pimg);
+		MatrixXd Ybuf;
+		MatrixXd B, R, T, Pval;
+		VectorXd sigmahat;
+		for(size_t tile = tile0; tile < tile1; tile++) {
+			size_t v0 = tile*GLM_TILE;
+			size_t nv = std::min(GLM_TILE, nvox-v0);
+
+			Eigen::Map<const MatrixXd> Y(glmTile(fmri, fmri_vw, v0, nv, Ybuf),
+					tlen, nv);
+
+			// betas and residuals
+			B.noalias() = Xinv*Y;
+			R = Y;
+			R.noalias() -= X*B;
+
+			// t = beta / sqrt(sigmahat*covInv), as in regress()
+			sigmahat = R.colwise().squaredNorm().transpose()/dof;
+			T = B.array()/(covInv*sigmahat.transpose()).array().sqrt();
+
+			// two sided p-values
+			Pval.resize(P, nv);
+			student_cdf.twoSided(P*nv, T.data(), Pval.data());
+
+			glmStore(bimg, b_vw, B, v0);
+			glmStore(Timg, t_vw, T, v0);
+			glmStore(pimg, p_vw, Pval, v0);
 		}
-    }
+	});
+}
+
+/**
+ * @brief Finds clusters of 6-connected voxels with |t| > thresh and the same
+ * sign in a 3D map, stored with x slowest and z fastest.
+ *
+ * @param dim Size of the map
+ * @param t Map values (NaN is never in a cluster)
+ * @param thresh Threshold on |t|
+ * @param label Work space, one element per voxel
+ * @param ids If not NULL, filled with the cluster index of each voxel (-1
+ * outside clusters)
+ *
+ * @return Mass (sum of |t|) of each cluster
+ */
+static vector<double> clusterMass(const size_t* dim, const float* t,
+		double thresh, vector<int64_t>& label, vector<int64_t>* ids)
+{
+	size_t nvox = dim[0]*dim[1]*dim[2];
+	size_t xstride = dim[1]*dim[2];
+	size_t ystride = dim[2];
+	label.resize(nvox);
+
+	// union-find, label is the parent (-1 below threshold), the root of each
+	// cluster is its first voxel
+	auto root = [&](int64_t v)
+	{
+		while(label[v] != v) {
+			label[v] = label[label[v]];
+			v = label[v];
+		}
+		return v;
+	};
+	auto join = [&](int64_t a, int64_t b)
+	{
+		if(label[b] < 0 || (t[a] > 0) != (t[b] > 0))
+			return;
+		a = root(a);
+		b = root(b);
+		if(a < b)
+			label[b] = a;
+		else
+			label[a] = b;
+	};
+
+	size_t vv = 0;
+	for(size_t xx=0; xx<dim[0]; xx++) {
+		for(size_t yy=0; yy<dim[1]; yy++) {
+			for(size_t zz=0; zz<dim[2]; zz++, vv++) {
+				if(!(fabs(t[vv]) > thresh)) {
+					label[vv] = -1;
+					continue;
+				}
+				label[vv] = vv;
+				if(xx > 0) join(vv, vv-xstride);
+				if(yy > 0) join(vv, vv-ystride);
+				if(zz > 0) join(vv, vv-1);
+			}
+		}
+	}
+
+	// roots are found in increasing order
+	vector<int64_t> roots;
+	vector<double> mass;
+	if(ids)
+		ids->assign(nvox, -1);
+	for(vv=0; vv<nvox; vv++) {
+		if(label[vv] < 0)
+			continue;
+		int64_t rr = root(vv);
+		if(rr == (int64_t)vv) {
+			roots.push_back(rr);
+			mass.push_back(0);
+		}
+		size_t cc = std::lower_bound(roots.begin(), roots.end(), rr) -
+			roots.begin();
+		mass[cc] += fabs(t[vv]);
+		if(ids)
+			(*ids)[vv] = cc;
+	}
+	return mass;
+}
+
+/**
+ * @brief Nonparametric, family-wise error corrected p-values for each
+ * regressor of a general linear model, from the max-T (and optionally
+ * cluster mass) null distribution.
+ *
+ * Each regressor is tested with the Freedman-Lane procedure: the residuals
+ * of the other regressors are permuted (and/or sign flipped) and refit. Only
+ * the design is permuted in memory; the data is streamed from the image in
+ * tiles of voxels, each tile is reduced once, and the t-scores of a whole
+ * batch of permutations are computed with one matrix-matrix product. Tiles
+ * are split between threads. Each permutation is generated from its own
+ * generator, seeded with (seed, permutation number), so results do not
+ * depend on the number of threads.
+ *
+ * Permutation 0 is always the unpermuted data, so p-values are at least
+ * 1/nperm. Memory is bounded by the tiles, plus a float map per permutation
+ * in a batch when cluster p-values are requested.
+ *
+ * @param fmri Input 4D image, the last dimension matches the rows of X
+ * (subjects or time points)
+ * @param X Regressors
+ * @param nperm Number of permutations (including the unpermuted data)
+ * @param mode How rows are exchanged (reordered, sign flipped, or both)
+ * @param fwe_pimg Output max-T corrected p-values, one volume per regressor
+ * @param cluster_pimg Output cluster mass corrected p-values (one volume per
+ * regressor) for the cluster each voxel is in, 1 outside clusters. May be
+ * NULL to skip cluster inference.
+ * @param clusterthresh Clusters are 6-connected voxels with |t| above this
+ * and the same sign, the mass of a cluster is the sum of its |t|
+ * @param seed Random seed
+ * @param batch Number of permutations to evaluate per pass over the data
+ */
+void fmriGLMPermute(ptr<const MRImage> fmri, const MatrixXd& X,
+		size_t nperm, PermuteT mode, ptr<MRImage> fwe_pimg,
+		ptr<MRImage> cluster_pimg, double clusterthresh,
+		unsigned int seed, size_t batch)
+{
+	if(fmri->ndim() != 4)
+		throw INVALID_ARGUMENT("fMRI must be 4D!");
+	if(fmri->tlen() != X.rows())
+		throw INVALID_ARGUMENT("fMRI must have same number of timepoints as X "
+				"has rows!");
+	if(X.cols() < 1 || X.cols() >= X.rows())
+		throw INVALID_ARGUMENT("X (regressors) must have at least 1 column, "
+				"and fewer columns than rows!");
+	if(nperm < 1 || batch < 1)
+		throw INVALID_ARGUMENT("At least 1 permutation (and batch size of 1) "
+				"is required!");
+	for(auto img : {fwe_pimg, cluster_pimg}) {
+		if(!img)
+			continue;
+		for(size_t ii=0; ii<3; ii++) {
+			if(img->dim(ii) != fmri->dim(ii))
+				throw INVALID_ARGUMENT("p image must have matching size to "
+						"fMRI!");
+		}
+		if(img->tlen() != X.cols())
+			throw INVALID_ARGUMENT("p images must have one volume per column "
+					"of X (regressors)!");
+	}
+	if(!fwe_pimg)
+		throw INVALID_ARGUMENT("FWE p image is required!");
+
+	const size_t tlen = fmri->tlen();
+	const size_t P = X.cols();
+	const size_t nvox = fmri->elements()/tlen;
+	const size_t dim[3] = {fmri->dim(0), fmri->dim(1), fmri->dim(2)};
+	const double dof = X.rows()-X.cols();
+	const bool clusters = (bool)cluster_pimg;
+	const size_t GLM_TILE = 512;
+	const size_t ntiles = (nvox+GLM_TILE-1)/GLM_TILE;
+	batch = std::min(batch, nperm);
+
+	// The residual sum of squares of exchanged residuals W is
+	// |W|^2 - |Q^T W|^2, with Q an orthonormal basis for the columns of X
+	Eigen::JacobiSVD<MatrixXd> svd(X, Eigen::ComputeThinU);
+	double tol = svd.singularValues()[0]*tlen*
+		std::numeric_limits<double>::epsilon();
+	size_t rank = 0;
+	for(size_t ii=0; ii<svd.singularValues().rows(); ii++) {
+		if(svd.singularValues()[ii] > tol)
+			rank++;
+	}
+	MatrixXd Q = svd.matrixU().leftCols(rank);
+	MatrixXd Xinv = pseudoInverse(X);
+	VectorXd covInv = pseudoInverse(X.transpose()*X).diagonal();
+	const size_t rows = rank+1;
+
+	// Row exchange for permutation kk, row tt is replaced by sign[tt] times
+	// row perm[tt]. Permutation 0 is the identity.
+	auto exchange = [&](size_t kk, vector<size_t>& perm, vector<double>& sign)
+	{
+		perm.resize(tlen);
+		std::iota(perm.begin(), perm.end(), 0);
+		sign.assign(tlen, 1);
+		if(kk == 0)
+			return;
+
+		std::seed_seq sseq({seed, (unsigned int)kk,
+				(unsigned int)((uint64_t)kk>>32)});
+		std::mt19937 rng(sseq);
+		if(mode != PERMUTE_SIGNS)
+			std::shuffle(perm.begin(), perm.end(), rng);
+		if(mode != PERMUTE_ROWS) {
+			std::bernoulli_distribution coin(0.5);
+			for(size_t tt=0; tt<tlen; tt++)
+				sign[tt] = coin(rng) ? -1 : 1;
+		}
+	};
+
+	NDView<double> fwe_vw(fwe_pimg);
+	NDView<double> cluster_vw;
+	if(clusters)
+		cluster_vw.setArray(cluster_pimg);
+
+	vector<double> tobs(nvox);
+	vector<float> tmaps(clusters ? batch*nvox : 0);
+	vector<double> maxt(nperm);
+	vector<double> maxmass(nperm);
+	vector<int64_t> obsid;
+	vector<double> obsmass;
+	for(size_t jj=0; jj<P; jj++) {
+		// Reduced model (without regressor jj), its residuals are exchanged
+		MatrixXd Z(tlen, P-1);
+		for(size_t cc=0, kk=0; cc<P; cc++) {
+			if(cc != jj)
+				Z.col(kk++) = X.col(cc);
+		}
+		MatrixXd Zinv = P > 1 ? pseudoInverse(Z) : MatrixXd(0, tlen);
+
+		// Rows applied to the exchanged residuals: the row of X^+ for
+		// regressor jj (giving beta) and Q^T (giving the fit)
+		MatrixXd base(rows, tlen);
+		base.row(0) = Xinv.row(jj);
+		base.bottomRows(rank) = Q.transpose();
+
+		for(size_t k0=0; k0<nperm; k0+=batch) {
+			size_t nb = std::min(batch, nperm-k0);
+
+			// Exchange the columns of base rather than the rows of the data,
+			// stacking the whole batch
+			MatrixXd A(nb*rows, tlen);
+			parallelFor(0, nb, [&](size_t, size_t b, size_t e)
+			{
+				vector<size_t> perm;
+				vector<double> sign;
+				for(size_t kk=b; kk<e; kk++) {
+					exchange(k0+kk, perm, sign);
+					for(size_t tt=0; tt<tlen; tt++) {
+						A.block(kk*rows, perm[tt], rows, 1) =
+							sign[tt]*base.col(tt);
+					}
+				}
+			});
+
+			vector<vector<double>> chunkmax(numThreads(),
+					vector<double>(nb, 0));
+			parallelFor(0, ntiles, [&](size_t chunk, size_t tile0,
+						size_t tile1)
+			{
+				NDConstView<double> fmri_vw(fmri);
+				MatrixXd Ybuf, R, AR;
+				VectorXd rss;
+				vector<double>& localmax = chunkmax[chunk];
+				for(size_t tile=tile0; tile<tile1; tile++) {
+					size_t v0 = tile*GLM_TILE;
+					size_t nv = std::min(GLM_TILE, nvox-v0);
+					Eigen::Map<const MatrixXd> Y(glmTile(fmri, fmri_vw, v0,
+								nv, Ybuf), tlen, nv);
+
+					// Freedman-Lane residuals, their norm doesn't change when
+					// rows are exchanged
+					R = Y;
+					if(P > 1)
+						R.noalias() -= Z*(Zinv*Y);
+					rss = R.colwise().squaredNorm().transpose();
+					AR.noalias() = A*R;
+
+					for(size_t kk=0; kk<nb; kk++) {
+						for(size_t vv=0; vv<nv; vv++) {
+							double beta = AR(kk*rows, vv);
+							double ss = rss[vv] - AR.block(kk*rows+1, vv,
+									rank, 1).squaredNorm();
+							double t = beta/sqrt(std::max(ss, 0.)/dof*
+									covInv[jj]);
+							if(fabs(t) > localmax[kk])
+								localmax[kk] = fabs(t);
+							if(k0+kk == 0)
+								tobs[v0+vv] = t;
+							if(clusters)
+								tmaps[kk*nvox+v0+vv] = t;
+						}
+					}
+				}
+			});
+			for(size_t kk=0; kk<nb; kk++) {
+				maxt[k0+kk] = 0;
+				for(auto& cm : chunkmax)
+					maxt[k0+kk] = std::max(maxt[k0+kk], cm[kk]);
+			}
+
+			if(clusters) {
+				parallelFor(0, nb, [&](size_t, size_t b, size_t e)
+				{
+					vector<int64_t> label;
+					for(size_t kk=b; kk<e; kk++) {
+						auto mass = clusterMass(dim, &tmaps[kk*nvox],
+								clusterthresh, label,
+								k0+kk == 0 ? &obsid : NULL);
+						maxmass[k0+kk] = 0;
+						for(auto m : mass)
+							maxmass[k0+kk] = std::max(maxmass[k0+kk], m);
+						if(k0+kk == 0)
+							obsmass = mass;
+					}
+				});
+			}
+		}
+
+		// Corrected p-value is the fraction of permutations whose maximum is
+		// at least as large
+		std::sort(maxt.begin(), maxt.end());
+		for(size_t vv=0; vv<nvox; vv++) {
+			double p = 1;
+			if(!std::isnan(tobs[vv])) {
+				size_t below = std::lower_bound(maxt.begin(), maxt.end(),
+						fabs(tobs[vv])) - maxt.begin();
+				p = (double)(nperm-below)/nperm;
+			}
+			fwe_vw.set(vv*P+jj, p);
+		}
+
+		if(clusters) {
+			std::sort(maxmass.begin(), maxmass.end());
+			for(size_t vv=0; vv<nvox; vv++) {
+				double p = 1;
+				if(obsid[vv] >= 0) {
+					size_t below = std::lower_bound(maxmass.begin(),
+							maxmass.end(), obsmass[obsid[vv]]) -
+						maxmass.begin();
+					p = (double)(nperm-below)/nperm;
+				}
+				cluster_vw.set(vv*P+jj, p);
+			}
+		}
+	}
 }
 
 /**
@@ -1235,30 +2421,23 @@ double bs_transition(double f, double cutoff , double cuton, int w)
 }
 
 /**
- * @brief Takes the FFT of each line of the image, performs bandpass filtering
- * on the line and then invert FFTs and writes back to the input image.
+ * @brief Creates the frequency response of a butterworth filter for the
+ * positive frequencies of a padded, real FFT, including the 1/N
+ * normalization of the unscaled inverse transform.
  *
- * @param inimg Input image
+ * @param dt Sample spacing (TR)
+ * @param psize Padded length of the time series
  * @param cuton Minimum frequency (may be 0)
  * @param cutoff Maximum frequency in band (may be INFINITY)
+ * @param order Order of the butterworth filter
+ *
+ * @return Response at each of the psize/2+1 frequencies
  */
-void fmriBandPass(ptr<MRImage> inimg, double cuton, double cutoff)
+static vector<double> bandPassResponse(double dt, int psize, double cuton,
+		double cutoff, int order)
 {
-	const int BUTTERWORTH_ORDER = 2;
-
-	if(inimg->ndim() != 4)
-		throw INVALID_ARGUMENT("Input image to timeFilter is not 4D!");
-
-	size_t tlen = inimg->tlen();
-	double Fs = 1./inimg->spacing(3);
-
-	int psize = round2(inimg->tlen()); // padded data size
-
-	auto rbuffer = (double*)fftw_malloc(sizeof(double)*psize);
-	auto ibuffer = (fftw_complex*)fftw_malloc(sizeof(fftw_complex)*psize);
-
-	fftw_plan fwd = fftw_plan_dft_r2c_1d(psize, rbuffer, ibuffer, FFTW_MEASURE);
-	fftw_plan rev = fftw_plan_dft_c2r_1d(psize, ibuffer, rbuffer, FFTW_MEASURE);
+	double Fs = 1./dt;
+	int fsize = psize/2+1; // number of non-redundant frequencies
 
 	double(*smoothfunc)(double, double, double, int) = NULL;
 	bool pos_valid = !(cuton < 0 || std::isnan(cuton) || std::isinf(cuton));
@@ -1292,107 +2471,559 @@ void fmriBandPass(ptr<MRImage> inimg, double cuton, double cutoff)
 	cerr << "Frequencies in FFT: " << 0 << " - " << Fs/2.0
 		<< "hz" << endl;
 
-	//Create the 1-D filter
-	double T = (double)psize*inimg->spacing(3);
-	for(Vector3DIter<double> it(inimg); !it.eof(); ++it) {
-		// Copy from input
-		for(size_t tt = 0 ; tt < tlen; tt++)
-			rbuffer[tt] = it[tt];
-
-		// Zero Pad
-		for(size_t tt = tlen; tt < psize; tt++)
-			rbuffer[tt] = 0;
-
-		// fourier transform
-		fftw_execute(fwd);
-
-		// Positive Frequencies Only
-		for(size_t ii=0; ii<psize/2+1; ii++) {
-			double ff = (double)ii/T;
-			cdouble_t tmp(ibuffer[ii][0], ibuffer[ii][1]);
-			tmp *= smoothfunc(ff, cutoff, cuton, BUTTERWORTH_ORDER)/psize;
-			ibuffer[ii][0] = tmp.real();
-			ibuffer[ii][1] = tmp.imag();
+	//Create the 1-D filter (positive frequencies only), including the 1/N
+	//normalization of the unscaled inverse transform
+	double T = (double)psize*dt;
+	vector<double> response(fsize);
+	for(size_t ii=0; ii<fsize; ii++) {
+		double ff = (double)ii/T;
+		response[ii] = smoothfunc(ff, cutoff, cuton, order)/psize;
+	}
+	return response;
+}
+
+/**
+ * @brief Takes the FFT of each line of the image, performs bandpass filtering
+ * on the line and then invert FFTs and writes back to the input image.
+ *
+ * Time series are gathered into blocks of FILTER_BATCH voxels and transformed
+ * together with a single fftw_plan_many_dft_r2c/c2r pair. The plans are created
+ * once (planning is not thread safe) and then executed on per-thread buffers
+ * over slabs of the image in parallel.
+ *
+ * @param inimg Input image
+ * @param cuton Minimum frequency (may be 0)
+ * @param cutoff Maximum frequency in band (may be INFINITY)
+ */
+void fmriBandPass(ptr<MRImage> inimg, double cuton, double cutoff)
+{
+	const int BUTTERWORTH_ORDER = 2;
+	const int FILTER_BATCH = 64;
+
+	if(inimg->ndim() != 4)
+		throw INVALID_ARGUMENT("Input image to timeFilter is not 4D!");
+
+	size_t tlen = inimg->tlen();
+	int psize = round2(inimg->tlen()); // padded data size
+	int fsize = psize/2+1; // number of non-redundant frequencies
+	vector<double> response = bandPassResponse(inimg->spacing(3), psize,
+			cuton, cutoff, BUTTERWORTH_ORDER);
+
+	// Plan once, for a batch of contiguous time series
+	auto rplan = (double*)fftw_malloc(sizeof(double)*psize*FILTER_BATCH);
+	auto iplan = (fftw_complex*)fftw_malloc(sizeof(fftw_complex)*
+			fsize*FILTER_BATCH);
+	fftw_plan fwd, rev;
+	{
+		std::lock_guard<std::mutex> lock(fftwPlanMutex());
+		fwd = fftw_plan_many_dft_r2c(1, &psize, FILTER_BATCH, rplan, NULL, 1,
+				psize, iplan, NULL, 1, fsize, FFTW_MEASURE);
+		rev = fftw_plan_many_dft_c2r(1, &psize, FILTER_BATCH, iplan, NULL, 1,
+				fsize, rplan, NULL, 1, psize, FFTW_MEASURE);
+	}
+
+	// Process slabs of the image in parallel, each thread with its own buffers
+	parallelFor(0, inimg->dim(0), [&](size_t, size_t x0, size_t x1)
+	{
+		auto rbuffer = (double*)fftw_malloc(sizeof(double)*psize*FILTER_BATCH);
+		auto ibuffer = (fftw_complex*)fftw_malloc(sizeof(fftw_complex)*
+				fsize*FILTER_BATCH);
+
+		Vector3DIter<double> rit(inimg);
+		rit.setROI(slabROI(inimg, x0, x1));
+		Vector3DIter<double> wit(inimg);
+		wit.setROI(slabROI(inimg, x0, x1));
+		rit.goBegin();
+		wit.goBegin();
+		while(!rit.eof()) {
+			// Copy from input, zero padding each series
+			int nbatch = 0;
+			for(; !rit.eof() && nbatch < FILTER_BATCH; ++rit, ++nbatch) {
+				double* row = &rbuffer[nbatch*psize];
+				for(size_t tt = 0 ; tt < tlen; tt++)
+					row[tt] = rit[tt];
+				for(size_t tt = tlen; tt < psize; tt++)
+					row[tt] = 0;
+			}
+
+			// Unused rows of the last block
+			for(size_t ii=nbatch*psize; ii<psize*FILTER_BATCH; ii++)
+				rbuffer[ii] = 0;
+
+			// fourier transform
+			fftw_execute_dft_r2c(fwd, rbuffer, ibuffer);
+
+			// Apply filter
+			for(size_t bb=0; bb<nbatch; bb++) {
+				fftw_complex* row = &ibuffer[bb*fsize];
+				for(size_t ii=0; ii<fsize; ii++) {
+					row[ii][0] *= response[ii];
+					row[ii][1] *= response[ii];
+				}
+			}
+
+			// inverse fourier transform
+			fftw_execute_dft_c2r(rev, ibuffer, rbuffer);
+
+			// Copy Back Out
+			for(int bb=0; bb < nbatch; ++wit, ++bb) {
+				double* row = &rbuffer[bb*psize];
+				for(size_t tt = 0 ; tt < tlen; tt++)
+					wit.set(tt, row[tt]);
+			}
 		}
 
-		// inverse fourier transform
-		fftw_execute(rev);
+		fftw_free(rbuffer);
+		fftw_free(ibuffer);
+	});
 
-		// Copy Back Out
-		for(size_t tt = 0 ; tt < tlen; tt++)
-			it.set(tt, rbuffer[tt]);
+	{
+		std::lock_guard<std::mutex> lock(fftwPlanMutex());
+		fftw_destroy_plan(fwd);
+		fftw_destroy_plan(rev);
 	}
+	fftw_free(rplan);
+	fftw_free(iplan);
 };
 
 /**
  * @brief Regresses out the given variables, creating time series which are
  * uncorrelated with X
  *
- * @param inout Input 4D image
+ * @param inimg Input 4D image
  * @param X matrix of covariates
  *
+ * @return Residuals, as a FLOAT32 image
  */
 ptr<MRImage> regressOut(ptr<const MRImage> inimg, const MatrixXd& X)
 {
-	// Add Augmented version with intercept
-	MatrixXd Xaug(X.rows(), X.cols()+1);
-	Xaug.leftCols(X.cols()) = X;
-	Xaug.rightCols(1).setOnes();
+	auto out = dPtrCast<MRImage>(inimg->createAnother(FLOAT32));
+	regressOut(inimg, X, out);
+	return out;
+}
 
+/**
+ * @brief Regresses out the given variables, writing time series which are
+ * uncorrelated with X to out. Time series are processed in tiles (as
+ * matrix-matrix products), with tiles split between threads. Constant time
+ * series are set to zero.
+ *
+ * @param inimg Input 4D image
+ * @param X matrix of covariates
+ * @param out Output 4D image, the same size as inimg. May be inimg itself to
+ * regress in place.
+ */
+void regressOut(ptr<const MRImage> inimg, const MatrixXd& X,
+		ptr<MRImage> out)
+{
 	const double DELTA = 1e-20;
 	size_t tlen = inimg->tlen();
-	if(tlen != Xaug.rows()) {
+	if(inimg->ndim() != 4 || tlen != X.rows()) {
 		throw INVALID_ARGUMENT("Error, input design matrix must have matching "
 				"number of rows to input fMRI");
 	}
+	for(size_t dd=0; dd<4; dd++) {
+		if(out->ndim() != 4 || out->dim(dd) != inimg->dim(dd))
+			throw INVALID_ARGUMENT("Output must be the same size as input");
+	}
 	MatrixXd cinv = pseudoInverse(X.transpose()*X);
 	MatrixXd prebeta = cinv*X.transpose();
-	VectorXd y(X.rows());
-	VectorXd beta(X.cols());
 
-	//allocate output
-	auto out = dPtrCast<MRImage>(inimg->copyCast(FLOAT32));
+	// Time is the fastest dimension, so a run of voxels is a tlen x nv matrix
+	// Y, and the residuals are Y - X((XtX)^-1Xt Y). Each tile is read before
+	// it is written, so out may alias inimg.
+	const size_t TILE = 512;
+	size_t nvox = inimg->elements()/tlen;
+	size_t ntiles = (nvox+TILE-1)/TILE;
+	parallelFor(0, ntiles, [&](size_t, size_t tile0, size_t tile1)
+	{
+		NDConstView<double> in_vw(inimg);
+		NDView<double> out_vw(out);
+		MatrixXd Ybuf, R;
+		for(size_t tile = tile0; tile < tile1; tile++) {
+			size_t v0 = tile*TILE;
+			size_t nv = std::min(TILE, nvox-v0);
+			Eigen::Map<const MatrixXd> Y(glmTile(inimg, in_vw, v0, nv, Ybuf),
+					tlen, nv);
+
+			R = Y;
+			R.noalias() -= X*(prebeta*Y);
+
+			// zero constant signals, while the tile is in cache
+			for(size_t vv=0; vv<nv; vv++) {
+				if(!(Y.col(vv).maxCoeff() - Y.col(vv).minCoeff() > DELTA))
+					R.col(vv).setZero();
+			}
 
-	// Create Iterators
-	Vector3DIter<double> oit(out);
-	Vector3DConstIter<double> iit(inimg);
+			glmStore(out, out_vw, R, v0);
+		}
+	});
+}
 
-	// Iterate through and regress each line
-	for(iit.goBegin(), oit.goBegin(); !iit.eof(); ++iit, ++oit) {
+/**
+ * @brief Cleans fMRI data in a single pass: regresses out confounds (zeroing
+ * constant time series), then band pass filters and optionally normalizes
+ * each time series. This gives the same result as regressOut followed by
+ * fmriBandPass, but each tile of time series is loaded once, kept in double
+ * precision through every step, and stored once into the only new image.
+ * Tiles are split between threads.
+ *
+ * @param inimg Input 4D image
+ * @param X Confounds to regress out, may have 0 columns to skip regression
+ * @param cuton Minimum frequency (may be 0)
+ * @param cutoff Maximum frequency in band (may be INFINITY). If neither
+ * cuton nor cutoff is a valid frequency (both NaN or INFINITY) no filtering is
+ * performed.
+ * @param normalize Scale each time series to zero mean and unit variance
+ *
+ * @return Cleaned image (FLOAT32)
+ */
+ptr<MRImage> cleanFMRI(ptr<const MRImage> inimg, const MatrixXd& X,
+		double cuton, double cutoff, bool normalize)
+{
+	const int BUTTERWORTH_ORDER = 2;
+	const int FILTER_BATCH = 64;
+	const double DELTA = 1e-20;
+
+	if(inimg->ndim() != 4)
+		throw INVALID_ARGUMENT("Input image to cleanFMRI is not 4D!");
+	size_t tlen = inimg->tlen();
+	if(X.cols() > 0 && X.rows() != tlen) {
+		throw INVALID_ARGUMENT("Error, input design matrix must have matching "
+				"number of rows to input fMRI");
+	}
 
-		// statistics
-		double minv = std::numeric_limits<double>::max();
-		double maxv = std::numeric_limits<double>::min();
+	bool filter = !((cuton < 0 || std::isnan(cuton) || std::isinf(cuton)) &&
+			(cutoff < 0 || std::isnan(cutoff) || std::isinf(cutoff)));
+	int psize = filter ? round2(tlen) : tlen; // padded data size
+	int fsize = psize/2+1; // number of non-redundant frequencies
+	vector<double> response;
+	if(filter) {
+		response = bandPassResponse(inimg->spacing(3), psize, cuton, cutoff,
+				BUTTERWORTH_ORDER);
+	}
+
+	MatrixXd prebeta;
+	if(X.cols() > 0)
+		prebeta = pseudoInverse(X.transpose()*X)*X.transpose();
+
+	// Plan once, for a batch of contiguous time series
+	fftw_plan fwd = NULL;
+	fftw_plan rev = NULL;
+	double* rplan = NULL;
+	fftw_complex* iplan = NULL;
+	if(filter) {
+		std::lock_guard<std::mutex> lock(fftwPlanMutex());
+		rplan = (double*)fftw_malloc(sizeof(double)*psize*FILTER_BATCH);
+		iplan = (fftw_complex*)fftw_malloc(sizeof(fftw_complex)*
+				fsize*FILTER_BATCH);
+		fwd = fftw_plan_many_dft_r2c(1, &psize, FILTER_BATCH, rplan, NULL, 1,
+				psize, iplan, NULL, 1, fsize, FFTW_MEASURE);
+		rev = fftw_plan_many_dft_c2r(1, &psize, FILTER_BATCH, iplan, NULL, 1,
+				fsize, rplan, NULL, 1, psize, FFTW_MEASURE);
+	}
 
-		for(size_t tt=0; tt<tlen; ++tt) {
-			minv = std::min(minv, iit[tt]);
-			maxv = std::max(maxv, iit[tt]);
-			y[tt] = iit[tt];
+	auto out = dPtrCast<MRImage>(inimg->createAnother(FLOAT32));
+	size_t nvox = inimg->elements()/tlen;
+	size_t ntiles = (nvox+FILTER_BATCH-1)/FILTER_BATCH;
+	parallelFor(0, ntiles, [&](size_t, size_t tile0, size_t tile1)
+	{
+		NDConstView<double> in_vw(inimg);
+		NDView<double> out_vw(out);
+		MatrixXd Ybuf;
+
+		// Each column is a (padded) time series, laid out as FFTW expects
+		auto rbuffer = (double*)fftw_malloc(sizeof(double)*psize*FILTER_BATCH);
+		fftw_complex* ibuffer = NULL;
+		if(filter) {
+			ibuffer = (fftw_complex*)fftw_malloc(sizeof(fftw_complex)*
+					fsize*FILTER_BATCH);
 		}
+		Eigen::Map<MatrixXd> R(rbuffer, psize, FILTER_BATCH);
+
+		for(size_t tile = tile0; tile < tile1; tile++) {
+			size_t v0 = tile*FILTER_BATCH;
+			size_t nv = std::min<size_t>(FILTER_BATCH, nvox-v0);
+			Eigen::Map<const MatrixXd> Y(glmTile(inimg, in_vw, v0, nv, Ybuf),
+					tlen, nv);
+
+			// Regress out confounds, zero constant signals
+			R.setZero();
+			R.topLeftCorner(tlen, nv) = Y;
+			if(X.cols() > 0) {
+				R.topLeftCorner(tlen, nv).noalias() -= X*(prebeta*Y);
+				for(size_t vv=0; vv<nv; vv++) {
+					if(!(Y.col(vv).maxCoeff() - Y.col(vv).minCoeff() > DELTA))
+						R.col(vv).setZero();
+				}
+			}
 
-		// b = (XtX)^-1Xty
-		// X*((XtX)^-1Xty)
-		// y
-		if(fabs(maxv - minv) > DELTA) {
-			beta = prebeta*y;
-			y -= X*beta;
-		} else
-			y.setZero();
-
-		for(size_t tt=0; tt<tlen; ++tt) {
-			oit.set(tt, y[tt]);
+			// Filter
+			if(filter) {
+				fftw_execute_dft_r2c(fwd, rbuffer, ibuffer);
+				for(size_t bb=0; bb<nv; bb++) {
+					fftw_complex* row = &ibuffer[bb*fsize];
+					for(size_t ii=0; ii<fsize; ii++) {
+						row[ii][0] *= response[ii];
+						row[ii][1] *= response[ii];
+					}
+				}
+				fftw_execute_dft_c2r(rev, ibuffer, rbuffer);
+			}
+
+			// Normalize
+			if(normalize) {
+				for(size_t vv=0; vv<nv; vv++) {
+					auto y = R.col(vv).head(tlen);
+					double mean = y.mean();
+					double sd = sqrt((y.array()-mean).square().sum()/(tlen-1));
+					if(sd > 0)
+						y = (y.array()-mean)/sd;
+					else
+						y.setZero();
+				}
+			}
+
+			glmStore(out, out_vw, R.topLeftCorner(tlen, nv), v0);
 		}
+
+		fftw_free(rbuffer);
+		if(ibuffer)
+			fftw_free(ibuffer);
+	});
+
+	if(filter) {
+		std::lock_guard<std::mutex> lock(fftwPlanMutex());
+		fftw_destroy_plan(fwd);
+		fftw_destroy_plan(rev);
+		fftw_free(rplan);
+		fftw_free(iplan);
 	}
 
 	return out;
 }
 
 /**
- * @brief Creates a matrix of timeseries, then perfrorms principal components
- * analysis on it to reduce the number of timeseries to outsz. Each unique
- * non-zero label in the input image will be considered a group of measurements
- * which will be reduced together. Thus if there are labels 0,1,2 there will be
- * 2 columns in the output.
+ * @brief Scans a labelmap once, building a dense label->column table and then
+ * bucketing (counting sort) the offsets of voxels with non-zero labels, so
+ * that each label's voxels can be gathered without re-scanning the image.
+ *
+ * @param labelmap Labelmap, in the same space as the fMRI
+ * @param nvox Number of voxels (per time point) in the fMRI
+ * @param labels Output, the non-zero labels in increasing order, one per
+ * column
+ * @param offsets Output, voxels of column c are voxels[offsets[c]] to
+ * voxels[offsets[c+1]-1]
+ * @param voxels Output, linear voxel indices, bucketed by label and in
+ * increasing order within each label
+ */
+static void bucketLabels(ptr<const MRImage> labelmap, size_t nvox,
+		vector<int64_t>& labels, vector<size_t>& offsets,
+		vector<size_t>& voxels)
+{
+	if(labelmap->elements() < nvox)
+		throw INVALID_ARGUMENT("Labelmap has fewer voxels than fMRI!");
+
+	// Read labels and their range
+	vector<int64_t> vlabel(nvox);
+	int64_t minl = std::numeric_limits<int64_t>::max();
+	int64_t maxl = std::numeric_limits<int64_t>::min();
+	NDConstView<int64_t> lvw(labelmap);
+	for(size_t vv=0; vv<nvox; vv++) {
+		vlabel[vv] = lvw[vv];
+		if(vlabel[vv] != 0) {
+			minl = std::min(minl, vlabel[vv]);
+			maxl = std::max(maxl, vlabel[vv]);
+		}
+	}
+
+	labels.clear();
+	voxels.clear();
+	offsets.assign(1, 0);
+	if(minl > maxl)
+		return;
+
+	// If the labels are too sparse for a dense table, replace them with their
+	// rank first
+	vector<int64_t> sparse;
+	if((uint64_t)maxl-(uint64_t)minl >= nvox) {
+		for(size_t vv=0; vv<nvox; vv++) {
+			if(vlabel[vv] != 0)
+				sparse.push_back(vlabel[vv]);
+		}
+		std::sort(sparse.begin(), sparse.end());
+		sparse.erase(std::unique(sparse.begin(), sparse.end()), sparse.end());
+		for(size_t vv=0; vv<nvox; vv++) {
+			if(vlabel[vv] != 0)
+				vlabel[vv] = 1 + std::lower_bound(sparse.begin(), sparse.end(),
+						vlabel[vv]) - sparse.begin();
+		}
+		minl = 1;
+		maxl = sparse.size();
+	}
+
+	// Count members, then assign columns and column offsets
+	vector<size_t> table(maxl-minl+1, 0);
+	for(size_t vv=0; vv<nvox; vv++) {
+		if(vlabel[vv] != 0)
+			table[vlabel[vv]-minl]++;
+	}
+
+	size_t total = 0;
+	for(size_t ii=0; ii<table.size(); ii++) {
+		if(table[ii] == 0)
+			continue;
+		labels.push_back(sparse.empty() ? minl+ii : sparse[ii]);
+		size_t count = table[ii];
+		table[ii] = total;
+		total += count;
+		offsets.push_back(total);
+	}
+
+	// Place voxels, table now holds the next free slot for each label
+	voxels.resize(total);
+	for(size_t vv=0; vv<nvox; vv++) {
+		if(vlabel[vv] != 0)
+			voxels[table[vlabel[vv]-minl]++] = vv;
+	}
+}
+
+/**
+ * @brief Copies the time series of one voxel out of a 4D image. Time is the
+ * fastest dimension, so the time series is contiguous.
+ *
+ * @param fmri Input 4D image
+ * @param vw View of fmri, used for casting
+ * @param vox Linear voxel index
+ * @param out Output array of fmri->tlen() values
+ */
+static void gatherVoxel(ptr<const MRImage> fmri, NDConstView<double>& vw,
+		size_t vox, double* out)
+{
+	size_t tlen = fmri->tlen();
+	if(fmri->type() == FLOAT64) {
+		const double* src = (const double*)fmri->data() + vox*tlen;
+		std::copy(src, src+tlen, out);
+	} else {
+		for(size_t tt=0; tt<tlen; tt++)
+			out[tt] = vw[vox*tlen+tt];
+	}
+}
+
+/**
+ * @brief Computes the leading principal components of Y, scaled by their
+ * singular values (U*S, like rpiPCA). The smaller of the two Gram matrices is
+ * eigen-decomposed.
+ *
+ * @param Y Matrix with one sample per row
+ * @param odim Maximum number of components
+ *
+ * @return Matrix with up to odim columns, fewer if Y has lower rank
+ */
+static MatrixXd leadingComponents(const Ref<const MatrixXd> Y, size_t odim)
+{
+	bool wide = Y.cols() >= Y.rows();
+	size_t n = wide ? Y.rows() : Y.cols();
+	MatrixXd G = MatrixXd::Zero(n, n);
+	if(wide)
+		G.selfadjointView<Eigen::Lower>().rankUpdate(Y);
+	else
+		G.selfadjointView<Eigen::Lower>().rankUpdate(Y.transpose());
+
+	Eigen::SelfAdjointEigenSolver<MatrixXd> eig(G);
+	const VectorXd& lambda = eig.eigenvalues();
+	const MatrixXd& V = eig.eigenvectors();
+	double tol = n*lambda.cwiseAbs().maxCoeff()*
+		std::numeric_limits<double>::epsilon();
+
+	// Eigenvalues are ascending
+	MatrixXd out(Y.rows(), std::min(odim, n));
+	size_t kept = 0;
+	for(size_t ii=n; ii-- > 0 && kept < odim && lambda[ii] > tol; kept++) {
+		if(wide)
+			out.col(kept) = V.col(ii)*sqrt(lambda[ii]);
+		else
+			out.col(kept) = Y*V.col(ii);
+	}
+	return out.leftCols(kept);
+}
+
+/**
+ * @brief Gathers the normalized time series of every labeled voxel (bucketed
+ * by label) then reduces each label group to outsz components, with the
+ * groups handled in parallel.
+ *
+ * @param fmri 		FMRI image with timeseres to extract
+ * @param labelmap	Labelmap used to identify relevent input timeseries
+ * @param outsz		Number of components per label group
+ * @param ica		Follow PCA with ICA
+ *
+ * @return Matrix with 1 block of outsz columns per label group
+ */
+static MatrixXd extractLabelComponents(ptr<const MRImage> fmri,
+		ptr<const MRImage> labelmap, size_t outsz, bool ica)
+{
+	// Check Inputs
+	if(!fmri->matchingOrient(labelmap, false, true))
+		throw INVALID_ARGUMENT("Input image orientations do not match!");
+
+	size_t tlen = fmri->tlen();
+	if(tlen <= 1)
+		throw INVALID_ARGUMENT("Input image is not 4D!");
+
+	vector<int64_t> labels;
+	vector<size_t> offsets, voxels;
+	bucketLabels(labelmap, fmri->elements()/tlen, labels, offsets, voxels);
+
+	// Fill matrix with normalized time series, so that each label group is a
+	// contiguous block of columns
+	MatrixXd Y(tlen, voxels.size());
+	parallelFor(0, voxels.size(), [&](size_t, size_t b, size_t e)
+	{
+		NDConstView<double> vw(fmri);
+		for(size_t ii=b; ii<e; ii++) {
+			double* col = Y.col(ii).data();
+			gatherVoxel(fmri, vw, voxels[ii], col);
+
+			double sum = 0, sumsq = 0;
+			for(size_t tt=0; tt<tlen; tt++) {
+				sum += col[tt];
+				sumsq += col[tt]*col[tt];
+			}
+			double stddev = sqrt(sample_var(tlen, sum, sumsq));
+			double mean = sum/tlen;
+
+			//skip invalid timeseries (left as zeros)
+			if(std::isnan(mean) || std::isinf(mean) || stddev == 0)
+				Y.col(ii).setZero();
+			else
+				Y.col(ii) = (Y.col(ii).array()-mean)/stddev;
+		}
+	});
+
+	// Reduce label groups in parallel, larger groups take longer so they are
+	// handed out one at a time. Rank deficient groups leave zero columns.
+	MatrixXd X = MatrixXd::Zero(tlen, labels.size()*outsz);
+	std::atomic<size_t> next(0);
+	parallelFor(0, numThreads(), [&](size_t, size_t, size_t)
+	{
+		for(size_t ll; (ll = next++) < labels.size(); ) {
+			MatrixXd comp = leadingComponents(Y.middleCols(offsets[ll],
+						offsets[ll+1]-offsets[ll]), outsz);
+			if(ica && comp.cols() > 0)
+				comp = symICA(comp);
+			X.middleCols(ll*outsz, comp.cols()) = comp;
+		}
+	});
+
+	return X;
+}
+
+/**
+ * @brief Computes the average time series of each label group. Each unique
+ * non-zero label in the input image will be considered a group of
+ * measurements which will be averaged together. Thus if there are labels
+ * 0,1,2 there will be 2 columns in the output.
  *
  * Note that labelmap and fmri should be in the same pixel space (except for
  * dimension 3)
@@ -1414,37 +3045,40 @@ MatrixXd extractLabelAVG(ptr<const MRImage> fmri,
 	if(tlen <= 1)
 		throw INVALID_ARGUMENT("Input image not 4D!");
 
-	// Create output regressors (all non-zero labels)
-	MatrixXd X;
-	auto labels = getLabels(labelmap);
-	if(labels.count(0) > 0)
-		X.resize(tlen, labels.size()-1);
-	else
-		X.resize(tlen, labels.size());
-	X.setZero();
+	vector<int64_t> labels;
+	vector<size_t> offsets, voxels;
+	bucketLabels(labelmap, fmri->elements()/tlen, labels, offsets, voxels);
 
-	// Create Map of labels->columns
-	std::map<int64_t, int64_t> labelToCol;
+	// Sum each chunk of the bucketed voxels separately, then combine the
+	// chunks in order, so the result does not depend on timing
+	size_t nthreads = numThreads();
+	vector<MatrixXd> partial(nthreads);
+	size_t nchunks = parallelFor(0, voxels.size(),
+			[&](size_t chunk, size_t b, size_t e)
 	{
-	auto it = labels.begin();
-	for(size_t ii=0; it != labels.end(); ++it) {
-		if(*it != 0)
-			labelToCol[*it] = ii++;
-	}
-	}
-
-	// Create Local Variables
-	Vector3DConstIter<double> it(fmri);
-	NDConstIter<int> lit(labelmap);
-	for(it.goBegin(), lit.goBegin(); !lit.eof(); ++lit, ++it) {
-		if(*lit != 0) {
-			size_t col = labelToCol[*lit];
-			for(size_t tt=0; tt<tlen; tt++)
-				X(tt, col) += it[tt];
+		MatrixXd& sum = partial[chunk];
+		sum.setZero(tlen, labels.size());
+		if(b == e)
+			return;
+
+		NDConstView<double> vw(fmri);
+		VectorXd ts(tlen);
+		size_t col = std::upper_bound(offsets.begin(), offsets.end(), b) -
+			offsets.begin() - 1;
+		for(size_t ii=b; ii<e; ii++) {
+			while(offsets[col+1] <= ii)
+				col++;
+			gatherVoxel(fmri, vw, voxels[ii], ts.data());
+			sum.col(col) += ts;
 		}
-	}
+	}, nthreads);
+
+	MatrixXd X = MatrixXd::Zero(tlen, labels.size());
+	for(size_t cc=0; cc<nchunks; cc++)
+		X += partial[cc];
+	for(size_t cc=0; cc<labels.size(); cc++)
+		X.col(cc) /= offsets[cc+1]-offsets[cc];
 
-	X /= tlen;
 	return X;
 }
 
@@ -1468,84 +3102,7 @@ MatrixXd extractLabelAVG(ptr<const MRImage> fmri,
 MatrixXd extractLabelPCA(ptr<const MRImage> fmri,
 		ptr<const MRImage> labelmap, size_t outsz)
 {
-	// Check Inputs
-	if(!fmri->matchingOrient(labelmap, false, true))
-		throw INVALID_ARGUMENT("Input image orientations do not match!");
-
-	int tlen = fmri->tlen();
-	if(tlen <= 1)
-		throw INVALID_ARGUMENT("Input image is not 4D!");
-
-	// Need to create a block matrix where each block corresponds to 1 label
-	// group. To do this, the number of members of each group is computed and
-	// then a map to the first element of each column block is calculated
-
-	// Create Map of labels->size
-	std::map<int64_t, int64_t> labelToCol;
-	for(FlatConstIter<int64_t> it(labelmap); !it.eof(); ++it) {
-		if(*it != 0) {
-			auto ret = labelToCol.insert({*it,0});
-			ret.first->second++;
-		}
-	}
-
-	cerr << "Counts: " <<endl;
-	for(auto& p : labelToCol)
-		cerr<<p.first<<"->"<<p.second<<endl;
-	cerr<<endl;
-
-	size_t cumu = 0;
-	for(auto& p : labelToCol) {
-		size_t prev = cumu;
-		cumu += p.second;
-		p.second = prev;
-	}
-
-	cerr << "Offsets: " <<endl;
-	for(auto& p : labelToCol)
-		cerr<<p.first<<"->"<<p.second<<endl;
-	cerr<<endl;
-
-	cerr<<"Total cols: " <<cumu<<endl;
-	MatrixXd X(tlen, cumu);
-
-	// Create Local Variables
-	Vector3DConstIter<double> it(fmri);
-	NDConstIter<int> lit(labelmap);
-
-	// Fill Matrix with X, note that each time we find a particular label, we
-	// use the current value in labelToCol then incremente it, so that next
-	// visitation to the label produces the next volumn, and so on
-	double mean, stddev;
-	for(it.goBegin(), lit.goBegin(); !lit.eof(); ++lit, ++it) {
-		if(*lit != 0) {
-			mean = 0;
-			stddev = 0;
-			size_t col = labelToCol[*lit];
-			labelToCol[*lit]++;
-
-			// Compute Mean and Fill Column of X
-			for(int tt = 0 ; tt<tlen; tt++) {
-				X(tt, col) = it[tt];
-				mean += it[tt];
-				stddev += it[tt]*it[tt];
-			}
-			stddev = sqrt(sample_var(tlen, mean, stddev));
-			mean /= tlen;
-
-			//skip invalid timeseries (left as zeros)
-			if(std::isnan(mean) || std::isinf(mean) || stddev == 0)
-				X.col(col).setZero();
-			else
-				X.col(col) = (X.col(col).array()-mean)/stddev;
-		}
-	}
-
-	std::cout << "PCA" << endl;
-	X = rpiPCA(X, 1, outsz);
-	std::cout << "Done" << endl;
-
-	return X;
+	return extractLabelComponents(fmri, labelmap, outsz, false);
 }
 
 /**
@@ -1568,91 +3125,7 @@ MatrixXd extractLabelPCA(ptr<const MRImage> fmri,
 MatrixXd extractLabelICA(ptr<const MRImage> fmri,
 		ptr<const MRImage> labelmap, size_t outsz)
 {
-	// Check Inputs
-	if(!fmri->matchingOrient(labelmap, false, true))
-		throw INVALID_ARGUMENT("Input image orientations do not match!");
-
-	int tlen = fmri->tlen();
-	if(tlen <= 1)
-		throw INVALID_ARGUMENT("Input image is not 4D!");
-
-	// Need to create a block matrix where each block corresponds to 1 label
-	// group. To do this, the number of members of each group is computed and
-	// then a map to the first element of each column block is calculated
-
-	// Create Map of labels->size
-	std::map<int64_t, int64_t> labelToCol;
-	size_t tc = 0;
-	for(FlatConstIter<int64_t> it(labelmap); !it.eof(); ++it) {
-		if(*it != 0) {
-			auto ret = labelToCol.insert({*it,0});
-			ret.first->second++;
-			tc++;
-		}
-	}
-
-	cerr << "Counts: " <<endl;
-	for(auto& p : labelToCol)
-		cerr<<p.first<<"->"<<p.second<<endl;
-	cerr<<endl;
-
-	size_t cumu = 0;
-	for(auto& p : labelToCol) {
-		size_t prev = cumu;
-		cumu += p.second;
-		p.second = prev;
-	}
-
-	cerr << "Offsets: " <<endl;
-	for(auto& p : labelToCol)
-		cerr<<p.first<<"->"<<p.second<<endl;
-	cerr<<endl;
-
-	cerr<<"Total cols: " <<cumu<<endl;
-	MatrixXd X(tlen, cumu);
-
-	// Create Local Variables
-	Vector3DConstIter<double> it(fmri);
-	NDConstIter<int> lit(labelmap);
-
-	// Fill Matrix with X, note that each time we find a particular label, we
-	// use the current value in labelToCol then incremente it, so that next
-	// visitation to the label produces the next volumn, and so on
-	double mean, stddev;
-	for(it.goBegin(), lit.goBegin(); !lit.eof(); ++lit, ++it) {
-		if(*lit != 0) {
-			tc--;
-			mean = 0;
-			stddev = 0;
-			size_t col = labelToCol[*lit];
-			labelToCol[*lit]++;
-
-			// Compute Mean and Fill Column of X
-			for(int tt = 0 ; tt<tlen; tt++) {
-				X(tt, col) = it[tt];
-				mean += it[tt];
-				stddev += it[tt]*it[tt];
-			}
-			stddev = sqrt(sample_var(tlen, mean, stddev));
-			mean /= tlen;
-
-			//skip invalid timeseries (left as zeros)
-			if(std::isnan(mean) || std::isinf(mean) || stddev == 0)
-				X.col(col).setZero();
-			else
-				X.col(col) = (X.col(col).array()-mean)/stddev;
-		}
-	}
-
-	std::cout << "PCA" << endl;
-	X = rpiPCA(X, 1, outsz);
-	std::cout << "Done" << endl;
-
-	std::cout << "ICA...";
-	X = symICA(X);
-	std::cout << "Done" << endl;
-
-	return X;
+	return extractLabelComponents(fmri, labelmap, outsz, true);
 }
 
 void openRWBusError(int sig, siginfo_t* inf, void*)
@@ -1711,20 +3184,51 @@ void MatMap::open(std::string filename, bool writeable)
 	if(datamap.size() < 2*sizeof(size_t))
 		throw INVALID_ARGUMENT("Error! Mapped Dataset is less than the "
 				"size of two size_t's");
-	if(datamap.size() != (*nrowsptr)*(*ncolsptr)*sizeof(double)+
-			2*sizeof(size_t))
+
+	// The element size follows from the file size
+	size_t nelem = (*nrowsptr)*(*ncolsptr);
+	if(datamap.size() == nelem*sizeof(double)+2*sizeof(size_t))
+		m_single = false;
+	else if(datamap.size() == nelem*sizeof(float)+2*sizeof(size_t))
+		m_single = true;
+	else
 		throw INVALID_ARGUMENT("Error! Mismatch in map size ("+
 				std::to_string(datamap.size())+") and size in file ("+
 				std::to_string(*nrowsptr)+", "+std::to_string(*ncolsptr)+")");
 
 	m_rows = *nrowsptr;
 	m_cols = *ncolsptr;
-	new (&this->mat) Eigen::Map<MatrixXd>(dataptr, m_rows, m_cols);
+	if(m_single) {
+		new (&this->mat) Eigen::Map<MatrixXd>(NULL, 0, 0);
+		new (&this->matf) Eigen::Map<Eigen::MatrixXf>((float*)dataptr,
+				m_rows, m_cols);
+	} else {
+		new (&this->mat) Eigen::Map<MatrixXd>(dataptr, m_rows, m_cols);
+		new (&this->matf) Eigen::Map<Eigen::MatrixXf>(NULL, 0, 0);
+	}
 
 	act.sa_sigaction = externalBusError;
 	sigaction(SIGBUS, &act, NULL);
 };
 
+/**
+ * @brief Passes an madvise() hint for the whole mapping, for instance
+ * MADV_WILLNEED to start reading the file in ahead of use or
+ * MADV_SEQUENTIAL to read ahead aggressively while it is scanned.
+ *
+ * @param advice One of the MADV_* constants from sys/mman.h
+ */
+void MatMap::advise(int advice) const
+{
+	// the mapping starts with the two size_t's of the header
+	if(mat.data())
+		madvise((size_t*)mat.data()-2, 2*sizeof(size_t)+
+				m_rows*m_cols*sizeof(double), advice);
+	else if(matf.data())
+		madvise((size_t*)matf.data()-2, 2*sizeof(size_t)+
+				m_rows*m_cols*sizeof(float), advice);
+}
+
 /**
  * @brief Open an new file as a memory map. ANY OLD FILE WILL BE DELETED
  * The file is always opened for writing and reading. Note the same file
@@ -1733,8 +3237,10 @@ void MatMap::open(std::string filename, bool writeable)
  * @param filename File to open
  * @param rows Number of rows in matrix file
  * @param cols number of columns in matrix file
+ * @param single Store floats (in matf) rather than doubles (in mat)
  */
-void MatMap::create(std::string filename, size_t newrows, size_t newcols)
+void MatMap::create(std::string filename, size_t newrows, size_t newcols,
+		bool single)
 {
 	struct sigaction act;
 	act.sa_sigaction = createBusError;
@@ -1742,8 +3248,9 @@ void MatMap::create(std::string filename, size_t newrows, size_t newcols)
 
 	m_rows = newrows;
 	m_cols = newcols;
-	if(datamap.openNew(filename, 2*sizeof(size_t)+
-				m_rows*m_cols*sizeof(double)) < 0)
+	m_single = single;
+	if(datamap.openNew(filename, 2*sizeof(size_t)+m_rows*m_cols*
+				(m_single ? sizeof(float) : sizeof(double))) < 0)
 		throw INVALID_ARGUMENT("Error creating "+filename+" as rw-memmap");
 
 	size_t* nrowsptr = (size_t*)datamap.data();
@@ -1752,7 +3259,14 @@ void MatMap::create(std::string filename, size_t newrows, size_t newcols)
 
 	*nrowsptr = m_rows;
 	*ncolsptr = m_cols;
-	new (&this->mat) Eigen::Map<MatrixXd>(dataptr, m_rows, m_cols);
+	if(m_single) {
+		new (&this->mat) Eigen::Map<MatrixXd>(NULL, 0, 0);
+		new (&this->matf) Eigen::Map<Eigen::MatrixXf>((float*)dataptr,
+				m_rows, m_cols);
+	} else {
+		new (&this->mat) Eigen::Map<MatrixXd>(dataptr, m_rows, m_cols);
+		new (&this->matf) Eigen::Map<Eigen::MatrixXf>(NULL, 0, 0);
+	}
 
 	act.sa_sigaction = externalBusError;
 	sigaction(SIGBUS, &act, NULL);
@@ -17,6 +17,7 @@
 #include <Eigen/IterativeSolvers>
 #include <string>
 #include <vector>
+#include <functional>
 
 #include "npltypes.h"
 #include "mrimage.h"
@@ -27,32 +28,52 @@ namespace npl {
 
 class MatrixReorg;
 
+/**
+ * @brief How MatrixReorg stores its tall matrices on disk
+ */
+enum MatStorageT {
+	STORE_FLOAT64, // Memory mapped doubles
+	STORE_FLOAT32, // Memory mapped floats, half the size of STORE_FLOAT64
+	STORE_FLOAT32_GZ // zlib compressed floats, decompressed when used
+};
+
 /**
  * @brief Uses randomized subspace approximation to reduce the input matrix
  * (made up of blocks stored on disk with a given prefix). This assumes that
  * the matrix is a wide matrix (which is generally a good assumption in
  * fMRI) and that it therefore is better to reduce the number of columns.
  *
- * To achieve this, we transpose the algorithm of 4.4 from
+ * To achieve this, we follow algorithm 4.3 from
  * Halko N, Martinsson P-G, Tropp J A. Finding structure with randomness:
  * Probabilistic algorithms for constructing approximate matrix decompositions.
  * 2009;1–74. Available from: http://arxiv.org/abs/0909.4061
+ * iterating on AA^T in the (short) row space. The basis is grown in blocks
+ * (see adaptiveRangeFinder()) until the remaining singular values are below
+ * varthresh times the largest, so memory and passes are only spent on the
+ * rank that is actually needed. Since the matrix is stored in blocks of
+ * columns, AA^TQ is accumulated block by block in a single pass, so each power
+ * iteration reads the data once rather than twice, and Q^TA for each block of
+ * the basis shares a pass with the first iteration of the next block. With
+ * gram set, AA^T is accumulated once and the iterations need no passes at all.
  *
  * @param A MatrixReorg object that can be used to load images on disk
- * @param rank Number of output columns (output rank)
- * @param poweriters Number of power iterations to perform. 2 passes over A are
+ * @param rank Maximum number of output columns (output rank), the first block
+ * of the basis has up to 16 columns
+ * @param poweriters Number of power iterations to perform. 1 pass over A is
  * required for each iteration, but iteration drives error to 0 at an
  * exponential rate
  * @param varthresh stop after the eigenvalues reach this ratio of the maximum
  * @param cvarthresh stop after the sum of eigenvalues reaches this ratio of total
  * @param U Output U matrix, if null then ignored
  * @param V Output V matrix, if null then ignored
+ * @param gram Form AA^T (rows x rows) in memory, rather than using one pass
+ * over the data per power iteration
  *
  * @return Vector of singular values
  */
 VectorXd onDiskSVD(const MatrixReorg& A,
 		int rank, size_t poweriters, double varthresh, double cvarthresh,
-		MatrixXd* U=NULL, MatrixXd* V=NULL);
+		MatrixXd* U=NULL, MatrixXd* V=NULL, bool gram=false);
 
 /**
  * @brief Create on disk matrices based on an array of input images. The array
@@ -71,10 +92,12 @@ VectorXd onDiskSVD(const MatrixReorg& A,
  * @param normts Whether to normalize the timeseries, within each input image
  * before  writing to flat matrices
  * @param verbose Print more information during reorganization
+ * @param storage How to store the matrices, products are always accumulated
+ * in double precision
  */
 void gicaCreateMatrices(size_t tcat, size_t scat, vector<std::string> masks,
 		vector<std::string> inputs, std::string prefix, double maxmem, bool normts,
-		bool verbose);
+		bool verbose, MatStorageT storage = STORE_FLOAT64);
 
 /**
  * @brief Compute PCA for the given group, defined
@@ -102,9 +125,10 @@ void gicaCreateMatrices(size_t tcat, size_t scat, vector<std::string> masks,
  * ratio of the total sum of singular values will be treated as zero
  * @param maxrank maximum rank to use in reduction
  * @param verbose whether to print debuging information
+ * @param nprocs number of processes to split passes over the data between
  */
 void gicaReduceFull(std::string inpref, std::string outpref, double varthresh,
-		double cvarthresh, size_t maxrank, bool verbose);
+		double cvarthresh, size_t maxrank, bool verbose, size_t nprocs = 1);
 
 /**
  * @brief Compute PCA for the given group, defined
@@ -135,9 +159,11 @@ void gicaReduceFull(std::string inpref, std::string outpref, double varthresh,
  * @param cvarthresh threshold for singular values, everything after this
  * ratio of the total sum of singular values will be treated as zero
  * @param verbose whether to print debuging information
+ * @param nprocs number of processes to split passes over the data between
  */
 void gicaReduceProb(std::string inpref, std::string outpref, double varthresh,
-		double cvarthresh, size_t rank, size_t poweriters, bool verbose);
+		double cvarthresh, size_t rank, size_t poweriters, bool verbose,
+		size_t nprocs = 1);
 
 /**
  * @brief Perform ICA with each dimension as a separate timeseries. This is
@@ -184,7 +210,8 @@ public:
 	/**
 	 * @brief default constructor no file is opened
 	 */
-	MatMap() : mat(NULL, 0, 0)
+	MatMap() : mat(NULL, 0, 0), matf(NULL, 0, 0), m_rows(0), m_cols(0),
+		m_single(false)
 	{
 	};
 
@@ -196,10 +223,12 @@ public:
 	 * @param filename File to open
 	 * @param rows Number of rows in matrix file
 	 * @param cols number of columns in matrix file
+	 * @param single Store floats (in matf) rather than doubles (in mat)
 	 */
-	MatMap(std::string filename, size_t rows, size_t cols) : mat(NULL, 0, 0)
+	MatMap(std::string filename, size_t rows, size_t cols, bool single=false)
+		: mat(NULL, 0, 0), matf(NULL, 0, 0)
 	{
-		create(filename, rows, cols);
+		create(filename, rows, cols, single);
 	};
 
 	/**
@@ -211,7 +240,8 @@ public:
 	 * @param filename File to open
 	 * @param writeable whether writing is allowed
 	 */
-	MatMap(std::string filename, bool writeable=false) : mat(NULL, 0, 0)
+	MatMap(std::string filename, bool writeable=false) : mat(NULL, 0, 0),
+		matf(NULL, 0, 0)
 	{
 		open(filename, writeable);
 	};
@@ -237,8 +267,10 @@ public:
 	 * @param filename File to open
 	 * @param newrows Number of rows in matrix file
 	 * @param newcols number of columns in matrix file
+	 * @param single Store floats (in matf) rather than doubles (in mat)
 	 */
-	void create(std::string filename, size_t newrows, size_t newcols);
+	void create(std::string filename, size_t newrows, size_t newcols,
+			bool single=false);
 
 	void close()
 	{
@@ -250,14 +282,31 @@ public:
 		return datamap.isopen();
 	};
 
+	/**
+	 * @brief Passes an madvise() hint for the whole mapping, for instance
+	 * MADV_WILLNEED to start reading the file in ahead of use or
+	 * MADV_SEQUENTIAL to read ahead aggressively while it is scanned.
+	 *
+	 * @param advice One of the MADV_* constants from sys/mman.h
+	 */
+	void advise(int advice) const;
+
 	const size_t& rows() const { return m_rows; };
 	const size_t& cols() const { return m_cols; };
 
+	/**
+	 * @brief Whether the file holds floats (matf is valid) rather than doubles
+	 * (mat is valid). This is determined from the file size when opening.
+	 */
+	bool single() const { return m_single; };
+
 	Eigen::Map<MatrixXd> mat;
+	Eigen::Map<Eigen::MatrixXf> matf;
 private:
 	MemMap datamap;
 	size_t m_rows;
 	size_t m_cols;
+	bool m_single;
 };
 
 /**
@@ -279,8 +328,11 @@ public:
 	 * @param maxd Maximum number of doubles to include in a block, this
 	 * should be sized to fit into memory
 	 * @param verbose Print information
+	 * @param storage How createMats() should store the tall matrices,
+	 * checkMats() reads this from the information file
 	 */
-	MatrixReorg(std::string prefix="", size_t maxd=(1<<30), bool verbose=true);
+	MatrixReorg(std::string prefix="", size_t maxd=(1<<30), bool verbose=true,
+			MatStorageT storage=STORE_FLOAT64);
 
 	/**
 	 * @brief Creates two sets of matrices from a set of input images. The matrices
@@ -295,6 +347,11 @@ public:
 	 * masknames. Note that if no mask is provided, one will be generated from the
 	 * set of non-zero variance timeseries in the first input image in the column.
 	 *
+	 * Images are read, masked and normalized ahead by numThreads() loading
+	 * threads while the calling thread writes them into the tall matrices.
+	 * Images being loaded (at their full, unmasked size) and waiting to be
+	 * written are together limited to maxd doubles.
+	 *
 	 * This file writes matrices called /tall_# and /wide_#. Tall matrices have
 	 * the entire concatinated timeseries for a limited set of spacial locations,
 	 * Wide matrices have entire concatinated spacial signals for a limited number
@@ -343,17 +400,144 @@ public:
 		return m_prefix+"_tall_"+std::to_string(ii);
 	};
 
+	/**
+	 * @brief Returns a read-only mapping of tall matrix ii. Mappings are
+	 * opened on first use and kept until the matrices are recreated or
+	 * re-checked, so repeated multiplies do not re-map the files. The first
+	 * access of each block should not race with other accesses.
+	 *
+	 * Not available for STORE_FLOAT32_GZ, and for STORE_FLOAT32 only matf is
+	 * valid, use tallPanels() or loadTall() for any storage type.
+	 *
+	 * @param ii Tall matrix to map
+	 *
+	 * @return Mapping of the tall matrix
+	 */
+	const MatMap& tallMat(size_t ii) const;
+
+	/**
+	 * @brief Calls func(panel, col) for consecutive panels of columns of tall
+	 * matrix ii, in double precision. Double storage is passed as a single
+	 * panel without copying, float storage is converted a few MB at a time.
+	 * Compressed storage is decompressed one panel at a time, so the memory
+	 * used does not depend on the size of the block.
+	 *
+	 * @param ii Tall matrix to read
+	 * @param func Function called with each panel and the index (within tall
+	 * matrix ii) of its first column
+	 */
+	void tallPanels(size_t ii, const std::function<void(
+				const Eigen::Ref<const MatrixXd>, size_t)>& func) const;
+
+	/**
+	 * @brief Reads all of tall matrix ii into memory, in double precision
+	 *
+	 * @param ii Tall matrix to read
+	 * @param out Output matrix, resized to tallMatRows() x tallMatCols()[ii]
+	 */
+	void loadTall(size_t ii, MatrixXd& out) const;
+
+	/**
+	 * @brief How the tall matrices are stored
+	 */
+	inline MatStorageT storage() const { return m_storage; };
+
+	/**
+	 * @brief Sets the number of worker processes used by the products
+	 * (preMult(), postMult(), gramMult() and gram()). Each process gets a
+	 * contiguous run of tall blocks (gram() may instead split its output) and
+	 * numThreads()/nprocs threads, and results are combined through shared
+	 * memory. This keeps each worker's partial results in its own address
+	 * space (and so NUMA domain). The products fork, so throw if called from
+	 * inside parallelFor.
+	 *
+	 * @param nprocs Number of processes, 1 (the default) runs everything in
+	 * the calling process
+	 */
+	inline void setProcesses(size_t nprocs)
+	{
+		m_nprocs = nprocs > 0 ? nprocs : 1;
+	};
+
+	/**
+	 * @brief Number of worker processes used by the products
+	 */
+	inline size_t processes() const { return m_nprocs; };
+
 	inline std::string inColMaskName(size_t ii) const
 	{
 		return m_prefix+"_mask_"+std::to_string(ii)+".nii.gz";
 	};
 
+	/**
+	 * @brief Computes out = in*A (or in*A^T if transpose is set), where A is
+	 * the matrix stored in the tall blocks. Blocks are split between processes
+	 * (see setProcesses()) and threads, and each thread asks the kernel to
+	 * read the next block in while it multiplies the current one.
+	 *
+	 * @param out Output matrix, must already be the correct size
+	 * @param in Input matrix
+	 * @param transpose Use A^T rather than A
+	 */
 	void preMult(Eigen::Ref<MatrixXd> out, const Eigen::Ref<const MatrixXd> in,
 			bool transpose = false) const;
 
+	/**
+	 * @brief Computes out = A*in (or A^T*in if transpose is set), where A is
+	 * the matrix stored in the tall blocks. Blocks are split between processes
+	 * (see setProcesses()) and threads, and each thread asks the kernel to
+	 * read the next block in while it multiplies the current one.
+	 *
+	 * @param out Output matrix, must already be the correct size
+	 * @param in Input matrix
+	 * @param transpose Use A^T rather than A
+	 */
 	void postMult(Eigen::Ref<MatrixXd> out, const Eigen::Ref<const MatrixXd> in,
 			bool transpose = false) const;
 
+	/**
+	 * @brief Computes out = A*A^T*in in a single pass over the data. Since A is
+	 * stored in blocks of columns, A*A^T*in = SUM(A_b*(A_b^T*in)), so each
+	 * block is only read once. Blocks are split between processes and threads.
+	 *
+	 * @param out Output matrix, rows() x in.cols()
+	 * @param in Input matrix, rows() x in.cols()
+	 */
+	void gramMult(Eigen::Ref<MatrixXd> out,
+			const Eigen::Ref<const MatrixXd> in) const;
+
+	/**
+	 * @brief Computes Y = A*A^T*X and B = P*A together in a single pass over
+	 * the data, and the squared Frobenius norm of A if sqnorm is given.
+	 * Either product is skipped if X has no columns or P has no rows. These
+	 * are the products adaptiveRangeFinder() needs for each block of its
+	 * basis.
+	 *
+	 * @param Y Output, rows() x X.cols()
+	 * @param X Input, rows() x X.cols()
+	 * @param B Output, P.rows() x cols()
+	 * @param P Input, P.rows() x rows()
+	 * @param sqnorm If not NULL, set to the squared Frobenius norm of A
+	 */
+	void rangeMult(Eigen::Ref<MatrixXd> Y, const Eigen::Ref<const MatrixXd> X,
+			Eigen::Ref<MatrixXd> B, const Eigen::Ref<const MatrixXd> P,
+			double* sqnorm = NULL) const;
+
+	/**
+	 * @brief Computes the Gram matrix A*A^T (rows() x rows()), by accumulating
+	 * A_b*A_b^T over the blocks. The lower triangle is split by output column
+	 * into bands of about equal size, one per thread. If a rows() x rows()
+	 * partial sum per process fits in the memory limit, each process gets a
+	 * disjoint run of blocks and the partial sums are added. Otherwise the
+	 * bands are divided between processes, each of which reads every block,
+	 * so that only one rows() x rows() matrix is needed; compressed blocks
+	 * would then be decompressed once per process, so they stay in a single
+	 * process. Blocks are read in order (with the next block prefetched).
+	 *
+	 * @param out Output matrix, rows() x rows()
+	 */
+	void gram(Eigen::Ref<MatrixXd> out) const;
+
 	inline int rows() const { return m_totalrows; };
 	inline int cols() const { return m_totalcols; };
 
@@ -379,10 +563,17 @@ public:
 //	vector<int> m_outrows;
 	vector<int> m_outcols;
 	size_t m_maxdoubles;
+	MatStorageT m_storage;
+	size_t m_nprocs;
+
+	// Persistent read-only mappings of the tall matrices, see tallMat()
+	mutable vector<ptr<MatMap>> m_blocks;
 };
 
 /**
- * @brief Performs general linear model analysis on a 4D image.
+ * @brief Performs general linear model analysis on a 4D image. Voxels are
+ * regressed in tiles (as matrix-matrix products), with tiles split between
+ * threads.
  *
  * @param fmri Input 4D image.
  * @param X Regressors
@@ -393,6 +584,53 @@ public:
 void fmriGLM(ptr<const MRImage> fmri, const MatrixXd& X,
 		ptr<MRImage> bimg, ptr<MRImage> Timg, ptr<MRImage> pimg);
 
+/**
+ * @brief How the rows (observations) of the data are exchanged under the null
+ * hypothesis in fmriGLMPermute
+ */
+enum PermuteT {
+	PERMUTE_ROWS, // Reorder the rows, for exchangeable errors
+	PERMUTE_SIGNS, // Flip the signs of rows, for symmetric errors
+	PERMUTE_BOTH // Reorder and flip signs
+};
+
+/**
+ * @brief Nonparametric, family-wise error corrected p-values for each
+ * regressor of a general linear model, from the max-T (and optionally
+ * cluster mass) null distribution.
+ *
+ * Each regressor is tested with the Freedman-Lane procedure: the residuals
+ * of the other regressors are permuted (and/or sign flipped) and refit. Only
+ * the design is permuted in memory; the data is streamed from the image in
+ * tiles of voxels, each tile is reduced once, and the t-scores of a whole
+ * batch of permutations are computed with one matrix-matrix product. Tiles
+ * are split between threads. Each permutation is generated from its own
+ * generator, seeded with (seed, permutation number), so results do not
+ * depend on the number of threads.
+ *
+ * Permutation 0 is always the unpermuted data, so p-values are at least
+ * 1/nperm. Memory is bounded by the tiles, plus a float map per permutation
+ * in a batch when cluster p-values are requested.
+ *
+ * @param fmri Input 4D image, the last dimension matches the rows of X
+ * (subjects or time points)
+ * @param X Regressors
+ * @param nperm Number of permutations (including the unpermuted data)
+ * @param mode How rows are exchanged (reordered, sign flipped, or both)
+ * @param fwe_pimg Output max-T corrected p-values, one volume per regressor
+ * @param cluster_pimg Output cluster mass corrected p-values (one volume per
+ * regressor) for the cluster each voxel is in, 1 outside clusters. May be
+ * NULL to skip cluster inference.
+ * @param clusterthresh Clusters are 6-connected voxels with |t| above this
+ * and the same sign, the mass of a cluster is the sum of its |t|
+ * @param seed Random seed
+ * @param batch Number of permutations to evaluate per pass over the data
+ */
+void fmriGLMPermute(ptr<const MRImage> fmri, const MatrixXd& X,
+		size_t nperm, PermuteT mode, ptr<MRImage> fwe_pimg,
+		ptr<MRImage> cluster_pimg = NULL, double clusterthresh = 3,
+		unsigned int seed = 0, size_t batch = 64);
+
 
 /**
  * @brief Takes the FFT of each line of the image, performs bandpass filtering
@@ -411,15 +649,50 @@ void fmriBandPass(ptr<MRImage> inimg, double cuton, double cutoff);
  * @param inimg Input 4D image
  * @param X matrix of covariates
  *
+ * @return Residuals, as a FLOAT32 image
  */
 ptr<MRImage> regressOut(ptr<const MRImage> inimg, const MatrixXd& X);
 
 /**
- * @brief Creates a matrix of timeseries, then perfrorms principal components
- * analysis on it to reduce the number of timeseries to outsz. Each unique
- * non-zero label in the input image will be considered a group of measurements
- * which will be reduced together. Thus if there are labels 0,1,2 there will be
- * 2 columns in the output.
+ * @brief Regresses out the given variables, writing time series which are
+ * uncorrelated with X to out. Time series are processed in tiles (as
+ * matrix-matrix products), with tiles split between threads. Constant time
+ * series are set to zero.
+ *
+ * @param inimg Input 4D image
+ * @param X matrix of covariates
+ * @param out Output 4D image, the same size as inimg. May be inimg itself to
+ * regress in place.
+ */
+void regressOut(ptr<const MRImage> inimg, const MatrixXd& X,
+		ptr<MRImage> out);
+
+/**
+ * @brief Cleans fMRI data in a single pass: regresses out confounds (zeroing
+ * constant time series), then band pass filters and optionally normalizes
+ * each time series. This gives the same result as regressOut followed by
+ * fmriBandPass, but each tile of time series is loaded once, kept in double
+ * precision through every step, and stored once into the only new image.
+ * Tiles are split between threads.
+ *
+ * @param inimg Input 4D image
+ * @param X Confounds to regress out, may have 0 columns to skip regression
+ * @param cuton Minimum frequency (may be 0)
+ * @param cutoff Maximum frequency in band (may be INFINITY). If neither
+ * cuton nor cutoff is a valid frequency (both NaN or INFINITY) no filtering is
+ * performed.
+ * @param normalize Scale each time series to zero mean and unit variance
+ *
+ * @return Cleaned image (FLOAT32)
+ */
+ptr<MRImage> cleanFMRI(ptr<const MRImage> inimg, const MatrixXd& X,
+		double cuton, double cutoff, bool normalize = false);
+
+/**
+ * @brief Computes the average time series of each label group. Each unique
+ * non-zero label in the input image will be considered a group of
+ * measurements which will be averaged together. Thus if there are labels
+ * 0,1,2 there will be 2 columns in the output.
  *
  * Note that labelmap and fmri should be in the same pixel space (except for
  * dimension 3)
@@ -21,6 +21,7 @@
 #include "mrimage_utils.h"
 #include "registration.h"
 #include "byteswap.h"
+#include "utility.h"
 #include "macros.h"
 
 #include "fftw3.h"
@@ -122,8 +123,12 @@ ptr<MRImage> fft_forward(ptr<const MRImage> in,
 	output->copyMetadata(in);
 
 	// create ND FFTW Plan
-	auto fwd = fftw_plan_dft((int)ndim, osize32.data(), outbuff, outbuff,
-			FFTW_FORWARD, FFTW_MEASURE);
+	fftw_plan fwd;
+	{
+		std::lock_guard<std::mutex> lock(fftwPlanMutex());
+		fwd = fftw_plan_dft((int)ndim, osize32.data(), outbuff, outbuff,
+				FFTW_FORWARD, FFTW_MEASURE);
+	}
 	for(size_t ii=0; ii<opixels; ii++) {
 		outbuff[ii][0] = 0;
 		outbuff[ii][1] = 0;
@@ -142,6 +147,10 @@ ptr<MRImage> fft_forward(ptr<const MRImage> in,
 
 	// fourier transform
 	fftw_execute(fwd);
+	{
+		std::lock_guard<std::mutex> lock(fftwPlanMutex());
+		fftw_destroy_plan(fwd);
+	}
 
 #ifndef NDEBUG
 	OrderIter<cdouble_t> it(output);;
@@ -198,8 +207,12 @@ ptr<MRImage> fft_backward(ptr<const MRImage> in,
 	output->copyMetadata(in);
 
 	// create ND FFTW Plan
-	auto plan = fftw_plan_dft((int)ndim, osize32.data(), outbuff, outbuff,
-			FFTW_BACKWARD, FFTW_MEASURE);
+	fftw_plan plan;
+	{
+		std::lock_guard<std::mutex> lock(fftwPlanMutex());
+		plan = fftw_plan_dft((int)ndim, osize32.data(), outbuff, outbuff,
+				FFTW_BACKWARD, FFTW_MEASURE);
+	}
 	for(size_t ii=0; ii<opixels; ii++) {
 		outbuff[ii][0] = 0;
 		outbuff[ii][1] = 0;
@@ -248,6 +261,10 @@ ptr<MRImage> fft_backward(ptr<const MRImage> in,
 
 	// fourier transform
 	fftw_execute(plan);
+	{
+		std::lock_guard<std::mutex> lock(fftwPlanMutex());
+		fftw_destroy_plan(plan);
+	}
 
 	return output;
 }
@@ -300,10 +317,14 @@ ptr<MRImage> resample(ptr<const MRImage> in, double* spacing,
 	auto ibuffer = (fftw_complex*)fftw_malloc(sizeof(fftw_complex)*linelen*2);
 	auto obuffer = &ibuffer[linelen];
 	for(size_t dd=0; dd<ndim; dd++) {
-		auto fwd = fftw_plan_dft_1d((int)psize[dd], ibuffer, obuffer,
-				FFTW_FORWARD, FFTW_MEASURE);
-		auto bwd = fftw_plan_dft_1d((int)rsize[dd], ibuffer, obuffer,
-				FFTW_BACKWARD, FFTW_MEASURE);
+		fftw_plan fwd, bwd;
+		{
+			std::lock_guard<std::mutex> lock(fftwPlanMutex());
+			fwd = fftw_plan_dft_1d((int)psize[dd], ibuffer, obuffer,
+					FFTW_FORWARD, FFTW_MEASURE);
+			bwd = fftw_plan_dft_1d((int)rsize[dd], ibuffer, obuffer,
+					FFTW_BACKWARD, FFTW_MEASURE);
+		}
 
 		// extract line
 		ChunkIter<cdouble_t> it(working);
@@ -352,6 +373,12 @@ ptr<MRImage> resample(ptr<const MRImage> in, double* spacing,
 			}
 		}
 
+		{
+			std::lock_guard<std::mutex> lock(fftwPlanMutex());
+			fftw_destroy_plan(fwd);
+			fftw_destroy_plan(bwd);
+		}
+
 		// update ROI
 		roi[dd] = osize[dd];
 		DBG3(cerr << isize[dd] << "->" << osize[dd] << endl);
@@ -421,10 +448,14 @@ ptr<MRImage> smoothDownsample(ptr<const MRImage> in, double sigma, double spacin
 	auto ibuffer = (fftw_complex*)fftw_malloc(sizeof(fftw_complex)*linelen*2);
 	auto obuffer = &ibuffer[linelen];
 	for(size_t dd=0; dd<ndim; dd++) {
-		auto fwd = fftw_plan_dft_1d((int)psize[dd], ibuffer, obuffer,
-				FFTW_FORWARD, FFTW_MEASURE);
-		auto bwd = fftw_plan_dft_1d((int)rsize[dd], ibuffer, obuffer,
-				FFTW_BACKWARD, FFTW_MEASURE);
+		fftw_plan fwd, bwd;
+		{
+			std::lock_guard<std::mutex> lock(fftwPlanMutex());
+			fwd = fftw_plan_dft_1d((int)psize[dd], ibuffer, obuffer,
+					FFTW_FORWARD, FFTW_MEASURE);
+			bwd = fftw_plan_dft_1d((int)rsize[dd], ibuffer, obuffer,
+					FFTW_BACKWARD, FFTW_MEASURE);
+		}
 
 		double sd = sigma/in->spacing(dd);
 
@@ -477,6 +508,12 @@ ptr<MRImage> smoothDownsample(ptr<const MRImage> in, double sigma, double spacin
 			}
 		}
 
+		{
+			std::lock_guard<std::mutex> lock(fftwPlanMutex());
+			fftw_destroy_plan(fwd);
+			fftw_destroy_plan(bwd);
+		}
+
 		// update ROI
 		roi[dd] = osize[dd];
 		DBG3(cerr << isize[dd] << "->" << osize[dd] << endl);
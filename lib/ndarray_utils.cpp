@@ -67,6 +67,35 @@ std::unordered_set<int64_t> getLabels(ptr<const NDArray> in)
 	return oset;
 }
 
+/**
+ * @brief Returns an ROI (for Slicer::setROI and the iterators derived from it)
+ * that covers the slab [x0, x1) of the first dimension, all of the second and
+ * third dimensions, and only the first element of higher dimensions (so that
+ * it matches Vector3DIter). Used to split image loops across threads.
+ *
+ * @param img Image to iterate over
+ * @param x0 First index in dimension 0
+ * @param x1 One past the last index in dimension 0
+ *
+ * @return ROI as [min, max] pairs
+ */
+std::vector<std::pair<int64_t,int64_t>> slabROI(ptr<const NDArray> img,
+		int64_t x0, int64_t x1)
+{
+	std::vector<std::pair<int64_t,int64_t>> roi(img->ndim());
+	for(size_t dd=0; dd<3 && dd<img->ndim(); dd++) {
+		roi[dd].first = 0;
+		roi[dd].second = img->dim(dd)-1;
+	}
+	for(size_t dd=3; dd<img->ndim(); dd++) {
+		roi[dd].first = 0;
+		roi[dd].second = 0;
+	}
+	roi[0].first = x0;
+	roi[0].second = x1-1;
+	return roi;
+}
+
 /**
  * @brief Computes the derivative of the image in the specified direction.
  * The output will be the same size as the input.
@@ -621,10 +650,14 @@ void shiftImageFFT(ptr<NDArray> inout, size_t dim, double dist,
 	size_t paddiff = padsize-inout->dim(dim);
 	auto ibuffer = (fftw_complex*)fftw_malloc(sizeof(fftw_complex)*padsize);
 	auto obuffer = (fftw_complex*)fftw_malloc(sizeof(fftw_complex)*padsize);
-	fftw_plan fwd = fftw_plan_dft_1d((int)padsize, ibuffer, obuffer,
-			FFTW_FORWARD, FFTW_MEASURE);
-	fftw_plan rev = fftw_plan_dft_1d((int)padsize, ibuffer, obuffer,
-			FFTW_BACKWARD, FFTW_MEASURE);
+	fftw_plan fwd, rev;
+	{
+		std::lock_guard<std::mutex> lock(fftwPlanMutex());
+		fwd = fftw_plan_dft_1d((int)padsize, ibuffer, obuffer,
+				FFTW_FORWARD, FFTW_MEASURE);
+		rev = fftw_plan_dft_1d((int)padsize, ibuffer, obuffer,
+				FFTW_BACKWARD, FFTW_MEASURE);
+	}
 
 	// need copy data into center of buffer, create iterator that moves
 	// in the specified dimension fastest
@@ -675,6 +708,14 @@ void shiftImageFFT(ptr<NDArray> inout, size_t dim, double dist,
 			oit.set(tmp);
 		}
 	}
+
+	{
+		std::lock_guard<std::mutex> lock(fftwPlanMutex());
+		fftw_destroy_plan(fwd);
+		fftw_destroy_plan(rev);
+	}
+	fftw_free(ibuffer);
+	fftw_free(obuffer);
 }
 
 /********************
@@ -764,10 +805,14 @@ void shearImageFFT(ptr<NDArray> inout, size_t dim, size_t len, double* dist,
 	size_t padsize = round2(2*inout->dim(dim));
 	size_t paddiff = padsize-inout->dim(dim);
 	auto buffer = (fftw_complex*)fftw_malloc(sizeof(fftw_complex)*padsize);
-	fftw_plan fwd = fftw_plan_dft_1d((int)padsize, buffer, buffer,
-			FFTW_FORWARD, FFTW_MEASURE);
-	fftw_plan rev = fftw_plan_dft_1d((int)padsize, buffer, buffer,
-			FFTW_BACKWARD, FFTW_MEASURE);
+	fftw_plan fwd, rev;
+	{
+		std::lock_guard<std::mutex> lock(fftwPlanMutex());
+		fwd = fftw_plan_dft_1d((int)padsize, buffer, buffer,
+				FFTW_FORWARD, FFTW_MEASURE);
+		rev = fftw_plan_dft_1d((int)padsize, buffer, buffer,
+				FFTW_BACKWARD, FFTW_MEASURE);
+	}
 	std::vector<double> center(inout->ndim());
 	for(size_t ii=0; ii<center.size(); ii++) {
 		center[ii] = (inout->dim(ii)-1)/2.;
@@ -829,6 +874,13 @@ void shearImageFFT(ptr<NDArray> inout, size_t dim, size_t len, double* dist,
 			it.set(tmp);
 		}
 	}
+
+	{
+		std::lock_guard<std::mutex> lock(fftwPlanMutex());
+		fftw_destroy_plan(fwd);
+		fftw_destroy_plan(rev);
+	}
+	fftw_free(buffer);
 }
 
 double getMaxShear(const Matrix3d& in)
@@ -1796,8 +1848,12 @@ ptr<NDArray> pphelp_padFFT(ptr<const NDArray> in,
 
 	// fourier transform
 	for(size_t dd = 0; dd < oimg->ndim(); dd++) {
-		fftw_plan fwd = fftw_plan_dft_1d((int)osize[dd], buffer, buffer,
-				FFTW_FORWARD, FFTW_MEASURE);
+		fftw_plan fwd;
+		{
+			std::lock_guard<std::mutex> lock(fftwPlanMutex());
+			fwd = fftw_plan_dft_1d((int)osize[dd], buffer, buffer,
+					FFTW_FORWARD, FFTW_MEASURE);
+		}
 
 		ChunkIter<cdouble_t> it(oimg);
 		it.setLineChunk(dd);
@@ -1828,7 +1884,10 @@ ptr<NDArray> pphelp_padFFT(ptr<const NDArray> in,
 			}
 		}
 
-		fftw_destroy_plan(fwd);
+		{
+			std::lock_guard<std::mutex> lock(fftwPlanMutex());
+			fftw_destroy_plan(fwd);
+		}
 	}
 
 	fftw_free(buffer);
@@ -1977,8 +2036,12 @@ ptr<NDArray> pseudoPolar(ptr<const NDArray> in, size_t prdim)
 		fftw_complex* prechirp = &buffer[usize+uppadsize];
 		fftw_complex* postchirp = &buffer[usize+2*uppadsize];
 		fftw_complex* convchirp = &buffer[usize+3*uppadsize];
-		fftw_plan plan = fftw_plan_dft_1d((int)usize, current, current,
-				FFTW_BACKWARD, FFTW_MEASURE);
+		fftw_plan plan;
+		{
+			std::lock_guard<std::mutex> lock(fftwPlanMutex());
+			plan = fftw_plan_dft_1d((int)usize, current, current,
+					FFTW_BACKWARD, FFTW_MEASURE);
+		}
 
 		assert(buffsize >= usize+3*uppadsize);
 
@@ -2028,7 +2091,10 @@ ptr<NDArray> pseudoPolar(ptr<const NDArray> in, size_t prdim)
 			prevAlpha = alpha;
 		}
 
-		fftw_destroy_plan(plan);
+		{
+			std::lock_guard<std::mutex> lock(fftwPlanMutex());
+			fftw_destroy_plan(plan);
+		}
 	}
 	fftw_free(buffer);
 
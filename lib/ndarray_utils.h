@@ -47,6 +47,21 @@ using std::vector;
  */
 std::unordered_set<int64_t> getLabels(ptr<const NDArray> in);
 
+/**
+ * @brief Returns an ROI (for Slicer::setROI and the iterators derived from it)
+ * that covers the slab [x0, x1) of the first dimension, all of the second and
+ * third dimensions, and only the first element of higher dimensions (so that
+ * it matches Vector3DIter). Used to split image loops across threads.
+ *
+ * @param img Image to iterate over
+ * @param x0 First index in dimension 0
+ * @param x1 One past the last index in dimension 0
+ *
+ * @return ROI as [min, max] pairs
+ */
+std::vector<std::pair<int64_t,int64_t>> slabROI(ptr<const NDArray> img,
+		int64_t x0, int64_t x1);
+
 /**
  * @brief Returns whether two NDArrays have the same dimensions, and therefore
  * can be element-by-element compared/operated on. elL is set to true if left
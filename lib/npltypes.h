@@ -33,6 +33,14 @@ using Eigen::Matrix;
 enum Metric {METRIC_MI, METRIC_VI, METRIC_NMI, METRIC_COR, METRIC_REDUNDANCY,
 	METRIC_NMIMETRIC, METRIC_DUALTC};
 
+/**
+ * @brief Strategy for choosing the voxels used to estimate a metric. FULL uses
+ * every voxel, UNIFORM draws voxels uniformly at random, STRATIFIED draws one
+ * random voxel from each cell of a regular grid and MASK restricts sampling to
+ * voxels inside a mask
+ */
+enum SampleMode {SAMPLE_FULL, SAMPLE_UNIFORM, SAMPLE_STRATIFIED, SAMPLE_MASK};
+
 /**
  * @brief Make the shared_ptr name shorter...
  *
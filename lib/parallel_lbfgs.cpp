@@ -0,0 +1,166 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * NPL is free software: you can redistribute it and/or modify it under the
+ * terms of the BSD 2-Clause License available in LICENSE or at
+ * http://opensource.org/licenses/BSD-2-Clause
+ *
+ * @file parallel_lbfgs.cpp L-BFGS optimizer with a speculative, parallel line
+ * search
+ *
+ *****************************************************************************/
+
+#include "parallel_lbfgs.h"
+#include "utility.h"
+#include "trace.h"
+#include "macros.h"
+
+#include <cmath>
+#include <algorithm>
+
+using Eigen::VectorXd;
+
+namespace npl {
+
+ParallelLBFGSOpt::ParallelLBFGSOpt(size_t dim,
+		const std::vector<ValGradFunc>& valgrad) :
+	state_x(VectorXd::Zero(dim)), state_val(NAN), stop_G(1e-5), stop_X(1e-5),
+	stop_F(1e-5), stop_Its(1000), opt_histsize(6), opt_ls_s(1),
+	opt_ls_beta(0.5), opt_ls_sigma(1e-4), opt_ls_curv(0.9),
+	opt_ls_trials(valgrad.size()), evals(0), ls_time(0), m_valgrad(valgrad)
+{
+	if(valgrad.empty())
+		throw INVALID_ARGUMENT("At least one value/gradient function is "
+				"required");
+}
+
+void ParallelLBFGSOpt::reset_history()
+{
+	m_hist_s.clear();
+	m_hist_y.clear();
+}
+
+VectorXd ParallelLBFGSOpt::direction(const VectorXd& g) const
+{
+	size_t hsize = m_hist_s.size();
+	if(hsize == 0)
+		return -g/g.norm();
+
+	std::vector<double> alpha(hsize);
+	VectorXd q = g;
+	for(int ii = hsize-1; ii >= 0; ii--) {
+		alpha[ii] = m_hist_s[ii].dot(q)/m_hist_y[ii].dot(m_hist_s[ii]);
+		q -= alpha[ii]*m_hist_y[ii];
+	}
+
+	// initial hessian is gamma*I, from the most recent step
+	q *= m_hist_s.back().dot(m_hist_y.back())/m_hist_y.back().squaredNorm();
+
+	for(size_t ii = 0; ii < hsize; ii++) {
+		double beta = m_hist_y[ii].dot(q)/m_hist_y[ii].dot(m_hist_s[ii]);
+		q += (alpha[ii]-beta)*m_hist_s[ii];
+	}
+	return -q;
+}
+
+StopReason ParallelLBFGSOpt::optimize()
+{
+	size_t ntrials = std::max<size_t>(opt_ls_trials, 1);
+	size_t nfunc = std::min(ntrials, m_valgrad.size());
+	std::vector<VectorXd> tx(ntrials);
+	std::vector<VectorXd> tg(ntrials, VectorXd(state_x.rows()));
+	std::vector<double> tv(ntrials);
+	std::vector<double> talpha(ntrials);
+	std::vector<int> tret(ntrials);
+
+	evals = 1;
+	ls_time = 0;
+	double val;
+	VectorXd grad(state_x.rows());
+	int ret = m_valgrad[0](state_x, val, grad);
+	state_val = val;
+	if(ret != 0)
+		return ENDFAIL;
+
+	for(size_t it = 0; it < stop_Its; it++) {
+		double gnorm = grad.norm();
+		if(gnorm < stop_G || gnorm == 0)
+			return ENDGRAD;
+
+		// fall back to steepest descent if the history gives an ascent
+		// direction
+		VectorXd dir = direction(grad);
+		double gd = grad.dot(dir);
+		if(!(gd < 0)) {
+			reset_history();
+			dir = -grad/gnorm;
+			gd = -gnorm;
+		}
+		double dnorm = dir.norm();
+
+		int best = -1;
+		double lsstart = traceClock();
+		for(double alpha = opt_ls_s; best < 0; ) {
+			if(alpha*dnorm < stop_X) {
+				ls_time += traceClock()-lsstart;
+				return ENDSTEP;
+			}
+
+			for(size_t tt = 0; tt < ntrials; tt++)
+				talpha[tt] = alpha*pow(opt_ls_beta, tt);
+
+			parallelFor(0, ntrials, [&](size_t ff, size_t b, size_t e)
+			{
+				for(size_t tt = b; tt < e; tt++) {
+					tx[tt] = state_x + talpha[tt]*dir;
+					tret[tt] = m_valgrad[ff](tx[tt], tv[tt], tg[tt]);
+				}
+			}, nfunc);
+			evals += ntrials;
+
+			// lowest value, preferring trials with sufficient curvature
+			bool bestcurv = false;
+			for(size_t tt = 0; tt < ntrials; tt++) {
+				if(tret[tt] != 0 || !std::isfinite(tv[tt]) ||
+						tv[tt] > val + opt_ls_sigma*talpha[tt]*gd)
+					continue;
+
+				bool curv = fabs(tg[tt].dot(dir)) <= opt_ls_curv*fabs(gd);
+				if(best < 0 || (curv && !bestcurv) ||
+						(curv == bestcurv && tv[tt] < tv[best])) {
+					best = tt;
+					bestcurv = curv;
+				}
+			}
+			alpha = talpha[ntrials-1]*opt_ls_beta;
+		}
+		ls_time += traceClock()-lsstart;
+
+		// update history
+		VectorXd s = tx[best] - state_x;
+		VectorXd y = tg[best] - grad;
+		if(s.dot(y) > 0) {
+			m_hist_s.push_back(s);
+			m_hist_y.push_back(y);
+			while(m_hist_s.size() > (size_t)std::max(opt_histsize, 0)) {
+				m_hist_s.pop_front();
+				m_hist_y.pop_front();
+			}
+		}
+
+		double dval = val - tv[best];
+		state_x = tx[best];
+		val = tv[best];
+		state_val = val;
+		grad = tg[best];
+
+		if(s.norm() < stop_X)
+			return ENDSTEP;
+		if(fabs(dval) < stop_F)
+			return ENDVALUE;
+	}
+
+	return ENDITERS;
+}
+
+}
@@ -0,0 +1,161 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * NPL is free software: you can redistribute it and/or modify it under the
+ * terms of the BSD 2-Clause License available in LICENSE or at
+ * http://opensource.org/licenses/BSD-2-Clause
+ *
+ * @file parallel_lbfgs.h L-BFGS optimizer with a speculative, parallel line
+ * search
+ *
+ *****************************************************************************/
+
+#ifndef PARALLEL_LBFGS_H
+#define PARALLEL_LBFGS_H
+
+#include "opt_common.h"
+
+#include <Eigen/Dense>
+#include <deque>
+#include <vector>
+
+namespace npl {
+
+/**
+ * @brief L-BFGS optimizer whose line search evaluates several step lengths at
+ * once. Each batch of the line search tries opt_ls_trials steps,
+ * opt_ls_s*opt_ls_beta^k, concurrently (see parallelFor), each trial using one
+ * of the value/gradient functions passed to the constructor. Of the trials
+ * that satisfy the Armijo condition, those that also satisfy the (strong)
+ * curvature condition are preferred and the one with the lowest value is
+ * accepted. If none satisfy the Armijo condition the next batch continues
+ * from the shortest step tried.
+ *
+ * The value/gradient functions must all compute the same function but must
+ * not share state, so that they can be called simultaneously (for instance
+ * each bound to its own copy of a metric computer). Nested parallelFor calls
+ * run serially, so while trials are running each function is single
+ * threaded.
+ *
+ * The accepted steps (and so results) depend on opt_ls_trials but not on
+ * the number of functions or threads. With opt_ls_trials = 1 this is a plain
+ * backtracking L-BFGS.
+ */
+class ParallelLBFGSOpt
+{
+public:
+	/**
+	 * @brief Constructor
+	 *
+	 * @param dim Number of parameters
+	 * @param valgrad Value/gradient functions, trials are spread over these
+	 * (at most valgrad.size() trials run at once). Must not be empty.
+	 */
+	ParallelLBFGSOpt(size_t dim, const std::vector<ValGradFunc>& valgrad);
+
+	/**
+	 * @brief Minimizes the function, starting from (and updating) state_x.
+	 * The history from previous calls is kept unless reset_history() is
+	 * called.
+	 *
+	 * @return Reason for stopping
+	 */
+	StopReason optimize();
+
+	/**
+	 * @brief Clears the stored steps and gradient changes, so that the next
+	 * iteration is steepest descent
+	 */
+	void reset_history();
+
+	/**
+	 * @brief Current (and after optimize(), final) parameters
+	 */
+	Eigen::VectorXd state_x;
+
+	/**
+	 * @brief Value at state_x, after optimize()
+	 */
+	double state_val;
+
+	/**
+	 * @brief Stop when the gradient norm falls below this
+	 */
+	double stop_G;
+
+	/**
+	 * @brief Stop when the step size falls below this
+	 */
+	double stop_X;
+
+	/**
+	 * @brief Stop when the change in value falls below this
+	 */
+	double stop_F;
+
+	/**
+	 * @brief Maximum number of iterations
+	 */
+	size_t stop_Its;
+
+	/**
+	 * @brief Number of previous steps used to approximate the Hessian
+	 */
+	int opt_histsize;
+
+	/**
+	 * @brief Initial (largest) step length of each line search. Steepest
+	 * descent steps (no history) are normalized, so this is a distance.
+	 */
+	double opt_ls_s;
+
+	/**
+	 * @brief Factor between successive step lengths in the line search
+	 */
+	double opt_ls_beta;
+
+	/**
+	 * @brief Sufficient decrease (Armijo) constant
+	 */
+	double opt_ls_sigma;
+
+	/**
+	 * @brief Curvature constant, trials with |g'd| <= opt_ls_curv*|g0'd| are
+	 * preferred
+	 */
+	double opt_ls_curv;
+
+	/**
+	 * @brief Number of step lengths evaluated per batch of the line search,
+	 * defaults to the number of value/gradient functions
+	 */
+	size_t opt_ls_trials;
+
+	/**
+	 * @brief Number of function evaluations performed by the last call to
+	 * optimize()
+	 */
+	size_t evals;
+
+	/**
+	 * @brief Wall time (seconds, see traceClock) spent in the line search by
+	 * the last call to optimize()
+	 */
+	double ls_time;
+
+private:
+	std::vector<ValGradFunc> m_valgrad;
+
+	// step (s) and gradient change (y) history, oldest first
+	std::deque<Eigen::VectorXd> m_hist_s;
+	std::deque<Eigen::VectorXd> m_hist_y;
+
+	/**
+	 * @brief Approximates -H^-1*g with the two-loop recursion
+	 */
+	Eigen::VectorXd direction(const Eigen::VectorXd& g) const;
+};
+
+}
+
+#endif // PARALLEL_LBFGS_H
@@ -11,15 +11,20 @@
 
 #include "registration.h"
 #include "lbfgs.h"
+#include "parallel_lbfgs.h"
 #include "statistics.h"
 #include "mrimage_utils.h"
 #include "ndarray_utils.h"
+#include "utility.h"
+#include "trace.h"
 #include "macros.h"
 
 #include <memory>
 #include <stdexcept>
 #include <functional>
 #include <algorithm>
+#include <mutex>
+#include <atomic>
 
 #include <Eigen/Dense>
 #include <Eigen/Geometry>
@@ -33,9 +38,6 @@ using Eigen::AngleAxisd;
 using std::cerr;
 using std::endl;
 
-//#define CLOCK(S) S
-#define CLOCK(S)
-
 
 #ifdef VERYDEBUG
 #define DEBUGWRITE(FOO) FOO
@@ -48,6 +50,269 @@ namespace npl {
 /******************************************************************
  * Registration Functions
  *****************************************************************/
+
+/**
+ * @brief Converts the name of a sampling strategy (FULL, UNIFORM, STRATIFIED,
+ * MASK) to a SampleMode
+ *
+ * @param name Name of the strategy
+ *
+ * @return Sample mode
+ */
+static SampleMode parseSampleMode(std::string name)
+{
+	if(name == "FULL")
+		return SAMPLE_FULL;
+	else if(name == "UNIFORM")
+		return SAMPLE_UNIFORM;
+	else if(name == "STRATIFIED")
+		return SAMPLE_STRATIFIED;
+	else if(name == "MASK")
+		return SAMPLE_MASK;
+	throw INVALID_ARGUMENT("Unknown sampling strategy: " + name);
+}
+
+/**
+ * @brief Number of step lengths the line search tries at once on small images
+ * (see lineSearchTrials)
+ */
+static const size_t LINESEARCH_TRIALS = 4;
+
+/**
+ * @brief Number of step lengths the line search tries at once (see
+ * ParallelLBFGSOpt::opt_ls_trials) when optimizing a metric on img. The
+ * metrics split their work into slabs of the first dimension, which leaves
+ * threads idle on small (coarse pyramid level) images, so there several
+ * trials are evaluated speculatively. The count only depends on the problem,
+ * never on the number of threads, so the result of the registration doesn't
+ * either; the trials are spread over lineSearchCopies() copies of the metric.
+ *
+ * @param img Image the metric is computed on
+ * @param resample Whether the metric draws new samples for each evaluation,
+ * in which case separate copies would see different samples and trials
+ * couldn't be compared
+ *
+ * @return Number of trials per batch of the line search
+ */
+static size_t lineSearchTrials(ptr<const MRImage> img, bool resample)
+{
+	const size_t MAXVOXELS = 1<<18;
+	if(resample || img->elements() > MAXVOXELS)
+		return 1;
+	return LINESEARCH_TRIALS;
+}
+
+/**
+ * @brief Number of copies of a metric to evaluate ntrials line search trials
+ * on, one per thread that can be used
+ *
+ * @param ntrials Number of trials per batch (see lineSearchTrials)
+ *
+ * @return Number of metric computers, including the original
+ */
+static size_t lineSearchCopies(size_t ntrials)
+{
+	return std::max<size_t>(1, std::min(ntrials, numThreads()));
+}
+
+/**
+ * @brief Counts and times the metric evaluations made while optimizing one
+ * level (only while tracing is enabled), see timedValue etc. Evaluations may
+ * come from several threads at once (speculative line search), so updates are
+ * locked.
+ */
+struct EvalStats
+{
+	EvalStats() { reset(); };
+
+	/**
+	 * @brief Clears the counts, for the next level
+	 */
+	void reset()
+	{
+		nvalue = ngrad = 0;
+		tvalue = tgrad = 0;
+	};
+
+	/**
+	 * @brief Records an evaluation
+	 *
+	 * @param grad Whether the gradient was computed
+	 * @param start Start time (traceClock())
+	 */
+	void add(bool grad, double start)
+	{
+		double dur = traceClock()-start;
+		traceSpan(grad ? "valueGrad" : "value", "metric", start, dur);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if(grad) {
+			ngrad++;
+			tgrad += dur;
+		} else {
+			nvalue++;
+			tvalue += dur;
+		}
+	};
+
+	/**
+	 * @brief Attaches the counts and times to a level's span, along with the
+	 * final metric
+	 *
+	 * @param level Span of the level
+	 * @param final Value of the metric at the point the optimizer accepted
+	 */
+	void record(TraceScope& level, double final)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		level.arg("value_evals", nvalue);
+		level.arg("value_time", tvalue);
+		level.arg("grad_evals", ngrad);
+		level.arg("grad_time", tgrad);
+		level.arg("final_metric", final);
+	};
+
+	std::mutex mutex;
+	size_t nvalue;
+	size_t ngrad;
+	double tvalue;
+	double tgrad;
+};
+
+/**
+ * @brief Returns comp.value() as a function, counted in stats when tracing
+ */
+template <typename T>
+static ValFunc timedValue(T& comp, EvalStats& stats)
+{
+	return [&comp, &stats](const VectorXd& x, double& v)
+	{
+		if(!tracing())
+			return comp.value(x, v);
+		double start = traceClock();
+		int ret = comp.value(x, v);
+		stats.add(false, start);
+		return ret;
+	};
+}
+
+/**
+ * @brief Returns comp.grad() as a function, counted in stats when tracing
+ */
+template <typename T>
+static GradFunc timedGrad(T& comp, EvalStats& stats)
+{
+	return [&comp, &stats](const VectorXd& x, VectorXd& g)
+	{
+		if(!tracing())
+			return comp.grad(x, g);
+		double start = traceClock();
+		int ret = comp.grad(x, g);
+		stats.add(true, start);
+		return ret;
+	};
+}
+
+/**
+ * @brief Returns comp.valueGrad() as a function, counted in stats when
+ * tracing
+ */
+template <typename T>
+static ValGradFunc timedValueGrad(T& comp, EvalStats& stats)
+{
+	return [&comp, &stats](const VectorXd& x, double& v, VectorXd& g)
+	{
+		if(!tracing())
+			return comp.valueGrad(x, v, g);
+		double start = traceClock();
+		int ret = comp.valueGrad(x, v, g);
+		stats.add(true, start);
+		return ret;
+	};
+}
+
+/**
+ * @brief Minimizes a metric computer with ParallelLBFGSOpt, starting from x.
+ * Each batch of the line search tries ntrials step lengths, spread over comp
+ * and the extra computers (which must be set up identically to comp). The
+ * result depends on ntrials but not on the number of extra computers.
+ *
+ * @param comp Metric computer
+ * @param extra Additional copies of comp for speculative line search
+ * @param ntrials Step lengths per batch of the line search (see
+ * lineSearchTrials)
+ * @param x Initial parameters, updated with the result
+ * @param stopx Smallest step to take, stop after steps reach this size
+ * @param level Span of the pyramid level, the evaluation counts and times,
+ * time in the optimizer and line search and the metric at the accepted point
+ * are attached to it (if tracing)
+ * @param hist History size (if > 0, otherwise the optimizer default)
+ * @param beta Line search step reduction factor (if > 0, otherwise the
+ * optimizer default)
+ *
+ * @return Reason the optimizer stopped
+ */
+template <typename T>
+static StopReason optimizeMetric(T& comp, const std::vector<ptr<T>>& extra,
+		size_t ntrials, VectorXd& x, double stopx, TraceScope& level,
+		int hist = 0, double beta = 0)
+{
+	EvalStats stats;
+	double start = traceClock();
+
+	std::vector<ValGradFunc> vgfuncs;
+	vgfuncs.push_back(timedValueGrad(comp, stats));
+	for(auto& c : extra)
+		vgfuncs.push_back(timedValueGrad(*c, stats));
+
+	ParallelLBFGSOpt opt(x.rows(), vgfuncs);
+	opt.stop_Its = 10000;
+	opt.stop_X = stopx;
+	opt.stop_G = 0;
+	opt.stop_F = 0;
+	opt.opt_ls_trials = ntrials;
+	if(hist > 0)
+		opt.opt_histsize = hist;
+	if(beta > 0)
+		opt.opt_ls_beta = beta;
+	opt.state_x = x;
+	StopReason stopr = opt.optimize();
+	x = opt.state_x;
+	level.arg("trials", ntrials);
+
+	level.arg("optimize_time", traceClock()-start);
+	level.arg("line_search_time", opt.ls_time);
+	stats.record(level, opt.state_val);
+	level.note(Optimizer::explainStop(stopr));
+	return stopr;
+}
+/**
+ * @brief Attaches the description of a pyramid level to its span: the level,
+ * sigma, number of voxels and the time spent building the level of each
+ * pyramid (see ImagePyramid::smoothTime).
+ *
+ * @param trace Span of the level
+ * @param pyramids Pyramids used at this level (NULL entries are skipped, the
+ * first must not be NULL)
+ * @param ii Level
+ */
+static void traceLevel(TraceScope& trace,
+		std::initializer_list<const ImagePyramid*> pyramids, size_t ii)
+{
+	if(!trace.on())
+		return;
+
+	double smooth = 0;
+	for(auto pyr : pyramids) {
+		if(pyr)
+			smooth += pyr->smoothTime(ii);
+	}
+	trace.arg("level", ii);
+	trace.arg("sigma", (*pyramids.begin())->sigmas()[ii]);
+	trace.arg("voxels", (*pyramids.begin())->level(ii)->elements());
+	trace.arg("smooth_time", smooth);
+}
+
 /**
  * @brief Performs correlation based registration between two 3D volumes. note
  * that the two volumes should have identical sampling and identical
@@ -58,59 +323,108 @@ namespace npl {
  * @param fixed     Image which will be the target of registration.
  * @param moving    Image which will be rotated then shifted to match fixed.
  * @param sigmas	Standard deviation of smoothing at each level
+ * @param fftinit   Start the optimizer from the estimate of fourierInit3D
+ * rather than the identity
+ * @param gaussnewton Use the Gauss-Newton solver (RigidCorrComp::gaussNewton)
+ * rather than L-BFGS
  *
  * @return Output rigid transform
  */
 Rigid3DTrans corReg3D(shared_ptr<const MRImage> fixed,
-		shared_ptr<const MRImage> moving, const std::vector<double>& sigmas)
+		shared_ptr<const MRImage> moving, const std::vector<double>& sigmas,
+		bool fftinit, bool gaussnewton)
 {
-	using namespace std::placeholders;
-	using std::bind;
-
 	// make sure the input image has matching properties
 	if(!fixed->matchingOrient(moving, true, true))
 		throw INVALID_ARGUMENT("Input images have mismatching pixels in");
 
-	// create value and gradient functions from RigiCorrComputer
-	RigidCorrComp comp(true);
-	auto vfunc = bind(&RigidCorrComp::value, &comp, _1, _2);
-	auto vgfunc = bind(&RigidCorrComp::valueGrad, &comp, _1, _2, _3);
-	auto gfunc = bind(&RigidCorrComp::grad, &comp, _1, _2);
+	Rigid3DTrans init;
+	if(fftinit)
+		init = fourierInit3D(fixed, moving);
 
-	Rigid3DTrans rigid;
-	for(size_t ii=0; ii<sigmas.size(); ii++) {
-		// smooth and downsample input images
-		auto sm_fixed = smoothDownsample(fixed, sigmas[ii]);
-		auto sm_moving = smoothDownsample(moving, sigmas[ii]);
+	ImagePyramid fixpyr(fixed, sigmas);
+	ImagePyramid movpyr(moving, sigmas, 1, true);
+	return corReg3D(fixpyr, movpyr, init, gaussnewton);
+}
+
+/**
+ * @brief Performs correlation based registration between two 3D volumes,
+ * using pre-computed pyramids. Both pyramids must have the same sigmas and
+ * come from images with identical sampling and orientation.
+ *
+ * @param fixed     Pyramid of the image which will be the target of
+ * registration.
+ * @param moving    Pyramid of the image which will be rotated then shifted to
+ * match fixed (derivatives are used if cached).
+ * @param init      Initial transform (RAS coordinates), identity by default
+ * @param gaussnewton Use the Gauss-Newton solver (RigidCorrComp::gaussNewton)
+ * rather than L-BFGS
+ *
+ * @return Output rigid transform
+ */
+Rigid3DTrans corReg3D(const ImagePyramid& fixed, const ImagePyramid& moving,
+		Rigid3DTrans init, bool gaussnewton)
+{
+	if(fixed.sigmas() != moving.sigmas())
+		throw INVALID_ARGUMENT("Fixed and moving pyramids have different "
+				"levels");
+	if(!init.ras_coord)
+		throw INVALID_ARGUMENT("Initial transform must be in RAS coordinates");
+
+	RigidCorrComp comp(true);
+	Rigid3DTrans rigid = init;
+	VectorXd x(6);
+	for(size_t ii=0; ii<fixed.levels(); ii++) {
+		// pre-smoothed and downsampled input images
+		auto sm_fixed = fixed.level(ii);
+		auto sm_moving = moving.level(ii);
 		DEBUGWRITE(sm_fixed->write("smooth_fixed_"+to_string(ii)+".nii.gz"));
 		DEBUGWRITE(sm_moving->write("smooth_moving_"+to_string(ii)+".nii.gz"));
+		TraceScope trace("level", "corReg3D");
+		traceLevel(trace, {&fixed, &moving}, ii);
 		comp.setFixed(sm_fixed);
-		comp.setMoving(sm_moving);
-
-		// initialize optimizer
-		LBFGSOpt opt(6, vfunc, gfunc, vgfunc);
-		opt.stop_Its = 10000;
-		opt.stop_X = 0.00001;
-		opt.stop_G = 0;
-		opt.stop_F = 0;
+		comp.setMoving(sm_moving, moving.deriv(ii));
+
+		// copies for speculative line search trials (sharing the images)
+		std::vector<ptr<RigidCorrComp>> extra;
+		size_t ntrials = lineSearchTrials(sm_moving, false);
+		for(size_t tt=1; !gaussnewton && tt<lineSearchCopies(ntrials); tt++) {
+			extra.push_back(std::make_shared<RigidCorrComp>(true));
+			extra.back()->setFixed(sm_fixed);
+			extra.back()->setMoving(sm_moving, moving.deriv(ii));
+		}
 
 		// grab the parameters from the previous iteration (or initialized)
 		rigid.toIndexCoords(sm_moving, true);
 		for(size_t ii=0; ii<3; ii++) {
-			opt.state_x[ii] = radToDeg(rigid.rotation[ii]);
-			opt.state_x[ii+3] = rigid.shift[ii]*sm_moving->spacing(ii);
+			x[ii] = radToDeg(rigid.rotation[ii]);
+			x[ii+3] = rigid.shift[ii]*sm_moving->spacing(ii);
 			assert(rigid.center[ii] == (sm_moving->dim(ii)-1.)/2.);
 		}
 
 		// run the optimizer
-		StopReason stopr = opt.optimize();
-		cerr << Optimizer::explainStop(stopr) << endl;
+		if(gaussnewton) {
+			double start = traceClock();
+			size_t passes = comp.gaussNewton(x, 0.00001);
+			cerr << "Gauss-Newton, " << passes << " passes" << endl;
+			if(trace.on()) {
+				double val;
+				trace.arg("optimize_time", traceClock()-start);
+				trace.arg("passes", passes);
+				comp.value(x, val);
+				trace.arg("final_metric", val);
+			}
+		} else {
+			StopReason stopr = optimizeMetric(comp, extra, ntrials, x, 0.00001,
+					trace);
+			cerr << Optimizer::explainStop(stopr) << endl;
+		}
 
 		// set values from parameters, and convert to RAS coordinate so that no
 	// matter the sampling after smoothing the values remain
 		for(size_t ii=0; ii<3; ii++) {
-			rigid.rotation[ii] = degToRad(opt.state_x[ii]);
-			rigid.shift[ii] = opt.state_x[ii+3]/sm_moving->spacing(ii);
+			rigid.rotation[ii] = degToRad(x[ii]);
+			rigid.shift[ii] = x[ii+3]/sm_moving->spacing(ii);
 			rigid.center[ii] = (sm_moving->dim(ii)-1)/2.;
 		}
 
@@ -120,6 +434,447 @@ Rigid3DTrans corReg3D(shared_ptr<const MRImage> fixed,
 	return rigid;
 };
 
+/**
+ * @brief Copies a single volume of a 4D image into the region roi of out,
+ * zeroing values below thresh.
+ *
+ * @param fmri Input 4D image
+ * @param tt Volume to copy
+ * @param thresh Values below this are set to zero
+ * @param roi Region of out to copy the volume into (same size as a volume)
+ * @param out Output 3D image
+ */
+static void extractThreshVolume(ptr<const MRImage> fmri, size_t tt,
+		double thresh, const std::vector<std::pair<int64_t,int64_t>>& roi,
+		ptr<MRImage> out)
+{
+	Vector3DConstIter<double> iit(fmri);
+	NDIter<double> it(out);
+	it.setROI(roi);
+	for(iit.goBegin(), it.goBegin(); !it.eof() && !iit.eof(); ++iit, ++it) {
+		double v = iit[tt];
+		if(v < thresh)
+			it.set(0);
+		else
+			it.set(v);
+	}
+}
+
+/**
+ * @brief Registers a (thresholded, padded) volume to a pre-smoothed fixed
+ * pyramid, one level at a time.
+ *
+ * @param fixed Smoothed fixed images
+ * @param moving Smoothed moving images (same levels as fixed)
+ * @param comp Correlation computer, bound to opt
+ * @param opt Optimizer to use (unless gnits > 0)
+ * @param stats Evaluation counter that opt's functions report to (see
+ * timedValue)
+ * @param gnits If > 0 use RigidCorrComp::gaussNewton with at most this many
+ * passes (and opt.stop_X as the minimum step) rather than opt
+ * @param volume Volume number, for tracing
+ * @param rigid Initial transform (in RAS space), updated with the result
+ */
+static void registerVolume(const ImagePyramid& fixed,
+		const ImagePyramid& moving, RigidCorrComp& comp, LBFGSOpt& opt,
+		EvalStats& stats, size_t gnits, size_t volume, Rigid3DTrans& rigid)
+{
+	for(size_t ii=0; ii<fixed.levels(); ii++) {
+		TraceScope trace("level", "motion");
+		traceLevel(trace, {&fixed, &moving}, ii);
+		trace.arg("volume", volume);
+		stats.reset();
+		double start = traceClock();
+
+		auto sm_moving = moving.level(ii);
+		comp.setFixed(fixed.level(ii));
+		comp.setMoving(sm_moving, moving.deriv(ii));
+
+		// grab the parameters from the previous level (or initialized)
+		rigid.toIndexCoords(sm_moving, true);
+		for(size_t dd=0; dd<3; dd++) {
+			opt.state_x[dd] = radToDeg(rigid.rotation[dd]);
+			opt.state_x[dd+3] = rigid.shift[dd]*sm_moving->spacing(dd);
+		}
+
+		// run the optimizer
+		double final = NAN;
+		if(gnits > 0) {
+			size_t passes = comp.gaussNewton(opt.state_x, opt.stop_X, gnits);
+			trace.arg("passes", passes);
+			if(trace.on()) {
+				comp.value(opt.state_x, final);
+				trace.arg("final_metric", final);
+			}
+		} else {
+			opt.reset_history();
+			trace.note(Optimizer::explainStop(opt.optimize()));
+
+			// LBFGSOpt doesn't report the value at its result
+			if(trace.on())
+				comp.value(opt.state_x, final);
+			stats.record(trace, final);
+		}
+		trace.arg("optimize_time", traceClock()-start);
+
+		// set values from parameters, and convert to RAS coordinate so that
+		// the values remain valid at the next level
+		for(size_t dd=0; dd<3; dd++) {
+			rigid.rotation[dd] = degToRad(opt.state_x[dd]);
+			rigid.shift[dd] = opt.state_x[dd+3]/sm_moving->spacing(dd);
+			rigid.center[dd] = (sm_moving->dim(dd)-1)/2.;
+		}
+		rigid.toRASCoords(sm_moving);
+	}
+}
+
+/**
+ * @brief Converts the result of registerVolume to motion parameters: the
+ * inverse transform, about the center of grid, in RAS space.
+ *
+ * @param rigid Registration result (RAS)
+ * @param grid Image whose center the parameters are relative to
+ *
+ * @return [CX, CY, CZ, RX, RY, RZ, SX, SY, SZ]
+ */
+static std::vector<double> motionParams(Rigid3DTrans rigid,
+		ptr<const MRImage> grid)
+{
+	rigid.toIndexCoords(grid, true);
+	rigid.invert();
+	rigid.toRASCoords(grid);
+
+	std::vector<double> motion(9);
+	for(size_t dd=0; dd<3; dd++) {
+		motion[dd] = rigid.center[dd];
+		motion[dd+3] = rigid.rotation[dd];
+		motion[dd+6] = rigid.shift[dd];
+	}
+	return motion;
+}
+
+/**
+ * @brief Resamples volume tt of interp's image with the inverse of the given
+ * motion parameters.
+ *
+ * @param interp Interpolator over the input image
+ * @param tt Volume to resample
+ * @param motion Motion parameters [CX, CY, CZ, RX, RY, RZ, SX, SY, SZ]
+ * @param invert Apply the motion directly, rather than its inverse
+ * @param out Output 3D volume, same grid as the input
+ */
+static void resampleMotion(LanczosInterp3DView<double>& interp, size_t tt,
+		const std::vector<double>& motion, bool invert, ptr<MRImage> out)
+{
+	Rigid3DTrans rigid;
+	rigid.ras_coord = true;
+	for(size_t dd=0; dd<3; dd++) {
+		rigid.center[dd] = motion[dd];
+		rigid.rotation[dd] = motion[dd+3];
+		rigid.shift[dd] = motion[dd+6];
+	}
+	if(!invert)
+		rigid.invert();
+
+	Matrix3d R = rigid.rotMatrix();
+	Vector3d ind;
+	for(NDIter<double> it(out); !it.eof(); ++it) {
+		it.index(3, ind.array().data());
+		out->indexToPoint(3, ind.array().data(), ind.array().data());
+		ind = R*(ind-rigid.center) + rigid.center + rigid.shift;
+		out->pointToIndex(3, ind.array().data(), ind.array().data());
+		it.set(interp(ind[0], ind[1], ind[2], tt));
+	}
+}
+
+/**
+ * @brief Computes motion parameters for each volume of a 4D image by rigidly
+ * registering it (with correlation) to the reference volume. The smoothed
+ * reference pyramid is computed once and shared, then volumes are registered
+ * concurrently, each thread with its own RigidCorrComp and LBFGSOpt. Every
+ * volume starts from the identity so results do not depend on the number of
+ * threads.
+ *
+ * @param fmri Input 4D image
+ * @param reftime Volume to use as the reference
+ * @param sigmas Standard deviation of smoothing (in physical space) at each
+ * level
+ * @param minstep Minimum step size, the optimizer stops below this
+ * @param maxstep Maximum (initial) step size of the line search
+ * @param histsize History size of the L-BFGS optimizer
+ * @param beta Line search step reduction factor
+ * @param padsize Number of voxels to pad each volume by during registration
+ * @param gaussnewton Use the Gauss-Newton solver (RigidCorrComp::gaussNewton)
+ * rather than L-BFGS, then only minstep applies
+ *
+ * @return Vector of motion parameters. Elements are (C = center, R = rotation
+ * in radians, S = shift, all in RAS space): [CX, CY, CZ, RX, RY, RZ, SX, SY,
+ * SZ]
+ */
+std::vector<std::vector<double>> computeMotion(ptr<const MRImage> fmri,
+		size_t reftime, const std::vector<double>& sigmas, double minstep,
+		double maxstep, int histsize, double beta, int padsize,
+		bool gaussnewton)
+{
+	if(fmri->ndim() < 3)
+		throw INVALID_ARGUMENT("Input to computeMotion must be at least 3D");
+	if(reftime >= fmri->tlen())
+		throw INVALID_ARGUMENT("Reference volume is past the end of input");
+	if(padsize < 0)
+		padsize = 0;
+
+	double thresh = otsuThresh(fmri);
+
+	// padded volume size, and the region of it that holds the input volume
+	size_t vsize[3];
+	std::vector<std::pair<int64_t,int64_t>> roi(3);
+	for(size_t dd=0; dd<3; dd++) {
+		vsize[dd] = fmri->dim(dd)+padsize;
+		roi[dd].first = padsize/2;
+		roi[dd].second = roi[dd].first + fmri->dim(dd)-1;
+	}
+
+	// Pre-Compute Fixed Smoothing, this is shared (read-only) by all threads
+	auto vol = dPtrCast<MRImage>(fmri->createAnother(3, vsize, FLOAT32));
+	extractThreshVolume(fmri, reftime, thresh, roi, vol);
+	ImagePyramid fixed(vol, sigmas);
+
+	std::vector<std::vector<double>> motion(fmri->tlen(),
+			std::vector<double>(9, 0));
+	parallelFor(0, fmri->tlen(), [&](size_t, size_t t0, size_t t1)
+	{
+		// Registration Tools (per thread)
+		auto moving = dPtrCast<MRImage>(fmri->createAnother(3, vsize,
+					FLOAT32));
+		RigidCorrComp comp(true);
+		EvalStats stats;
+		LBFGSOpt opt(6, timedValue(comp, stats), timedGrad(comp, stats),
+				timedValueGrad(comp, stats));
+		opt.stop_Its = 10000000;
+		opt.stop_X = minstep;
+		opt.stop_G = 0;
+		opt.stop_F = 0;
+		opt.opt_histsize = histsize;
+		opt.opt_ls_beta = beta;
+		opt.opt_ls_s = maxstep;
+
+		for(size_t tt=t0; tt<t1; tt++) {
+			if(tt == reftime)
+				continue;
+
+			// Extract and threshold moving volume, then register
+			extractThreshVolume(fmri, tt, thresh, roi, moving);
+			ImagePyramid movpyr(moving, sigmas, 1, true);
+			Rigid3DTrans rigid;
+			registerVolume(fixed, movpyr, comp, opt, stats,
+					gaussnewton ? 50 : 0, tt, rigid);
+			motion[tt] = motionParams(rigid, moving);
+		}
+	});
+
+	return motion;
+}
+
+/**
+ * @brief Applies the inverse of the given motion parameters to every volume
+ * of a 4D image (volumes are resampled in parallel).
+ *
+ * @param fmri Input 4D image
+ * @param motion Motion parameters, one row of 9 per volume, as returned by
+ * computeMotion
+ * @param invert Apply the motion parameters directly rather than their
+ * inverse (for simulating motion)
+ *
+ * @return Motion corrected image
+ */
+ptr<MRImage> applyMotion(ptr<const MRImage> fmri,
+		const std::vector<std::vector<double>>& motion, bool invert)
+{
+	if(motion.size() != fmri->tlen())
+		throw INVALID_ARGUMENT("Motion rows don't match input timepoints");
+	for(size_t tt=0; tt<motion.size(); tt++) {
+		if(motion[tt].size() != 9)
+			throw INVALID_ARGUMENT("Motion row " + std::to_string(tt) +
+					" does not have 9 columns");
+	}
+
+	auto out = dPtrCast<MRImage>(fmri->copy());
+	parallelFor(0, fmri->tlen(), [&](size_t, size_t t0, size_t t1)
+	{
+		// per-thread working buffer and interpolator
+		auto vol = dPtrCast<MRImage>(fmri->createAnother(3, fmri->dim(),
+					FLOAT64));
+		LanczosInterp3DView<double> interp(fmri);
+		Vector3DIter<double> oit(out);
+		for(size_t tt=t0; tt<t1; tt++) {
+			resampleMotion(interp, tt, motion[tt], invert, vol);
+
+			// Copy result into output volume tt
+			NDIter<double> vit(vol);
+			for(oit.goBegin(); !oit.eof(); ++oit, ++vit)
+				oit.set(tt, *vit);
+		}
+	});
+
+	return out;
+}
+
+/**
+ * @brief Performs motion correction on a set of volumes. Each 3D volume is
+ * extracted and linearly registered with the ref volume.
+ *
+ * @param input 3+D volume (set of 3D volumes, all higher dimensions are
+ *              treated equally as separate volumes).
+ * @param ref   Reference t, all images will be registered to the specified
+ *              timepoint
+ *
+ * @return      Motion corrected volume.
+ */
+ptr<MRImage> motionCorrect(ptr<const MRImage> input, size_t ref)
+{
+	return applyMotion(input, computeMotion(input, ref, {2, 1, 0.5}));
+}
+
+/**
+ * @brief Computes the framewise displacement between two sets of motion
+ * parameters (as returned by computeMotion), the sum of the absolute changes
+ * in shift plus the arc length of the changes in rotation on a sphere of the
+ * given radius (Power et al. 2012). The second set is re-expressed about the
+ * center of the first, so the centers need not match.
+ *
+ * @param m1 Motion parameters [CX, CY, CZ, RX, RY, RZ, SX, SY, SZ]
+ * @param m2 Motion parameters [CX, CY, CZ, RX, RY, RZ, SX, SY, SZ]
+ * @param radius Radius (mm) used to convert rotations to displacements
+ *
+ * @return Framewise displacement in mm
+ */
+double framewiseDisplacement(const std::vector<double>& m1,
+		const std::vector<double>& m2, double radius)
+{
+	if(m1.size() != 9 || m2.size() != 9)
+		throw INVALID_ARGUMENT("Motion parameters should have 9 elements");
+
+	// R(x-c)+s+c = R(x-c1) + s + (R-I)(c1-c) + c1
+	Rigid3DTrans rigid;
+	Vector3d c1, c2;
+	for(size_t dd=0; dd<3; dd++) {
+		rigid.rotation[dd] = m2[dd+3];
+		c1[dd] = m1[dd];
+		c2[dd] = m2[dd];
+	}
+	Vector3d shift2 = (rigid.rotMatrix()-Matrix3d::Identity())*(c1-c2);
+
+	double fd = 0;
+	for(size_t dd=0; dd<3; dd++) {
+		fd += radius*fabs(m2[dd+3]-m1[dd+3]);
+		fd += fabs(m2[dd+6]+shift2[dd]-m1[dd+6]);
+	}
+	return fd;
+}
+
+/**
+ * @brief Constructor, computes the reference pyramid.
+ *
+ * @param ref Reference volume (3D, or 4D with a single volume)
+ * @param sigmas Standard deviation of smoothing at each level
+ * @param maxits Maximum optimizer iterations at each level
+ * @param minstep Minimum step size, the optimizer stops below this
+ * @param maxstep Maximum (initial) step size of the line search
+ * @param histsize History size of the L-BFGS optimizer
+ * @param beta Line search step reduction factor
+ * @param padsize Number of voxels to pad each volume by
+ */
+OnlineMotionCorr::OnlineMotionCorr(ptr<const MRImage> ref,
+		const std::vector<double>& sigmas, size_t maxits, double minstep,
+		double maxstep, int histsize, double beta, int padsize) :
+	m_sigmas(sigmas), m_maxits(maxits), m_minstep(minstep),
+	m_maxstep(maxstep), m_histsize(histsize), m_beta(beta), m_roi(3),
+	m_comp(true), m_fd(0), m_count(0)
+{
+	if(ref->ndim() < 3 || ref->tlen() != 1)
+		throw INVALID_ARGUMENT("Reference for OnlineMotionCorr must be a "
+				"single 3D volume");
+	if(padsize < 0)
+		padsize = 0;
+
+	// padded volume size, and the region of it that holds the input volume
+	size_t vsize[3];
+	for(size_t dd=0; dd<3; dd++) {
+		vsize[dd] = ref->dim(dd)+padsize;
+		m_roi[dd].first = padsize/2;
+		m_roi[dd].second = m_roi[dd].first + ref->dim(dd)-1;
+	}
+
+	m_thresh = otsuThresh(ref);
+	m_moving = dPtrCast<MRImage>(ref->createAnother(3, vsize, FLOAT32));
+	extractThreshVolume(ref, 0, m_thresh, m_roi, m_moving);
+
+	m_fixed.reset(new ImagePyramid(m_moving, m_sigmas));
+}
+
+/**
+ * @brief Forget the previous volume's transform, the next volume will be
+ * registered starting from the identity
+ */
+void OnlineMotionCorr::reset()
+{
+	m_rigid = Rigid3DTrans();
+	m_motion.clear();
+	m_fd = 0;
+}
+
+/**
+ * @brief Estimates the motion of a volume relative to the reference and
+ * resamples it into the reference position. After this motion() and fd()
+ * return the parameters for this volume.
+ *
+ * @param vol Input volume, same grid as the reference
+ *
+ * @return Motion corrected volume
+ */
+ptr<MRImage> OnlineMotionCorr::correct(ptr<const MRImage> vol)
+{
+	if(vol->ndim() < 3 || vol->tlen() != 1)
+		throw INVALID_ARGUMENT("Input to OnlineMotionCorr must be a single "
+				"3D volume");
+	for(size_t dd=0; dd<3; dd++) {
+		if(vol->dim(dd) != m_roi[dd].second-m_roi[dd].first+1)
+			throw INVALID_ARGUMENT("Input volume size does not match the "
+					"reference");
+	}
+
+	EvalStats stats;
+	LBFGSOpt opt(6, timedValue(m_comp, stats), timedGrad(m_comp, stats),
+			timedValueGrad(m_comp, stats));
+	opt.stop_Its = m_maxits;
+	opt.stop_X = m_minstep;
+	opt.stop_G = 0;
+	opt.stop_F = 0;
+	opt.opt_histsize = m_histsize;
+	opt.opt_ls_beta = m_beta;
+	opt.opt_ls_s = m_maxstep;
+
+	// register, starting from the previous volume's transform
+	extractThreshVolume(vol, 0, m_thresh, m_roi, m_moving);
+	ImagePyramid movpyr(m_moving, m_sigmas, 1, true);
+	registerVolume(*m_fixed, movpyr, m_comp, opt, stats, 0, m_count,
+			m_rigid);
+
+	auto motion = motionParams(m_rigid, m_moving);
+	if(m_motion.empty())
+		m_fd = 0;
+	else
+		m_fd = framewiseDisplacement(m_motion, motion);
+	m_motion.swap(motion);
+	m_count++;
+
+	// resample into the reference position
+	auto out = dPtrCast<MRImage>(vol->createAnother(3, vol->dim(), FLOAT64));
+	LanczosInterp3DView<double> interp(vol);
+	resampleMotion(interp, 0, m_motion, false, out);
+	return out;
+}
+
 /**
  * @brief Performs correlation based registration between two 3D volumes. note
  * that the two volumes should have identical sampling and identical
@@ -134,6 +889,14 @@ Rigid3DTrans corReg3D(shared_ptr<const MRImage> fixed,
  * @param binrarius Radius of kernel in pdf density estimation
  * @param metric metric to use (default is MI)
  * @param stopx Smallest step to take, stop after steps reach this size
+ * @param sampling Voxel sampling strategy for the fixed image (FULL, UNIFORM,
+ * STRATIFIED or MASK)
+ * @param sampfrac Fraction of fixed voxels to use when sampling
+ * @param resample Draw new samples at each iteration rather than once per
+ * level
+ * @param mask Mask to sample from (required for MASK sampling)
+ * @param fftinit Start the optimizer from the estimate of fourierInit3D
+ * rather than the identity
  *
  * @return          4x4 Matrix, indicating rotation about the center then
  *                  shift. Rotation matrix is the first 3x3 and shift is the
@@ -141,49 +904,96 @@ Rigid3DTrans corReg3D(shared_ptr<const MRImage> fixed,
  */
 Rigid3DTrans informationReg3D(shared_ptr<const MRImage> fixed,
 		shared_ptr<const MRImage> moving, const std::vector<double>& sigmas,
-		size_t nbins, size_t binradius, string metric, double stopx)
+		size_t nbins, size_t binradius, string metric, double stopx,
+		string sampling, double sampfrac, bool resample,
+		ptr<const MRImage> mask, bool fftinit)
 {
-	using namespace std::placeholders;
-	using std::bind;
-
-	Rigid3DTrans rigid;
-
 	// make sure the input image has matching properties
 	if(!fixed->matchingOrient(moving, true, true))
 		throw INVALID_ARGUMENT("Input images have mismatching pixels in");
 
-	for(size_t ii=0; ii<sigmas.size(); ii++) {
-		// smooth and downsample input images
-		auto sm_fixed = smoothDownsample(fixed, sigmas[ii]);
-		auto sm_moving = smoothDownsample(moving, sigmas[ii]);
+	Rigid3DTrans init;
+	if(fftinit)
+		init = fourierInit3D(fixed, moving);
+
+	ImagePyramid fixpyr(fixed, sigmas);
+	ImagePyramid movpyr(moving, sigmas, 1, true);
+	return informationReg3D(fixpyr, movpyr, nbins, binradius, metric, stopx,
+			sampling, sampfrac, resample, mask, init);
+}
+
+/**
+ * @brief Performs information-based registration between two 3D volumes,
+ * using pre-computed pyramids. Both pyramids must have the same sigmas and
+ * come from images with identical sampling and orientation.
+ *
+ * @param fixed Pyramid of the image which will be the target of registration.
+ * @param moving Pyramid of the image which will be rotated then shifted to
+ * match fixed (derivatives are used if cached).
+ * @param nbins number of bins for estimation of marginal pdf's
+ * @param binrarius Radius of kernel in pdf density estimation
+ * @param metric metric to use (default is MI)
+ * @param stopx Smallest step to take, stop after steps reach this size
+ * @param sampling Voxel sampling strategy for the fixed image (FULL, UNIFORM,
+ * STRATIFIED or MASK)
+ * @param sampfrac Fraction of fixed voxels to use when sampling
+ * @param resample Draw new samples at each iteration rather than once per
+ * level
+ * @param mask Mask to sample from (required for MASK sampling)
+ * @param init Initial transform (RAS coordinates), identity by default
+ *
+ * @return Rigid transform
+ */
+Rigid3DTrans informationReg3D(const ImagePyramid& fixed,
+		const ImagePyramid& moving, size_t nbins, size_t binradius,
+		string metric, double stopx, string sampling, double sampfrac,
+		bool resample, ptr<const MRImage> mask, Rigid3DTrans init)
+{
+	Rigid3DTrans rigid = init;
+
+	if(fixed.sigmas() != moving.sigmas())
+		throw INVALID_ARGUMENT("Fixed and moving pyramids have different "
+				"levels");
+	if(!init.ras_coord)
+		throw INVALID_ARGUMENT("Initial transform must be in RAS coordinates");
+	SampleMode sampmode = parseSampleMode(sampling);
+
+	for(size_t ii=0; ii<fixed.levels(); ii++) {
+		// pre-smoothed and downsampled input images
+		auto sm_fixed = fixed.level(ii);
+		auto sm_moving = moving.level(ii);
 		DEBUGWRITE(sm_fixed->write("smooth_fixed_"+to_string(ii)+".nii.gz"));
 		DEBUGWRITE(sm_moving->write("smooth_moving_"+to_string(ii)+".nii.gz"));
+		TraceScope trace("level", "informationReg3D");
+		traceLevel(trace, {&fixed, &moving}, ii);
+
+		auto setup = [&](RigidInfoComp& comp)
+		{
+			comp.setBins(nbins, binradius);
+			comp.setSampling(sampmode, sampfrac, resample, mask);
+			comp.setFixed(sm_fixed);
+			comp.setMoving(sm_moving, moving.deriv(ii));
+
+			if(metric == "MI")
+				comp.m_metric = METRIC_MI;
+			else if(metric == "NMI")
+				comp.m_metric = METRIC_NMI;
+			else if(metric == "VI") {
+				comp.m_metric = METRIC_VI;
+			}
+		};
 
 		RigidInfoComp comp(true);
-		comp.setBins(nbins, binradius);
-		comp.setFixed(sm_fixed);
-		comp.setMoving(sm_moving);
-
-		if(metric == "MI")
-			comp.m_metric = METRIC_MI;
-		else if(metric == "NMI")
-			comp.m_metric = METRIC_NMI;
-		else if(metric == "VI") {
-			comp.m_metric = METRIC_VI;
+		setup(comp);
+
+		// copies for speculative line search trials (sharing the images)
+		std::vector<ptr<RigidInfoComp>> extra;
+		size_t ntrials = lineSearchTrials(sm_moving, resample);
+		for(size_t tt=1; tt<lineSearchCopies(ntrials); tt++) {
+			extra.push_back(std::make_shared<RigidInfoComp>(true));
+			setup(*extra.back());
 		}
 
-		// create value and gradient functions
-		auto vfunc = bind(&RigidInfoComp::value, &comp, _1, _2);
-		auto vgfunc = bind(&RigidInfoComp::valueGrad, &comp, _1, _2, _3);
-		auto gfunc = bind(&RigidInfoComp::grad, &comp, _1, _2);
-
-		// initialize optimizer
-		LBFGSOpt opt(6, vfunc, gfunc, vgfunc);
-		opt.stop_Its = 10000;
-		opt.stop_X = stopx;
-		opt.stop_G = 0;
-		opt.stop_F = 0;
-
 		cerr << "Init Rigid: " << ii << endl;
 		cerr << "Rotation: " << rigid.rotation.transpose() << endl;
 		cerr << "Center : " << rigid.center.transpose() << endl;
@@ -191,9 +1001,10 @@ Rigid3DTrans informationReg3D(shared_ptr<const MRImage> fixed,
 
 		// grab the parameters from the previous iteration (or initialized)
 		rigid.toIndexCoords(sm_moving, true);
+		VectorXd x(6);
 		for(size_t ii=0; ii<3; ii++) {
-			opt.state_x[ii] = radToDeg(rigid.rotation[ii]);
-			opt.state_x[ii+3] = rigid.shift[ii]*sm_moving->spacing(ii);
+			x[ii] = radToDeg(rigid.rotation[ii]);
+			x[ii+3] = rigid.shift[ii]*sm_moving->spacing(ii);
 			assert(rigid.center[ii] == (sm_moving->dim(ii)-1.)/2.);
 		}
 
@@ -203,14 +1014,15 @@ Rigid3DTrans informationReg3D(shared_ptr<const MRImage> fixed,
 		cerr << "Shift : " << rigid.shift.transpose() << endl;
 
 		// run the optimizer
-		StopReason stopr = opt.optimize();
+		StopReason stopr = optimizeMetric(comp, extra, ntrials, x, stopx,
+				trace);
 		cerr << Optimizer::explainStop(stopr) << endl;
 
 		// set values from parameters, and convert to RAS coordinate so that no
 		// matter the sampling after smoothing the values remain
 		for(size_t ii=0; ii<3; ii++) {
-			rigid.rotation[ii] = degToRad(opt.state_x[ii]);
-			rigid.shift[ii] = opt.state_x[ii+3]/sm_moving->spacing(ii);
+			rigid.rotation[ii] = degToRad(x[ii]);
+			rigid.shift[ii] = x[ii+3]/sm_moving->spacing(ii);
 			rigid.center[ii] = (sm_moving->dim(ii)-1)/2.;
 		}
 
@@ -230,6 +1042,395 @@ Rigid3DTrans informationReg3D(shared_ptr<const MRImage> fixed,
 	return rigid;
 };
 
+/**
+ * @brief Trilinear interpolation in a flat N*N*N array with periodic (WRAP)
+ * boundary conditions, used to sample unshifted fourier domains at fractional
+ * frequencies.
+ *
+ * @param img Image data, with the last dimension fastest
+ * @param N Size of the image in every dimension
+ * @param x Index (frequency) in dimension 0
+ * @param y Index (frequency) in dimension 1
+ * @param z Index (frequency) in dimension 2
+ *
+ * @return Interpolated value
+ */
+static double wrapSample3D(const double* img, int64_t N, double x, double y,
+		double z)
+{
+	double fx = floor(x);
+	double fy = floor(y);
+	double fz = floor(z);
+	double wx = x-fx;
+	double wy = y-fy;
+	double wz = z-fz;
+	int64_t x0 = (((int64_t)fx%N)+N)%N;
+	int64_t y0 = (((int64_t)fy%N)+N)%N;
+	int64_t z0 = (((int64_t)fz%N)+N)%N;
+	int64_t x1 = (x0+1)%N;
+	int64_t y1 = (y0+1)%N;
+	int64_t z1 = (z0+1)%N;
+
+	const double* r00 = &img[(x0*N+y0)*N];
+	const double* r01 = &img[(x0*N+y1)*N];
+	const double* r10 = &img[(x1*N+y0)*N];
+	const double* r11 = &img[(x1*N+y1)*N];
+
+	return (1-wx)*((1-wy)*((1-wz)*r00[z0] + wz*r00[z1]) +
+				wy*((1-wz)*r01[z0] + wz*r01[z1])) +
+		wx*((1-wy)*((1-wz)*r10[z0] + wz*r10[z1]) +
+				wy*((1-wz)*r11[z0] + wz*r11[z1]));
+}
+
+/**
+ * @brief Multiplies a 3D image by a separable Tukey window (flat in the middle
+ * half, cosine tapered over the outer quarters) so that the edges of the
+ * field of view don't produce axis-aligned streaks in the fourier domain.
+ *
+ * @param inout Input/output image
+ */
+static void taperWindow(ptr<MRImage> inout)
+{
+	int64_t index[3];
+	for(NDIter<double> it(inout); !it.eof(); ++it) {
+		it.index(3, index);
+		double w = 1;
+		for(size_t dd=0; dd<3; dd++) {
+			double u = inout->dim(dd) > 1 ?
+				index[dd]/(inout->dim(dd)-1.) : 0.5;
+			u = std::min(u, 1-u);
+			if(u < 0.25)
+				w *= 0.5-0.5*cos(4*M_PI*u);
+		}
+		it.set(w*(*it));
+	}
+}
+
+/**
+ * @brief Computes the FFT of a 3D image zero-padded to N*N*N, and returns it
+ * as a flat array (last dimension fastest) with unshifted frequencies.
+ *
+ * @param in Input image (at most N in each dimension)
+ * @param N Size of the padded fourier domain
+ *
+ * @return Fourier domain of in
+ */
+static std::vector<cdouble_t> paddedFFT(ptr<const MRImage> in, int64_t N)
+{
+	auto fimg = fft_forward(in, {(size_t)N, (size_t)N, (size_t)N});
+
+	int64_t index[3];
+	std::vector<cdouble_t> out(N*N*N);
+	for(NDConstIter<cdouble_t> it(fimg); !it.eof(); ++it) {
+		it.index(3, index);
+		out[(index[0]*N+index[1])*N+index[2]] = *it;
+	}
+	return out;
+}
+
+/**
+ * @brief Computes the angular signature of a magnitude spectrum on the
+ * pseudo-polar grid. The pseudo-polar grid has 3 faces, one per
+ * pseudo-radius dimension, and each face has P*P rays with slopes in [-1,1]
+ * for the two remaining dimensions (in increasing order). The signature is the
+ * ramp weighted magnitude integrated along each ray out to radius N/2 - 1.
+ * Because the magnitude spectrum doesn't change with translation and rotates
+ * with the image, two signatures differ only by a rotation.
+ *
+ * @param mag Magnitude spectrum (unshifted, N*N*N, last dimension fastest)
+ * @param N Size of the fourier domain
+ * @param P Number of slopes along each side of a face
+ *
+ * @return Signature, P*P values for each of the 3 faces
+ */
+static std::vector<double> pseudoPolarSignature(const std::vector<double>& mag,
+		int64_t N, int64_t P)
+{
+	std::vector<double> sig(3*P*P);
+	double rmax = N/2.-1;
+	parallelFor(0, 3*P, [&](size_t, size_t b, size_t e)
+	{
+		double dir[3];
+		for(size_t rr=b; rr<e; rr++) {
+			int64_t face = rr/P;
+			int64_t oa = face == 0 ? 1 : 0;
+			int64_t ob = face == 2 ? 1 : 2;
+			dir[face] = 1;
+			dir[oa] = -1+2.*(rr%P)/(P-1.);
+			for(int64_t jj=0; jj<P; jj++) {
+				dir[ob] = -1+2.*jj/(P-1.);
+				double norm = sqrt(dir[0]*dir[0]+dir[1]*dir[1]+dir[2]*dir[2]);
+				double sum = 0;
+				for(int64_t ww=1; ww*norm <= rmax; ww++) {
+					sum += ww*norm*wrapSample3D(mag.data(), N, ww*dir[0],
+							ww*dir[1], ww*dir[2]);
+				}
+				sig[rr*P+jj] = sum*norm;
+			}
+		}
+	});
+	return sig;
+}
+
+/**
+ * @brief Bilinearly interpolates a pseudo-polar signature in an arbitrary
+ * direction. Signatures of real images are symmetric (dir and -dir are the
+ * same) so the direction need not point into the positive half of a face.
+ *
+ * @param sig Signature from pseudoPolarSignature
+ * @param P Number of slopes along each side of a face
+ * @param dir Direction to sample
+ *
+ * @return Interpolated signature
+ */
+static double pseudoPolarAt(const std::vector<double>& sig, int64_t P,
+		const Vector3d& dir)
+{
+	int64_t face = 0;
+	for(int64_t dd=1; dd<3; dd++) {
+		if(fabs(dir[dd]) > fabs(dir[face]))
+			face = dd;
+	}
+	int64_t oa = face == 0 ? 1 : 0;
+	int64_t ob = face == 2 ? 1 : 2;
+
+	double a = (dir[oa]/dir[face]+1)*(P-1)/2.;
+	double b = (dir[ob]/dir[face]+1)*(P-1)/2.;
+	int64_t a0 = clamp<int64_t>(0, P-2, (int64_t)a);
+	int64_t b0 = clamp<int64_t>(0, P-2, (int64_t)b);
+	double wa = a-a0;
+	double wb = b-b0;
+
+	const double* row0 = &sig[(face*P+a0)*P];
+	const double* row1 = &sig[(face*P+a0+1)*P];
+	return (1-wa)*((1-wb)*row0[b0] + wb*row0[b0+1]) +
+		wa*((1-wb)*row1[b0] + wb*row1[b0+1]);
+}
+
+/**
+ * @brief Estimates the rigid transform between two 3D volumes from their
+ * Fourier transforms, for use as the starting point of corReg3D or
+ * informationReg3D. Both images are downsampled to isotropic voxels and
+ * windowed, then the rotation is found by matching the angular signatures of
+ * their magnitude spectra (which don't depend on translation) sampled on the
+ * pseudo-polar grid, and the shift is found by phase correlation between the
+ * moving image and the rotated fixed image. This takes 4 FFTs, regardless of
+ * how large the initial misalignment is. The two volumes should have identical
+ * sampling and identical orientation.
+ *
+ * @param fixed Image which will be the target of registration.
+ * @param moving Image which will be rotated then shifted to match fixed.
+ * @param maxangle Largest rotation (in degrees, about each axis) to consider
+ * @param size Images are downsampled to at most this many voxels across their
+ * largest dimension
+ *
+ * @return Estimated rigid transform (RAS coordinates), in the same form as
+ * the output of corReg3D
+ */
+Rigid3DTrans fourierInit3D(ptr<const MRImage> fixed, ptr<const MRImage> moving,
+		double maxangle, size_t size)
+{
+	if(fixed->ndim() != 3 || moving->ndim() != 3)
+		throw INVALID_ARGUMENT("Fourier initialization requires 3D images");
+	if(!fixed->matchingOrient(moving, true, true))
+		throw INVALID_ARGUMENT("Input images have mismatching pixels in");
+	if(size < 4)
+		throw INVALID_ARGUMENT("Fourier initialization size must be at least 4");
+	TraceScope trace("init", "fourierInit3D");
+
+	/*
+	 * Downsample to isotropic voxels, so that rotations in index space are
+	 * rotations, and pad to a cube so frequency sampling is isotropic too
+	 */
+	double spacing = 0;
+	for(size_t dd=0; dd<3; dd++) {
+		spacing = std::max(spacing, fixed->spacing(dd));
+		spacing = std::max(spacing, fixed->dim(dd)*fixed->spacing(dd)/size);
+	}
+	auto dfix = smoothDownsample(fixed, spacing/2, spacing);
+	auto dmov = smoothDownsample(moving, spacing/2, spacing);
+
+	int64_t N = 0;
+	for(size_t dd=0; dd<3; dd++)
+		N = std::max<int64_t>(N, round2(2*dmov->dim(dd)));
+	int64_t P = N/2;
+
+	auto wfix = dPtrCast<MRImage>(dfix->copy());
+	auto wmov = dPtrCast<MRImage>(dmov->copy());
+	taperWindow(wfix);
+	taperWindow(wmov);
+	auto ffix = paddedFFT(wfix, N);
+	auto fmov = paddedFFT(wmov, N);
+
+	/*
+	 * Rotation: moving(R(u-c)+c+s) = fixed(u) means |Fm|(Rk) = |Ff|(k), so
+	 * search for R maximizing the correlation between sig_f(d) and
+	 * sig_m(Rd). Each ray is weighted by the solid angle it covers.
+	 */
+	std::vector<double> mag(N*N*N);
+	for(size_t ii=0; ii<mag.size(); ii++)
+		mag[ii] = abs(ffix[ii]);
+	auto fsig = pseudoPolarSignature(mag, N, P);
+	for(size_t ii=0; ii<mag.size(); ii++)
+		mag[ii] = abs(fmov[ii]);
+	auto msig = pseudoPolarSignature(mag, N, P);
+
+	std::vector<Vector3d> dirs(3*P*P);
+	std::vector<double> weights(3*P*P);
+	for(int64_t rr=0; rr<3*P; rr++) {
+		int64_t face = rr/P;
+		int64_t oa = face == 0 ? 1 : 0;
+		int64_t ob = face == 2 ? 1 : 2;
+		for(int64_t jj=0; jj<P; jj++) {
+			Vector3d dir;
+			dir[face] = 1;
+			dir[oa] = -1+2.*(rr%P)/(P-1.);
+			dir[ob] = -1+2.*jj/(P-1.);
+			weights[rr*P+jj] = pow(dir.squaredNorm(), -1.5);
+			dirs[rr*P+jj] = dir.normalized();
+		}
+	}
+
+	// weighted correlation between fixed and rotated moving signatures
+	auto score = [&](const Vector3d& angles)
+	{
+		Matrix3d R;
+		R = AngleAxisd(degToRad(angles[0]), Vector3d::UnitX())*
+			AngleAxisd(degToRad(angles[1]), Vector3d::UnitY())*
+			AngleAxisd(degToRad(angles[2]), Vector3d::UnitZ());
+		double sw = 0, sf = 0, sm = 0, sff = 0, smm = 0, sfm = 0;
+		for(size_t ii=0; ii<dirs.size(); ii++) {
+			double f = fsig[ii];
+			double m = pseudoPolarAt(msig, P, R*dirs[ii]);
+			double w = weights[ii];
+			sw += w;
+			sf += w*f;
+			sm += w*m;
+			sff += w*f*f;
+			smm += w*m*m;
+			sfm += w*f*m;
+		}
+		double cov = sfm/sw - sf*sm/(sw*sw);
+		double vf = sff/sw - sf*sf/(sw*sw);
+		double vm = smm/sw - sm*sm/(sw*sw);
+		return vf > 0 && vm > 0 ? cov/sqrt(vf*vm) : 0;
+	};
+
+	/*
+	 * Coarse grid over the whole range, then repeatedly search the
+	 * neighborhood of the best rotation with half the step. Ties go to the
+	 * first candidate so the result doesn't depend on the number of threads.
+	 */
+	double step = std::max(maxangle/6, 0.5);
+	int64_t nstep = (int64_t)ceil(maxangle/step);
+	Vector3d best(0, 0, 0);
+	for(; step >= 0.25; step /= 2, nstep = 1) {
+		int64_t side = 2*nstep+1;
+		int64_t ncand = side*side*side;
+		Vector3d center = best;
+		size_t nchunk = numThreads();
+		std::vector<double> cscore(nchunk, -INFINITY);
+		std::vector<int64_t> cbest(nchunk, 0);
+		nchunk = parallelFor(0, ncand, [&](size_t chunk, size_t b, size_t e)
+		{
+			for(size_t cc=b; cc<e; cc++) {
+				Vector3d angles(-nstep+(int64_t)cc/(side*side),
+						-nstep+((int64_t)cc/side)%side,
+						-nstep+(int64_t)cc%side);
+				angles = center + angles*step;
+				double v = score(angles);
+				if(v > cscore[chunk]) {
+					cscore[chunk] = v;
+					cbest[chunk] = cc;
+				}
+			}
+		}, nchunk);
+
+		size_t bc = 0;
+		for(size_t cc=1; cc<nchunk; cc++) {
+			if(cscore[cc] > cscore[bc])
+				bc = cc;
+		}
+		int64_t cc = cbest[bc];
+		best = center + step*Vector3d(-nstep+cc/(side*side),
+				-nstep+(cc/side)%side, -nstep+cc%side);
+	}
+
+	/*
+	 * Translation: rotating the fixed image, g(v) = fixed(R^-1(v-c)+c), gives
+	 * moving(v) = g(v-s), so the phase correlation of moving and g peaks at s
+	 */
+	Rigid3DTrans rigid;
+	rigid.ras_coord = false;
+	for(size_t dd=0; dd<3; dd++) {
+		rigid.rotation[dd] = degToRad(best[dd]);
+		rigid.center[dd] = (dmov->dim(dd)-1.)/2.;
+	}
+	Matrix3d Rinv = rigid.rotMatrix().transpose();
+
+	auto rfix = dPtrCast<MRImage>(dfix->createAnother());
+	LinInterp3DView<double> interp(dfix, CONSTZERO);
+	int64_t index[3];
+	for(NDIter<double> it(rfix); !it.eof(); ++it) {
+		it.index(3, index);
+		Vector3d u = Rinv*(Vector3d(index[0], index[1], index[2]) -
+				rigid.center) + rigid.center;
+		it.set(interp(u[0], u[1], u[2]));
+	}
+	taperWindow(rfix);
+	auto frot = paddedFFT(rfix, N);
+
+	size_t NNN = N*N*N;
+	auto cross = createMRImage({(size_t)N, (size_t)N, (size_t)N}, CDOUBLE);
+	{
+		size_t ii = 0;
+		for(NDIter<cdouble_t> it(cross); !it.eof(); ++it, ++ii) {
+			cdouble_t v = fmov[ii]*conj(frot[ii]);
+			double m = abs(v);
+			it.set(m > 0 ? v/m : 0);
+		}
+	}
+	auto corr = fft_backward(cross, {(size_t)N, (size_t)N, (size_t)N});
+	std::vector<double> pc(NNN);
+	{
+		size_t ii = 0;
+		for(NDConstIter<cdouble_t> it(corr); !it.eof(); ++it, ++ii)
+			pc[ii] = (*it).real();
+	}
+
+	size_t peak = 0;
+	for(size_t ii=1; ii<NNN; ii++) {
+		if(pc[ii] > pc[peak])
+			peak = ii;
+	}
+
+	// sub-voxel peak from a parabola through the neighbors in each dimension
+	int64_t pind[3] = {(int64_t)peak/(N*N), ((int64_t)peak/N)%N,
+		(int64_t)peak%N};
+	int64_t stride[3] = {N*N, N, 1};
+	for(size_t dd=0; dd<3; dd++) {
+		size_t lo = peak + ((pind[dd]+N-1)%N - pind[dd])*stride[dd];
+		size_t hi = peak + ((pind[dd]+1)%N - pind[dd])*stride[dd];
+		double denom = pc[lo] - 2*pc[peak] + pc[hi];
+		double off = denom < 0 ? 0.5*(pc[lo]-pc[hi])/denom : 0;
+		double s = pind[dd] + off;
+		rigid.shift[dd] = s >= N/2 ? s-N : s;
+	}
+
+	// estimate in index coordinates
+	if(trace.on()) {
+		const char* rnames[3] = {"rotation_x", "rotation_y", "rotation_z"};
+		const char* snames[3] = {"shift_x", "shift_y", "shift_z"};
+		for(size_t dd=0; dd<3; dd++) {
+			trace.arg(rnames[dd], rigid.rotation[dd]);
+			trace.arg(snames[dd], rigid.shift[dd]);
+		}
+	}
+
+	rigid.toRASCoords(dmov);
+	return rigid;
+}
+
 /**
  * @brief Information based registration between two 3D volumes. note
  * that the two volumes should have identical sampling and identical
@@ -251,6 +1452,12 @@ Rigid3DTrans informationReg3D(shared_ptr<const MRImage> fixed,
  * @param beta Fraction of previous step size to consider for next step size.
  * Essentially this decides how quickly to reduce step sizes (note 1 would mean
  * NO reduction and would continue forever, 0 would do 1 step then stop)
+ * @param sampling Voxel sampling strategy for the fixed image (FULL, UNIFORM,
+ * STRATIFIED or MASK)
+ * @param sampfrac Fraction of fixed voxels to use when sampling
+ * @param resample Draw new samples at each iteration rather than once per
+ * level
+ * @param mask Mask to sample from (required for MASK sampling)
  *
  * @return parameters of bspline
  */
@@ -258,28 +1465,15 @@ ptr<MRImage> infoDistCor(ptr<const MRImage> infixed, ptr<const MRImage> inmoving
 		bool otsu, int dir, double bspace, double jac, double tps,
 		const std::vector<double>& sigmas,
 		size_t nbins, size_t binradius, string metric,
-		size_t hist, double stopx, double beta)
+		size_t hist, double stopx, double beta, string sampling,
+		double sampfrac, bool resample, ptr<const MRImage> mask)
 {
-	using namespace std::placeholders;
-	using std::bind;
 	size_t pp;
 
 	// make sure the input image has matching properties
 	if(!infixed->matchingOrient(inmoving, true, true))
 		throw INVALID_ARGUMENT("Input images have mismatching pixels in");
 
-	// Create Distortion Correction Computer
-	DistCorrInfoComp comp(true);
-	comp.setBins(nbins, binradius);
-
-	if(metric == "MI")
-		comp.m_metric = METRIC_MI;
-	else if(metric == "NMI")
-		comp.m_metric = METRIC_NMI;
-	else if(metric == "VI") {
-		comp.m_metric = METRIC_VI;
-	}
-
 	// CREATE MASK
 
 	ptr<MRImage> mmask, fmask;
@@ -297,66 +1491,106 @@ ptr<MRImage> infoDistCor(ptr<const MRImage> infixed, ptr<const MRImage> inmoving
 		moving = dPtrCast<MRImage>(inmoving->copy());
 	}
 
-	comp.m_jac_reg = jac;
-	comp.m_tps_reg = tps;
+	// Create Distortion Correction Computer
+	auto setup = [&](DistCorrInfoComp& comp)
+	{
+		comp.setBins(nbins, binradius);
+		comp.setSampling(parseSampleMode(sampling), sampfrac, resample, mask);
+
+		if(metric == "MI")
+			comp.m_metric = METRIC_MI;
+		else if(metric == "NMI")
+			comp.m_metric = METRIC_NMI;
+		else if(metric == "VI") {
+			comp.m_metric = METRIC_VI;
+		}
 
-	// Need to provide gridding for bspline image
-	comp.setFixed(fixed);
-	comp.initializeKnots(bspace);
+		comp.m_jac_reg = jac;
+		comp.m_tps_reg = tps;
 
-	// create value and gradient functions
-	auto vfunc = bind(&DistCorrInfoComp::value, &comp, _1, _2);
-	auto vgfunc = bind(&DistCorrInfoComp::valueGrad, &comp, _1, _2, _3);
-	auto gfunc = bind(&DistCorrInfoComp::grad, &comp, _1, _2);
+		// Need to provide gridding for bspline image
+		comp.setFixed(fixed);
+		comp.initializeKnots(bspace);
+	};
+
+	DistCorrInfoComp comp(true);
+	setup(comp);
+
+	// copies for speculative line search trials, sharing comp's basis cache.
+	// These are set up along with comp so that they draw the same samples.
+	std::vector<ptr<DistCorrInfoComp>> copies;
+	for(size_t tt=1; tt<lineSearchCopies(resample ? 1 : LINESEARCH_TRIALS);
+			tt++) {
+		copies.push_back(std::make_shared<DistCorrInfoComp>(true));
+		copies.back()->shareBasis(comp);
+		setup(*copies.back());
+	}
+
+	// smooth and downsample input images (spacing ~ FWHM)
+	ImagePyramid fixpyr(fixed, sigmas, 2.355);
+	ImagePyramid movpyr(moving, sigmas, 2.355);
+	std::shared_ptr<ImagePyramid> fmaskpyr, mmaskpyr;
+	if(otsu) {
+		fmaskpyr.reset(new ImagePyramid(fmask, sigmas, 2.355));
+		mmaskpyr.reset(new ImagePyramid(mmask, sigmas, 2.355));
+	}
 
 	for(size_t ii=0; ii<sigmas.size(); ii++) {
-		// smooth and downsample input images
 		cerr << "Sigma: " << sigmas[ii] << endl;
-		auto sm_fixed = smoothDownsample(fixed, sigmas[ii], sigmas[ii]*2.355);
-		auto sm_moving = smoothDownsample(moving, sigmas[ii], sigmas[ii]*2.355);
+		TraceScope trace("level", "infoDistCor");
+		traceLevel(trace, {&fixpyr, &movpyr, fmaskpyr.get(), mmaskpyr.get()},
+				ii);
+		ptr<const MRImage> sm_fixed = fixpyr.level(ii);
+		ptr<const MRImage> sm_moving = movpyr.level(ii);
 
-		// Threshold
+		// Threshold (pyramid levels are read-only, so work on copies)
 		if(otsu) {
-			auto sm_mmask = smoothDownsample(mmask, sigmas[ii], sigmas[ii]*2.355);
-			auto sm_fmask = smoothDownsample(fmask, sigmas[ii], sigmas[ii]*2.355);
-			FlatIter<double> mmaskit(sm_mmask);
-			FlatIter<double> fmaskit(sm_fmask);
-			FlatIter<double> mit(sm_moving);
-			FlatIter<double> fit(sm_fixed);
+			auto th_fixed = dPtrCast<MRImage>(sm_fixed->copy());
+			auto th_moving = dPtrCast<MRImage>(sm_moving->copy());
+			FlatConstIter<double> mmaskit(mmaskpyr->level(ii));
+			FlatConstIter<double> fmaskit(fmaskpyr->level(ii));
+			FlatIter<double> mit(th_moving);
+			FlatIter<double> fit(th_fixed);
 			for(; !mit.eof(); ++mmaskit, ++fmaskit, ++mit, ++fit) {
-				if(mmaskit.get() < 0.01)
+				if(*mmaskit < 0.01)
 					mit.set(0);
-				if(fmaskit.get() < 0.01)
+				if(*fmaskit < 0.01)
 					fit.set(0);
 			}
+			sm_fixed = th_fixed;
+			sm_moving = th_moving;
 		}
 
 		comp.setFixed(sm_fixed);
 		comp.setMoving(sm_moving, dir);
 
-		// initialize optimizer
-		LBFGSOpt opt(comp.nparam(), vfunc, gfunc, vgfunc);
-		opt.stop_Its = 10000;
-		opt.stop_G = 0;
-		opt.stop_F = 0;
-		opt.stop_X = stopx;
-		opt.opt_histsize = hist;
-		opt.opt_ls_beta = beta;
+		// only the copies used at this level need the moving image
+		size_t ntrials = lineSearchTrials(sm_fixed, resample);
+		std::vector<ptr<DistCorrInfoComp>> extra;
+		for(size_t tt=0; tt<copies.size(); tt++) {
+			copies[tt]->setFixed(sm_fixed);
+			if(tt+1 < lineSearchCopies(ntrials)) {
+				copies[tt]->setMoving(sm_moving, dir);
+				extra.push_back(copies[tt]);
+			}
+		}
 
 		// grab the parameters from the previous iteration (or initialized)
+		VectorXd x(comp.nparam());
 		pp = 0;
 		for(FlatConstIter<double> pit(comp.getDeform()); !pit.eof(); ++pit, ++pp)
-			opt.state_x[pp] = *pit;
+			x[pp] = *pit;
 
 		// run the optimizer
-		StopReason stopr = opt.optimize();
+		StopReason stopr = optimizeMetric(comp, extra, ntrials, x, stopx, trace,
+				hist, beta);
 		cerr << Optimizer::explainStop(stopr) << endl;
 
 		// set values from parameters, and convert to RAS coordinate so that no
 		// matter the sampling after smoothing the values remain
 		pp = 0;
 		for(FlatIter<double> pit(comp.getDeform()); !pit.eof(); ++pit, ++pp)
-			pit.set(opt.state_x[pp]);
+			pit.set(x[pp]);
 
 	}
 
@@ -513,10 +1747,512 @@ int distcorDerivTest(double step, double tol,
 	return 0;
 }
 
-/*********************************************************************
- * Registration Class Implementations
- ********************************************************************/
-
+/*********************************************************************
+ * Registration Class Implementations
+ ********************************************************************/
+
+/*********************
+ * Image Pyramid
+ *********************/
+
+/**
+ * @brief Builds all the levels of the pyramid.
+ *
+ * @param img Input image
+ * @param sigmas Standard deviation of smoothing (in physical units) for
+ * each level, in any order (levels are returned in this order)
+ * @param spacefactor Output spacing of each level is sigma*spacefactor
+ * (but never finer than the input)
+ * @param derivs Also compute the derivative images (computeDerivs)
+ */
+ImagePyramid::ImagePyramid(ptr<const MRImage> img,
+		const std::vector<double>& sigmas, double spacefactor, bool derivs)
+	: m_sigmas(sigmas), m_levels(sigmas.size()), m_times(sigmas.size(), 0)
+{
+	// build from the finest level to the coarsest
+	std::vector<size_t> order(sigmas.size());
+	for(size_t ii=0; ii<order.size(); ii++)
+		order[ii] = ii;
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+	{
+		return sigmas[a] < sigmas[b];
+	});
+
+	bool isotropic = true;
+	for(size_t dd=1; dd<img->ndim(); dd++) {
+		if(img->spacing(dd) != img->spacing(0))
+			isotropic = false;
+	}
+
+	ptr<const MRImage> prev = img;
+	double prevsigma = 0;
+	for(size_t ii=0; ii<order.size(); ii++) {
+		double sigma = sigmas[order[ii]];
+		if(sigma < 0)
+			throw INVALID_ARGUMENT("Pyramid sigmas must be >= 0");
+		TraceScope trace("smooth", "ImagePyramid");
+		trace.arg("sigma", sigma);
+		double start = traceClock();
+
+		if(ii > 0 && sigma == prevsigma) {
+			// repeated level
+			m_levels[order[ii]] = m_levels[order[ii-1]];
+		} else if(ii == 0 && sigma == 0 && isotropic) {
+			// no smoothing or resampling needed
+			m_levels[order[ii]] = dPtrCast<MRImage>(img->copyCast(FLOAT64));
+		} else {
+			// Gaussians compose, so only smooth by the difference
+			double dsigma = sqrt(sigma*sigma - prevsigma*prevsigma);
+			m_levels[order[ii]] = smoothDownsample(prev, dsigma,
+					sigma*spacefactor);
+		}
+
+		prev = m_levels[order[ii]];
+		prevsigma = sigma;
+		m_times[order[ii]] = traceClock()-start;
+	}
+
+	if(derivs)
+		computeDerivs();
+}
+
+/**
+ * @brief Computes the derivative (in every direction) of each level, if
+ * they have not already been computed
+ */
+void ImagePyramid::computeDerivs()
+{
+	if(!m_derivs.empty())
+		return;
+
+	m_derivs.resize(m_levels.size());
+	parallelFor(0, m_levels.size(), [&](size_t, size_t l0, size_t l1)
+	{
+		for(size_t ii=l0; ii<l1; ii++) {
+			TraceScope trace("derivative", "ImagePyramid");
+			double start = traceClock();
+			m_derivs[ii] = dPtrCast<MRImage>(derivative(m_levels[ii]));
+			m_times[ii] += traceClock()-start;
+		}
+	});
+}
+
+/*********************
+ * Voxel Sampling
+ ********************/
+
+/**
+ * @brief Picks n distinct values from [0, N) uniformly at random (Floyd's
+ * algorithm) and returns them in increasing order.
+ *
+ * @param N Number of values to choose from
+ * @param n Number of values to choose
+ * @param rng Random number generator
+ * @param out Output sorted values
+ */
+static void sampleSorted(int64_t N, int64_t n, std::mt19937& rng,
+		vector<int64_t>& out)
+{
+	vector<bool> taken(N, false);
+	out.clear();
+	out.reserve(n);
+	for(int64_t jj = N-n; jj < N; jj++) {
+		std::uniform_int_distribution<int64_t> dist(0, jj);
+		int64_t tt = dist(rng);
+		if(taken[tt])
+			tt = jj;
+		taken[tt] = true;
+		out.push_back(tt);
+	}
+	std::sort(out.begin(), out.end());
+}
+
+VoxelSampler::VoxelSampler() : m_mode(SAMPLE_FULL), m_frac(1),
+	m_resample(false)
+{
+	m_dim[0] = m_dim[1] = m_dim[2] = 1;
+}
+
+/**
+ * @brief Sets the sampling strategy. This does not draw new samples, call
+ * sample() after changing the strategy.
+ *
+ * @param mode Sampling mode
+ * @param frac Fraction of voxels to use (of the voxels in the mask for
+ * SAMPLE_MASK), must be in (0, 1]
+ * @param resample Draw a new set of samples for each optimizer iteration
+ * rather than using the same samples throughout
+ * @param mask Mask to restrict sampling to (only used by SAMPLE_MASK).
+ */
+void VoxelSampler::setup(SampleMode mode, double frac, bool resample,
+		ptr<const MRImage> mask)
+{
+	if(frac <= 0 || frac > 1)
+		throw INVALID_ARGUMENT("Sampling fraction must be in (0, 1]");
+	if(mode == SAMPLE_MASK && !mask)
+		throw INVALID_ARGUMENT("Mask sampling requires a mask image");
+	if(mask && mask->ndim() < 3)
+		throw INVALID_ARGUMENT("Sampling mask must be 3D");
+
+	m_mode = mode;
+	m_frac = frac;
+	m_resample = resample;
+	m_mask = mask;
+	m_maskimg.reset();
+	m_inside.clear();
+}
+
+/**
+ * @brief Draws a new set of samples from the grid of img
+ *
+ * @param img Image to draw samples from
+ */
+void VoxelSampler::sample(ptr<const MRImage> img)
+{
+	if(img->ndim() < 3)
+		throw INVALID_ARGUMENT("Voxel sampling requires a 3D image");
+
+	for(size_t dd=0; dd<3; dd++)
+		m_dim[dd] = img->dim(dd);
+	int64_t nvox = m_dim[0]*m_dim[1]*m_dim[2];
+
+	m_samples.clear();
+	if(m_mode == SAMPLE_UNIFORM) {
+		int64_t nsamp = max<int64_t>(1, round(m_frac*nvox));
+		sampleSorted(nvox, nsamp, m_rng, m_samples);
+	} else if(m_mode == SAMPLE_STRATIFIED) {
+		// Split the grid into cells with ~1/frac voxels then take one random
+		// voxel from each cell
+		double step = cbrt(1./m_frac);
+		int64_t ncell[3];
+		for(size_t dd=0; dd<3; dd++)
+			ncell[dd] = max<int64_t>(1, round(m_dim[dd]/step));
+
+		int64_t lo[3], hi[3], ind[3];
+		m_samples.reserve(ncell[0]*ncell[1]*ncell[2]);
+		for(int64_t cx = 0; cx < ncell[0]; cx++) {
+			lo[0] = cx*m_dim[0]/ncell[0];
+			hi[0] = (cx+1)*m_dim[0]/ncell[0];
+			for(int64_t cy = 0; cy < ncell[1]; cy++) {
+				lo[1] = cy*m_dim[1]/ncell[1];
+				hi[1] = (cy+1)*m_dim[1]/ncell[1];
+				for(int64_t cz = 0; cz < ncell[2]; cz++) {
+					lo[2] = cz*m_dim[2]/ncell[2];
+					hi[2] = (cz+1)*m_dim[2]/ncell[2];
+					for(size_t dd=0; dd<3; dd++) {
+						std::uniform_int_distribution<int64_t> dist(lo[dd],
+								hi[dd]-1);
+						ind[dd] = dist(m_rng);
+					}
+					m_samples.push_back((ind[0]*m_dim[1]+ind[1])*m_dim[2]+
+							ind[2]);
+				}
+			}
+		}
+		std::sort(m_samples.begin(), m_samples.end());
+	} else if(m_mode == SAMPLE_MASK) {
+		// Find voxels inside the mask (by physical location), only when the
+		// image changes
+		if(m_maskimg != img) {
+			NDConstView<double> mask_vw(m_mask);
+			int64_t ind[3], mind[3];
+			double pt[3], cind[3];
+			m_inside.clear();
+			for(int64_t lin = 0; lin < nvox; lin++) {
+				index(lin, ind);
+				img->indexToPoint(3, ind, pt);
+				m_mask->pointToIndex(3, pt, cind);
+
+				bool inbounds = true;
+				for(size_t dd=0; dd<3; dd++) {
+					mind[dd] = round(cind[dd]);
+					inbounds &= mind[dd] >= 0 && mind[dd] < m_mask->dim(dd);
+				}
+				if(inbounds && mask_vw.get(3, mind) > 0)
+					m_inside.push_back(lin);
+			}
+			m_maskimg = img;
+		}
+
+		if(m_inside.empty())
+			throw RUNTIME_ERROR("Sampling mask does not overlap image");
+
+		int64_t nsamp = max<int64_t>(1, round(m_frac*m_inside.size()));
+		if(nsamp == (int64_t)m_inside.size()) {
+			m_samples = m_inside;
+		} else {
+			sampleSorted(m_inside.size(), nsamp, m_rng, m_samples);
+			for(size_t ii=0; ii<m_samples.size(); ii++)
+				m_samples[ii] = m_inside[m_samples[ii]];
+		}
+	}
+}
+
+/**
+ * @brief Number of voxels in the current sample
+ */
+int64_t VoxelSampler::size() const
+{
+	if(m_mode == SAMPLE_FULL)
+		return m_dim[0]*m_dim[1]*m_dim[2];
+	return m_samples.size();
+}
+
+/**
+ * @brief Finds the positions [b, e) in the sample whose voxels fall in planes
+ * [x0, x1) of the first dimension.
+ *
+ * @param x0 First plane
+ * @param x1 One past the last plane
+ * @param b Output first position
+ * @param e Output one past the last position
+ */
+void VoxelSampler::slab(int64_t x0, int64_t x1, int64_t& b, int64_t& e) const
+{
+	int64_t plane = m_dim[1]*m_dim[2];
+	if(m_mode == SAMPLE_FULL) {
+		b = x0*plane;
+		e = x1*plane;
+	} else {
+		b = std::lower_bound(m_samples.begin(), m_samples.end(), x0*plane) -
+			m_samples.begin();
+		e = std::lower_bound(m_samples.begin()+b, m_samples.end(), x1*plane) -
+			m_samples.begin();
+	}
+}
+
+/*********************
+ * B-Spline Basis Cache
+ ********************/
+
+/**
+ * @brief Constructor
+ *
+ * @param budget Maximum memory (bytes) to use for the cache
+ */
+BSplineBasisCache::BSplineBasisCache(size_t budget) : m_budget(budget),
+	m_valid(false), m_tried(false)
+{
+}
+
+/**
+ * @brief Drops the cached rows
+ */
+void BSplineBasisCache::invalidate()
+{
+	m_valid = false;
+	m_tried = false;
+	m_rows.clear();
+	m_knots.clear();
+	m_w.clear();
+	m_dw.clear();
+	m_rows.shrink_to_fit();
+	m_knots.shrink_to_fit();
+	m_w.shrink_to_fit();
+	m_dw.shrink_to_fit();
+}
+
+/**
+ * @brief Computes the basis at a point. Out of bounds knots are clamped
+ * (as BSplineView does with ZEROFLUX), so knots may be repeated, and knots
+ * with zero weight and derivative are skipped.
+ *
+ * @param deform Knot image
+ * @param dcind Continuous index in deform
+ * @param dir Direction of the derivative
+ * @param knots Output linear knot indices (MAXSUPPORT long)
+ * @param w Output basis values (MAXSUPPORT long)
+ * @param dw Output derivative of basis in dir (MAXSUPPORT long)
+ *
+ * @return Number of entries filled
+ */
+int BSplineBasisCache::compute(const ptr<const MRImage>& deform,
+		const double* dcind, int dir, int64_t* knots, double* w, double* dw)
+{
+	const size_t* dim = deform->dim();
+
+	// separable weights, clamped knot indices
+	double wd[3][5];
+	double dwd[3][5];
+	int64_t kd[3][5];
+	for(size_t dd=0; dd<3; dd++) {
+		int64_t center = round(dcind[dd]);
+		for(int ii=0; ii<5; ii++) {
+			int64_t knot = center+ii-2;
+			double dist = knot-dcind[dd];
+			wd[dd][ii] = B3kern(dist);
+			if(dd == dir)
+				dwd[dd][ii] = -dB3kern(dist)/deform->spacing(dd);
+			else
+				dwd[dd][ii] = wd[dd][ii];
+			kd[dd][ii] = clamp<int64_t>(0, dim[dd]-1, knot);
+		}
+	}
+
+	int n = 0;
+	for(int ii=0; ii<5; ii++) {
+		for(int jj=0; jj<5; jj++) {
+			for(int kk=0; kk<5; kk++) {
+				double ww = wd[0][ii]*wd[1][jj]*wd[2][kk];
+				double dww = dwd[0][ii]*dwd[1][jj]*dwd[2][kk];
+				if(ww == 0 && dww == 0)
+					continue;
+				knots[n] = (kd[0][ii]*dim[1]+kd[1][jj])*dim[2]+kd[2][kk];
+				w[n] = ww;
+				dw[n] = dww;
+				n++;
+			}
+		}
+	}
+	return n;
+}
+
+/**
+ * @brief Whether two 3D images have exactly the same size, spacing, origin
+ * and direction
+ */
+static bool sameGrid(ptr<const MRImage> a, ptr<const MRImage> b)
+{
+	if(a == b)
+		return true;
+	if(!a || !b || a->ndim() != b->ndim())
+		return false;
+	for(size_t dd=0; dd<a->ndim(); dd++) {
+		if(a->dim(dd) != b->dim(dd) || a->spacing(dd) != b->spacing(dd) ||
+				a->origin(dd) != b->origin(dd))
+			return false;
+	}
+	return a->getDirection() == b->getDirection();
+}
+
+/**
+ * @brief Sets the geometry and builds the rows for every sample if they are
+ * not already cached and fit in the budget. If the rows didn't fit, later
+ * calls with the same geometry return false without trying again. The knot
+ * image is compared by geometry, so computers with their own (identically
+ * gridded) knot images can share a cache and call this concurrently.
+ *
+ * @param grid Image whose voxels are sampled (only geometry is used)
+ * @param deform Knot image (only geometry is used)
+ * @param dir Direction of the derivative
+ * @param sampler Voxels to build rows for
+ *
+ * @return true if rows are cached
+ */
+bool BSplineBasisCache::update(ptr<const MRImage> grid,
+		ptr<const MRImage> deform, int dir, const VoxelSampler& sampler)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if(m_tried && dir == m_dir && sameGrid(deform, m_deform))
+		return m_valid;
+
+	invalidate();
+	m_deform = deform;
+	m_dir = dir;
+	m_tried = true;
+
+	// New samples every iteration would need new rows every iteration
+	if(sampler.resample())
+		return false;
+
+	// Most points are supported by 4 knots per dimension
+	const size_t entbytes = sizeof(int32_t)+2*sizeof(double);
+	int64_t nsamp = sampler.size();
+	size_t bytes = (nsamp+1)*sizeof(int64_t) + nsamp*64*entbytes;
+	if(bytes > m_budget || deform->elements() > INT32_MAX)
+		return false;
+	size_t maxent = (m_budget - (nsamp+1)*sizeof(int64_t))/entbytes;
+
+	// Each thread builds the rows of a slab of the grid, then the slabs are
+	// concatenated in order. The entries built so far (by all threads) are
+	// counted, so the build stops as soon as it exceeds the budget.
+	size_t nchunk = std::min<size_t>(numThreads(), grid->dim(0));
+	vector<vector<int32_t>> knotbuf(nchunk);
+	vector<vector<double>> wbuf(nchunk);
+	vector<vector<double>> dwbuf(nchunk);
+	std::atomic<size_t> nent(0);
+	m_rows.assign(nsamp+1, 0);
+	nchunk = parallelFor(0, grid->dim(0), [&](size_t chunk, size_t x0,
+				size_t x1)
+	{
+		int64_t knots[MAXSUPPORT];
+		double w[MAXSUPPORT];
+		double dw[MAXSUPPORT];
+		double fcind[3], dcind[3], pt[3];
+
+		int64_t s0, s1;
+		sampler.slab(x0, x1, s0, s1);
+		size_t guess = std::min<size_t>((s1-s0)*64, maxent);
+		knotbuf[chunk].reserve(guess);
+		wbuf[chunk].reserve(guess);
+		dwbuf[chunk].reserve(guess);
+		for(int64_t ss = s0; ss < s1; ss++) {
+			sampler.index(sampler.at(ss), fcind);
+			grid->indexToPoint(3, fcind, pt);
+			deform->pointToIndex(3, pt, dcind);
+			int n = compute(deform, dcind, dir, knots, w, dw);
+			if(nent.fetch_add(n) + n > maxent)
+				return;
+
+			knotbuf[chunk].insert(knotbuf[chunk].end(), knots, knots+n);
+			wbuf[chunk].insert(wbuf[chunk].end(), w, w+n);
+			dwbuf[chunk].insert(dwbuf[chunk].end(), dw, dw+n);
+			m_rows[ss+1] = n;
+		}
+	}, nchunk);
+
+	if(nent > maxent) {
+		invalidate();
+		m_tried = true;
+		return false;
+	}
+	for(int64_t ss = 0; ss < nsamp; ss++)
+		m_rows[ss+1] += m_rows[ss];
+
+	m_knots.reserve(m_rows[nsamp]);
+	m_w.reserve(m_rows[nsamp]);
+	m_dw.reserve(m_rows[nsamp]);
+	for(size_t cc = 0; cc < nchunk; cc++) {
+		m_knots.insert(m_knots.end(), knotbuf[cc].begin(), knotbuf[cc].end());
+		m_w.insert(m_w.end(), wbuf[cc].begin(), wbuf[cc].end());
+		m_dw.insert(m_dw.end(), dwbuf[cc].begin(), dwbuf[cc].end());
+		vector<int32_t>().swap(knotbuf[cc]);
+		vector<double>().swap(wbuf[cc]);
+		vector<double>().swap(dwbuf[cc]);
+	}
+
+	m_valid = true;
+	return true;
+}
+
+/**
+ * @brief Fills the basis of a sample, from the cache if it has been built
+ * otherwise by computing it at dcind.
+ *
+ * @param ss Position in the sample
+ * @param dcind Continuous index of the sample in the knot image (only used
+ * when rows are not cached)
+ * @param knots Output linear knot indices (MAXSUPPORT long)
+ * @param w Output basis values (MAXSUPPORT long)
+ * @param dw Output derivative of basis in dir (MAXSUPPORT long)
+ *
+ * @return Number of entries filled
+ */
+int BSplineBasisCache::basis(int64_t ss, const double* dcind,
+		int64_t* knots, double* w, double* dw) const
+{
+	if(!m_valid)
+		return compute(m_deform, dcind, m_dir, knots, w, dw);
+
+	int n = 0;
+	for(int64_t kk = m_rows[ss]; kk < m_rows[ss+1]; kk++, n++) {
+		knots[n] = m_knots[kk];
+		w[n] = m_w[kk];
+		dw[n] = m_dw[kk];
+	}
+	return n;
+}
+
 /*********************
  * Correlation
  ********************/
@@ -536,59 +2272,105 @@ RigidCorrComp::RigidCorrComp(bool compdiff) : m_compdiff(compdiff)
 }
 
 /**
- * @brief Computes the gradient and value of the correlation.
+ * @brief Trilinear interpolation in a flat 3D array with clamped (ZEROFLUX)
+ * boundary conditions. Identical to LinInterp3DView<double> but without the
+ * per-sample type dispatch.
  *
- * The basic gyst of this function is to compute dC/dP where p is a parameter.
- * dC/dP = f*dg/dP = f*dg/dx*dx/dP
- * where x is a 3d coordinate so that dg/dx is the gradient of the image
- * and dx/dP is the jacobian of the coordinate system with respect to a
- * change in parameter. For shift dx/dP is a diagonal matrix, for rotation
- * dx/dR = derivative of rotation matrix wrt to a paremeter * (x-c) where
- * x-c is the vector from the center of the image to the coodinate
+ * @param img Image data, with the last dimension fastest
+ * @param dim Size of the image
+ * @param x Index in dimension 0
+ * @param y Index in dimension 1
+ * @param z Index in dimension 2
  *
- * @param x Paramters (Rx, Ry, Rz, Sx, Sy, Sz).
- * @param v Value at the given rotation
- * @param g Gradient at the given rotation
+ * @return Interpolated value
+ */
+inline
+double linSample3D(const double* img, const int64_t* dim,
+		double x, double y, double z)
+{
+	double fx = floor(x);
+	double fy = floor(y);
+	double fz = floor(z);
+	double wx = x-fx;
+	double wy = y-fy;
+	double wz = z-fz;
+	int64_t x0 = clamp<int64_t>(0, dim[0]-1, (int64_t)fx);
+	int64_t y0 = clamp<int64_t>(0, dim[1]-1, (int64_t)fy);
+	int64_t z0 = clamp<int64_t>(0, dim[2]-1, (int64_t)fz);
+	int64_t x1 = clamp<int64_t>(0, dim[0]-1, (int64_t)fx+1);
+	int64_t y1 = clamp<int64_t>(0, dim[1]-1, (int64_t)fy+1);
+	int64_t z1 = clamp<int64_t>(0, dim[2]-1, (int64_t)fz+1);
+
+	const double* r00 = &img[(x0*dim[1]+y0)*dim[2]];
+	const double* r01 = &img[(x0*dim[1]+y1)*dim[2]];
+	const double* r10 = &img[(x1*dim[1]+y0)*dim[2]];
+	const double* r11 = &img[(x1*dim[1]+y1)*dim[2]];
+
+	return (1-wx)*((1-wy)*((1-wz)*r00[z0] + wz*r00[z1]) +
+				wy*((1-wz)*r01[z0] + wz*r01[z1])) +
+		wx*((1-wy)*((1-wz)*r10[z0] + wz*r10[z1]) +
+				wy*((1-wz)*r11[z0] + wz*r11[z1]));
+}
+
+/**
+ * @brief Evaluates the Parzen window weights B3kern(x0+ii, r) and (if dw is
+ * not NULL) dB3kern(x0+ii, r) for ii in [0, n). This uses the branch-free
+ * form of the cubic B-spline, (max(0,2-|u|)^3 - 4*max(0,1-|u|)^3)/6, so that
+ * the loops vectorize.
  *
- * @return 0 if successful
+ * @param x0 Distance of the first bin from the center
+ * @param r Kernel radius
+ * @param n Number of weights
+ * @param w Output weights
+ * @param dw Output derivative weights (may be NULL)
  */
-int RigidCorrComp::valueGrad(const VectorXd& params,
-		double& val, VectorXd& grad)
+inline
+void parzenWeights(double x0, double r, int n, double* w, double* dw)
 {
-	if(!m_fixed) throw INVALID_ARGUMENT("ERROR must set fixed image before "
-				"computing value.");
-	if(!m_moving) throw INVALID_ARGUMENT("ERROR must set moving image before "
-				"computing value.");
-	if(!m_moving->matchingOrient(m_fixed, true, true)) {
-		throw INVALID_ARGUMENT("Moving and Fixed Images must have the same "
-				"orientation and gred!");
+	double s = 2/r;
+	for(int ii=0; ii<n; ii++) {
+		double a = fabs((x0+ii)*s);
+		double p2 = std::max(0., 2-a);
+		double p1 = std::max(0., 1-a);
+		w[ii] = (p2*p2*p2 - 4*p1*p1*p1)*s/6;
+	}
+
+	if(dw) {
+		for(int ii=0; ii<n; ii++) {
+			double u = (x0+ii)*s;
+			double a = fabs(u);
+			double p2 = std::max(0., 2-a);
+			double p1 = std::max(0., 1-a);
+			double sgn = (u > 0) - (u < 0);
+			dw[ii] = sgn*(2*p1*p1 - p2*p2/2)*s*s;
+		}
 	}
+}
 
+/**
+ * @brief Computes the transform shared by the RigidCorrComp passes from the
+ * parameters: the inverse rotation, the shift in index space and the
+ * matrices M_k = dR/dR_k*R^-1, so that dv/dR_k = M_k*(v-s-c).
+ *
+ * @param params Paramters (Rx, Ry, Rz, Sx, Sy, Sz), degrees and mm
+ * @param moving Moving image (for the spacing)
+ * @param Rinv Output inverse rotation
+ * @param shift Output shift (index space)
+ * @param M Output rotation derivative matrices
+ */
+static void rigidCorrGeometry(const VectorXd& params,
+		ptr<const MRImage> moving, Matrix3d& Rinv, Vector3d& shift,
+		Matrix3d* M)
+{
 	// Degrees -> Radians, mm -> index
 	double rx = params[0]*M_PI/180.;
 	double ry = params[1]*M_PI/180.;
 	double rz = params[2]*M_PI/180.;
-	double sx = params[3]/m_moving->spacing(0);
-	double sy = params[4]/m_moving->spacing(1);
-	double sz = params[5]/m_moving->spacing(2);
-
-//#if defined DEBUG || defined VERYDEBUG
-	cerr << "VALGRAD Rotation: " << rx << ", " << ry << ", " << rz << ", Shift: "
-		<< sx << ", " << sy << ", " << sz << endl;
-//#endif
-
-	// Compute derivative Images (if debugging is enabled, otherwise just
-	// compute the gradient)
-	grad.setZero();
-	size_t count = 0;
-	double mov_sum = 0;
-	double fix_sum = 0;
-	double mov_ss = 0;
-	double fix_ss = 0;
-	double corr = 0;
+	double sx = params[3]/moving->spacing(0);
+	double sy = params[4]/moving->spacing(1);
+	double sz = params[5]/moving->spacing(2);
 
 	// Update Transform Matrix
-	Matrix3d Rinv;
 	Rinv(0, 0) = cos(ry)*cos(rz);;
 	Rinv(0, 1) = cos(rz)*sin(rx)*sin(ry)+cos(rx)*sin(rz);
 	Rinv(0, 2) = -cos(rx)*cos(rz)*sin(ry)+sin(rx)*sin(rz);
@@ -599,78 +2381,176 @@ int RigidCorrComp::valueGrad(const VectorXd& params,
 	Rinv(2, 1) = -cos(ry)*sin(rx);
 	Rinv(2, 2) = cos(rx)*cos(ry);
 
-	Vector3d ind;
-	Vector3d cind;
-	Vector3d shift(sx, sy, sz);
-	Eigen::Map<Vector3d> center(m_center);
+	shift = Vector3d(sx, sy, sz);
 
 	// dRigid/dRx, dRigid/dRy, dRigid/dRz = ddRx*(u-c), ddRy*(u-c) ...
-	Matrix3d ddRx, ddRy, ddRz;
-	ddRx <<0,0,0,cos(rx)*cos(rz)*sin(ry)-sin(rx)*sin(rz),
+	Matrix3d ddR[3];
+	ddR[0] <<0,0,0,cos(rx)*cos(rz)*sin(ry)-sin(rx)*sin(rz),
 		-(cos(rz)*sin(rx))-cos(rx)*sin(ry)*sin(rz),
 		-(cos(rx)*cos(ry)),cos(rz)*sin(rx)*sin(ry)+cos(rx)*sin(rz),
 		cos(rx)*cos(rz)-sin(rx)*sin(ry)*sin(rz),-(cos(ry)*sin(rx));
-	ddRy <<-(cos(rz)*sin(ry)),sin(ry)*sin(rz),cos(ry),cos(ry)*cos(rz)*sin(rx),
+	ddR[1] <<-(cos(rz)*sin(ry)),sin(ry)*sin(rz),cos(ry),cos(ry)*cos(rz)*sin(rx),
 		-(cos(ry)*sin(rx)*sin(rz)),sin(rx)*sin(ry),-(cos(rx)*cos(ry)*cos(rz)),
 		cos(rx)*cos(ry)*sin(rz),-(cos(rx)*sin(ry));
-	ddRz <<-(cos(ry)*sin(rz)),-(cos(ry)*cos(rz)),0,
+	ddR[2] <<-(cos(ry)*sin(rz)),-(cos(ry)*cos(rz)),0,
 		cos(rx)*cos(rz)-sin(rx)*sin(ry)*sin(rz),
 		-(cos(rz)*sin(rx)*sin(ry))-cos(rx)*sin(rz),0,
 		cos(rz)*sin(rx)+cos(rx)*sin(ry)*sin(rz),
 		cos(rx)*cos(rz)*sin(ry)-sin(rx)*sin(rz),0;
 
-	Vector3d gradG; //dg/dx, dg/dy, dg/dz
-	Matrix3d dR; //dg/dRx, dg/dRy, dg/dRz
-	Vector3d dgdR;
-
-	NDConstIter<double> mit(m_moving);
-	Vector3DConstIter<double> dmit(m_dmoving);
-	LinInterp3DView<double> fix_vw(m_fixed);
-	for(; !mit.eof() && !dmit.eof(); ++mit, ++dmit) {
-
-		mit.index(3, ind.array().data());
-
-		// u = c + R^-1(v - s - c)
-		// where u is the output index, v the input, c the center of rotation
-		// and s the shift
-		// cind = center + rInv*(ind-shift-center);
-		cind = Rinv*(ind-shift-center) + center;
-
-		// Here we compute dg(v(u,p))/dp, where g is the image, u is the
-		// coordinate in the fixed image, and p is the param.
-		// dg/dp = SUM_i dg/dv_i dv_i/dp, where v is the rotated coordinate, so
-		// dg/dv_i is the directional derivative in original space,
-		// dv_i/dp is the derivative of the rotated coordinate system with
-		// respect to a parameter
-		gradG[0] = dmit[0];
-		gradG[1] = dmit[1];
-		gradG[2] = dmit[2];
+	// u = c + R^-1(v - s - c), where u is the output index, v the input, c
+	// the center of rotation and s the shift. The rotated coordinate relative
+	// to the center is then cind-c = R^-1*w, with w = v-s-c, so
+	// dv/dR_k = ddR_k*R^-1*w = M_k*w
+	for(size_t kk=0; kk<3; kk++)
+		M[kk] = ddR[kk]*Rinv;
+}
 
-		dR.row(0) = ddRx*(cind-center);
-		dR.row(1) = ddRy*(cind-center);
-		dR.row(2) = ddRz*(cind-center);
+/**
+ * @brief Computes the sums needed for correlation and (if dograd is set) its
+ * gradient.
+ *
+ * The basic gyst of this function is to compute dC/dP where p is a parameter.
+ * dC/dP = f*dg/dP = f*dg/dx*dx/dP
+ * where x is a 3d coordinate so that dg/dx is the gradient of the image
+ * and dx/dP is the jacobian of the coordinate system with respect to a
+ * change in parameter. For shift dx/dP is a diagonal matrix, for rotation
+ * dx/dR = derivative of rotation matrix wrt to a paremeter * (x-c) where
+ * x-c is the vector from the center of the image to the coodinate
+ *
+ * Because dx/dR is linear in the coordinate, along a line of the image
+ * (fixed x,y) the rotation gradient only needs SUM f*dg/dv and SUM z*f*dg/dv,
+ * so each line is reduced with vectorized dot products and the coordinate
+ * transform is only evaluated once per line.
+ *
+ * @param params Paramters (Rx, Ry, Rz, Sx, Sy, Sz).
+ * @param dograd Whether to compute the gradient terms
+ * @param sums Output sums: moving sum, fixed sum, moving sum of squares,
+ * fixed sum of squares, sum of products, then the 6 (unnormalized) gradient
+ * terms in index/radian units (only if dograd is set)
+ */
+void RigidCorrComp::computeCorr(const VectorXd& params, bool dograd,
+		double* sums)
+{
+	if(!m_fixed) throw INVALID_ARGUMENT("ERROR must set fixed image before "
+				"computing value.");
+	if(!m_moving) throw INVALID_ARGUMENT("ERROR must set moving image before "
+				"computing value.");
+	if(!m_moving->matchingOrient(m_fixed, true, true)) {
+		throw INVALID_ARGUMENT("Moving and Fixed Images must have the same "
+				"orientation and gred!");
+	}
 
-		// compute SUM_i dg/dv_i dv_i/dp
-		dgdR = dR*gradG;
+	Matrix3d Rinv;
+	Vector3d shift;
+	Matrix3d M[3];
+	rigidCorrGeometry(params, m_moving, Rinv, shift, M);
+	Eigen::Map<Vector3d> center(m_center);
 
-		// compute correlation, since it requires almost no additional work
-		double g = *mit;
-		double f = fix_vw(cind[0], cind[1], cind[2]);
+	// Per-slab partial sums: mov_sum, fix_sum, mov_ss, fix_ss, corr, then the
+	// six gradient terms
+	const size_t NSUMS = 11;
+	size_t nthreads = numThreads();
+	vector<double> partial(nthreads*NSUMS, 0);
+
+	const int64_t nx = m_movdim[0];
+	const int64_t ny = m_movdim[1];
+	const int64_t nz = m_movdim[2];
+	const int64_t nvox = nx*ny*nz;
+	const double* fix = m_fixbuf.data();
+	const int64_t* fixdim = m_fixdim;
+
+	size_t nchunks = parallelFor(0, nx, [&](size_t chunk, size_t x0, size_t x1)
+	{
+		double* psums = &partial[chunk*NSUMS];
+		Eigen::ArrayXd f(nz);
+		Eigen::ArrayXd zf(nz);
+		Eigen::ArrayXd zz = Eigen::ArrayXd::LinSpaced(nz, 0, nz-1);
+		Vector3d w0, c0, sfg, szfg;
+		Vector3d dc = Rinv.col(2);
+
+		for(int64_t xx=x0; xx<x1; xx++) {
+			for(int64_t yy=0; yy<ny; yy++) {
+				w0 = Vector3d(xx, yy, 0) - shift - center;
+				c0 = Rinv*w0 + center;
+
+				// Sample fixed image along the (rotated) line
+				for(int64_t zi=0; zi<nz; zi++) {
+					f[zi] = linSample3D(fix, fixdim, c0[0]+zi*dc[0],
+							c0[1]+zi*dc[1], c0[2]+zi*dc[2]);
+				}
 
-		mov_sum += g;
-		fix_sum += f;
-		mov_ss += g*g;
-		fix_ss += f*f;
-		corr += g*f;
+				int64_t off = (xx*ny+yy)*nz;
+				Eigen::Map<const Eigen::ArrayXd> g(&m_movbuf[off], nz);
+
+				psums[0] += g.sum();
+				psums[1] += f.sum();
+				psums[2] += g.square().sum();
+				psums[3] += f.square().sum();
+				psums[4] += (g*f).sum();
+
+				if(!dograd)
+					continue;
+
+				// dg/dv_i for the line
+				Eigen::Map<const Eigen::ArrayXd> gx(&m_dmovbuf[off], nz);
+				Eigen::Map<const Eigen::ArrayXd> gy(&m_dmovbuf[nvox+off], nz);
+				Eigen::Map<const Eigen::ArrayXd> gz(&m_dmovbuf[2*nvox+off], nz);
+
+				zf = zz*f;
+				sfg[0] = (f*gx).sum();
+				sfg[1] = (f*gy).sum();
+				sfg[2] = (f*gz).sum();
+				szfg[0] = (zf*gx).sum();
+				szfg[1] = (zf*gy).sum();
+				szfg[2] = (zf*gz).sum();
+
+				// SUM_z f*(M_k*(w0 + z*e_z)).dg/dv
+				for(size_t kk=0; kk<3; kk++) {
+					psums[5+kk] += (M[kk]*w0).dot(sfg) +
+						M[kk].col(2).dot(szfg);
+				}
+				psums[8] += sfg[0];
+				psums[9] += sfg[1];
+				psums[10] += sfg[2];
+			}
+		}
+	}, nthreads);
+
+	// Combine in a fixed order so results don't depend on thread timing
+	for(size_t ii=0; ii<NSUMS; ii++)
+		sums[ii] = 0;
+	for(size_t cc=0; cc<nchunks; cc++) {
+		for(size_t ii=0; ii<NSUMS; ii++)
+			sums[ii] += partial[cc*NSUMS+ii];
+	}
+}
 
-		grad[0] += f*dgdR[0];
-		grad[1] += f*dgdR[1];
-		grad[2] += f*dgdR[2];
-		grad[3] += f*gradG[0];
-		grad[4] += f*gradG[1];
-		grad[5] += f*gradG[2];
+/**
+ * @brief Computes the gradient and value of the correlation.
+ *
+ * @param x Paramters (Rx, Ry, Rz, Sx, Sy, Sz).
+ * @param v Value at the given rotation
+ * @param g Gradient at the given rotation
+ *
+ * @return 0 if successful
+ */
+int RigidCorrComp::valueGrad(const VectorXd& params,
+		double& val, VectorXd& grad)
+{
+//#if defined DEBUG || defined VERYDEBUG
+	cerr << "VALGRAD Rotation: " << params[0]*M_PI/180. << ", "
+		<< params[1]*M_PI/180. << ", " << params[2]*M_PI/180. << ", Shift: "
+		<< params[3]/m_moving->spacing(0) << ", "
+		<< params[4]/m_moving->spacing(1) << ", "
+		<< params[5]/m_moving->spacing(2) << endl;
+//#endif
 
-	}
+	double sums[11];
+	computeCorr(params, true, sums);
+	grad.resize(6);
+	for(size_t ii=0; ii<6; ii++)
+		grad[ii] = sums[5+ii];
 
 	// Radians -> Degrees, index to mm
 	grad[0] *= M_PI/180.;
@@ -680,10 +2560,10 @@ int RigidCorrComp::valueGrad(const VectorXd& params,
 	grad[4] /= m_moving->spacing(1);
 	grad[5] /= m_moving->spacing(2);
 
-	count = m_moving->elements();
-	val = sample_corr(count, mov_sum, fix_sum, mov_ss, fix_ss, corr);
-	double sd1 = sqrt(sample_var(count, mov_sum, mov_ss));
-	double sd2 = sqrt(sample_var(count, fix_sum, fix_ss));
+	size_t count = m_moving->elements();
+	val = sample_corr(count, sums[0], sums[1], sums[2], sums[3], sums[4]);
+	double sd1 = sqrt(sample_var(count, sums[0], sums[2]));
+	double sd2 = sqrt(sample_var(count, sums[1], sums[3]));
 	grad /= (count-1)*sd1*sd2;
 
 //#if defined VERYDEBUG || defined DEBUG
@@ -698,7 +2578,6 @@ int RigidCorrComp::valueGrad(const VectorXd& params,
 
 	return 0;
 }
-
 /**
  * @brief Computes the gradient of the correlation. Note that this
  * function just calls valueGrad because computing the
@@ -724,6 +2603,41 @@ int RigidCorrComp::grad(const VectorXd& params, VectorXd& grad)
  * @return 0 if successful
  */
 int RigidCorrComp::value(const VectorXd& params, double& val)
+{
+	//#if defined DEBUG || defined VERYDEBUG
+	cerr << "VAL() Rotation: " << params[0]*M_PI/180. << ", "
+		<< params[1]*M_PI/180. << ", " << params[2]*M_PI/180. << ", Shift: "
+		<< params[3]/m_moving->spacing(0) << ", "
+		<< params[4]/m_moving->spacing(1) << ", "
+		<< params[5]/m_moving->spacing(2) << endl;
+	//#endif
+
+	double sums[11];
+	computeCorr(params, false, sums);
+	val = sample_corr(m_moving->elements(), sums[0], sums[1], sums[2],
+			sums[3], sums[4]);
+
+//#if defined VERYDEBUG || defined DEBUG
+	cerr << "Value: " << val << endl;
+//#endif
+
+	if(m_compdiff)
+		val = -val;
+	return 0;
+};
+
+/**
+ * @brief Computes the correlation sums along with the sums needed for the
+ * Gauss-Newton normal equations. The derivative of each sample with respect
+ * to the parameters is J = dg/dv*dv/dP (as in computeCorr), which along a line
+ * of the moving image is (p_k + z*q_k).dg/dv for rotations, so it is filled in
+ * for the whole line at once and reduced into J^T*J with a single product.
+ *
+ * @param params Paramters (Rx, Ry, Rz, Sx, Sy, Sz).
+ * @param sums Output, the 5 correlation sums, then SUM J*f, SUM J, SUM J*g
+ * (6 each) and SUM J*J^T (36, column major)
+ */
+void RigidCorrComp::computeNormal(const VectorXd& params, double* sums)
 {
 	if(!m_fixed) throw INVALID_ARGUMENT("ERROR must set fixed image before "
 				"computing value.");
@@ -734,76 +2648,187 @@ int RigidCorrComp::value(const VectorXd& params, double& val)
 				"orientation and gred!");
 	}
 
-	assert(m_fixed->ndim() == 3);
-	assert(m_moving->ndim() == 3);
-
-	// Degrees -> Radians, mm -> index
-	double rx = params[0]*M_PI/180.;
-	double ry = params[1]*M_PI/180.;
-	double rz = params[2]*M_PI/180.;
-	double sx = params[3]/m_moving->spacing(0);
-	double sy = params[4]/m_moving->spacing(1);
-	double sz = params[5]/m_moving->spacing(2);
+	Matrix3d Rinv;
+	Vector3d shift;
+	Matrix3d M[3];
+	rigidCorrGeometry(params, m_moving, Rinv, shift, M);
+	Eigen::Map<Vector3d> center(m_center);
 
-	//#if defined DEBUG || defined VERYDEBUG
-	cerr << "VAL() Rotation: " << rx << ", " << ry << ", " << rz << ", Shift: "
-		<< sx << ", " << sy << ", " << sz << endl;
-	//#endif
-	Vector3d shift(sx, sy, sz);
+	// Per-slab partial sums
+	const size_t NSUMS = 59;
+	size_t nthreads = numThreads();
+	vector<double> partial(nthreads*NSUMS, 0);
+
+	const int64_t nx = m_movdim[0];
+	const int64_t ny = m_movdim[1];
+	const int64_t nz = m_movdim[2];
+	const int64_t nvox = nx*ny*nz;
+	const double* fix = m_fixbuf.data();
+	const int64_t* fixdim = m_fixdim;
+
+	size_t nchunks = parallelFor(0, nx, [&](size_t chunk, size_t x0, size_t x1)
+	{
+		double* psums = &partial[chunk*NSUMS];
+		Eigen::Map<Eigen::Matrix<double,6,1>> sjf(psums+5);
+		Eigen::Map<Eigen::Matrix<double,6,1>> sj(psums+11);
+		Eigen::Map<Eigen::Matrix<double,6,1>> sjg(psums+17);
+		Eigen::Map<Eigen::Matrix<double,6,6>> sjj(psums+23);
+
+		Eigen::VectorXd f(nz);
+		Eigen::Matrix<double,Eigen::Dynamic,6> J(nz, 6);
+		Eigen::ArrayXd zz = Eigen::ArrayXd::LinSpaced(nz, 0, nz-1);
+		Vector3d w0, c0, p;
+		Vector3d dc = Rinv.col(2);
+
+		for(int64_t xx=x0; xx<x1; xx++) {
+			for(int64_t yy=0; yy<ny; yy++) {
+				w0 = Vector3d(xx, yy, 0) - shift - center;
+				c0 = Rinv*w0 + center;
+
+				// Sample fixed image along the (rotated) line
+				for(int64_t zi=0; zi<nz; zi++) {
+					f[zi] = linSample3D(fix, fixdim, c0[0]+zi*dc[0],
+							c0[1]+zi*dc[1], c0[2]+zi*dc[2]);
+				}
 
-	// Update Transform Matrix
-	Matrix3d Rinv;
-	Rinv(0, 0) = cos(ry)*cos(rz);;
-	Rinv(0, 1) = cos(rz)*sin(rx)*sin(ry)+cos(rx)*sin(rz);
-	Rinv(0, 2) = -cos(rx)*cos(rz)*sin(ry)+sin(rx)*sin(rz);
-	Rinv(1, 0) = -cos(ry)*sin(rz);
-	Rinv(1, 1) = cos(rx)*cos(rz)-sin(rx)*sin(ry)*sin(rz);
-	Rinv(1, 2) = cos(rz)*sin(rx)+cos(rx)*sin(ry)*sin(rz);
-	Rinv(2, 0) = sin(ry);
-	Rinv(2, 1) = -cos(ry)*sin(rx);
-	Rinv(2, 2) = cos(rx)*cos(ry);
+				int64_t off = (xx*ny+yy)*nz;
+				Eigen::Map<const Eigen::VectorXd> g(&m_movbuf[off], nz);
+				Eigen::Map<const Eigen::ArrayXd> gx(&m_dmovbuf[off], nz);
+				Eigen::Map<const Eigen::ArrayXd> gy(&m_dmovbuf[nvox+off], nz);
+				Eigen::Map<const Eigen::ArrayXd> gz(&m_dmovbuf[2*nvox+off], nz);
+
+				psums[0] += g.sum();
+				psums[1] += f.sum();
+				psums[2] += g.squaredNorm();
+				psums[3] += f.squaredNorm();
+				psums[4] += g.dot(f);
+
+				// J_k = (M_k*(w0 + z*e_z)).dg/dv, J_3+d = dg/dv_d
+				for(size_t kk=0; kk<3; kk++) {
+					p = M[kk]*w0;
+					J.col(kk) = ((p[0]+zz*M[kk](0,2))*gx +
+							(p[1]+zz*M[kk](1,2))*gy +
+							(p[2]+zz*M[kk](2,2))*gz).matrix();
+				}
+				J.col(3) = gx.matrix();
+				J.col(4) = gy.matrix();
+				J.col(5) = gz.matrix();
+
+				sjf.noalias() += J.transpose()*f;
+				sj += J.colwise().sum().transpose();
+				sjg.noalias() += J.transpose()*g;
+				sjj.noalias() += J.transpose()*J;
+			}
+		}
+	}, nthreads);
+
+	// Combine in a fixed order so results don't depend on thread timing
+	for(size_t ii=0; ii<NSUMS; ii++)
+		sums[ii] = 0;
+	for(size_t cc=0; cc<nchunks; cc++) {
+		for(size_t ii=0; ii<NSUMS; ii++)
+			sums[ii] += partial[cc*NSUMS+ii];
+	}
+}
 
-	Eigen::Map<Vector3d> center(m_center);
+/**
+ * @brief Maximizes correlation with a damped (Levenberg-Marquardt)
+ * Gauss-Newton solver.
+ *
+ * With f the fixed image sampled at each moving voxel and g the moving image,
+ * a change in parameters dP changes the samples by -J*dP (the same
+ * approximation used by the gradient). Correlation is stationary where
+ * J^T(f - a*g) = 0 for the centered images with a = |f|^2/(f^T g), so each
+ * step solves the least squares problem
+ *
+ * min |f - a*g - J*dP|^2, ie (J^T J + lambda*diag(J^T J))*dP = J^T(f - a*g)
+ *
+ * where all the terms are centered and come from one computeNormal pass.
+ * Iteration stops when the step falls below minstep, or a step reduces 1-corr
+ * by less than 1%. Each pass is traced (a normalEquations span) with the
+ * correlation and damping.
+ *
+ * @param params Initial paramters (Rx, Ry, Rz, Sx, Sy, Sz), updated with the
+ * result
+ * @param minstep Stop once steps (in parameter units) are smaller than this
+ * @param maxits Maximum number of passes
+ *
+ * @return Number of passes over the image
+ */
+size_t RigidCorrComp::gaussNewton(VectorXd& params, double minstep,
+		size_t maxits)
+{
+	if(params.rows() != 6)
+		throw INVALID_ARGUMENT("RigidCorrComp takes 6 parameters");
+
+	// Radians -> Degrees, index -> mm
+	Eigen::Matrix<double,6,1> scale;
+	for(size_t dd=0; dd<3; dd++) {
+		scale[dd] = 180./M_PI;
+		scale[dd+3] = m_moving->spacing(dd);
+	}
 
-	Vector3d ind;
-	Vector3d cind;
-
-	//  Resample Output and Compute Orientation. While actually resampling is
-	//  optional, it helps with debugging
-	double sum1 = 0;
-	double sum2 = 0;
-	double ss1 = 0;
-	double ss2 = 0;
-	double corr = 0;
-	LinInterp3DView<double> fix_vw(m_fixed);
-	Vector3DConstIter<double> mit(m_moving);
-	for(; !mit.eof(); ++mit) {
-		mit.index(3, ind.array().data());
-
-		// u = c + R^-1(v - s - c)
-		// where u is the output index, v the input, c the center of rotation
-		// and s the shift
-		cind = center + Rinv*(ind-center-shift);
-
-		double a = mit[0];
-		double b = fix_vw(cind[0], cind[1], cind[2]);
-		sum1 += a;
-		ss1 += a*a;
-		sum2 += b;
-		ss2 += b*b;
-		corr += a*b;
-	}
-
-	val = sample_corr(m_moving->elements(), sum1, sum2, ss1, ss2, corr);
+	double sums[59];
+	double count = m_moving->elements();
+	double lambda = 1e-3;
+	double bestval = -INFINITY;
+	VectorXd best = params;
+	Eigen::Matrix<double,6,6> A;
+	Eigen::Matrix<double,6,1> b;
+
+	size_t passes = 0;
+	while(passes < maxits) {
+		double val;
+		{
+			TraceScope trace("normalEquations", "RigidCorrComp");
+			computeNormal(params, sums);
+			val = sample_corr(count, sums[0], sums[1], sums[2], sums[3],
+					sums[4]);
+			trace.arg("corr", val);
+			trace.arg("lambda", lambda);
+		}
+		passes++;
+
+		if(val > bestval) {
+			// converged once steps stop reducing 1-corr appreciably (the
+			// jacobian is approximate so convergence near the end is slow)
+			bool converged = val - bestval < 0.01*(1-bestval);
+
+			// accept, and build the (centered) normal equations
+			best = params;
+			bestval = val;
+			lambda = std::max(lambda/10, 1e-8);
+			if(converged)
+				break;
+
+			Eigen::Map<Eigen::Matrix<double,6,1>> sjf(sums+5);
+			Eigen::Map<Eigen::Matrix<double,6,1>> sj(sums+11);
+			Eigen::Map<Eigen::Matrix<double,6,1>> sjg(sums+17);
+			Eigen::Map<Eigen::Matrix<double,6,6>> sjj(sums+23);
+			double cff = sums[3] - sums[1]*sums[1]/count;
+			double cfg = sums[4] - sums[0]*sums[1]/count;
+			double a = cfg > 0 ? cff/cfg : 0;
+
+			A = sjj - sj*sj.transpose()/count;
+			b = (sjf - sj*sums[1]/count) - a*(sjg - sj*sums[0]/count);
+		} else {
+			// reject, retry from the best point with more damping
+			params = best;
+			lambda *= 10;
+		}
 
-//#if defined VERYDEBUG || defined DEBUG
-	cerr << "Value: " << val << endl;
-//#endif
+		Eigen::Matrix<double,6,6> H = A;
+		H.diagonal() *= 1+lambda;
+		Eigen::Matrix<double,6,1> step = H.ldlt().solve(b);
+		step = step.cwiseProduct(scale);
+		if(!step.allFinite() || step.norm() < minstep)
+			break;
+		params = best + step;
+	}
 
-	if(m_compdiff)
-		val = -val;
-	return 0;
-};
+	params = best;
+	return passes;
+}
 
 /**
  * @brief Set the fixed image for registration/comparison
@@ -818,6 +2843,14 @@ void RigidCorrComp::setFixed(ptr<const MRImage> newfix)
 		throw INVALID_ARGUMENT("Fixed image is not isotropic!");
 
 	m_fixed = newfix;
+
+	// Flat copy for fast interpolation
+	for(size_t ii=0; ii<3; ii++)
+		m_fixdim[ii] = m_fixed->dim(ii);
+	m_fixbuf.resize(m_fixed->elements());
+	size_t ii = 0;
+	for(NDConstIter<double> it(m_fixed); !it.eof(); ++it, ++ii)
+		m_fixbuf[ii] = *it;
 };
 
 /**
@@ -830,7 +2863,8 @@ void RigidCorrComp::setFixed(ptr<const MRImage> newfix)
  *
  * @param moving Input moving image (not modified)
  */
-void RigidCorrComp::setMoving(ptr<const MRImage> newmove)
+void RigidCorrComp::setMoving(ptr<const MRImage> newmove,
+		ptr<const MRImage> dmoving)
 {
 	if(newmove->ndim() != 3)
 		throw INVALID_ARGUMENT("Moving image is not 3D!");
@@ -838,10 +2872,34 @@ void RigidCorrComp::setMoving(ptr<const MRImage> newmove)
 		throw INVALID_ARGUMENT("Moving image is not isotropic!");
 
 	m_moving = newmove;
-	m_dmoving = dPtrCast<MRImage>(derivative(m_moving));
+	if(dmoving) {
+		if(dmoving->ndim() != 4 || dmoving->tlen() != 3 ||
+				!std::equal(dmoving->dim(), dmoving->dim()+3, m_moving->dim()))
+			throw INVALID_ARGUMENT("Moving derivative does not match moving "
+					"image");
+		m_dmoving = dmoving;
+	} else {
+		m_dmoving = dPtrCast<MRImage>(derivative(m_moving));
+	}
 
 	for(size_t ii=0; ii<3 && ii<m_moving->ndim(); ii++)
 		m_center[ii] = (m_moving->dim(ii)-1)/2.;
+
+	// Flat copies of the image and its derivative (as separate planes) for
+	// the vectorized line reductions in computeCorr
+	for(size_t ii=0; ii<3; ii++)
+		m_movdim[ii] = m_moving->dim(ii);
+	size_t nvox = m_moving->elements();
+	m_movbuf.resize(nvox);
+	m_dmovbuf.resize(3*nvox);
+	size_t ii = 0;
+	Vector3DConstIter<double> dit(m_dmoving);
+	for(NDConstIter<double> it(m_moving); !it.eof(); ++it, ++dit, ++ii) {
+		m_movbuf[ii] = *it;
+		m_dmovbuf[ii] = dit[0];
+		m_dmovbuf[nvox+ii] = dit[1];
+		m_dmovbuf[2*nvox+ii] = dit[2];
+	}
 }
 
 /****************************************************************************
@@ -896,7 +2954,8 @@ void RigidInfoComp::setBins(size_t nbins, size_t krad)
  *
  * @param newmove New moving image
  */
-void RigidInfoComp::setMoving(ptr<const MRImage> newmove)
+void RigidInfoComp::setMoving(ptr<const MRImage> newmove,
+		ptr<const MRImage> dmoving)
 {
 	if(newmove->ndim() != 3)
 		throw INVALID_ARGUMENT("Moving image is not 3D!");
@@ -907,7 +2966,15 @@ void RigidInfoComp::setMoving(ptr<const MRImage> newmove)
 	// Setup accessors and Members Images
 	//////////////////////////////////////
 	m_moving = newmove;
-	m_dmoving = dPtrCast<MRImage>(derivative(m_moving));
+	if(dmoving) {
+		if(dmoving->ndim() != 4 || dmoving->tlen() != 3 ||
+				!std::equal(dmoving->dim(), dmoving->dim()+3, m_moving->dim()))
+			throw INVALID_ARGUMENT("Moving derivative does not match moving "
+					"image");
+		m_dmoving = dmoving;
+	} else {
+		m_dmoving = dPtrCast<MRImage>(derivative(m_moving));
+	}
 
 	m_move_get.setArray(m_moving);
 	m_dmove_get.setArray(m_dmoving);
@@ -937,21 +3004,240 @@ void RigidInfoComp::setFixed(ptr<const MRImage> newfixed)
 	if(!newfixed->isIsotropic(true, 0.1))
 		throw INVALID_ARGUMENT("Fixed image is not isotropic!");
 
-	//////////////////////////////////////
-	// Set up Members
-	//////////////////////////////////////
-	m_fixed = newfixed;
-	m_fit.setArray(m_fixed);
+	//////////////////////////////////////
+	// Set up Members
+	//////////////////////////////////////
+	m_fixed = newfixed;
+	m_fit.setArray(m_fixed);
+	m_sampler.sample(m_fixed);
+
+	//////////////////////////////////////
+	// compute ranges, and bin widths
+	//////////////////////////////////////
+	m_rangefix[0] = INFINITY;
+	m_rangefix[1] = -INFINITY;
+	for(NDConstIter<double> it(m_fixed); !it.eof(); ++it) {
+		m_rangefix[0] = std::min(m_rangefix[0], *it);
+		m_rangefix[1] = std::max(m_rangefix[1], *it);
+	}
+}
+
+/**
+ * @brief Sets the strategy for choosing the voxels of the fixed image that
+ * contribute to the joint histogram. If the fixed image has been set a new
+ * sample is drawn immediately.
+ *
+ * @param mode Sampling mode
+ * @param frac Fraction of voxels to use, in (0, 1]
+ * @param resample Draw a new sample at each call to valueGrad
+ * @param mask Mask to sample from, required for SAMPLE_MASK
+ */
+void RigidInfoComp::setSampling(SampleMode mode, double frac, bool resample,
+		ptr<const MRImage> mask)
+{
+	m_sampler.setup(mode, frac, resample, mask);
+	if(m_fixed)
+		m_sampler.sample(m_fixed);
+}
+
+/**
+ * @brief Zeros then fills the joint histogram (m_pdfjoint) and, if dograd
+ * is set, the derivative of the joint histogram with respect to each
+ * parameter (m_dpdfjoint) for the given rigid transform. Also updates
+ * m_wmove and m_wfix.
+ *
+ * Only the fixed voxels chosen by m_sampler are used. Slabs of the fixed image
+ * are histogrammed in parallel, each thread into its own buffers. Within a
+ * thread the derivative histogram is stored with the 6 parameters adjacent
+ * ([fix][move][param]) so that each Parzen window update touches contiguous
+ * memory. The per-thread buffers are then merged in a fixed order, so the
+ * result does not depend on thread timing.
+ *
+ * @param params Paramters (Rx, Ry, Rz, Sx, Sy, Sz).
+ * @param dograd Whether to fill m_dpdfjoint
+ */
+void RigidInfoComp::fillHistograms(const VectorXd& params, bool dograd)
+{
+	// Degrees -> Radians, mm -> index
+	double rx = params[0]*M_PI/180.;
+	double ry = params[1]*M_PI/180.;
+	double rz = params[2]*M_PI/180.;
+	double sx = params[3]/m_moving->spacing(0);
+	double sy = params[4]/m_moving->spacing(1);
+	double sz = params[5]/m_moving->spacing(2);
+
+	// Update Transform Matrix
+	Matrix3d rotation;
+	rotation(0,0) = cos(ry)*cos(rz);
+	rotation(0,1) = -cos(ry)*sin(rz);
+	rotation(0,2) = sin(ry);
+	rotation(1,0) = cos(rz)*sin(rx)*sin(ry)+cos(rx)*sin(rz);
+	rotation(1,1) = cos(rx)*cos(rz) - sin(rx)*sin(ry)*sin(rz);
+	rotation(1,2) = -cos(ry)*sin(rx);
+	rotation(2,0) = -cos(rx)*cos(rz)*sin(ry)+sin(rx)*sin(rz);
+	rotation(2,1) = cos(rz)*sin(rx)+cos(rx)*sin(ry)*sin(rz);
+	rotation(2,2) = cos(rx)*cos(ry);
+
+	Vector3d shift(sx, sy, sz);
+	Eigen::Map<Vector3d> center(m_center);
+
+	// dRigid/dRx, dRigid/dRy, dRigid/dRz = ddRx*(u-c), ddRy*(u-c) ...
+	Matrix3d ddRx, ddRy, ddRz;
+	ddRx <<0,0,0,cos(rx)*cos(rz)*sin(ry)-sin(rx)*sin(rz),
+		-(cos(rz)*sin(rx))-cos(rx)*sin(ry)*sin(rz),
+		-(cos(rx)*cos(ry)),cos(rz)*sin(rx)*sin(ry)+cos(rx)*sin(rz),
+		cos(rx)*cos(rz)-sin(rx)*sin(ry)*sin(rz),-(cos(ry)*sin(rx));
+	ddRy <<-(cos(rz)*sin(ry)),sin(ry)*sin(rz),cos(ry),cos(ry)*cos(rz)*sin(rx),
+		-(cos(ry)*sin(rx)*sin(rz)),sin(rx)*sin(ry),-(cos(rx)*cos(ry)*cos(rz)),
+		cos(rx)*cos(ry)*sin(rz),-(cos(rx)*sin(ry));
+	ddRz <<-(cos(ry)*sin(rz)),-(cos(ry)*cos(rz)),0,
+		cos(rx)*cos(rz)-sin(rx)*sin(ry)*sin(rz),
+		-(cos(rz)*sin(rx)*sin(ry))-cos(rx)*sin(rz),0,
+		cos(rz)*sin(rx)+cos(rx)*sin(ry)*sin(rz),
+		cos(rx)*cos(rz)*sin(ry)-sin(rx)*sin(rz),0;
+
+	// compute updated moving width
+	m_wmove = (m_rangemove[1]-m_rangemove[0])/(m_bins-2*m_krad-1);
+	m_wfix = (m_rangefix[1]-m_rangefix[0])/(m_bins-2*m_krad-1);
+
+	const int64_t bins = m_bins;
+	const int64_t tbins = bins*bins;
+	const int krad = m_krad;
+	const int kwidth = 2*m_krad+1;
+
+	size_t nthreads = numThreads();
+	vector<vector<double>> pdfbuf(nthreads);
+	vector<vector<double>> dpdfbuf(nthreads);
+
+	size_t nchunks = parallelFor(0, m_fixed->dim(0),
+			[&](size_t chunk, size_t x0, size_t x1)
+	{
+		vector<double>& pdf = pdfbuf[chunk];
+		vector<double>& dpdf = dpdfbuf[chunk];
+		pdf.assign(tbins, 0);
+		if(dograd)
+			dpdf.assign(6*tbins, 0);
+
+		vector<double> fixweight(kwidth);
+		vector<double> movweight(kwidth);
+		vector<double> dmovweight(kwidth);
+
+		// Thread-local accessors
+		LinInterp3DView<double> move_get(m_moving);
+		LinInterp3DView<double> dmove_get(m_dmoving);
+		NDConstView<double> fix_get(m_fixed);
+
+		// Sampled voxels in this slab
+		int64_t s0, s1;
+		m_sampler.slab(x0, x1, s0, s1);
+
+		Vector3d ind;
+		Vector3d cind;
+		Vector3d gradG; //dg/dx, dg/dy, dg/dz
+		Matrix3d dR; //dg/dRx, dg/dRy, dg/dRz
+		Vector3d dgdR;
+		double dgdPhi[6];
+
+		for(int64_t ss = s0; ss < s1; ss++) {
+			int64_t lin = m_sampler.at(ss);
+			m_sampler.index(lin, ind.array().data());
+
+			// u = c + R^-1(v - s - c)
+			// where u is the output index, v the input, c the center of
+			// rotation and s the shift
+			cind = rotation*(ind-center) + center + shift;
+
+			// get actual values
+			double g = move_get(cind[0], cind[1], cind[2]);
+			double f = fix_get[lin];
+
+			// compute bins
+			double cbinfix = (f-m_rangefix[0])/m_wfix + m_krad;
+			double cbinmove = (g-m_rangemove[0])/m_wmove + m_krad;
+			int64_t binfix = round(cbinfix);
+			int64_t binmove = round(cbinmove);
+
+			assert(binfix+m_krad < m_bins);
+			assert(binmove+m_krad < m_bins);
+			assert(binfix-m_krad >= 0);
+			assert(binmove-m_krad >= 0);
+
+			parzenWeights(binfix-krad-cbinfix, krad, kwidth,
+					fixweight.data(), NULL);
+			parzenWeights(binmove-krad-cbinmove, krad, kwidth,
+					movweight.data(), dograd ? dmovweight.data() : NULL);
+
+			for(int ii = 0; ii < kwidth; ii++) {
+				double* row = &pdf[(binfix-krad+ii)*bins + binmove-krad];
+				for(int jj = 0; jj < kwidth; jj++)
+					row[jj] += fixweight[ii]*movweight[jj];
+			}
+
+			if(!dograd)
+				continue;
+
+			// Here we compute dg(v(u,p))/dp, where g is the image, u is the
+			// coordinate in the fixed image, and p is the param.
+			// dg/dp = SUM_i dg/dv_i dv_i/dp, where v is the rotated
+			// coordinate, so dg/dv_i is the directional derivative in
+			// original space, dv_i/dp is the derivative of the rotated
+			// coordinate system with respect to a parameter
+			gradG[0] = dmove_get(cind[0], cind[1], cind[2], 0);
+			gradG[1] = dmove_get(cind[0], cind[1], cind[2], 1);
+			gradG[2] = dmove_get(cind[0], cind[1], cind[2], 2);
+
+			dR.row(0) = ddRx*(ind-center);
+			dR.row(1) = ddRy*(ind-center);
+			dR.row(2) = ddRz*(ind-center);
+
+			// compute SUM_i dg/dv_i dv_i/dp
+			dgdR = dR*gradG;
+			dgdPhi[0] = dgdR[0];
+			dgdPhi[1] = dgdR[1];
+			dgdPhi[2] = dgdR[2];
+			dgdPhi[3] = gradG[0];
+			dgdPhi[4] = gradG[1];
+			dgdPhi[5] = gradG[2];
+
+			for(int ii = 0; ii < kwidth; ii++) {
+				double* row = &dpdf[((binfix-krad+ii)*bins+binmove-krad)*6];
+				for(int jj = 0; jj < kwidth; jj++) {
+					double w = fixweight[ii]*dmovweight[jj];
+					for(int phi = 0; phi < 6; phi++)
+						row[jj*6+phi] += w*dgdPhi[phi];
+				}
+			}
+		}
+	}, nthreads);
+
+	// Merge thread histograms, always in chunk order. Each thread merges a
+	// range of fixed bins.
+	parallelFor(0, bins, [&](size_t, size_t b0, size_t b1)
+	{
+		for(int64_t bb = b0*bins; bb < b1*bins; bb++) {
+			double v = 0;
+			for(size_t cc = 0; cc < nchunks; cc++)
+				v += pdfbuf[cc][bb];
+			m_pdfjoint[bb] = v;
+		}
 
-	//////////////////////////////////////
-	// compute ranges, and bin widths
-	//////////////////////////////////////
-	m_rangefix[0] = INFINITY;
-	m_rangefix[1] = -INFINITY;
-	for(NDConstIter<double> it(m_fixed); !it.eof(); ++it) {
-		m_rangefix[0] = std::min(m_rangefix[0], *it);
-		m_rangefix[1] = std::max(m_rangefix[1], *it);
-	}
+		if(!dograd)
+			return;
+
+		for(int64_t bb = b0*bins; bb < b1*bins; bb++) {
+			for(int phi = 0; phi < 6; phi++) {
+				double v = 0;
+				for(size_t cc = 0; cc < nchunks; cc++)
+					v += dpdfbuf[cc][bb*6+phi];
+				m_dpdfjoint[phi*tbins+bb] = v;
+			}
+		}
+	});
+
+	m_pdfmove.zero();
+	m_pdffix.zero();
+	if(dograd)
+		m_dpdfmove.zero();
 }
 
 /**
@@ -999,121 +3285,12 @@ int RigidInfoComp::valueGrad(const VectorXd& params,
 		<< sx << ", " << sy << ", " << sz << endl;
 //#endif
 
-	// Update Transform Matrix
-	Matrix3d rotation;
-	rotation(0,0) = cos(ry)*cos(rz);
-	rotation(0,1) = -cos(ry)*sin(rz);
-	rotation(0,2) = sin(ry);
-	rotation(1,0) = cos(rz)*sin(rx)*sin(ry)+cos(rx)*sin(rz);
-	rotation(1,1) = cos(rx)*cos(rz) - sin(rx)*sin(ry)*sin(rz);
-	rotation(1,2) = -cos(ry)*sin(rx);
-	rotation(2,0) = -cos(rx)*cos(rz)*sin(ry)+sin(rx)*sin(rz);
-	rotation(2,1) = cos(rz)*sin(rx)+cos(rx)*sin(ry)*sin(rz);
-	rotation(2,2) = cos(rx)*cos(ry);
-
-	Vector3d ind;
-	Vector3d cind;
-	Vector3d shift(sx, sy, sz);
-	Eigen::Map<Vector3d> center(m_center);
-
-	// dRigid/dRx, dRigid/dRy, dRigid/dRz = ddRx*(u-c), ddRy*(u-c) ...
-	Matrix3d ddRx, ddRy, ddRz;
-	ddRx <<0,0,0,cos(rx)*cos(rz)*sin(ry)-sin(rx)*sin(rz),
-		-(cos(rz)*sin(rx))-cos(rx)*sin(ry)*sin(rz),
-		-(cos(rx)*cos(ry)),cos(rz)*sin(rx)*sin(ry)+cos(rx)*sin(rz),
-		cos(rx)*cos(rz)-sin(rx)*sin(ry)*sin(rz),-(cos(ry)*sin(rx));
-	ddRy <<-(cos(rz)*sin(ry)),sin(ry)*sin(rz),cos(ry),cos(ry)*cos(rz)*sin(rx),
-		-(cos(ry)*sin(rx)*sin(rz)),sin(rx)*sin(ry),-(cos(rx)*cos(ry)*cos(rz)),
-		cos(rx)*cos(ry)*sin(rz),-(cos(rx)*sin(ry));
-	ddRz <<-(cos(ry)*sin(rz)),-(cos(ry)*cos(rz)),0,
-		cos(rx)*cos(rz)-sin(rx)*sin(ry)*sin(rz),
-		-(cos(rz)*sin(rx)*sin(ry))-cos(rx)*sin(rz),0,
-		cos(rz)*sin(rx)+cos(rx)*sin(ry)*sin(rz),
-		cos(rx)*cos(rz)*sin(ry)-sin(rx)*sin(rz),0;
-
-	Vector3d gradG; //dg/dx, dg/dy, dg/dz
-	Matrix3d dR; //dg/dRx, dg/dRy, dg/dRz
-	Vector3d dgdR;
-
-	// Zero Everything
-	m_pdfmove.zero();
-	m_pdffix.zero();
-	m_pdfjoint.zero();
-	m_dpdfmove.zero();
-	m_dpdfjoint.zero();
-
-	// compute updated moving width
-	m_wmove = (m_rangemove[1]-m_rangemove[0])/(m_bins-2*m_krad-1);
-	m_wfix = (m_rangefix[1]-m_rangefix[0])/(m_bins-2*m_krad-1);
-
-	// for computing rotated indices
-	double cbinmove, cbinfix; //continuous
-	double binmove, binfix; // nearest int
-	double dgdPhi[6];
-
-	// Compute Probabilities
-	for(m_fit.goBegin(); !m_fit.eof(); ++m_fit) {
-		m_fit.index(3, ind.array().data());
-
-		// u = c + R^-1(v - s - c)
-		// where u is the output index, v the input, c the center of rotation
-		// and s the shift
-		// cind = center + rInv*(ind-shift-center);
-		cind = rotation*(ind-center) + center + shift;
-
-		// Here we compute dg(v(u,p))/dp, where g is the image, u is the
-		// coordinate in the fixed image, and p is the param.
-		// dg/dp = SUM_i dg/dv_i dv_i/dp, where v is the rotated coordinate, so
-		// dg/dv_i is the directional derivative in original space,
-		// dv_i/dp is the derivative of the rotated coordinate system with
-		// respect to a parameter
-		gradG[0] = m_dmove_get(cind[0], cind[1], cind[2], 0);
-		gradG[1] = m_dmove_get(cind[0], cind[1], cind[2], 1);
-		gradG[2] = m_dmove_get(cind[0], cind[1], cind[2], 2);
-
-		dR.row(0) = ddRx*(ind-center);
-		dR.row(1) = ddRy*(ind-center);
-		dR.row(2) = ddRz*(ind-center);
-
-		// compute SUM_i dg/dv_i dv_i/dp
-		dgdR = dR*gradG;
-		dgdPhi[0] = dgdR[0];
-		dgdPhi[1] = dgdR[1];
-		dgdPhi[2] = dgdR[2];
-		dgdPhi[3] = gradG[0];
-		dgdPhi[4] = gradG[1];
-		dgdPhi[5] = gradG[2];
-
-		// get actual values
-		double g = m_move_get(cind[0], cind[1], cind[2]);
-		double f = *m_fit;
-
-		// compute bins
-		cbinfix = (f-m_rangefix[0])/m_wfix + m_krad;
-		cbinmove = (g-m_rangemove[0])/m_wmove + m_krad;
-		binfix = round(cbinfix);
-		binmove = round(cbinmove);
-
-		assert(binfix+m_krad < m_bins);
-		assert(binmove+m_krad < m_bins);
-		assert(binfix-m_krad >= 0);
-		assert(binmove-m_krad >= 0);
-
-		for(int ii = binfix-m_krad; ii <= binfix+m_krad; ii++)
-			for(int jj = binmove-m_krad; jj <= binmove+m_krad; jj++) {
-				m_pdfjoint[{ii,jj}] += B3kern(ii-cbinfix, m_krad)*
-					B3kern(jj-cbinmove, m_krad);
-		}
+	// New samples for each iteration
+	if(m_sampler.resample())
+		m_sampler.sample(m_fixed);
 
-		for(int phi = 0; phi < 6; phi++) {
-			for(int ii = binfix-m_krad; ii <= binfix+m_krad; ii++) {
-				for(int jj = binmove-m_krad; jj <= binmove+m_krad; jj++) {
-					m_dpdfjoint[{phi,ii,jj}] += B3kern(ii-cbinfix, m_krad)*
-						dB3kern(jj-cbinmove, m_krad)*dgdPhi[phi];
-				}
-			}
-		}
-	}
+	// Fill m_pdfjoint and m_dpdfjoint
+	fillHistograms(params, true);
 
 	///////////////////////
 	// Update Entropies
@@ -1289,65 +3466,8 @@ int RigidInfoComp::value(const VectorXd& params, double& val)
 		<< sx << ", " << sy << ", " << sz << endl;
 //#endif
 
-	// Update Transform Matrix
-	Matrix3d rotation;
-	rotation(0,0) = cos(ry)*cos(rz);
-	rotation(0,1) = -cos(ry)*sin(rz);
-	rotation(0,2) = sin(ry);
-	rotation(1,0) = cos(rz)*sin(rx)*sin(ry)+cos(rx)*sin(rz);
-	rotation(1,1) = cos(rx)*cos(rz) - sin(rx)*sin(ry)*sin(rz);
-	rotation(1,2) = -cos(ry)*sin(rx);
-	rotation(2,0) = -cos(rx)*cos(rz)*sin(ry)+sin(rx)*sin(rz);
-	rotation(2,1) = cos(rz)*sin(rx)+cos(rx)*sin(ry)*sin(rz);
-	rotation(2,2) = cos(rx)*cos(ry);
-
-	Vector3d shift(sx, sy, sz);
-	Eigen::Map<Vector3d> center(m_center);
-	Vector3d ind;
-	Vector3d cind;
-
-	// Zero
-	m_pdfmove.zero();
-	m_pdffix.zero();
-	m_pdfjoint.zero();
-
-	m_wmove = (m_rangemove[1]-m_rangemove[0])/(m_bins-2*m_krad-1);
-	m_wfix = (m_rangefix[1]-m_rangefix[0])/(m_bins-2*m_krad-1);
-
-	// for computing rotated indices
-	double cbinmove, cbinfix; //continuous
-	double binmove, binfix; // nearest int
-
-	// Compute Probabilities
-	for(m_fit.goBegin(); !m_fit.eof(); ++m_fit) {
-		m_fit.index(3, ind.array().data());
-
-		// u = c + R^-1(v - s - c)
-		// where u is the output index, v the input, c the center of rotation
-		// and s the shift
-		cind = rotation*(ind-center)+center+shift;
-
-		// get actual values
-		double g = m_move_get(cind[0], cind[1], cind[2]);
-		double f = *m_fit;
-
-		// compute bins
-		cbinfix = (f-m_rangefix[0])/m_wfix + m_krad;
-		cbinmove = (g-m_rangemove[0])/m_wmove + m_krad;
-		binfix = round(cbinfix);
-		binmove = round(cbinmove);
-
-		assert(binfix+m_krad < m_bins);
-		assert(binmove+m_krad < m_bins);
-		assert(binfix-m_krad >= 0);
-		assert(binmove-m_krad >= 0);
-
-		for(int ii = binfix-m_krad; ii <= binfix+m_krad; ii++) {
-			for(int jj = binmove-m_krad; jj <= binmove+m_krad; jj++)
-				m_pdfjoint[{ii,jj}] += B3kern(ii-cbinfix, m_krad)*
-					B3kern(jj-cbinmove, m_krad);
-		}
-	}
+	// Fill m_pdfjoint
+	fillHistograms(params, false);
 
 	// Scale
 	size_t tbins = m_bins*m_bins;
@@ -1463,6 +3583,8 @@ void ProbDistCorrInfoComp::initialize(ptr<const MRImage> fixed,
 	m_fixed = fixed;
 	m_moving = moving;
 	m_dmoving = dPtrCast<MRImage>(derivative(m_moving, m_dir));
+	m_sampler.sample(m_fixed);
+	m_basis.invalidate();
 	m_bins = nbins;
 	m_krad = krad;
 
@@ -1516,58 +3638,146 @@ void ProbDistCorrInfoComp::initialize(ptr<const MRImage> fixed,
 	gradbuff.resize(m_deform->elements());
 	m_gradHjoint.resize(osize.data()); //3D
 	m_gradHmove.resize(osize.data()); //3D
+}
 
-	// Create Derivates of Individual Bins
-	m_dpdfmove.resize(osize.data()); // 4D
-	m_dpdfjoint.resize(osize.data()); // 5D
+/**
+ * @brief Sets the strategy for choosing the voxels of the fixed image that
+ * contribute to the joint histogram. If the fixed image has been set a new
+ * sample is drawn immediately.
+ *
+ * @param mode Sampling mode
+ * @param frac Fraction of voxels to use, in (0, 1]
+ * @param resample Draw a new sample at each call to valueGrad
+ * @param mask Mask to sample from, required for SAMPLE_MASK
+ */
+void ProbDistCorrInfoComp::setSampling(SampleMode mode, double frac,
+		bool resample, ptr<const MRImage> mask)
+{
+	m_sampler.setup(mode, frac, resample, mask);
+	m_basis.invalidate();
+	if(m_fixed)
+		m_sampler.sample(m_fixed);
 }
 
 /**
- * @brief Updates m_move_cache, m_dmove_cache, m_corr_cache and m_rangemove
+ * @brief Updates m_fixed_cache and m_rangefix at the voxels chosen by
+ * m_sampler
  */
 void ProbDistCorrInfoComp::updateCaches()
 {
-	NDConstView<double> fixed_vw(m_fixed);
-	BSplineView<double> bsp_vw(m_deform);
-	bsp_vw.m_boundmethod = ZEROFLUX;
-	bsp_vw.m_ras = true;
+	m_basis.update(m_fixed, m_deform, m_dir, m_sampler);
+
+	// Each thread updates a slab of the cache and extends its own copy of
+	// the range, the ranges are merged afterward
+	size_t nchunk = min<size_t>(numThreads(), m_fixed->dim(0));
+	vector<double> rangebuf(2*nchunk);
+	nchunk = parallelFor(0, m_fixed->dim(0), [&](size_t chunk, size_t x0,
+				size_t x1)
+	{
+		NDConstView<double> fixed_vw(m_fixed);
+		NDView<double> cache_vw(m_fixed_cache);
+		NDConstView<double> param_vw(m_deform);
+
+		// Compute Probabilities (only at sampled voxels)
+		size_t dirlen = m_fixed_cache->dim(m_dir);
+		double dcind[3]; // index in distortion image
+		int64_t ind[3];
+		int64_t mind[3] ;
+		double pt[3]; // point
+		double Fm = 0;
+		double* range = &rangebuf[2*chunk];
+		range[0] = m_rangefix[0];
+		range[1] = m_rangefix[1];
+		int64_t knots[BSplineBasisCache::MAXSUPPORT];
+		double w[BSplineBasisCache::MAXSUPPORT];
+		double dw[BSplineBasisCache::MAXSUPPORT];
+
+		int64_t s0, s1;
+		m_sampler.slab(x0, x1, s0, s1);
+		for(int64_t ss = s0; ss < s1; ss++) {
+
+			// Compute Continuous Index of Point in Deform Image
+			m_sampler.index(m_sampler.at(ss), ind);
+			std::copy(ind, ind+3, mind);
+			if(!m_basis.cached()) {
+				m_fixed_cache->indexToPoint(3, mind, pt);
+				m_deform->pointToIndex(3, pt, dcind);
+			}
 
-	// Compute Probabilities
-	size_t dirlen = m_fixed_cache->dim(m_dir);
-	double dcind[3]; // index in distortion image
-	int64_t mind[3] ;
-	double pt[3]; // point
-	double Fm = 0;
-	for(NDIter<double> mit(m_fixed_cache); !mit.eof(); ++mit) {
-
-		// Compute Continuous Index of Point in Deform Image
-		mit.index(3, mind);
-		m_fixed_cache->indexToPoint(3, mind, pt);
-		m_deform->pointToIndex(3, pt, dcind);
-
-		// Sample B-Spline Value and Derivative at Current Position
-		double def = 0, ddef = 0;
-		bsp_vw.get(3, pt, m_dir, def, ddef);
-
-		// get linear index
-		double cind = mind[m_dir] + def/m_fixed->spacing(m_dir);
-		int64_t below = (int64_t)floor(cind);
-		int64_t above = below + 1;
-		Fm = 0;
-
-		// get values
-		if(below >= 0 && below < dirlen) {
-			mind[m_dir] = below;
-			Fm += fixed_vw.get(3, mind)*linKern(below-cind);
+			// Sample B-Spline Value and Derivative at Current Position
+			double def = 0, ddef = 0;
+			int nk = m_basis.basis(ss, dcind, knots, w, dw);
+			for(int kk = 0; kk < nk; kk++) {
+				def += w[kk]*param_vw[knots[kk]];
+				ddef += dw[kk]*param_vw[knots[kk]];
+			}
+
+			// get linear index
+			double cind = mind[m_dir] + def/m_fixed->spacing(m_dir);
+			int64_t below = (int64_t)floor(cind);
+			int64_t above = below + 1;
+			Fm = 0;
+
+			// get values
+			if(below >= 0 && below < dirlen) {
+				mind[m_dir] = below;
+				Fm += fixed_vw.get(3, mind)*linKern(below-cind);
+			}
+			if(above >= 0 && above < dirlen) {
+				mind[m_dir] = above;
+				Fm += fixed_vw.get(3, mind)*linKern(above-cind);
+			}
+
+			cache_vw.set(3, ind, Fm);
+			range[0] = std::min(range[0], Fm);
+			range[1] = std::max(range[1], Fm);
 		}
-		if(above >= 0 && above < dirlen) {
-			mind[m_dir] = above;
-			Fm += fixed_vw.get(3, mind)*linKern(above-cind);
+	}, nchunk);
+
+	for(size_t cc = 0; cc < nchunk; cc++) {
+		m_rangefix[0] = std::min(m_rangefix[0], rangebuf[2*cc]);
+		m_rangefix[1] = std::max(m_rangefix[1], rangebuf[2*cc+1]);
+	}
+}
+
+/**
+ * @brief Fills m_pdfjoint with the (unnormalized) joint histogram of the
+ * moving probabilities and m_fixed_cache over the voxels chosen by m_sampler.
+ * Each thread accumulates a slab of the fixed image into a private histogram,
+ * and the histograms are merged in a fixed order so that the result does not
+ * depend on scheduling.
+ */
+void ProbDistCorrInfoComp::fillJointPDF()
+{
+	const size_t movbins = m_moving->tlen();
+	const size_t tbins = movbins*m_bins;
+
+	size_t nchunk = min<size_t>(numThreads(), m_fixed->dim(0));
+	vector<vector<double>> pdfbuf(nchunk);
+	nchunk = parallelFor(0, m_fixed->dim(0), [&](size_t chunk, size_t x0,
+				size_t x1)
+	{
+		vector<double>& pdf = pdfbuf[chunk];
+		pdf.assign(tbins, 0);
+
+		NDConstView<double> move_vw(m_moving);
+		NDConstView<double> fix_vw(m_fixed_cache);
+		int64_t s0, s1;
+		m_sampler.slab(x0, x1, s0, s1);
+		for(int64_t ss = s0; ss < s1; ss++) {
+			int64_t lin = m_sampler.at(ss);
+			int64_t binfix = round((fix_vw[lin]-m_rangefix[0])/m_wfix);
+
+			// moving probabilities are laid out [voxel][bin], joint is
+			// [moving][fixed]
+			for(size_t ii = 0; ii < movbins; ii++)
+				pdf[ii*m_bins+binfix] += move_vw[lin*movbins+ii];
 		}
+	}, nchunk);
 
-		mit.set(Fm);
-		m_rangefix[0] = std::min(m_rangefix[0], Fm);
-		m_rangefix[1] = std::max(m_rangefix[1], Fm);
+	for(size_t cc = 0; cc < nchunk; cc++) {
+		for(size_t bb = 0; bb < tbins; bb++)
+			m_pdfjoint[bb] += pdfbuf[cc][bb];
 	}
 }
 
@@ -1580,110 +3790,24 @@ void ProbDistCorrInfoComp::updateCaches()
  */
 int ProbDistCorrInfoComp::metric(double& val, VectorXd& grad)
 {
-	CLOCK(clock_t c = clock());
+	TracePhases phases("ProbDistCorrInfoComp::metric");
 
 	//Zero Inputs
 	m_pdfmove.zero();
 	m_pdffix.zero();
 	m_pdfjoint.zero();
-	m_dpdfmove.zero();
-	m_dpdfjoint.zero();
-
-	// for computing distorted indices
-	int binfix; // nearest int
-	double fcind[3]; // Continuous index in fixed image
-	double dcind[3]; // Continuous index in deformation
-	int64_t dnind[3]; // Nearest knot to dcind
-	int64_t dind[5]; // last two dimensions are for bins
-	double pt[3];
-
-	// probweight cached derivative of p wrt to the center parameter
-	vector<double> fixweight(2*m_krad+1);
-	vector<double> invspace(m_deform->ndim());
-	for(size_t dd=0; dd<m_deform->ndim(); dd++)
-		invspace[dd] = 1./m_deform->spacing(dd);
-
-	Counter<> neighbors(3);
-	for(size_t dd=0; dd<3; dd++) neighbors.sz[dd] = 5;
 
 	// Compute Updated Version of Distortion-Corrected Image
-	CLOCK(c = clock());
+	phases.phase("updateCaches");
 	updateCaches();
-	CLOCK(c = clock() - c);
-	CLOCK(cerr << "Apply() Time:" << c << endl);
-	CLOCK(c = clock());
-
-	// Create Iterators/ Viewers
-	Vector3DConstIter<double> mit(m_moving);
-	Vector3DConstIter<double> dmit(m_dmoving);
-	NDConstIter<double> fit(m_fixed_cache);
-
-	BSplineView<double> bsp_vw(m_deform);
-	bsp_vw.m_boundmethod = ZEROFLUX;
-	bsp_vw.m_ras = true;
+	phases.phase("jointPDF");
 
 	// compute updated moving width
 	m_wfix = (m_rangefix[1]-m_rangefix[0])/(m_bins-1);
 	size_t movbins = m_moving->tlen();
 
 	// Compute Probabilities
-	for(; !fit.eof(); ++mit, ++fit, ++dmit) {
-
-		// Compute Continuous Index of Point in Deform Image
-		fit.index(3, fcind);
-		m_fixed_cache->indexToPoint(3, fcind, pt);
-		m_deform->pointToIndex(3, pt, dcind);
-
-		// compute bins
-		binfix = round((fit.get()-m_rangefix[0])/m_wfix);
-
-		/**************************************************************
-		 * Compute Marginal and Joint PDF's
-		 **************************************************************/
-		// Sum up Bins for Value Comp
-		for(int ii = 0; ii < movbins; ii++) {
-			m_pdfjoint[{ii,binfix}] += mit[ii];
-		}
-
-		/**************************************************************
-		 * Compute Derivative of Marginal and Joint PDFs
-		 **************************************************************/
-
-		// Find center
-		for(size_t dd=0; dd<3; dd++)
-			dnind[dd] = round(dcind[dd]);
-
-		/********************************************************
-		 * Add to Derivatives of Bins Within Reach of the Point
-		 *******************************************************/
-		for(dind[0] = max<int64_t>(0,dnind[0]-2); dind[0] <
-				min<int64_t>(m_deform->dim(0),dnind[0]+2); dind[0]++) {
-		for(dind[1] = max<int64_t>(0,dnind[1]-2); dind[1] <
-				min<int64_t>(m_deform->dim(1),dnind[1]+2); dind[1]++) {
-		for(dind[2] = max<int64_t>(0,dnind[2]-2); dind[2] <
-				min<int64_t>(m_deform->dim(2),dnind[2]+2); dind[2]++) {
-
-			double dPHI_dphi = 1;
-			for(int ii = 0; ii < 3; ii++)
-				dPHI_dphi *= B3kern(dind[ii]-dcind[ii]);
-
-			double dPHI_dydphi = 1;
-			for(int ii = 0; ii < 3; ii++) {
-				if(ii == m_dir)
-					dPHI_dydphi *= -invspace[ii]*dB3kern(dind[ii]-dcind[ii]);
-				else
-					dPHI_dydphi *= B3kern(dind[ii]-dcind[ii]);
-			}
-
-			for(int ii = 0; ii < movbins; ii++) {
-				dind[3] = ii;
-				dind[4] = binfix;
-				m_dpdfjoint[dind] += dmit[ii]*dPHI_dydphi;
-			}
-		}
-		}
-		}
-	}
+	fillJointPDF();
 
 	///////////////////////
 	// Update Entropies
@@ -1706,22 +3830,7 @@ int ProbDistCorrInfoComp::metric(double& val, VectorXd& grad)
 		}
 	}
 
-	//////////////////////////////
-	// Update Gradient Entropies
-	//////////////////////////////
-
-	size_t dpjsz = m_dpdfjoint.elements();
-	for(size_t ii=0; ii<dpjsz; ii++)
-		m_dpdfjoint[ii] *= -scale;
-	size_t dpmsz = m_dpdfmove.elements();
-	for(size_t ii=0; ii<dpmsz; ii++)
-		m_dpdfmove[ii] *= -scale;
-
-	size_t nparams = m_gradHmove.elements();
-
-	CLOCK(c = clock() - c);
-	CLOCK(cerr << "dPDF() Time: " << c << endl);
-	CLOCK(c = clock());
+	phases.phase("entropyGrad");
 
 	// update m_Hmove
 	m_Hmove = 0;
@@ -1736,32 +3845,74 @@ int ProbDistCorrInfoComp::metric(double& val, VectorXd& grad)
 	for(int ii=0; ii<tbins; ii++)
 		m_Hjoint -= m_pdfjoint[ii] > 0 ? m_pdfjoint[ii]*log(m_pdfjoint[ii]) : 0;
 
-
-	// Compute Gradient Marginal Entropy
-	m_gradHmove.zero();
-	for(int64_t ii=0; ii<m_bins; ii++) {
-		double p = m_pdfmove[ii];
-		if(p <= 0)
-			continue;
-		double lp = (log(p)+1);
-		for(int64_t pp=0; pp<nparams; pp++)
-			m_gradHmove[pp] -= lp*m_dpdfmove[pp*m_bins + ii];
+	/**************************************************************
+	 * Compute Gradient of Joint Entropy
+	 *
+	 * Rather than storing the derivative of every bin with respect to every
+	 * knot, the entropy derivative is gathered at each voxel and scattered
+	 * to the knots supporting it, a (transposed) sparse matrix-vector
+	 * product with the B-spline basis. Each thread accumulates a slab of
+	 * the fixed image into a private gradient, and the gradients are merged
+	 * in a fixed order so that the result does not depend on scheduling.
+	 **************************************************************/
+	vector<double> lpjoint(tbins, 0);
+	for(size_t ii=0; ii<tbins; ii++) {
+		if(m_pdfjoint[ii] > 0)
+			lpjoint[ii] = log(m_pdfjoint[ii])+1;
 	}
 
-	// Compute Gradient Joint Entropy
+	size_t nparams = m_gradHjoint.elements();
+	size_t nchunk = min<size_t>(numThreads(), m_fixed->dim(0));
+	vector<vector<double>> gradbuf(nchunk);
+	nchunk = parallelFor(0, m_fixed->dim(0), [&](size_t chunk, size_t x0,
+				size_t x1)
+	{
+		vector<double>& gradHjoint = gradbuf[chunk];
+		gradHjoint.assign(nparams, 0);
+
+		NDConstView<double> dmove_vw(m_dmoving);
+		NDConstView<double> fix_vw(m_fixed_cache);
+		double fcind[3]; // Continuous index in fixed image
+		double dcind[3]; // Continuous index in deformation
+		double pt[3];
+		int64_t knots[BSplineBasisCache::MAXSUPPORT];
+		double w[BSplineBasisCache::MAXSUPPORT];
+		double dw[BSplineBasisCache::MAXSUPPORT];
+
+		int64_t s0, s1;
+		m_sampler.slab(x0, x1, s0, s1);
+		for(int64_t ss = s0; ss < s1; ss++) {
+			int64_t lin = m_sampler.at(ss);
+			int64_t binfix = round((fix_vw[lin]-m_rangefix[0])/m_wfix);
+
+			// sum over the moving bins this voxel contributes to
+			double dH = 0;
+			for(size_t ii = 0; ii < movbins; ii++)
+				dH += lpjoint[ii*m_bins+binfix]*dmove_vw[lin*movbins+ii];
+			if(dH == 0)
+				continue;
+
+			if(!m_basis.cached()) {
+				m_sampler.index(lin, fcind);
+				m_fixed_cache->indexToPoint(3, fcind, pt);
+				m_deform->pointToIndex(3, pt, dcind);
+			}
+			int nk = m_basis.basis(ss, dcind, knots, w, dw);
+			for(int kk = 0; kk < nk; kk++)
+				gradHjoint[knots[kk]] += dw[kk]*dH;
+		}
+	}, nchunk);
+
 	m_gradHjoint.zero();
-	for(size_t ii=0; ii<tbins; ii++) {
-		double p = m_pdfjoint[ii];
-		if(p <= 0)
-			continue;
-		double lp = (log(p)+1);
-		for(size_t pp=0; pp<nparams; pp++)
-			m_gradHjoint[pp] -= lp*m_dpdfjoint[pp*tbins + ii];
+	for(size_t cc = 0; cc < nchunk; cc++) {
+		for(size_t pp = 0; pp < nparams; pp++)
+			m_gradHjoint[pp] += scale*gradbuf[cc][pp];
 	}
 
-	CLOCK(c = clock() - c);
-	CLOCK(cerr << "dH() Time: " << c << endl);
-	CLOCK(c = clock());
+	// Only the joint entropy is differentiated
+	m_gradHmove.zero();
+
+	phases.end();
 
 	// update value and grad
 	if(m_metric == METRIC_MI) {
@@ -1803,46 +3954,22 @@ int ProbDistCorrInfoComp::metric(double& val, VectorXd& grad)
  */
 int ProbDistCorrInfoComp::metric(double& val)
 {
-	// Views
-	BSplineView<double> bsp_vw(m_deform);
-	bsp_vw.m_boundmethod = ZEROFLUX;
-	bsp_vw.m_ras = true;
-
 	//Zero Inputs
 	m_pdfmove.zero();
 	m_pdffix.zero();
 	m_pdfjoint.zero();
 
-	// for computing distorted indices
-	int binfix; // nearest int
-
 	// Compute Updated Version of Distortion-Corrected Image
-	CLOCK(auto c = clock());
+	TracePhases phases("ProbDistCorrInfoComp::metric");
+	phases.phase("updateCaches");
 	updateCaches();
-	CLOCK(c = clock() - c);
-	CLOCK(cerr << "Apply() Time: " << c << endl);
-	CLOCK(c = clock());
-	size_t movbins = m_moving->tlen();
-
-	// Create Iterators/ Viewers
-	Vector3DConstIter<double> mit(m_moving);
-	NDConstIter<double> fit(m_fixed_cache);
+	phases.phase("jointPDF");
 
 	// compute updated moving width
 	m_wfix = (m_rangefix[1]-m_rangefix[0])/(m_bins-1);
 
 	// Compute Probabilities
-	for(; !fit.eof(); ++mit, ++fit) {
-		// compute bins
-		binfix = round((fit.get()-m_rangefix[0])/m_wfix);
-
-		/**************************************************************
-		 * Compute Joint PDF
-		 **************************************************************/
-		// Sum up Bins for Value Comp
-		for(int ii = 0; ii < movbins; ii++)
-			m_pdfjoint[{ii,binfix}] += mit[ii];
-	}
+	fillJointPDF();
 
 	///////////////////////
 	// Update Entropies
@@ -1866,9 +3993,7 @@ int ProbDistCorrInfoComp::metric(double& val)
 	}
 
 	// Scale Joint
-	CLOCK(c = clock() - c);
-	CLOCK(cerr << "PDF() Time: " << c << endl);
-	CLOCK(c = clock());
+	phases.phase("entropy");
 
 	// Compute Marginal Entropy
 	m_Hmove = 0;
@@ -1893,9 +4018,7 @@ int ProbDistCorrInfoComp::metric(double& val)
 		val =  (m_Hfix+m_Hmove)/m_Hjoint;
 	}
 
-	CLOCK(c = clock() - c);
-	CLOCK(cerr << "H() Time: " << c << endl);
-	CLOCK(c = clock());
+	phases.end();
 
 	// negate if we are using a similarity measure
 	if(m_compdiff && (m_metric == METRIC_NMI || m_metric == METRIC_MI))
@@ -1933,17 +4056,6 @@ int ProbDistCorrInfoComp::valueGrad(const VectorXd& params, double& val,
 	assert(m_pdfjoint.dim(0) == m_bins); // Moving
 	assert(m_pdfjoint.dim(1) == m_bins); // Fixed
 
-	assert(m_dpdfjoint.dim(0) == m_deform->dim(0));
-	assert(m_dpdfjoint.dim(1) == m_deform->dim(1));
-	assert(m_dpdfjoint.dim(2) == m_deform->dim(2));
-	assert(m_dpdfjoint.dim(3) == m_bins); // Moving PDF
-	assert(m_dpdfjoint.dim(4) == m_bins); // Fixed PDF
-
-	assert(m_dpdfmove.dim(0) == m_deform->dim(0));
-	assert(m_dpdfmove.dim(1) == m_deform->dim(1));
-	assert(m_dpdfmove.dim(2) == m_deform->dim(2));
-	assert(m_dpdfmove.dim(3) == m_bins); // Moving
-
 	assert(m_deform->elements() == gradbuff.rows());
 
 	// Fill Deform Image from params
@@ -1972,6 +4084,10 @@ int ProbDistCorrInfoComp::valueGrad(const VectorXd& params, double& val,
 		grad += m_jac_reg*gradbuff;
 	}
 
+	// New samples for each iteration
+	if(m_sampler.resample())
+		m_sampler.sample(m_fixed);
+
 	// Compute and add Metric
 	double tmp = 0;
 	if(metric(tmp, gradbuff) != 0) return -1;
@@ -2079,7 +4195,8 @@ int ProbDistCorrInfoComp::value(const VectorXd& params, double& val)
  * @param compdiff negate MI and NMI to create an effective distance
  */
 DistCorrInfoComp::DistCorrInfoComp(bool compdiff) :
-	m_compdiff(compdiff), m_metric(METRIC_MI)
+	m_compdiff(compdiff), m_metric(METRIC_MI),
+	m_basis(std::make_shared<BSplineBasisCache>())
 {
 	m_knotspace = 10;
 	setBins(128, 4);
@@ -2149,11 +4266,8 @@ void DistCorrInfoComp::initializeKnots(double space)
 	m_gradHjoint.resize(osize.data());
 	m_gradHmove.resize(osize.data());
 
-	// Create Derivates of Individual Bins
-	m_dpdfmove.resize(osize.data());
-	m_dpdfjoint.resize(osize.data());
-
 	m_deform->m_phasedim = m_dir;
+	m_basis->invalidate();
 }
 
 /**
@@ -2236,6 +4350,8 @@ void DistCorrInfoComp::setFixed(ptr<const MRImage> newfixed)
 		throw INVALID_ARGUMENT("Fixed image is not 3D!");
 
 	m_fixed = newfixed;
+	m_sampler.sample(m_fixed);
+	m_basis->invalidate();
 
 	// Compute Range of Values
 	m_rangefix[0] = INFINITY;
@@ -2247,63 +4363,168 @@ void DistCorrInfoComp::setFixed(ptr<const MRImage> newfixed)
 }
 
 /**
- * @brief Updates m_move_cache, m_dmove_cache, m_corr_cache and m_rangemove
+ * @brief Sets the strategy for choosing the voxels of the fixed image that
+ * contribute to the joint histogram. If the fixed image has been set a new
+ * sample is drawn immediately.
+ *
+ * @param mode Sampling mode
+ * @param frac Fraction of voxels to use, in (0, 1]
+ * @param resample Draw a new sample at each call to valueGrad
+ * @param mask Mask to sample from, required for SAMPLE_MASK
+ */
+void DistCorrInfoComp::setSampling(SampleMode mode, double frac,
+		bool resample, ptr<const MRImage> mask)
+{
+	m_sampler.setup(mode, frac, resample, mask);
+	m_basis->invalidate();
+	if(m_fixed)
+		m_sampler.sample(m_fixed);
+}
+
+/**
+ * @brief Updates m_move_cache, m_dmove_cache, m_corr_cache and m_rangemove at
+ * the voxels chosen by m_sampler
  */
 void DistCorrInfoComp::updateCaches()
 {
+	m_basis->update(m_fixed, m_deform, m_dir, m_sampler);
+
+	// Each thread updates a slab of the caches and finds its own range, the
+	// ranges are merged afterward
+	size_t nchunk = min<size_t>(numThreads(), m_fixed->dim(0));
+	vector<double> rangebuf(2*nchunk, 0);
+	nchunk = parallelFor(0, m_fixed->dim(0), [&](size_t chunk, size_t x0,
+				size_t x1)
+	{
+		NDConstView<double> move_vw(m_moving);
+		NDConstView<double> dmove_vw(m_dmoving);
+		NDView<double> mcache_vw(m_move_cache);
+		NDView<double> dmcache_vw(m_dmove_cache);
+		NDView<double> ccache_vw(m_corr_cache);
+		NDConstView<double> param_vw(m_deform);
+
+		// Compute Probabilities (only at sampled voxels)
+		size_t dirlen = m_corr_cache->dim(m_dir);
+		double dcind[3]; // index in distortion image
+		int64_t ind[3];
+		int64_t mind[3] ;
+		double pt[3]; // point
+		double Fm = 0;
+		double dFm = 0;
+		double* range = &rangebuf[2*chunk];
+		int64_t knots[BSplineBasisCache::MAXSUPPORT];
+		double w[BSplineBasisCache::MAXSUPPORT];
+		double dw[BSplineBasisCache::MAXSUPPORT];
+
+		int64_t s0, s1;
+		m_sampler.slab(x0, x1, s0, s1);
+		for(int64_t ss = s0; ss < s1; ss++) {
+
+			// Compute Continuous Index of Point in Deform Image
+			m_sampler.index(m_sampler.at(ss), ind);
+			std::copy(ind, ind+3, mind);
+			if(!m_basis->cached()) {
+				m_move_cache->indexToPoint(3, mind, pt);
+				m_deform->pointToIndex(3, pt, dcind);
+			}
+
+			// Sample B-Spline Value and Derivative at Current Position
+			double def = 0, ddef = 0;
+			int nk = m_basis->basis(ss, dcind, knots, w, dw);
+			for(int kk = 0; kk < nk; kk++) {
+				def += w[kk]*param_vw[knots[kk]];
+				ddef += dw[kk]*param_vw[knots[kk]];
+			}
+
+			// get linear index
+			double cind = mind[m_dir] + def/m_moving->spacing(m_dir);
+			int64_t below = (int64_t)floor(cind);
+			int64_t above = below + 1;
+			Fm = 0;
+			dFm = 0;
+
+			// get values
+			if(below >= 0 && below < dirlen) {
+				mind[m_dir] = below;
+				dFm += dmove_vw.get(3, mind)*linKern(below-cind);
+				Fm += move_vw.get(3, mind)*linKern(below-cind);
+			}
+			if(above >= 0 && above < dirlen) {
+				mind[m_dir] = above;
+				dFm += dmove_vw.get(3, mind)*linKern(above-cind);
+				Fm += move_vw.get(3, mind)*linKern(above-cind);
+			}
+
+			if(Fm < 1e-10 || ddef < -1) Fm = 0;
+			mcache_vw.set(3, ind, Fm);
+			ccache_vw.set(3, ind, Fm*(1+ddef));
+			dmcache_vw.set(3, ind, dFm);
+
+			double Fc = ccache_vw.get(3, ind);
+			range[0] = std::min(range[0], Fc);
+			range[1] = std::max(range[1], Fc);
+		}
+	}, nchunk);
+
+	// must include 0 because outside values get mapped to 0
 	m_rangemove[0] = 0;
 	m_rangemove[1] = 0;
-	NDConstView<double> move_vw(m_moving);
-	NDConstView<double> dmove_vw(m_dmoving);
-	BSplineView<double> bsp_vw(m_deform);
-	bsp_vw.m_boundmethod = ZEROFLUX;
-	bsp_vw.m_ras = true;
+	for(size_t cc = 0; cc < nchunk; cc++) {
+		m_rangemove[0] = std::min(m_rangemove[0], rangebuf[2*cc]);
+		m_rangemove[1] = std::max(m_rangemove[1], rangebuf[2*cc+1]);
+	}
+}
 
-	// Compute Probabilities
-	size_t dirlen = m_corr_cache->dim(m_dir);
-	double dcind[3]; // index in distortion image
-	int64_t mind[3] ;
-	double pt[3]; // point
-	double Fm = 0;
-	double dFm = 0;
-	for(NDIter<double> dmit(m_dmove_cache), mit(m_move_cache), cit(m_corr_cache);
-			!mit.eof(); ++dmit, ++mit, ++cit) {
-
-		// Compute Continuous Index of Point in Deform Image
-		dmit.index(3, mind);
-		m_move_cache->indexToPoint(3, mind, pt);
-		m_deform->pointToIndex(3, pt, dcind);
-
-		// Sample B-Spline Value and Derivative at Current Position
-		double def = 0, ddef = 0;
-		bsp_vw.get(3, pt, m_dir, def, ddef);
-
-		// get linear index
-		double cind = mind[m_dir] + def/m_moving->spacing(m_dir);
-		int64_t below = (int64_t)floor(cind);
-		int64_t above = below + 1;
-		Fm = 0;
-		dFm = 0;
-
-		// get values
-		if(below >= 0 && below < dirlen) {
-			mind[m_dir] = below;
-			dFm += dmove_vw.get(3, mind)*linKern(below-cind);
-			Fm += move_vw.get(3, mind)*linKern(below-cind);
-		}
-		if(above >= 0 && above < dirlen) {
-			mind[m_dir] = above;
-			dFm += dmove_vw.get(3, mind)*linKern(above-cind);
-			Fm += move_vw.get(3, mind)*linKern(above-cind);
+/**
+ * @brief Fills m_pdfjoint with the (unnormalized) Parzen-windowed joint
+ * histogram of m_fixed and m_corr_cache over the voxels chosen by m_sampler.
+ * Each thread accumulates a slab of
+ * the fixed image into a private histogram, and the histograms are merged in
+ * a fixed order so that the result does not depend on scheduling.
+ */
+void DistCorrInfoComp::fillJointPDF()
+{
+	const int64_t bins = m_bins;
+	const int64_t tbins = bins*bins;
+	const int krad = m_krad;
+	const int kwidth = 2*m_krad+1;
+
+	size_t nchunk = min<size_t>(numThreads(), m_fixed->dim(0));
+	vector<vector<double>> pdfbuf(nchunk);
+	nchunk = parallelFor(0, m_fixed->dim(0), [&](size_t chunk, size_t x0,
+				size_t x1)
+	{
+		vector<double>& pdf = pdfbuf[chunk];
+		pdf.assign(tbins, 0);
+		vector<double> movweight(kwidth);
+		vector<double> fixweight(kwidth);
+
+		NDConstView<double> corr_vw(m_corr_cache);
+		NDConstView<double> fix_vw(m_fixed);
+		int64_t s0, s1;
+		m_sampler.slab(x0, x1, s0, s1);
+		for(int64_t ss = s0; ss < s1; ss++) {
+			int64_t lin = m_sampler.at(ss);
+			double cbinfix = (fix_vw[lin]-m_rangefix[0])/m_wfix + m_krad;
+			int64_t binfix = round(cbinfix);
+			double cbinmove = (corr_vw[lin]-m_rangemove[0])/m_wmove + m_krad;
+			int64_t binmove = round(cbinmove);
+
+			parzenWeights(binfix-krad-cbinfix, krad, kwidth,
+					fixweight.data(), NULL);
+			parzenWeights(binmove-krad-cbinmove, krad, kwidth,
+					movweight.data(), NULL);
+			for(int ii = 0; ii < kwidth; ii++) {
+				double* row = &pdf[(binfix-krad+ii)*bins + binmove-krad];
+				for(int jj = 0; jj < kwidth; jj++)
+					row[jj] += fixweight[ii]*movweight[jj];
+			}
 		}
+	}, nchunk);
 
-		if(Fm < 1e-10 || ddef < -1) Fm = 0;
-		mit.set(Fm);
-		cit.set(Fm*(1+ddef));
-		dmit.set(dFm);
-
-		m_rangemove[0] = std::min(m_rangemove[0], cit.get());
-		m_rangemove[1] = std::max(m_rangemove[1], cit.get());
+	for(size_t cc = 0; cc < nchunk; cc++) {
+		for(int64_t bb = 0; bb < tbins; bb++)
+			m_pdfjoint[bb] += pdfbuf[cc][bb];
 	}
 }
 
@@ -2316,165 +4537,31 @@ void DistCorrInfoComp::updateCaches()
  */
 int DistCorrInfoComp::metric(double& val, VectorXd& grad)
 {
-	CLOCK(clock_t c = clock());
+	TracePhases phases("DistCorrInfoComp::metric");
 	//Zero Inputs
 	m_pdfmove.zero();
 	m_pdffix.zero();
 	m_pdfjoint.zero();
-	m_dpdfmove.zero();
-	m_dpdfjoint.zero();
-
-	// for computing distorted indices
-	double cbinmove, cbinfix; //continuous
-	int binmove, binfix; // nearest int
-	double fcind[3]; // Continuous index in fixed image
-	double dcind[3]; // Continuous index in deformation
-	int64_t dnind[3]; // Nearest knot to dcind
-	int64_t dind[5]; // last two dimensions are for bins
-	double pt[3];
-	double Fm;   /** Moving Value */
-	double dFm;  /** Derivative Moving Value */
-	double Fc;   /** Intensity Corrected Moving Value */
-	double Ff;   /** Fixed Value Value */
-
-	// probweight cached derivative of p wrt to the center parameter
-	vector<double> dmovweight(2*m_krad+1);
-	vector<double> movweight(2*m_krad+1);
-	vector<double> fixweight(2*m_krad+1);
-	vector<double> invspace(m_deform->ndim());
-	for(size_t dd=0; dd<m_deform->ndim(); dd++)
-		invspace[dd] = 1./m_deform->spacing(dd);
-
-	Counter<> neighbors(3);
-	for(size_t dd=0; dd<3; dd++) neighbors.sz[dd] = 5;
 
 	// Compute Updated Version of Distortion-Corrected Image
-	CLOCK(c = clock());
+	phases.phase("updateCaches");
 	updateCaches();
-	CLOCK(c = clock() - c);
-	CLOCK(cerr << "Apply() Time:" << c << endl);
-	CLOCK(c = clock());
-
-	// Create Iterators/ Viewers
-	NDConstIter<double> cit(m_corr_cache);
-	NDConstIter<double> mit(m_move_cache);
-	NDConstIter<double> dmit(m_dmove_cache);
-	NDConstIter<double> fit(m_fixed);
-
-	BSplineView<double> bsp_vw(m_deform);
-	bsp_vw.m_boundmethod = ZEROFLUX;
-	bsp_vw.m_ras = true;
+	phases.phase("jointPDF");
 
 	// compute updated moving width
 	m_wmove = (m_rangemove[1]-m_rangemove[0])/(m_bins-2*m_krad-1);
 	m_wfix = (m_rangefix[1]-m_rangefix[0])/(m_bins-2*m_krad-1);
 
 	// Compute Probabilities
-	for(cit.goBegin(), dmit.goBegin(), mit.goBegin(), fit.goBegin();
-			!fit.eof(); ++cit, ++mit, ++fit, ++dmit) {
-
-		// Compute Continuous Index of Point in Deform Image
-		fit.index(3, fcind);
-		m_fixed->indexToPoint(3, fcind, pt);
-		m_deform->pointToIndex(3, pt, dcind);
-
-		// get actual values
-		Fm = mit.get();
-		Fc = cit.get();
-		dFm = dmit.get();
-		Ff = fit.get();
-
-		// compute bins
-		cbinfix = (Ff-m_rangefix[0])/m_wfix + m_krad;
-		binfix = round(cbinfix);
-		cbinmove = (Fc-m_rangemove[0])/m_wmove + m_krad;
-		binmove = round(cbinmove);
-
-		/**************************************************************
-		 * Compute Marginal and Joint PDF's
-		 **************************************************************/
-
-		for(int jj = binmove-m_krad; jj <= binmove+m_krad; jj++)
-			dmovweight[jj-binmove+m_krad] = dB3kern(jj-cbinmove, m_krad);
-		for(int jj = binmove-m_krad; jj <= binmove+m_krad; jj++)
-			movweight[jj-binmove+m_krad] = B3kern(jj-cbinmove, m_krad);
-		for(int ii = binfix-m_krad; ii <= binfix+m_krad; ii++)
-			fixweight[ii-binfix+m_krad] = B3kern(ii-cbinfix, m_krad);
-
-		// Sum up Bins for Value Comp
-		for(int ii = binfix-m_krad; ii <= binfix+m_krad; ii++) {
-			for(int jj = binmove-m_krad; jj <= binmove+m_krad; jj++) {
-				m_pdfjoint[{ii,jj}] += movweight[jj-binmove+m_krad]*
-					fixweight[ii-binfix+m_krad];
-			}
-		}
-
-		/**************************************************************
-		 * Compute Derivative of Marginal and Joint PDFs
-		 **************************************************************/
-		if(dFm == 0 && Fm == 0)
-			continue;
-
-		assert(binfix+m_krad < m_bins);
-		assert(binmove+m_krad < m_bins);
-		assert(binfix-m_krad >= 0);
-		assert(binmove-m_krad >= 0);
-
-		// Find center
-		for(size_t dd=0; dd<3; dd++)
-			dnind[dd] = round(dcind[dd]);
-
-		/********************************************************
-		 * Add to Derivatives of Bins Within Reach of the Point
-		 *******************************************************/
-		for(dind[0] = max<int64_t>(0,dnind[0]-2); dind[0] <
-				min<int64_t>(m_deform->dim(0),dnind[0]+2); dind[0]++) {
-		for(dind[1] = max<int64_t>(0,dnind[1]-2); dind[1] <
-				min<int64_t>(m_deform->dim(1),dnind[1]+2); dind[1]++) {
-		for(dind[2] = max<int64_t>(0,dnind[2]-2); dind[2] <
-				min<int64_t>(m_deform->dim(2),dnind[2]+2); dind[2]++) {
-
-			double dPHI_dphi = 1;
-			for(int ii = 0; ii < 3; ii++)
-				dPHI_dphi *= B3kern(dind[ii]-dcind[ii]);
-
-			double dPHI_dydphi = 1;
-			for(int ii = 0; ii < 3; ii++) {
-				if(ii == m_dir)
-					dPHI_dydphi *= -invspace[ii]*dB3kern(dind[ii]-dcind[ii]);
-				else
-					dPHI_dydphi *= B3kern(dind[ii]-dcind[ii]);
-			}
-
-			double dg_dphi;
-			if(Fm <= 0) // 0/0 => 1
-				dg_dphi = dFm*dPHI_dphi;
-			else
-				dg_dphi = dFm*dPHI_dphi*Fc/Fm + Fm*dPHI_dydphi;
-
-			assert(dg_dphi == dg_dphi);
-			for(int jj = binmove-m_krad; jj <= binmove+m_krad; jj++) {
-				double tmp = dg_dphi*dmovweight[jj-binmove+m_krad];
-				dind[3] = jj;
-				m_dpdfmove[dind] += tmp;
-				for(int ii = binfix-m_krad; ii <= binfix+m_krad; ii++) {
-					dind[3] = ii;
-					dind[4] = jj;
-					m_dpdfjoint[dind] += tmp*fixweight[ii-binfix+m_krad];
-
-				}
-			}
-		}
-		}
-		}
-	}
+	fillJointPDF();
 
 	///////////////////////
 	// Update Entropies
 	///////////////////////
+	const int64_t bins = m_bins;
+	const size_t tbins = bins*bins;
 
 	// scale
-	size_t tbins = m_bins*m_bins;
 	double scale = 0;
 	for(size_t ii=0; ii<tbins; ii++)
 		scale += m_pdfjoint[ii];
@@ -2490,23 +4577,7 @@ int DistCorrInfoComp::metric(double& val, VectorXd& grad)
 		}
 	}
 
-	//////////////////////////////
-	// Update Gradient Entropies
-	//////////////////////////////
-
-	scale = -scale/m_wmove;
-	size_t dpjsz = m_dpdfjoint.elements();
-	for(size_t ii=0; ii<dpjsz; ii++)
-		m_dpdfjoint[ii] *= scale;
-	size_t dpmsz = m_dpdfmove.elements();
-	for(size_t ii=0; ii<dpmsz; ii++)
-		m_dpdfmove[ii] *= scale;
-
-	size_t nparams = m_gradHmove.elements();
-
-	CLOCK(c = clock() - c);
-	CLOCK(cerr << "dPDF() Time: " << c << endl);
-	CLOCK(c = clock());
+	phases.phase("entropyGrad");
 
 	// update m_Hmove
 	m_Hmove = 0;
@@ -2521,32 +4592,150 @@ int DistCorrInfoComp::metric(double& val, VectorXd& grad)
 	for(int ii=0; ii<tbins; ii++)
 		m_Hjoint -= m_pdfjoint[ii] > 0 ? m_pdfjoint[ii]*log(m_pdfjoint[ii]) : 0;
 
-
-	// Compute Gradient Marginal Entropy
-	m_gradHmove.zero();
-	for(int64_t ii=0; ii<m_bins; ii++) {
-		double p = m_pdfmove[ii];
-		if(p <= 0)
-			continue;
-		double lp = (log(p)+1);
-		for(int64_t pp=0; pp<nparams; pp++)
-			m_gradHmove[pp] -= lp*m_dpdfmove[pp*m_bins + ii];
+	/**************************************************************
+	 * Compute Gradient of Marginal and Joint Entropies
+	 *
+	 * Rather than storing the derivative of every bin with respect to every
+	 * knot, the entropy derivatives are gathered over the Parzen window of
+	 * each voxel and scattered to the knots supporting it, a (transposed)
+	 * sparse matrix-vector product with the B-spline basis. Each thread
+	 * accumulates a slab of the fixed image into private gradients, and the
+	 * gradients are merged in a fixed order so that the result does not
+	 * depend on scheduling.
+	 **************************************************************/
+	vector<double> lpjoint(tbins, 0);
+	vector<double> lpmove(bins, 0);
+	for(size_t ii=0; ii<tbins; ii++) {
+		if(m_pdfjoint[ii] > 0)
+			lpjoint[ii] = log(m_pdfjoint[ii])+1;
+	}
+	for(int64_t ii=0; ii<bins; ii++) {
+		if(m_pdfmove[ii] > 0)
+			lpmove[ii] = log(m_pdfmove[ii])+1;
 	}
 
-	// Compute Gradient Joint Entropy
+	const int krad = m_krad;
+	const int kwidth = 2*m_krad+1;
+	size_t nparams = m_gradHjoint.elements();
+	size_t nchunk = min<size_t>(numThreads(), m_fixed->dim(0));
+	vector<vector<double>> jointbuf(nchunk);
+	vector<vector<double>> movebuf(nchunk);
+	nchunk = parallelFor(0, m_fixed->dim(0), [&](size_t chunk, size_t x0,
+				size_t x1)
+	{
+		vector<double>& gradHjoint = jointbuf[chunk];
+		vector<double>& gradHmove = movebuf[chunk];
+		gradHjoint.assign(nparams, 0);
+		gradHmove.assign(nparams, 0);
+
+		double fcind[3]; // Continuous index in fixed image
+		double dcind[3]; // Continuous index in deformation
+		double pt[3];
+		double Fm;   /** Moving Value */
+		double dFm;  /** Derivative Moving Value */
+		double Fc;   /** Intensity Corrected Moving Value */
+		double Ff;   /** Fixed Value Value */
+		int64_t knots[BSplineBasisCache::MAXSUPPORT];
+		double w[BSplineBasisCache::MAXSUPPORT];
+		double dw[BSplineBasisCache::MAXSUPPORT];
+
+		// probweight cached derivative of p wrt to the center parameter
+		vector<double> dmovweight(kwidth);
+		vector<double> movweight(kwidth);
+		vector<double> fixweight(kwidth);
+
+		NDConstView<double> corr_vw(m_corr_cache);
+		NDConstView<double> move_vw(m_move_cache);
+		NDConstView<double> dmove_vw(m_dmove_cache);
+		NDConstView<double> fix_vw(m_fixed);
+
+		int64_t s0, s1;
+		m_sampler.slab(x0, x1, s0, s1);
+		for(int64_t ss = s0; ss < s1; ss++) {
+			int64_t lin = m_sampler.at(ss);
+
+			// get actual values
+			Fm = move_vw[lin];
+			dFm = dmove_vw[lin];
+			if(dFm == 0 && Fm == 0)
+				continue;
+			Fc = corr_vw[lin];
+			Ff = fix_vw[lin];
+
+			// compute bins
+			double cbinfix = (Ff-m_rangefix[0])/m_wfix + m_krad;
+			int64_t binfix = round(cbinfix);
+			double cbinmove = (Fc-m_rangemove[0])/m_wmove + m_krad;
+			int64_t binmove = round(cbinmove);
+
+			assert(binfix+m_krad < m_bins);
+			assert(binmove+m_krad < m_bins);
+			assert(binfix-m_krad >= 0);
+			assert(binmove-m_krad >= 0);
+
+			parzenWeights(binfix-krad-cbinfix, krad, kwidth,
+					fixweight.data(), NULL);
+			parzenWeights(binmove-krad-cbinmove, krad, kwidth,
+					movweight.data(), dmovweight.data());
+
+			// Gather entropy derivatives over the window, bins are laid out
+			// [fixed][moving] so each row of the window is contiguous
+			double dHjoint = 0;
+			double dHmove = 0;
+			for(int ii = 0; ii < kwidth; ii++) {
+				const double* row = &lpjoint[(binfix-krad+ii)*bins +
+					binmove-krad];
+				double tmp = 0;
+				for(int jj = 0; jj < kwidth; jj++)
+					tmp += row[jj]*dmovweight[jj];
+				dHjoint += fixweight[ii]*tmp;
+			}
+			for(int jj = 0; jj < kwidth; jj++)
+				dHmove += lpmove[binmove-krad+jj]*dmovweight[jj];
+			if(dHjoint == 0 && dHmove == 0)
+				continue;
+
+			// dg/dphi = a*PHI + b*dPHI/dy, where PHI is the basis
+			double a, b;
+			if(Fm <= 0) { // 0/0 => 1
+				a = dFm;
+				b = 0;
+			} else {
+				a = dFm*Fc/Fm;
+				b = Fm;
+			}
+
+			/********************************************************
+			 * Scatter to the Knots Within Reach of the Point
+			 *******************************************************/
+			if(!m_basis->cached()) {
+				m_sampler.index(lin, fcind);
+				m_fixed->indexToPoint(3, fcind, pt);
+				m_deform->pointToIndex(3, pt, dcind);
+			}
+			int nk = m_basis->basis(ss, dcind, knots, w, dw);
+			for(int kk = 0; kk < nk; kk++) {
+				double dg_dphi = a*w[kk] + b*dw[kk];
+				assert(dg_dphi == dg_dphi);
+				gradHjoint[knots[kk]] += dg_dphi*dHjoint;
+				gradHmove[knots[kk]] += dg_dphi*dHmove;
+			}
+		}
+	}, nchunk);
+
+	// Normalize, the -1 of dH = -SUM (log(p)+1) dp cancels the -1/m_wmove
+	// from moving the Parzen window
+	scale = scale/m_wmove;
 	m_gradHjoint.zero();
-	for(size_t ii=0; ii<tbins; ii++) {
-		double p = m_pdfjoint[ii];
-		if(p <= 0)
-			continue;
-		double lp = (log(p)+1);
-		for(size_t pp=0; pp<nparams; pp++)
-			m_gradHjoint[pp] -= lp*m_dpdfjoint[pp*tbins + ii];
+	m_gradHmove.zero();
+	for(size_t cc = 0; cc < nchunk; cc++) {
+		for(size_t pp = 0; pp < nparams; pp++) {
+			m_gradHjoint[pp] += scale*jointbuf[cc][pp];
+			m_gradHmove[pp] += scale*movebuf[cc][pp];
+		}
 	}
 
-	CLOCK(c = clock() - c);
-	CLOCK(cerr << "dH() Time: " << c << endl);
-	CLOCK(c = clock());
+	phases.end();
 
 	// update value and grad
 	if(m_metric == METRIC_MI) {
@@ -2598,52 +4787,18 @@ int DistCorrInfoComp::metric(double& val)
 	m_pdffix.zero();
 	m_pdfjoint.zero();
 
-	// for computing distorted indices
-	double cbinmove, cbinfix; //continuous
-	int binmove, binfix; // nearest int
-	double Fc;   /** Intensity Corrected Moving Value */
-	double Ff;   /** Fixed Value Value */
-
 	// Compute Updated Version of Distortion-Corrected Image
-	CLOCK(auto c = clock());
+	TracePhases phases("DistCorrInfoComp::metric");
+	phases.phase("updateCaches");
 	updateCaches();
-	CLOCK(c = clock() - c);
-	CLOCK(cerr << "Apply() Time: " << c << endl);
-	CLOCK(c = clock());
-
-	// Create Iterators/ Viewers
-	NDConstIter<double> cit(m_corr_cache);
-	NDConstIter<double> mit(m_move_cache);
-	NDConstIter<double> fit(m_fixed);
+	phases.phase("jointPDF");
 
 	// compute updated moving width
 	m_wmove = (m_rangemove[1]-m_rangemove[0])/(m_bins-2*m_krad-1);
 	m_wfix = (m_rangefix[1]-m_rangefix[0])/(m_bins-2*m_krad-1);
 
 	// Compute Probabilities
-	for(cit.goBegin(), mit.goBegin(), fit.goBegin();
-			!fit.eof(); ++cit, ++mit, ++fit) {
-		// get actual values
-		Fc = cit.get();
-		Ff = fit.get();
-
-		// compute bins
-		cbinfix = (Ff-m_rangefix[0])/m_wfix + m_krad;
-		binfix = round(cbinfix);
-		cbinmove = (Fc-m_rangemove[0])/m_wmove + m_krad;
-		binmove = round(cbinmove);
-
-		/**************************************************************
-		 * Compute Joint PDF
-		 **************************************************************/
-		// Sum up Bins for Value Comp
-		for(int ii = binfix-m_krad; ii <= binfix+m_krad; ii++) {
-			for(int jj = binmove-m_krad; jj <= binmove+m_krad; jj++) {
-				m_pdfjoint[{ii,jj}] += B3kern(jj-cbinmove, m_krad)*
-					B3kern(ii-cbinfix, m_krad);
-			}
-		}
-	}
+	fillJointPDF();
 
 	///////////////////////
 	// Update Entropies
@@ -2667,9 +4822,7 @@ int DistCorrInfoComp::metric(double& val)
 	}
 
 	// Scale Joint
-	CLOCK(c = clock() - c);
-	CLOCK(cerr << "PDF() Time: " << c << endl);
-	CLOCK(c = clock());
+	phases.phase("entropy");
 
 	// Compute Marginal Entropy
 	m_Hmove = 0;
@@ -2694,9 +4847,7 @@ int DistCorrInfoComp::metric(double& val)
 		val =  (m_Hfix+m_Hmove)/m_Hjoint;
 	}
 
-	CLOCK(c = clock() - c);
-	CLOCK(cerr << "H() Time: " << c << endl);
-	CLOCK(c = clock());
+	phases.end();
 
 	// negate if we are using a similarity measure
 	if(m_compdiff && (m_metric == METRIC_NMI || m_metric == METRIC_MI))
@@ -2735,17 +4886,6 @@ int DistCorrInfoComp::valueGrad(const VectorXd& params,
 	assert(m_pdfjoint.dim(0) == m_bins); // Moving
 	assert(m_pdfjoint.dim(1) == m_bins); // Fixed
 
-	assert(m_dpdfjoint.dim(0) == m_deform->dim(0));
-	assert(m_dpdfjoint.dim(1) == m_deform->dim(1));
-	assert(m_dpdfjoint.dim(2) == m_deform->dim(2));
-	assert(m_dpdfjoint.dim(3) == m_bins); // Moving PDF
-	assert(m_dpdfjoint.dim(4) == m_bins); // Fixed PDF
-
-	assert(m_dpdfmove.dim(0) == m_deform->dim(0));
-	assert(m_dpdfmove.dim(1) == m_deform->dim(1));
-	assert(m_dpdfmove.dim(2) == m_deform->dim(2));
-	assert(m_dpdfmove.dim(3) == m_bins); // Moving
-
 	assert(m_deform->elements() == gradbuff.rows());
 
 	// Fill Deform Image from params
@@ -2774,6 +4914,10 @@ int DistCorrInfoComp::valueGrad(const VectorXd& params,
 		grad += m_jac_reg*gradbuff;
 	}
 
+	// New samples for each iteration
+	if(m_sampler.resample())
+		m_sampler.sample(m_fixed);
+
 	// Compute and add Metric
 	double tmp = 0;
 	if(metric(tmp, gradbuff) != 0) return -1;
@@ -2998,8 +5142,8 @@ void Rigid3DTrans::toRASCoords(shared_ptr<const MRImage> in)
 	shift = t;
 	center = d;
 	rotation[1] = asin(Q(0,2));
-	rotation[2] = -Q(0,1)/cos(rotation[1]);
-	rotation[0] = -Q(1,2)/cos(rotation[1]);
+	rotation[2] = atan2(-Q(0,1), Q(0,0));
+	rotation[0] = atan2(-Q(1,2), Q(2,2));
 };
 
 /**
@@ -3091,8 +5235,8 @@ void Rigid3DTrans::toIndexCoords(shared_ptr<const MRImage> in,
 	shift = s;
 	center = c;
 	rotation[1] = asin(R(0,2));
-	rotation[2] = -R(0,1)/cos(rotation[1]);
-	rotation[0] = -R(1,2)/cos(rotation[1]);
+	rotation[2] = atan2(-R(0,1), R(0,0));
+	rotation[0] = atan2(-R(1,2), R(2,2));
 	//	rotation = R.eulerAngles(0,1,2);
 };
 
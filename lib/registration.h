@@ -18,6 +18,9 @@
 #include <Eigen/Dense>
 
 #include <memory>
+#include <mutex>
+#include <random>
+#include <vector>
 
 namespace npl {
 
@@ -39,6 +42,323 @@ namespace npl {
 
 /** @{ */
 
+/**
+ * @brief Picks the voxels of a 3D image that are used to estimate a metric.
+ * With SAMPLE_FULL every voxel is visited, otherwise a sorted list of linear
+ * indices is drawn by sample(). Samples are sorted so that those falling in a
+ * range of planes of the first dimension can be found with slab(), which lets
+ * the metrics keep their slab-parallel structure.
+ */
+class VoxelSampler
+{
+public:
+	VoxelSampler();
+
+	/**
+	 * @brief Sets the sampling strategy. This does not draw new samples, call
+	 * sample() after changing the strategy.
+	 *
+	 * @param mode Sampling mode
+	 * @param frac Fraction of voxels to use (of the voxels in the mask for
+	 * SAMPLE_MASK), must be in (0, 1]
+	 * @param resample Draw a new set of samples for each optimizer iteration
+	 * rather than using the same samples throughout
+	 * @param mask Mask to restrict sampling to (only used by SAMPLE_MASK).
+	 * Voxels are mapped to the mask through their physical location, so the
+	 * mask need not have the same sampling as the image.
+	 */
+	void setup(SampleMode mode, double frac, bool resample,
+			ptr<const MRImage> mask);
+
+	/**
+	 * @brief Draws a new set of samples from the grid of img (values of img are
+	 * not used)
+	 *
+	 * @param img Image to draw samples from
+	 */
+	void sample(ptr<const MRImage> img);
+
+	/**
+	 * @brief Whether new samples should be drawn for each iteration
+	 */
+	bool resample() const { return m_resample; };
+
+	/**
+	 * @brief Whether every voxel is being used
+	 */
+	bool full() const { return m_mode == SAMPLE_FULL; };
+
+	/**
+	 * @brief Number of voxels in the current sample
+	 */
+	int64_t size() const;
+
+	/**
+	 * @brief Finds the positions [b, e) in the sample whose voxels fall in
+	 * planes [x0, x1) of the first dimension. Use at() to convert positions
+	 * into linear indices.
+	 *
+	 * @param x0 First plane
+	 * @param x1 One past the last plane
+	 * @param b Output first position
+	 * @param e Output one past the last position
+	 */
+	void slab(int64_t x0, int64_t x1, int64_t& b, int64_t& e) const;
+
+	/**
+	 * @brief Returns the linear index of the voxel at the given position in
+	 * the sample
+	 */
+	int64_t at(int64_t pos) const
+	{
+		return m_mode == SAMPLE_FULL ? pos : m_samples[pos];
+	};
+
+	/**
+	 * @brief Converts a linear index into a 3D index
+	 *
+	 * @param lin Linear index
+	 * @param ind Output index (x,y,z)
+	 */
+	template <typename T>
+	void index(int64_t lin, T* ind) const
+	{
+		ind[2] = lin%m_dim[2];
+		lin /= m_dim[2];
+		ind[1] = lin%m_dim[1];
+		ind[0] = lin/m_dim[1];
+	};
+
+private:
+	SampleMode m_mode;
+	double m_frac;
+	bool m_resample;
+	ptr<const MRImage> m_mask;
+
+	int64_t m_dim[3];
+	std::vector<int64_t> m_samples;
+	std::mt19937 m_rng;
+
+	// voxels inside m_mask for the last image sampled (m_maskimg)
+	std::vector<int64_t> m_inside;
+	ptr<const MRImage> m_maskimg;
+};
+
+/**
+ * @brief Gaussian scale-space pyramid of an image, one smoothed and
+ * downsampled image per sigma (see smoothDownsample). Levels are built from
+ * the finest to the coarsest, each from the previous one, smoothing only by
+ * the additional sqrt(s1^2 - s0^2), so large sigmas never start from full
+ * resolution. Derivative images (as used by the setMoving functions of the
+ * rigid computers) may be computed once and cached.
+ *
+ * Because levels are downsampled from the previous level, the spacing of
+ * coarse levels may differ slightly from smoothDownsample(img, sigma), so
+ * images that are compared at each level should all come from pyramids.
+ *
+ * All levels are computed by the constructor and computeDerivs(), after
+ * which the pyramid is read-only and may be shared between threads.
+ */
+class ImagePyramid
+{
+public:
+	/**
+	 * @brief Builds all the levels of the pyramid.
+	 *
+	 * @param img Input image
+	 * @param sigmas Standard deviation of smoothing (in physical units) for
+	 * each level, in any order (levels are returned in this order)
+	 * @param spacefactor Output spacing of each level is sigma*spacefactor
+	 * (but never finer than the input)
+	 * @param derivs Also compute the derivative images (computeDerivs)
+	 */
+	ImagePyramid(ptr<const MRImage> img, const std::vector<double>& sigmas,
+			double spacefactor = 1, bool derivs = false);
+
+	/**
+	 * @brief Computes the derivative (in every direction) of each level, if
+	 * they have not already been computed
+	 */
+	void computeDerivs();
+
+	/**
+	 * @brief Number of levels
+	 */
+	size_t levels() const { return m_sigmas.size(); };
+
+	/**
+	 * @brief Standard deviations of smoothing, one per level
+	 */
+	const std::vector<double>& sigmas() const { return m_sigmas; };
+
+	/**
+	 * @brief Returns the smoothed image at the given level
+	 *
+	 * @param ii Level (index into sigmas)
+	 *
+	 * @return Smoothed and downsampled image
+	 */
+	ptr<const MRImage> level(size_t ii) const { return m_levels[ii]; };
+
+	/**
+	 * @brief Returns the derivative of the image at the given level, or NULL
+	 * if computeDerivs() has not been called
+	 *
+	 * @param ii Level (index into sigmas)
+	 *
+	 * @return Derivative image (see derivative())
+	 */
+	ptr<const MRImage> deriv(size_t ii) const
+	{
+		if(m_derivs.empty())
+			return NULL;
+		return m_derivs[ii];
+	};
+
+	/**
+	 * @brief Returns the wall time (seconds) spent building the given level,
+	 * smoothing and downsampling plus computing the derivative (if it has
+	 * been computed)
+	 *
+	 * @param ii Level (index into sigmas)
+	 *
+	 * @return Time in seconds
+	 */
+	double smoothTime(size_t ii) const { return m_times[ii]; };
+
+private:
+	std::vector<double> m_sigmas;
+	std::vector<ptr<MRImage>> m_levels;
+	std::vector<ptr<MRImage>> m_derivs;
+	std::vector<double> m_times;
+};
+
+/**
+ * @brief Sparse cache of the cubic B-spline basis at each sampled voxel. Row
+ * ss holds the knots (linear indices into the knot image) that support
+ * sample ss of a VoxelSampler, along with the value of the basis function
+ * and its derivative in the distortion direction. The deformation at a voxel
+ * is then the dot product of its row with the knot parameters, and the
+ * gradient with respect to the knots is the transpose product.
+ *
+ * Rows only depend on the geometry of the sampled image and the knot image,
+ * so they are built once (per pyramid level) and reused by every evaluation.
+ * If the cache would exceed the memory budget it is not built, and basis()
+ * computes rows on the fly instead.
+ */
+class BSplineBasisCache
+{
+public:
+	/**
+	 * @brief Maximum number of knots supporting any point (5 per dimension)
+	 */
+	static const int MAXSUPPORT = 125;
+
+	/**
+	 * @brief Constructor
+	 *
+	 * @param budget Maximum memory (bytes) to use for the cache
+	 */
+	BSplineBasisCache(size_t budget = 1024*1024*1024);
+
+	/**
+	 * @brief Sets the maximum memory (bytes) to use for the cache, 0 disables
+	 * caching. Invalidates the cache.
+	 */
+	void setBudget(size_t bytes) { m_budget = bytes; invalidate(); };
+
+	/**
+	 * @brief Maximum memory (bytes) to use for the cache
+	 */
+	size_t budget() const { return m_budget; };
+
+	/**
+	 * @brief Drops the cached rows, this must be called whenever the sample,
+	 * the sampled grid, the knot grid or the direction changes.
+	 */
+	void invalidate();
+
+	/**
+	 * @brief Whether rows are currently cached
+	 */
+	bool cached() const { return m_valid; };
+
+	/**
+	 * @brief Sets the geometry and builds the rows for every sample if they
+	 * are not already cached and fit in the budget. Rows are never cached
+	 * for samplers that resample each iteration. This must be called before
+	 * basis().
+	 *
+	 * If the rows didn't fit, later calls with the same geometry return false
+	 * without trying again. The knot image is compared by geometry, so
+	 * computers with their own (identically gridded) knot images can share a
+	 * cache and call this concurrently.
+	 *
+	 * @param grid Image whose voxels are sampled (only geometry is used)
+	 * @param deform Knot image (only geometry is used)
+	 * @param dir Direction of the derivative
+	 * @param sampler Voxels to build rows for
+	 *
+	 * @return true if rows are cached
+	 */
+	bool update(ptr<const MRImage> grid, ptr<const MRImage> deform, int dir,
+			const VoxelSampler& sampler);
+
+	/**
+	 * @brief Fills the basis of a sample, from the cache if it has been built
+	 * otherwise by computing it at dcind.
+	 *
+	 * @param ss Position in the sample
+	 * @param dcind Continuous index of the sample in the knot image (only
+	 * used when rows are not cached)
+	 * @param knots Output linear knot indices (MAXSUPPORT long)
+	 * @param w Output basis values (MAXSUPPORT long)
+	 * @param dw Output derivative of basis in dir (MAXSUPPORT long)
+	 *
+	 * @return Number of entries filled
+	 */
+	int basis(int64_t ss, const double* dcind, int64_t* knots, double* w,
+			double* dw) const;
+
+	/**
+	 * @brief Computes the basis at a point. Out of bounds knots are clamped
+	 * (as BSplineView does with ZEROFLUX), so knots may be repeated, and knots
+	 * with zero weight and derivative are skipped.
+	 *
+	 * @param deform Knot image
+	 * @param dcind Continuous index in deform
+	 * @param dir Direction of the derivative
+	 * @param knots Output linear knot indices (MAXSUPPORT long)
+	 * @param w Output basis values (MAXSUPPORT long)
+	 * @param dw Output derivative of basis in dir (MAXSUPPORT long)
+	 *
+	 * @return Number of entries filled
+	 */
+	static int compute(const ptr<const MRImage>& deform, const double* dcind,
+			int dir, int64_t* knots, double* w, double* dw);
+
+private:
+	size_t m_budget;
+	bool m_valid;
+
+	// whether update() has run since the last invalidate(), so that a cache
+	// that didn't fit isn't rebuilt at every evaluation
+	bool m_tried;
+
+	// geometry from the last update()
+	ptr<const MRImage> m_deform;
+	int m_dir;
+
+	// serializes update() between computers sharing the cache
+	std::mutex m_mutex;
+
+	// compressed rows, entries of sample ss are [m_rows[ss], m_rows[ss+1])
+	std::vector<int64_t> m_rows;
+	std::vector<int32_t> m_knots;
+	std::vector<double> m_w;
+	std::vector<double> m_dw;
+};
+
 /**
  * @brief The Rigid MI Computer is used to compute the mutual information
  * and gradient of mutual information between two images. As the name implies,
@@ -131,15 +451,19 @@ public:
 
 	/**
 	 * @brief Set the moving image for comparison, note that setting this
-	 * triggers a derivative computation and so is slower than setFixed.
+	 * triggers a derivative computation (unless one is provided) and so is
+	 * slower than setFixed.
 	 *
 	 * Note that modification of the moving image outside this class without
 	 * re-calling setMoving is undefined and will result in an out-of-date
 	 * moving image derivative. THIS WILL BREAK GRADIENT CALCULATIONS.
 	 *
 	 * @param moving Input moving image (not modified)
+	 * @param dmoving Derivative of moving (as computed by derivative(), for
+	 * instance cached by ImagePyramid). If NULL it will be computed.
 	 */
-	void setMoving(ptr<const MRImage> moving);
+	void setMoving(ptr<const MRImage> moving,
+			ptr<const MRImage> dmoving = NULL);
 
 	/**
 	 * @brief Return the current moving image.
@@ -150,6 +474,20 @@ public:
 	 */
 	ptr<const MRImage> getMoving() { return m_moving; };
 
+	/**
+	 * @brief Sets the strategy for choosing the voxels of the fixed image that
+	 * contribute to the joint histogram. By default every voxel is used. If
+	 * the fixed image has been set a new sample is drawn immediately.
+	 *
+	 * @param mode Sampling mode
+	 * @param frac Fraction of voxels to use, in (0, 1]
+	 * @param resample Draw a new sample at each call to valueGrad (each
+	 * iteration of the optimizer) rather than keeping a fixed sample
+	 * @param mask Mask to sample from, required for SAMPLE_MASK
+	 */
+	void setSampling(SampleMode mode, double frac = 1, bool resample = false,
+			ptr<const MRImage> mask = NULL);
+
 	/**
 	 * @brief Returns the number of parameters that are being estimated
 	 *
@@ -159,9 +497,26 @@ public:
 
 private:
 
+	/**
+	 * @brief Zeros then fills the joint histogram (m_pdfjoint) and, if
+	 * dograd is set, the joint histogram derivatives (m_dpdfjoint) for the
+	 * given parameters. Slabs of the fixed image are histogrammed in parallel
+	 * into per-thread buffers which are then merged in a fixed order.
+	 * m_pdfmove, m_pdffix and m_dpdfmove are zeroed.
+	 *
+	 * @param params Paramters (Rx, Ry, Rz, Sx, Sy, Sz).
+	 * @param dograd Whether to compute m_dpdfjoint
+	 */
+	void fillHistograms(const Eigen::VectorXd& params, bool dograd);
+
+	/**
+	 * @brief Chooses the fixed-image voxels used in the histograms
+	 */
+	VoxelSampler m_sampler;
+
 	ptr<const MRImage> m_fixed;
 	ptr<const MRImage> m_moving;
-	ptr<MRImage> m_dmoving;
+	ptr<const MRImage> m_dmoving;
 
 	/**
 	 * @brief Number of bins in marginal
@@ -261,6 +616,27 @@ public:
 	 */
 	int value(const Eigen::VectorXd& params, double& val);
 
+	/**
+	 * @brief Maximizes correlation with a damped (Levenberg-Marquardt)
+	 * Gauss-Newton solver. Each iteration is a single parallel pass over the
+	 * image that computes the correlation at the current parameters along
+	 * with the 6x6 normal equations of the intensity residual, whose Jacobian
+	 * comes from the moving image derivatives. Rejected steps increase the
+	 * damping and are re-solved from the stored equations, without another
+	 * pass. This does not depend on m_compdiff. Each pass is traced (a
+	 * normalEquations span) with the correlation and damping.
+	 *
+	 * @param params Initial paramters (Rx, Ry, Rz, Sx, Sy, Sz), updated with
+	 * the result
+	 * @param minstep Stop once steps (in parameter units) are smaller than
+	 * this
+	 * @param maxits Maximum number of passes
+	 *
+	 * @return Number of passes over the image
+	 */
+	size_t gaussNewton(Eigen::VectorXd& params, double minstep = 1e-3,
+			size_t maxits = 50);
+
 	/**
 	 * @brief Set the fixed image for registration/comparison
 	 *
@@ -276,15 +652,19 @@ public:
 
 	/**
 	 * @brief Set the moving image for comparison, note that setting this
-	 * triggers a derivative computation and so is slower than setFixed.
+	 * triggers a derivative computation (unless one is provided) and so is
+	 * slower than setFixed.
 	 *
 	 * Note that modification of the moving image outside this class without
 	 * re-calling setMoving is undefined and will result in an out-of-date
 	 * moving image derivative. THIS WILL BREAK GRADIENT CALCULATIONS.
 	 *
 	 * @param moving Input moving image (not modified)
+	 * @param dmoving Derivative of moving (as computed by derivative(), for
+	 * instance cached by ImagePyramid). If NULL it will be computed.
 	 */
-	void setMoving(ptr<const MRImage> moving);
+	void setMoving(ptr<const MRImage> moving,
+			ptr<const MRImage> dmoving = NULL);
 
 	/**
 	 * @brief Return the current moving image.
@@ -309,9 +689,52 @@ public:
 	bool m_compdiff;
 private:
 
+	/**
+	 * @brief Computes the sums needed for the correlation and (if dograd is
+	 * set) its gradient. The moving image is split into slabs which are
+	 * reduced in parallel, then the per-slab sums are combined in slab order
+	 * so that the result is reproducible for a given thread count.
+	 *
+	 * @param params Paramters (Rx, Ry, Rz, Sx, Sy, Sz).
+	 * @param dograd Whether to compute the gradient terms
+	 * @param sums Output, 5 correlation sums followed by 6 gradient terms
+	 */
+	void computeCorr(const Eigen::VectorXd& params, bool dograd, double* sums);
+
+	/**
+	 * @brief Computes the correlation sums along with the sums needed for
+	 * the Gauss-Newton normal equations, where J is the 6 element derivative
+	 * of each sample with respect to the parameters (index/radian units). Like
+	 * computeCorr this is a single parallel pass with per-slab sums.
+	 *
+	 * @param params Paramters (Rx, Ry, Rz, Sx, Sy, Sz).
+	 * @param sums Output, the 5 correlation sums, then SUM J*f, SUM J,
+	 * SUM J*g (6 each) and SUM J*J^T (36, column major)
+	 */
+	void computeNormal(const Eigen::VectorXd& params, double* sums);
+
 	ptr<const MRImage> m_fixed;
 	ptr<const MRImage> m_moving;
-	ptr<MRImage> m_dmoving;
+	ptr<const MRImage> m_dmoving;
+
+	/**
+	 * @brief Fixed image as a flat array (updated by setFixed)
+	 */
+	std::vector<double> m_fixbuf;
+
+	/**
+	 * @brief Moving image as a flat array (updated by setMoving)
+	 */
+	std::vector<double> m_movbuf;
+
+	/**
+	 * @brief Moving image derivatives, stored as 3 consecutive planes (d/dx,
+	 * d/dy, d/dz), each the same size as m_movbuf (updated by setMoving)
+	 */
+	std::vector<double> m_dmovbuf;
+
+	int64_t m_fixdim[3];
+	int64_t m_movdim[3];
 
 	double m_center[3];
 
@@ -420,6 +843,29 @@ public:
 	void initialize(ptr<const MRImage> fixed, ptr<const MRImage> moving,
 			size_t m_krad, size_t nbins, double space, int dir);
 
+	/**
+	 * @brief Sets the strategy for choosing the voxels of the fixed image that
+	 * contribute to the joint histogram. By default every voxel is used. If
+	 * the fixed image has been set a new sample is drawn immediately.
+	 *
+	 * @param mode Sampling mode
+	 * @param frac Fraction of voxels to use, in (0, 1]
+	 * @param resample Draw a new sample at each call to valueGrad (each
+	 * iteration of the optimizer) rather than keeping a fixed sample
+	 * @param mask Mask to sample from, required for SAMPLE_MASK
+	 */
+	void setSampling(SampleMode mode, double frac = 1, bool resample = false,
+			ptr<const MRImage> mask = NULL);
+
+	/**
+	 * @brief Sets the memory (bytes) that may be used to cache the B-spline
+	 * basis at each sampled voxel. If the cache would be larger (or when
+	 * resampling every iteration) the basis is computed on the fly.
+	 *
+	 * @param bytes Memory budget, 0 disables the cache
+	 */
+	void setBasisBudget(size_t bytes) { m_basis.setBudget(bytes); };
+
 	/**
 	 * @brief Return the current fixed image.
 	 *
@@ -458,6 +904,12 @@ private:
 	 */
 	int metric(double& val);
 
+	/**
+	 * @brief Adds the joint histogram of the moving probabilities and
+	 * m_fixed_cache to m_pdfjoint, uses m_wfix for the bin width.
+	 */
+	void fillJointPDF();
+
 	/* Variables:
 	 *
 	 * m_bins, m_krad
@@ -469,6 +921,16 @@ private:
 	 */
 	int m_dir;
 
+	/**
+	 * @brief Chooses the fixed-image voxels used in the histograms
+	 */
+	VoxelSampler m_sampler;
+
+	/**
+	 * @brief B-spline basis at each sampled voxel
+	 */
+	BSplineBasisCache m_basis;
+
 	ptr<const MRImage> m_fixed;
 	ptr<const MRImage> m_moving;
 	ptr<MRImage> m_dmoving;
@@ -514,18 +976,6 @@ private:
 	 */
 	NDArrayStore<2, double> m_pdfjoint;
 
-	/**
-	 * @brief First 3 Dimensions match dimensions in m_field, last two match
-	 * the dimensios of m_pdfjoint, (initialized by initializeKnots/setFixed)
-	 */
-	MRImageStore<5, double> m_dpdfjoint;
-
-	/**
-	 * @brief First 3 Dimensions match dimensions in m_field, last matches
-	 * m_pdfmove, (initialized by initializeKnots/setFixed)
-	 */
-	MRImageStore<4, double> m_dpdfmove;
-
 	/**
 	 * @brief Gradient of joint entropy at each knot.
 	 * (initialized by initializeKnots/setFixed)
@@ -677,6 +1127,39 @@ public:
 	 */
 	void setFixed(ptr<const MRImage> fixed);
 
+	/**
+	 * @brief Sets the strategy for choosing the voxels of the fixed image that
+	 * contribute to the joint histogram. By default every voxel is used. If
+	 * the fixed image has been set a new sample is drawn immediately.
+	 *
+	 * @param mode Sampling mode
+	 * @param frac Fraction of voxels to use, in (0, 1]
+	 * @param resample Draw a new sample at each call to valueGrad (each
+	 * iteration of the optimizer) rather than keeping a fixed sample
+	 * @param mask Mask to sample from, required for SAMPLE_MASK
+	 */
+	void setSampling(SampleMode mode, double frac = 1, bool resample = false,
+			ptr<const MRImage> mask = NULL);
+
+	/**
+	 * @brief Sets the memory (bytes) that may be used to cache the B-spline
+	 * basis at each sampled voxel. If the cache would be larger (or when
+	 * resampling every iteration) the basis is computed on the fly.
+	 *
+	 * @param bytes Memory budget, 0 disables the cache
+	 */
+	void setBasisBudget(size_t bytes) { m_basis->setBudget(bytes); };
+
+	/**
+	 * @brief Uses the same B-spline basis cache as other, so that copies
+	 * evaluated concurrently (for instance by a speculative line search)
+	 * build and store it once. The copies must be set up identically (same
+	 * sampling, fixed image and knot grid).
+	 *
+	 * @param other Computer whose cache to share
+	 */
+	void shareBasis(const DistCorrInfoComp& other) { m_basis = other.m_basis; };
+
 	/**
 	 * @brief Return the current fixed image.
 	 *
@@ -728,12 +1211,29 @@ private:
 	 */
 	int metric(double& val);
 
+	/**
+	 * @brief Adds the Parzen-windowed joint histogram of m_fixed and
+	 * m_corr_cache to m_pdfjoint, uses m_wfix/m_wmove for the bin widths.
+	 */
+	void fillJointPDF();
+
 	/* Variables:
 	 *
 	 * m_bins, m_krad
 	 *
 	 */
 
+	/**
+	 * @brief Chooses the fixed-image voxels used in the histograms
+	 */
+	VoxelSampler m_sampler;
+
+	/**
+	 * @brief B-spline basis at each sampled voxel, may be shared with copies
+	 * (see shareBasis)
+	 */
+	ptr<BSplineBasisCache> m_basis;
+
 	ptr<const MRImage> m_fixed;
 	ptr<const MRImage> m_moving;
 	ptr<MRImage> m_dmoving;
@@ -781,18 +1281,6 @@ private:
 	 */
 	NDArrayStore<2, double> m_pdfjoint;
 
-	/**
-	 * @brief First 3 Dimensions match dimensions in m_field, last two match
-	 * the dimensios of m_pdfjoint, (initialized by initializeKnots/setFixed)
-	 */
-	MRImageStore<5, double> m_dpdfjoint;
-
-	/**
-	 * @brief First 3 Dimensions match dimensions in m_field, last matches
-	 * m_pdfmove, (initialized by initializeKnots/setFixed)
-	 */
-	MRImageStore<4, double> m_dpdfmove;
-
 	/**
 	 * @brief Gradient of joint entropy at each knot.
 	 * (initialized by initializeKnots/setFixed)
@@ -951,6 +1439,170 @@ struct Rigid3DTrans
 
 };
 
+/**
+ * @brief Computes motion parameters for each volume of a 4D image by rigidly
+ * registering it (with correlation) to the reference volume. The smoothed
+ * reference pyramid is computed once and shared, then volumes are registered
+ * concurrently, each thread with its own RigidCorrComp and LBFGSOpt. Every
+ * volume starts from the identity so results do not depend on the number of
+ * threads.
+ *
+ * @param fmri Input 4D image
+ * @param reftime Volume to use as the reference
+ * @param sigmas Standard deviation of smoothing (in physical space) at each
+ * level
+ * @param minstep Minimum step size, the optimizer stops below this
+ * @param maxstep Maximum (initial) step size of the line search
+ * @param histsize History size of the L-BFGS optimizer
+ * @param beta Line search step reduction factor
+ * @param padsize Number of voxels to pad each volume by during registration
+ * @param gaussnewton Use the Gauss-Newton solver (RigidCorrComp::gaussNewton)
+ * rather than L-BFGS, then only minstep applies
+ *
+ * @return Vector of motion parameters. Elements are (C = center, R = rotation
+ * in radians, S = shift, all in RAS space): [CX, CY, CZ, RX, RY, RZ, SX, SY,
+ * SZ]
+ */
+std::vector<std::vector<double>> computeMotion(ptr<const MRImage> fmri,
+		size_t reftime, const std::vector<double>& sigmas,
+		double minstep = 1e-3, double maxstep = 1, int histsize = 4,
+		double beta = 0.35, int padsize = 3, bool gaussnewton = false);
+
+/**
+ * @brief Applies the inverse of the given motion parameters to every volume
+ * of a 4D image (volumes are resampled in parallel).
+ *
+ * @param fmri Input 4D image
+ * @param motion Motion parameters, one row of 9 per volume, as returned by
+ * computeMotion
+ * @param invert Apply the motion parameters directly rather than their
+ * inverse (for simulating motion)
+ *
+ * @return Motion corrected image
+ */
+ptr<MRImage> applyMotion(ptr<const MRImage> fmri,
+		const std::vector<std::vector<double>>& motion, bool invert = false);
+
+/**
+ * @brief Computes the framewise displacement between two sets of motion
+ * parameters (as returned by computeMotion), the sum of the absolute changes
+ * in shift plus the arc length of the changes in rotation on a sphere of the
+ * given radius (Power et al. 2012). The second set is re-expressed about the
+ * center of the first, so the centers need not match.
+ *
+ * @param m1 Motion parameters [CX, CY, CZ, RX, RY, RZ, SX, SY, SZ]
+ * @param m2 Motion parameters [CX, CY, CZ, RX, RY, RZ, SX, SY, SZ]
+ * @param radius Radius (mm) used to convert rotations to displacements
+ *
+ * @return Framewise displacement in mm
+ */
+double framewiseDisplacement(const std::vector<double>& m1,
+		const std::vector<double>& m2, double radius = 50);
+
+/**
+ * @brief Motion correction for volumes that arrive one at a time (for
+ * instance during real-time fMRI). The smoothed reference pyramid is computed
+ * once in the constructor, and each call to correct() registers one volume,
+ * starting from the previous volume's transform. The number of optimizer
+ * iterations per level is capped so that the time per volume is bounded.
+ *
+ * Parameters are the same as those of computeMotion, except that the
+ * intensity threshold is computed from the reference volume alone.
+ */
+class OnlineMotionCorr
+{
+public:
+	/**
+	 * @brief Constructor, computes the reference pyramid.
+	 *
+	 * @param ref Reference volume (3D, or 4D with a single volume)
+	 * @param sigmas Standard deviation of smoothing at each level
+	 * @param maxits Maximum optimizer iterations at each level
+	 * @param minstep Minimum step size, the optimizer stops below this
+	 * @param maxstep Maximum (initial) step size of the line search
+	 * @param histsize History size of the L-BFGS optimizer
+	 * @param beta Line search step reduction factor
+	 * @param padsize Number of voxels to pad each volume by
+	 */
+	OnlineMotionCorr(ptr<const MRImage> ref,
+			const std::vector<double>& sigmas = {2, 1, 0.5},
+			size_t maxits = 50, double minstep = 1e-3, double maxstep = 1,
+			int histsize = 4, double beta = 0.35, int padsize = 3);
+
+	/**
+	 * @brief Estimates the motion of a volume relative to the reference and
+	 * resamples it into the reference position. After this motion() and fd()
+	 * return the parameters for this volume.
+	 *
+	 * @param vol Input volume, same grid as the reference
+	 *
+	 * @return Motion corrected volume
+	 */
+	ptr<MRImage> correct(ptr<const MRImage> vol);
+
+	/**
+	 * @brief Forget the previous volume's transform, the next volume will be
+	 * registered starting from the identity
+	 */
+	void reset();
+
+	/**
+	 * @brief Motion parameters of the last volume [CX, CY, CZ, RX, RY, RZ,
+	 * SX, SY, SZ], see computeMotion
+	 */
+	const std::vector<double>& motion() const { return m_motion; };
+
+	/**
+	 * @brief Framewise displacement (mm) between the last two volumes, 0 for
+	 * the first volume
+	 */
+	double fd() const { return m_fd; };
+
+	/**
+	 * @brief Number of volumes corrected so far
+	 */
+	size_t count() const { return m_count; };
+
+private:
+	std::vector<double> m_sigmas;
+	size_t m_maxits;
+	double m_minstep;
+	double m_maxstep;
+	int m_histsize;
+	double m_beta;
+
+	/**
+	 * @brief Values below this are zeroed before registration
+	 */
+	double m_thresh;
+
+	/**
+	 * @brief Region of the padded volume that holds the input volume
+	 */
+	std::vector<std::pair<int64_t,int64_t>> m_roi;
+
+	/**
+	 * @brief Smoothed reference, one level per sigma
+	 */
+	ptr<ImagePyramid> m_fixed;
+
+	/**
+	 * @brief Padded working buffer for the moving volume
+	 */
+	ptr<MRImage> m_moving;
+
+	RigidCorrComp m_comp;
+
+	/**
+	 * @brief Registration result of the previous volume (warm start)
+	 */
+	Rigid3DTrans m_rigid;
+
+	std::vector<double> m_motion;
+	double m_fd;
+	size_t m_count;
+};
+
 /**
  * @brief Performs motion correction on a set of volumes. Each 3D volume is
  * extracted and linearly registered with the ref volume.
@@ -964,6 +1616,29 @@ struct Rigid3DTrans
  */
 ptr<MRImage> motionCorrect(ptr<const MRImage> input, size_t ref);
 
+/**
+ * @brief Estimates the rigid transform between two 3D volumes from their
+ * Fourier transforms, for use as the starting point of corReg3D or
+ * informationReg3D. Both images are downsampled to isotropic voxels and
+ * windowed, then the rotation is found by matching the angular signatures of
+ * their magnitude spectra (which don't depend on translation) sampled on the
+ * pseudo-polar grid, and the shift is found by phase correlation between the
+ * moving image and the rotated fixed image. This takes 4 FFTs, regardless of
+ * how large the initial misalignment is. The two volumes should have identical
+ * sampling and identical orientation.
+ *
+ * @param fixed Image which will be the target of registration.
+ * @param moving Image which will be rotated then shifted to match fixed.
+ * @param maxangle Largest rotation (in degrees, about each axis) to consider
+ * @param size Images are downsampled to at most this many voxels across their
+ * largest dimension
+ *
+ * @return Estimated rigid transform (RAS coordinates), in the same form as
+ * the output of corReg3D
+ */
+Rigid3DTrans fourierInit3D(ptr<const MRImage> fixed, ptr<const MRImage> moving,
+		double maxangle = 30, size_t size = 32);
+
 /**
  * @brief Performs correlation based registration between two 3D volumes. note
  * that the two volumes should have identical sampling and identical
@@ -974,11 +1649,35 @@ ptr<MRImage> motionCorrect(ptr<const MRImage> input, size_t ref);
  * @param fixed     Image which will be the target of registration.
  * @param moving    Image which will be rotated then shifted to match fixed.
  * @param sigmas	Standard deviation of smoothing at each level
+ * @param fftinit   Start the optimizer from the estimate of fourierInit3D
+ * rather than the identity
+ * @param gaussnewton Use the Gauss-Newton solver (RigidCorrComp::gaussNewton)
+ * rather than L-BFGS
  *
  * @return Output rigid transform
  */
 Rigid3DTrans corReg3D(ptr<const MRImage> fixed, ptr<const MRImage> moving,
-		const std::vector<double>& sigmas);
+		const std::vector<double>& sigmas, bool fftinit = false,
+		bool gaussnewton = false);
+
+/**
+ * @brief Performs correlation based registration between two 3D volumes,
+ * using pre-computed pyramids (so that a fixed image registered against many
+ * moving images is only smoothed once). Both pyramids must have the same
+ * sigmas and come from images with identical sampling and orientation.
+ *
+ * @param fixed     Pyramid of the image which will be the target of
+ * registration.
+ * @param moving    Pyramid of the image which will be rotated then shifted to
+ * match fixed (derivatives are used if cached).
+ * @param init      Initial transform (RAS coordinates), identity by default
+ * @param gaussnewton Use the Gauss-Newton solver (RigidCorrComp::gaussNewton)
+ * rather than L-BFGS
+ *
+ * @return Output rigid transform
+ */
+Rigid3DTrans corReg3D(const ImagePyramid& fixed, const ImagePyramid& moving,
+		Rigid3DTrans init = Rigid3DTrans(), bool gaussnewton = false);
 
 /**
  * @brief Performs information-based registration between two 3D volumes. note
@@ -993,13 +1692,53 @@ Rigid3DTrans corReg3D(ptr<const MRImage> fixed, ptr<const MRImage> moving,
  * @param binradius During parzen window, the radius of the smoothing kernel
  * @param metric metric to use (default is MI)
  * @param stopx Smallest step to take, stop after steps reach this size
+ * @param sampling Voxel sampling strategy for the fixed image (FULL, UNIFORM,
+ * STRATIFIED or MASK)
+ * @param sampfrac Fraction of fixed voxels to use when sampling
+ * @param resample Draw new samples at each iteration rather than once per
+ * level
+ * @param mask Mask to sample from (required for MASK sampling)
+ * @param fftinit Start the optimizer from the estimate of fourierInit3D
+ * rather than the identity
  *
  * @return          Rigid transform.
  */
 Rigid3DTrans informationReg3D(ptr<const MRImage> fixed,
 		ptr<const MRImage> moving, const std::vector<double>& sigmas,
 		size_t nbins = 128, size_t binradius = 4, std::string metric = "MI",
-		double stopx = 0.001);
+		double stopx = 0.001, std::string sampling = "FULL",
+		double sampfrac = 1, bool resample = false,
+		ptr<const MRImage> mask = NULL, bool fftinit = false);
+
+/**
+ * @brief Performs information-based registration between two 3D volumes,
+ * using pre-computed pyramids. Both pyramids must have the same sigmas and
+ * come from images with identical sampling and orientation.
+ *
+ * @param fixed Pyramid of the image which will be the target of registration.
+ * @param moving Pyramid of the image which will be rotated then shifted to
+ * match fixed (derivatives are used if cached).
+ * @param nbins     Number of bins during marginal density estimation (joint
+ *                  with have nbins*nbins)
+ * @param binradius During parzen window, the radius of the smoothing kernel
+ * @param metric metric to use (default is MI)
+ * @param stopx Smallest step to take, stop after steps reach this size
+ * @param sampling Voxel sampling strategy for the fixed image (FULL, UNIFORM,
+ * STRATIFIED or MASK)
+ * @param sampfrac Fraction of fixed voxels to use when sampling
+ * @param resample Draw new samples at each iteration rather than once per
+ * level
+ * @param mask Mask to sample from (required for MASK sampling)
+ * @param init Initial transform (RAS coordinates), identity by default
+ *
+ * @return          Rigid transform.
+ */
+Rigid3DTrans informationReg3D(const ImagePyramid& fixed,
+		const ImagePyramid& moving, size_t nbins = 128, size_t binradius = 4,
+		std::string metric = "MI", double stopx = 0.001,
+		std::string sampling = "FULL", double sampfrac = 1,
+		bool resample = false, ptr<const MRImage> mask = NULL,
+		Rigid3DTrans init = Rigid3DTrans());
 
 /**
  * @brief Information based registration between two 3D volumes. note
@@ -1022,6 +1761,12 @@ Rigid3DTrans informationReg3D(ptr<const MRImage> fixed,
  * @param beta Fraction of previous step size to consider for next step size.
  * Essentially this decides how quickly to reduce step sizes (note 1 would mean
  * NO reduction and would continue forever, 0 would do 1 step then stop)
+ * @param sampling Voxel sampling strategy for the fixed image (FULL, UNIFORM,
+ * STRATIFIED or MASK)
+ * @param sampfrac Fraction of fixed voxels to use when sampling
+ * @param resample Draw new samples at each iteration rather than once per
+ * level
+ * @param mask Mask to sample from (required for MASK sampling)
  *
  * @return parameters of bspline
  */
@@ -1029,7 +1774,9 @@ ptr<MRImage> infoDistCor(ptr<const MRImage> fixed, ptr<const MRImage> moving,
 		bool otsu, int dir, double bspace, double jac, double tps,
 		const std::vector<double>& sigmas,
 		size_t nbins = 128, size_t binradius = 4, string metric = "MI",
-		size_t hist = 8, double stopx = 1e-5, double beta = 0.5);
+		size_t hist = 8, double stopx = 1e-5, double beta = 0.5,
+		string sampling = "FULL", double sampfrac = 1, bool resample = false,
+		ptr<const MRImage> mask = NULL);
 
 /**
  * @brief This function checks the validity of the derivative functions used
@@ -19,6 +19,7 @@
 #include "statistics.h"
 #include "basic_functions.h"
 #include "macros.h"
+#include "utility.h"
 
 #include <fstream>
 #include <algorithm>
@@ -27,6 +28,7 @@
 #include <iostream>
 #include <map>
 #include <iomanip>
+#include <functional>
 
 using namespace std;
 using Eigen::MatrixXd;
@@ -145,6 +147,42 @@ void apply(double* dst, const double* src,  double(*func)(double), size_t sz)
 		dst[ii] = func(src[ii]);
 }
 
+namespace {
+
+// Arrays shorter than this (per thread) are not worth splitting up
+const size_t BATCH_GRAIN = 16384;
+
+/**
+ * @brief Calls func(begin, end) over [0, n), split between threads when n is
+ * large enough to make it worthwhile
+ */
+void batchFor(size_t n, const std::function<void(size_t, size_t)>& func)
+{
+	size_t nthreads = std::min(numThreads(), n/BATCH_GRAIN+1);
+	parallelFor(0, n, [&](size_t, size_t b, size_t e)
+	{
+		func(b, e);
+	}, nthreads);
+}
+
+/**
+ * @brief Complementary error function, Chebyshev fit with relative error
+ * below 1.2e-7 everywhere (Numerical Recipes erfcc). Branch free apart from
+ * the sign, so loops over it vectorize.
+ */
+inline double erfcApprox(double x)
+{
+	double z = fabs(x);
+	double t = 1/(1+0.5*z);
+	double r = t*exp(-z*z-1.26551223+t*(1.00002368+t*(0.37409196+
+					t*(0.09678418+t*(-0.18628806+t*(0.27886807+
+					t*(-1.13520398+t*(1.48851587+t*(-0.82215223+
+					t*0.17087277)))))))));
+	return x >= 0 ? r : 2-r;
+}
+
+}
+
 StudentsT::StudentsT(int dof, double dt, double tmax) :
 	m_dt(dt), m_tmax(tmax), m_dof(dof)
 {
@@ -205,6 +243,46 @@ double StudentsT::cumulative(double t) const
 		return out;
 };
 
+void StudentsT::cumulative(size_t n, const double* t, double* out) const
+{
+	const double* cdf = m_cdf.data();
+	const double last = m_cdf.size()-1;
+	const double idt = 1./m_dt;
+	batchFor(n, [&](size_t b, size_t e)
+	{
+		for(size_t ii=b; ii<e; ii++) {
+			// position in the table, m_tvals[k] = k*m_dt
+			double x = fabs(t[ii])*idt;
+			bool valid = x == x;
+			x = valid && x < last ? x : last;
+			size_t k = std::min(x, last-1);
+			double w = x-k;
+			double c = cdf[k]*(1-w) + cdf[k+1]*w;
+			c = t[ii] < 0 ? 1-c : c;
+			out[ii] = valid ? c : t[ii];
+		}
+	});
+}
+
+void StudentsT::twoSided(size_t n, const double* t, double* p) const
+{
+	const double* cdf = m_cdf.data();
+	const double last = m_cdf.size()-1;
+	const double idt = 1./m_dt;
+	batchFor(n, [&](size_t b, size_t e)
+	{
+		for(size_t ii=b; ii<e; ii++) {
+			double x = fabs(t[ii])*idt;
+			bool valid = x == x;
+			x = valid && x < last ? x : last;
+			size_t k = std::min(x, last-1);
+			double w = x-k;
+			double c = cdf[k]*(1-w) + cdf[k+1]*w;
+			p[ii] = valid ? 2*(1-c) : t[ii];
+		}
+	});
+}
+
 double StudentsT::density(double t) const
 {
 	bool negative = false;
@@ -271,6 +349,32 @@ double StudentsT::icdf(double p) const
 		return out;
 };
 
+void StudentsT::icdf(size_t n, const double* p, double* out) const
+{
+	const double tmax = m_tvals.back();
+	batchFor(n, [&](size_t b, size_t e)
+	{
+		for(size_t ii=b; ii<e; ii++) {
+			double pp = p[ii] < 0.5 ? 1-p[ii] : p[ii];
+			double sign = p[ii] < 0.5 ? -1 : 1;
+
+			auto it = std::upper_bound(m_cdf.begin(), m_cdf.end(), pp);
+			if(it == m_cdf.end()) {
+				out[ii] = sign*tmax;
+				continue;
+			}
+
+			// Linear Interpolate
+			int jj = distance(m_cdf.begin(), it);
+			double tp = m_tvals[jj-1];
+			double tn = m_tvals[jj];
+			double cp = m_cdf[jj-1];
+			double cn = m_cdf[jj];
+			out[ii] = sign*(tp*(cn-pp)/(cn-cp) + tn*(pp-cp)/(cn-cp));
+		}
+	});
+}
+
 void StudentsT::init()
 {
 	m_cdf.resize(m_tmax/m_dt);
@@ -361,13 +465,9 @@ void regress(RegrResult* out,
 
 	for(size_t ii=0; ii<X.cols(); ii++) {
 		out->std_err[ii] = sqrt(out->sigmahat*covInv[ii]);
-
-		double t = out->bhat[ii]/out->std_err[ii];
-		out->t[ii] = t;
-		double p = distrib.cdf(t);
-		if(t > 0) p = 1-p;
-		out->p[ii] = 2*p;
+		out->t[ii] = out->bhat[ii]/out->std_err[ii];
 	}
+	distrib.twoSided(X.cols(), out->t.data(), out->p.data());
 }
 
 /**
@@ -429,6 +529,75 @@ double gaussianCDF(double mean, double sd, double x)
 	return 0.5*(1+erf((x-mean)/(sd*sqrt(2))));
 }
 
+/**
+ * @brief 1D Gaussian distribution function for an array of positions. Uses
+ * the same formula as the scalar version, split between threads for large
+ * arrays.
+ *
+ * @param mean Mean of gaussian distribution
+ * @param sd Standard deviation
+ * @param n Number of positions
+ * @param x Positions to get the density of
+ * @param out Output densities (may be the same as x)
+ */
+void gaussianPDFBatch(double mean, double sd, size_t n, const double* x,
+		double* out)
+{
+	const double scale = 1/(sd*sqrt(2*M_PI));
+	const double ivar = 1/(2*sd*sd);
+	batchFor(n, [&](size_t b, size_t e)
+	{
+		for(size_t ii=b; ii<e; ii++)
+			out[ii] = exp(-(x[ii]-mean)*(x[ii]-mean)*ivar)*scale;
+	});
+}
+
+/**
+ * @brief 1D Gaussian cumulative distribution function for an array of
+ * positions, split between threads for large arrays.
+ *
+ * Uses a polynomial (Chebyshev) approximation of erfc rather than erf, with
+ * a relative error below 1.2e-7 in the tail that is being computed, so the
+ * absolute difference from the scalar gaussianCDF is below 6e-8 and small
+ * probabilities are more accurate than the scalar version (which rounds
+ * anything below ~1e-16 to 0).
+ *
+ * @param mean Mean of gaussian distribution
+ * @param sd Standard deviation
+ * @param n Number of positions
+ * @param x Positions to get the probability of
+ * @param out Output probabilities of a value falling below x (may be the same
+ * as x)
+ */
+void gaussianCDFBatch(double mean, double sd, size_t n, const double* x,
+		double* out)
+{
+	const double scale = 1/(sd*sqrt(2));
+	batchFor(n, [&](size_t b, size_t e)
+	{
+		for(size_t ii=b; ii<e; ii++)
+			out[ii] = 0.5*erfcApprox((mean-x[ii])*scale);
+	});
+}
+
+/**
+ * @brief Two sided p-values for an array of z-scores (standard normal),
+ * P(|Z| > |z|). Same approximation and accuracy as
+ * gaussianCDFBatch, NaN z-scores give NaN p-values.
+ *
+ * @param n Number of z-scores
+ * @param z Z-scores
+ * @param p Output p-values (may be the same as z)
+ */
+void gaussianTwoSided(size_t n, const double* z, double* p)
+{
+	batchFor(n, [&](size_t b, size_t e)
+	{
+		for(size_t ii=b; ii<e; ii++)
+			p[ii] = erfcApprox(fabs(z[ii])*M_SQRT1_2);
+	});
+}
+
 /**
  * @brief PDF for the gamma distribution, if mean is negative then it is
  * assumed that x should be negated as well. Unlike gammaPDF, this takes
@@ -2097,110 +2266,209 @@ VectorXd shootingRegr(const Ref<const MatrixXd> X, const Ref<const VectorXd> y,
 }
 
 /**
- * @brief
+ * @brief Orthonormalizes the columns of Y against Q (which should already be
+ * orthonormal) and each other. Projecting twice keeps the new columns
+ * orthogonal to Q to working precision.
  *
- * @param A M x N
- * @param subsize Columns in projection matrix,
- * @param poweriters Number of power iterations to perform
- * @param U Output Left Singular Vectors
- * @param E OUtput Singular Values
- * @param V Output Right Singular Vectors
+ * @param Q Current basis
+ * @param Y Columns to orthonormalize, overwritten
  */
-void randomizePowerIterationSVD(const Ref<const MatrixXd> A,
-		double tol, size_t startrank, size_t maxrank, size_t poweriters,
-		MatrixXd& U, VectorXd& E, MatrixXd& V)
+static void orthAgainst(const MatrixXd& Q, MatrixXd& Y)
 {
-	// Algorithm 4.4
-	MatrixXd Yc;
-	MatrixXd Yhc;
-	MatrixXd Qtmp;
-	MatrixXd Qhat;
-	MatrixXd Q;
-	MatrixXd Qc;
-	MatrixXd Omega;
-	VectorXd norms;
-
-	size_t curank = startrank;
-	do {
-		size_t nextsize = min(curank, A.rows()-curank);
-		Omega.resize(A.cols(), nextsize);
-		npl::fillGaussian<MatrixXd>(Omega);
-		Yc = A*Omega;
-
-		Eigen::HouseholderQR<MatrixXd> qr(Yc);
-		Qtmp = qr.householderQ()*MatrixXd::Identity(A.rows(), nextsize);
-		Eigen::HouseholderQR<MatrixXd> qrh;
+	Eigen::HouseholderQR<MatrixXd> qr;
+	for(size_t ii=0; ii<2; ii++) {
+		if(Q.cols() > 0)
+			Y -= Q*(Q.transpose()*Y);
+		qr.compute(Y);
+		Y = qr.householderQ()*MatrixXd::Identity(Y.rows(), Y.cols());
+	}
+}
+
+/**
+ * @brief Blocked, adaptive randomized range finder. Builds an orthonormal
+ * basis Q for the range of the rows x cols matrix A, along with B = Q^T A, a
+ * block of columns at a time. Each block is found by power iteration on AA^T
+ * in the space orthogonal to the current basis. The first block has blocksize
+ * columns, after that each block doubles the basis.
+ *
+ * Growth stops when the residual A-QB is small: either the Frobenius norm of
+ * the residual (from ||A||^2-||B||^2, which needs no extra passes) or the
+ * largest singular value of the newest block of B (an a-posteriori estimate
+ * of the residual's 2-norm before that block was added) is below tol times
+ * the largest singular value of A.
+ *
+ * A is only accessed through pass, and the product with the current block
+ * (B = P*A) is computed in the same pass as the first power iteration of the
+ * next block (Y = A*A^T*X).
+ *
+ * Halko N, Martinsson P, Tropp J. Finding structure with randomness:
+ * Probabilistic algorithms for constructing approximate matrix
+ * decompositions. 2009;1–74. Available from: http://arxiv.org/abs/0909.4061
+ *
+ * @param rows Rows in A
+ * @param cols Columns in A
+ * @param pass Function called as pass(Y, X, B, P, sqnorm), which should set
+ * Y = A*A^T*X and B = P*A in a single pass over A. Either product is skipped
+ * if X has no columns or P has no rows. If sqnorm is not NULL it should also
+ * be set to the squared Frobenius norm of A.
+ * @param tol Stop when the residual is below this ratio of the largest
+ * singular value, 0 always grows to maxrank
+ * @param blocksize Number of columns in the first block
+ * @param maxrank Maximum number of columns in Q
+ * @param poweriters Number of power iterations for each block
+ * @param Q Output basis (rows x k)
+ * @param B Output Q^T A (k x cols)
+ * @param verbose Print the rank and residual after each block
+ *
+ * @return Estimated relative residual, ||A-QB||_F/||A||_F
+ */
+double adaptiveRangeFinder(size_t rows, size_t cols,
+		const std::function<void(Ref<MatrixXd>, const Ref<const MatrixXd>,
+			Ref<MatrixXd>, const Ref<const MatrixXd>, double*)>& pass,
+		double tol, size_t blocksize, size_t maxrank, size_t poweriters,
+		MatrixXd& Q, MatrixXd& B, bool verbose)
+{
+	maxrank = std::min(maxrank, rows);
+	blocksize = std::max<size_t>(1, std::min(blocksize, maxrank));
+
+	MatrixXd none;
+	MatrixXd Omega(rows, blocksize);
+	MatrixXd Y(rows, blocksize);
+	MatrixXd Ynext;
+	double sqnorm = 0;
+	fillGaussian<MatrixXd>(Omega);
+	pass(Y, Omega, none, none.transpose(), &sqnorm);
+
+	// Rows of B, one matrix per block
+	vector<MatrixXd> blocks;
+	Q.resize(rows, 0);
+	double bnorm = 0;
+	double smax = 0;
+	double relerr = 1;
+	while(true) {
+		// Power iterations in the complement of Q, Y already has A*A^T*Omega
 		for(size_t ii=0; ii<poweriters; ii++) {
-			Yhc = A.transpose()*Qtmp;
-			qrh.compute(Yhc);
-			Qhat = qrh.householderQ()*MatrixXd::Identity(A.cols(), nextsize);
-			Yc = A*Qhat;
-			qr.compute(Yc);
-			Qtmp = qr.householderQ()*MatrixXd::Identity(A.rows(), nextsize);
+			orthAgainst(Q, Y);
+			Ynext.resize(rows, Y.cols());
+			pass(Ynext, Y, none, none.transpose(), NULL);
+			Y.swap(Ynext);
+		}
+		orthAgainst(Q, Y);
+
+		// Size of the next block, if there is one
+		size_t nextsize = std::min<size_t>(Q.cols()+Y.cols(),
+				maxrank-Q.cols()-Y.cols());
+
+		// B_i = Q_i^T A, and start the next block in the same pass
+		blocks.push_back(MatrixXd(Y.cols(), cols));
+		Omega.resize(rows, nextsize);
+		Ynext.resize(rows, nextsize);
+		fillGaussian<MatrixXd>(Omega);
+		pass(Ynext, Omega, blocks.back(), Y.transpose(), NULL);
+		const MatrixXd& Bi = blocks.back();
+
+		size_t oldcols = Q.cols();
+		Q.conservativeResize(rows, oldcols+Y.cols());
+		Q.rightCols(Y.cols()) = Y;
+
+		// Largest singular value of the new block, estimates the norm of the
+		// residual before it was added
+		Eigen::SelfAdjointEigenSolver<MatrixXd> eig(Bi*Bi.transpose(),
+				Eigen::EigenvaluesOnly);
+		double snew = sqrt(std::max(0., eig.eigenvalues().maxCoeff()));
+		smax = std::max(smax, snew);
+		bnorm += Bi.squaredNorm();
+		double ferr = sqrt(std::max(0., sqnorm-bnorm));
+		relerr = sqnorm > 0 ? ferr/sqrt(sqnorm) : 0;
+
+		if(verbose) {
+			cerr << "Range Finder Rank: " << Q.cols() << ", Relative Error: "
+				<< relerr << ", Block Singular Value: " << snew/smax << endl;
 		}
 
-		/*
-		 * Orthogonalize new basis with the current basis (Q) and then append
-		 */
-		if(Q.rows() > 0) {
-			// Orthogonalize the additional Q vectors Q with respect to the
-			// current Q vectors
-			Qc = Qtmp - Q*(Q.transpose()*Qtmp);
-
-			// After orthogonalizing wrt to Q, reorthogonalize wrt each other
-			norms.resize(Qc.cols());
-			for(size_t cc=0; cc<Qc.cols(); cc++) {
-				for(size_t jj=0; jj<cc; jj++)
-					Qc.col(cc) -= Qc.col(jj).dot(Qc.col(cc))*Qc.col(jj)/(norms[jj]*norms[jj]);
-				norms[cc] = Qc.col(cc).norm();
-			}
+		if(nextsize == 0 || ferr <= tol*smax || (oldcols > 0 &&
+					snew <= tol*smax))
+			break;
+		Y.swap(Ynext);
+	}
 
-			// If the matrix is essentially covered by existing space, quit
-			size_t keep = 0;
-			for(size_t cc=0; cc<Qc.cols(); cc++) {
-				if(norms[cc] > tol) {
-					Qc.col(cc) /= norms[cc];
-					keep++;
-				}
-			}
-			if(keep == 0)
-				break;
-
-			// Append Orthogonalized Basis
-			Q.conservativeResize(Qc.rows(), Q.cols()+keep);
-			keep = 0;
-			for(size_t cc=0; cc<Qc.cols(); cc++) {
-				if(norms[cc] > tol) {
-					Q.col(keep+curank) = Qc.col(cc);
-					keep++;
-				}
-			}
-		} else {
-			Q = Qtmp;
-		}
+	// Stack blocks of B
+	B.resize(Q.cols(), cols);
+	for(size_t bb=0, rr=0; bb<blocks.size(); bb++) {
+		B.middleRows(rr, blocks[bb].rows()) = blocks[bb];
+		rr += blocks[bb].rows();
+		blocks[bb].resize(0, 0);
+	}
 
-		curank = Q.cols();
-	} while(curank < maxrank && curank < A.cols());
+	if(verbose) {
+		cerr << "Range Finder Done, Rank: " << Q.cols() << ", Relative Error: "
+			<< relerr << endl;
+	}
+	return relerr;
+}
+
+/**
+ * @brief Computes the SVD of A from the range found by adaptiveRangeFinder()
+ *
+ * @param A M x N
+ * @param tol Relative tolerance for the residual
+ * @param startrank Size of the first block of the subspace
+ * @param maxrank Maximum size of the subspace
+ * @param poweriters Number of power iterations to perform for each block
+ * @param U Output Left Singular Vectors
+ * @param E Output Singular Values
+ * @param V Output Right Singular Vectors
+ */
+static void rangeFinderSVD(const Ref<const MatrixXd> A, double tol,
+		size_t startrank, size_t maxrank, size_t poweriters, MatrixXd& U,
+		VectorXd& E, MatrixXd& V)
+{
+	MatrixXd Q, B;
+	adaptiveRangeFinder(A.rows(), A.cols(), [&](Ref<MatrixXd> Y,
+				const Ref<const MatrixXd> X, Ref<MatrixXd> Bi,
+				const Ref<const MatrixXd> P, double* sqnorm)
+	{
+		if(X.cols() > 0)
+			Y.noalias() = A*(A.transpose()*X);
+		if(P.rows() > 0)
+			Bi.noalias() = P*A;
+		if(sqnorm)
+			*sqnorm = A.squaredNorm();
+	}, tol, startrank, maxrank, poweriters, Q, B);
 
 	// Form B = Q* x A
-	MatrixXd B = Q.transpose()*A;
 	Eigen::JacobiSVD<MatrixXd> smallsvd(B, Eigen::ComputeThinU | Eigen::ComputeThinV);
 	U = Q*smallsvd.matrixU();
 	E = smallsvd.singularValues();
 
-	VectorXd Einv(E.rows());
-	for(size_t ii=0; ii<E.rows(); ii++) {
-		if(E[ii] > std::numeric_limits<double>::epsilon())
-			Einv[ii] = 1./E[ii];
-		else
-			Einv[ii] = 0;
-	}
-
+	// A = U E V*, A* = V E U*, A*U = VE, V = A*UE^-1
 	V = smallsvd.matrixV();
 }
 
 /**
- * @brief
+ * @brief Computes the SVD of A using a random subspace that is grown until
+ * the residual is below tol times the largest singular value (see
+ * adaptiveRangeFinder())
+ *
+ * @param A M x N
+ * @param tol Relative tolerance for the residual
+ * @param startrank Size of the first block of the subspace
+ * @param maxrank Maximum size of the subspace
+ * @param poweriters Number of power iterations to perform for each block
+ * @param U Output Left Singular Vectors
+ * @param E OUtput Singular Values
+ * @param V Output Right Singular Vectors
+ */
+void randomizePowerIterationSVD(const Ref<const MatrixXd> A,
+		double tol, size_t startrank, size_t maxrank, size_t poweriters,
+		MatrixXd& U, VectorXd& E, MatrixXd& V)
+{
+	rangeFinderSVD(A, tol, startrank, maxrank, poweriters, U, E, V);
+}
+
+/**
+ * @brief Computes the SVD of A using a fixed size random subspace (see
+ * adaptiveRangeFinder())
  *
  * @param A M x N
  * @param subsize Columns in projection matrix,
@@ -2212,42 +2480,7 @@ void randomizePowerIterationSVD(const Ref<const MatrixXd> A,
 void randomizePowerIterationSVD(const Ref<const MatrixXd> A,
 		size_t subsize, size_t poweriters, MatrixXd& U, VectorXd& E, MatrixXd& V)
 {
-	subsize = std::min(subsize, (size_t)A.rows());
-	MatrixXd omega(A.cols(), subsize);
-	npl::fillGaussian<MatrixXd>(omega);
-	MatrixXd Y(A.rows(), subsize);
-	MatrixXd Yhat(A.rows(), subsize);
-	MatrixXd Q, Qhat;
-
-	Y = A*omega;
-	Eigen::HouseholderQR<MatrixXd> qr(Y);
-	Q = qr.householderQ()*MatrixXd::Identity(A.rows(), subsize);
-	Eigen::HouseholderQR<MatrixXd> qrh;
-	for(size_t ii=0; ii<poweriters; ii++) {
-		Yhat = A.transpose()*Q;
-		qrh.compute(Yhat);
-		Qhat = qrh.householderQ()*MatrixXd::Identity(A.cols(), subsize);
-		Y = A*Qhat;
-		qr.compute(Y);
-		Q = qr.householderQ()*MatrixXd::Identity(A.rows(), subsize);
-	}
-
-	// Form B = Q* x A
-	MatrixXd B = Q.transpose()*A;
-	Eigen::JacobiSVD<MatrixXd> smallsvd(B, Eigen::ComputeThinU | Eigen::ComputeThinV);
-	U = Q*smallsvd.matrixU();
-	E = smallsvd.singularValues();
-
-	VectorXd Einv(E.rows());
-	for(size_t ii=0; ii<E.rows(); ii++) {
-		if(E[ii] > std::numeric_limits<double>::epsilon())
-			Einv[ii] = 1./E[ii];
-		else
-			Einv[ii] = 0;
-	}
-
-	// A = U E V*, A* = V E U*, A*U = VE, V = A*UE^-1
-	V = smallsvd.matrixV();
+	rangeFinderSVD(A, 0, subsize, subsize, poweriters, U, E, V);
 }
 
 /**
@@ -2268,10 +2501,13 @@ void randomizePowerIterationSVD(const Ref<const MatrixXd> A,
  * @param odim Threshold for output dimensions. If this is <= 0 then it is
  * ignored, if it is > 0 then max(dim(varth), odim) is used as the output
  * dimension.
+ * @param maxdim Largest number of components to compute, which also bounds
+ * the output dimension. If this is <= 0 then 4*max(odim, 16) is used.
  *
  * @return 		RxP matrix, where P is the number of principal components
  */
-MatrixXd rpiPCA(const Ref<const MatrixXd> X, double varth, int odim)
+MatrixXd rpiPCA(const Ref<const MatrixXd> X, double varth, int odim,
+		int maxdim)
 {
 	double totalv = 0; // total variance
 	int outdim = 0;
@@ -2280,9 +2516,16 @@ MatrixXd rpiPCA(const Ref<const MatrixXd> X, double varth, int odim)
 	std::cout << "Computing SVD of "<<X.rows()<<"x"<<X.cols()<<" matrix"<< std::endl;
 //#endif //DEBUG
 
+	// Grow the basis until the remaining components are below 1% of the
+	// first, but at least to the requested dimension. The rank is bounded,
+	// otherwise a slowly decaying spectrum would make this a full SVD.
 	MatrixXd U, V;
 	VectorXd E;
-	randomizePowerIterationSVD(X, 0.01, 2, 10, 3, U, E, V);
+	if(maxdim <= 0)
+		maxdim = 4*std::max(odim, 16);
+	size_t maxrank = std::min<size_t>(std::min(X.rows(), X.cols()), maxdim);
+	size_t startrank = std::min<size_t>(maxrank, std::max(odim, 10));
+	randomizePowerIterationSVD(X, 0.01, startrank, maxrank, 3, U, E, V);
 //#ifndef NDEBUG
 	std::cout << "Done" << std::endl;
 //#endif //DEBUG
@@ -2302,7 +2545,7 @@ MatrixXd rpiPCA(const Ref<const MatrixXd> X, double varth, int odim)
 //#endif //DEBUG
 
 	// Merge the two dimension estimation results
-	outdim = std::max(odim, outdim);
+	outdim = std::min<int>(std::max(odim, outdim), E.rows());
 
 	// Return whitened signal
 	MatrixXd Xr = U.leftCols(outdim)*E.head(outdim).asDiagonal();
@@ -14,6 +14,7 @@
 #define STATISTICS_H
 
 #include <Eigen/Dense>
+#include <functional>
 #include "npltypes.h"
 #include "mrimage.h"
 
@@ -98,6 +99,51 @@ double gaussianPDF(double mean, double sd, double x);
  */
 double gaussianCDF(double mean, double sd, double x);
 
+/**
+ * @brief 1D Gaussian distribution function for an array of positions. Uses
+ * the same formula as the scalar version, split between threads for large
+ * arrays.
+ *
+ * @param mean Mean of gaussian distribution
+ * @param sd Standard deviation
+ * @param n Number of positions
+ * @param x Positions to get the density of
+ * @param out Output densities (may be the same as x)
+ */
+void gaussianPDFBatch(double mean, double sd, size_t n, const double* x,
+		double* out);
+
+/**
+ * @brief 1D Gaussian cumulative distribution function for an array of
+ * positions, split between threads for large arrays.
+ *
+ * Uses a polynomial (Chebyshev) approximation of erfc rather than erf, with
+ * a relative error below 1.2e-7 in the tail that is being computed, so the
+ * absolute difference from the scalar gaussianCDF is below 6e-8 and small
+ * probabilities are more accurate than the scalar version (which rounds
+ * anything below ~1e-16 to 0).
+ *
+ * @param mean Mean of gaussian distribution
+ * @param sd Standard deviation
+ * @param n Number of positions
+ * @param x Positions to get the probability of
+ * @param out Output probabilities of a value falling below x (may be the same
+ * as x)
+ */
+void gaussianCDFBatch(double mean, double sd, size_t n, const double* x,
+		double* out);
+
+/**
+ * @brief Two sided p-values for an array of z-scores (standard normal),
+ * P(|Z| > |z|). Same approximation and accuracy as
+ * gaussianCDFBatch, NaN z-scores give NaN p-values.
+ *
+ * @param n Number of z-scores
+ * @param z Z-scores
+ * @param p Output p-values (may be the same as z)
+ */
+void gaussianTwoSided(size_t n, const double* z, double* p);
+
 /**
  * @brief PDF for the gamma distribution, if mean is negative then it is
  * assumed that x should be negated as well. Unlike gammaPDF, this takes
@@ -299,6 +345,45 @@ public:
 	 */
 	double cdf(double t) const { return cumulative(t); };
 
+	/**
+	 * @brief Get the cumulative probability for an array of t values. Large
+	 * arrays are split between threads.
+	 *
+	 * The table is uniformly spaced, so the bracketing entries are computed
+	 * directly rather than searched for; the result is the same linear
+	 * interpolation as cumulative(t) and matches it to within round-off
+	 * (1e-14). NaN t values give NaN.
+	 *
+	 * @param n Number of t values
+	 * @param t T values to query
+	 * @param out Output cumulative probabilities (may be the same as t)
+	 */
+	void cumulative(size_t n, const double* t, double* out) const;
+
+	/**
+	 * @brief Get the cumulative probability for an array of t values, see
+	 * cumulative(n, t, out)
+	 *
+	 * @param n Number of t values
+	 * @param t T values to query
+	 * @param out Output cumulative probabilities (may be the same as t)
+	 */
+	void cdf(size_t n, const double* t, double* out) const
+	{
+		cumulative(n, t, out);
+	};
+
+	/**
+	 * @brief Two sided p-values for an array of t values, 2P(T > |t|). This
+	 * is what regress() reports and matches 2*(1-cdf(|t|)) to within
+	 * round-off. NaN t values give NaN.
+	 *
+	 * @param n Number of t values
+	 * @param t T values to query
+	 * @param p Output p-values (may be the same as t)
+	 */
+	void twoSided(size_t n, const double* t, double* p) const;
+
 	/**
 	 * @brief Get the probability density at some t value.
 	 *
@@ -327,6 +412,17 @@ public:
 	 */
 	double icdf(double t) const;
 
+	/**
+	 * @brief Get the T-scores for an array of cumulative probabilities, the
+	 * same as icdf(p) for each element. Large arrays are split between
+	 * threads.
+	 *
+	 * @param n Number of probabilities
+	 * @param p Cumulative probabilities
+	 * @param out Output T values (may be the same as p)
+	 */
+	void icdf(size_t n, const double* p, double* out) const;
+
 	/**
 	 * @brief Get the T-score that corresponds to a particular p-value.
 	 * Alias for icdf
@@ -398,7 +494,52 @@ void regress(RegrResult* out,
  *****************************************/
 
 /**
- * @brief
+ * @brief Blocked, adaptive randomized range finder. Builds an orthonormal
+ * basis Q for the range of the rows x cols matrix A, along with B = Q^T A, a
+ * block of columns at a time. Each block is found by power iteration on AA^T
+ * in the space orthogonal to the current basis. The first block has blocksize
+ * columns, after that each block doubles the basis.
+ *
+ * Growth stops when the residual A-QB is small: either the Frobenius norm of
+ * the residual (from ||A||^2-||B||^2, which needs no extra passes) or the
+ * largest singular value of the newest block of B (an a-posteriori estimate
+ * of the residual's 2-norm before that block was added) is below tol times
+ * the largest singular value of A.
+ *
+ * A is only accessed through pass, and the product with the current block
+ * (B = P*A) is computed in the same pass as the first power iteration of the
+ * next block (Y = A*A^T*X).
+ *
+ * Halko N, Martinsson P, Tropp J. Finding structure with randomness:
+ * Probabilistic algorithms for constructing approximate matrix
+ * decompositions. 2009;1–74. Available from: http://arxiv.org/abs/0909.4061
+ *
+ * @param rows Rows in A
+ * @param cols Columns in A
+ * @param pass Function called as pass(Y, X, B, P, sqnorm), which should set
+ * Y = A*A^T*X and B = P*A in a single pass over A. Either product is skipped
+ * if X has no columns or P has no rows. If sqnorm is not NULL it should also
+ * be set to the squared Frobenius norm of A.
+ * @param tol Stop when the residual is below this ratio of the largest
+ * singular value, 0 always grows to maxrank
+ * @param blocksize Number of columns in the first block
+ * @param maxrank Maximum number of columns in Q
+ * @param poweriters Number of power iterations for each block
+ * @param Q Output basis (rows x k)
+ * @param B Output Q^T A (k x cols)
+ * @param verbose Print the rank and residual after each block
+ *
+ * @return Estimated relative residual, ||A-QB||_F/||A||_F
+ */
+double adaptiveRangeFinder(size_t rows, size_t cols,
+		const std::function<void(Ref<MatrixXd>, const Ref<const MatrixXd>,
+			Ref<MatrixXd>, const Ref<const MatrixXd>, double*)>& pass,
+		double tol, size_t blocksize, size_t maxrank, size_t poweriters,
+		MatrixXd& Q, MatrixXd& B, bool verbose = false);
+
+/**
+ * @brief Computes the SVD of A using a fixed size random subspace (see
+ * adaptiveRangeFinder())
  *
  * @param A M x N
  * @param subsize Columns in projection matrix,
@@ -411,6 +552,20 @@ void randomizePowerIterationSVD(const Ref<const MatrixXd> A,
 		size_t subsize, size_t poweriters, MatrixXd& U, VectorXd& E,
 		MatrixXd& V);
 
+/**
+ * @brief Computes the SVD of A using a random subspace that is grown until
+ * the residual is below tol times the largest singular value (see
+ * adaptiveRangeFinder())
+ *
+ * @param A M x N
+ * @param tol Relative tolerance for the residual
+ * @param startrank Size of the first block of the subspace
+ * @param maxrank Maximum size of the subspace
+ * @param poweriters Number of power iterations to perform for each block
+ * @param U Output Left Singular Vectors
+ * @param E OUtput Singular Values
+ * @param V Output Right Singular Vectors
+ */
 void randomizePowerIterationSVD(const Ref<const MatrixXd> A,
 		double tol, size_t startrank, size_t maxrank, size_t poweriters,
 		MatrixXd& U, VectorXd& E, MatrixXd& V);
@@ -455,10 +610,13 @@ MatrixXd pca(const Ref<const MatrixXd> X, double varth = 1, int odim = -1);
  * @param odim Threshold for output dimensions. If this is <= 0 then it is
  * ignored, if it is > 0 then max(dim(varth), odim) is used as the output
  * dimension.
+ * @param maxdim Largest number of components to compute, which also bounds
+ * the output dimension. If this is <= 0 then 4*max(odim, 16) is used.
  *
  * @return 		RxP matrix, where P is the number of principal components
  */
-MatrixXd rpiPCA(const Ref<const MatrixXd> X, double varth, int odim);
+MatrixXd rpiPCA(const Ref<const MatrixXd> X, double varth, int odim,
+		int maxdim = -1);
 
 /**
  * @brief Computes the Independent Components of input matrix X using symmetric
@@ -0,0 +1,225 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * NPL is free software: you can redistribute it and/or modify it under the
+ * terms of the BSD 2-Clause License available in LICENSE or at
+ * http://opensource.org/licenses/BSD-2-Clause
+ *
+ * @file trace.cpp Lightweight timing instrumentation
+ *
+ *****************************************************************************/
+
+#include "trace.h"
+#include "macros.h"
+
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <map>
+#include <fstream>
+#include <iomanip>
+#include <cmath>
+
+namespace npl {
+
+std::atomic<bool> g_tracing(false);
+
+namespace {
+
+struct Span
+{
+	std::string name;
+	std::string cat;
+	size_t thread;
+	double start;
+	double dur;
+	std::vector<std::pair<std::string,double>> args;
+	std::string note;
+};
+
+std::mutex s_mutex;
+std::vector<Span> s_spans;
+
+// threads are numbered in the order they first record a span
+std::map<std::thread::id, size_t> s_threads;
+
+/**
+ * @brief Writes a string as a JSON string literal
+ */
+void writeString(std::ostream& os, const std::string& str)
+{
+	os << '"';
+	for(char c : str) {
+		if(c == '"' || c == '\\')
+			os << '\\' << c;
+		else if(c == '\n')
+			os << "\\n";
+		else if((unsigned char)c < 0x20)
+			os << ' ';
+		else
+			os << c;
+	}
+	os << '"';
+}
+
+/**
+ * @brief Writes the arguments (and note) of a span as a JSON object
+ */
+void writeArgs(std::ostream& os, const Span& span)
+{
+	os << "{";
+	for(size_t ii=0; ii<span.args.size(); ii++) {
+		if(ii > 0)
+			os << ", ";
+		writeString(os, span.args[ii].first);
+		os << ": ";
+		// JSON has no inf/nan
+		if(std::isfinite(span.args[ii].second))
+			os << span.args[ii].second;
+		else
+			os << "null";
+	}
+	if(!span.note.empty()) {
+		if(!span.args.empty())
+			os << ", ";
+		os << "\"note\": ";
+		writeString(os, span.note);
+	}
+	os << "}";
+}
+
+}
+
+/**
+ * @brief Enables or disables recording of spans. Spans already recorded are
+ * kept until clearTrace() is called.
+ *
+ * @param enable Whether to record spans
+ */
+void setTracing(bool enable)
+{
+	traceClock();
+	g_tracing = enable;
+}
+
+/**
+ * @brief Removes all recorded spans
+ */
+void clearTrace()
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+	s_spans.clear();
+}
+
+/**
+ * @brief Current time, in seconds since the first call
+ */
+double traceClock()
+{
+	static const auto epoch = std::chrono::steady_clock::now();
+	return std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - epoch).count();
+}
+
+/**
+ * @brief Records a span (if tracing is enabled)
+ *
+ * @param name Name of the span (what was done)
+ * @param cat Category (which function or class did it)
+ * @param start Start time, from traceClock()
+ * @param dur Duration in seconds
+ * @param args Named values to attach to the span
+ * @param note Free-form text to attach to the span
+ */
+void traceSpan(std::string name, std::string cat, double start, double dur,
+		const std::vector<std::pair<std::string,double>>& args,
+		std::string note)
+{
+	if(!tracing())
+		return;
+
+	std::lock_guard<std::mutex> lock(s_mutex);
+	auto ret = s_threads.insert(std::make_pair(std::this_thread::get_id(),
+				s_threads.size()));
+	s_spans.push_back(Span{name, cat, ret.first->second, start, dur, args,
+			note});
+}
+
+/**
+ * @brief Writes the recorded spans as JSON:
+ * {"spans": [{"name", "cat", "thread", "start", "dur", "args", "note"}]},
+ * with times in seconds.
+ *
+ * @param filename Output file
+ */
+void writeTraceJSON(std::string filename)
+{
+	std::ofstream ofs(filename);
+	if(!ofs.is_open())
+		throw RUNTIME_ERROR("Error opening " + filename + " for writing");
+
+	std::lock_guard<std::mutex> lock(s_mutex);
+	ofs << std::setprecision(9) << "{\"spans\": [";
+	for(size_t ii=0; ii<s_spans.size(); ii++) {
+		const Span& span = s_spans[ii];
+		ofs << (ii > 0 ? ",\n" : "\n") << "{\"name\": ";
+		writeString(ofs, span.name);
+		ofs << ", \"cat\": ";
+		writeString(ofs, span.cat);
+		ofs << ", \"thread\": " << span.thread << ", \"start\": "
+			<< span.start << ", \"dur\": " << span.dur << ", \"args\": ";
+		writeArgs(ofs, span);
+		ofs << "}";
+	}
+	ofs << "\n]}" << std::endl;
+}
+
+/**
+ * @brief Writes the recorded spans in the Chrome trace event format (complete
+ * events, times in microseconds), for chrome://tracing or Perfetto.
+ *
+ * @param filename Output file
+ */
+void writeChromeTrace(std::string filename)
+{
+	std::ofstream ofs(filename);
+	if(!ofs.is_open())
+		throw RUNTIME_ERROR("Error opening " + filename + " for writing");
+
+	std::lock_guard<std::mutex> lock(s_mutex);
+	ofs << std::fixed << std::setprecision(3) << "{\"traceEvents\": [";
+	for(size_t ii=0; ii<s_spans.size(); ii++) {
+		const Span& span = s_spans[ii];
+		ofs << (ii > 0 ? ",\n" : "\n") << "{\"name\": ";
+		writeString(ofs, span.name);
+		ofs << ", \"cat\": ";
+		writeString(ofs, span.cat);
+		ofs << ", \"ph\": \"X\", \"pid\": 0, \"tid\": " << span.thread
+			<< ", \"ts\": " << span.start*1e6 << ", \"dur\": "
+			<< span.dur*1e6 << ", \"args\": ";
+		ofs.unsetf(std::ios::floatfield);
+		ofs << std::setprecision(9);
+		writeArgs(ofs, span);
+		ofs << std::fixed << std::setprecision(3) << "}";
+	}
+	ofs << "\n], \"displayTimeUnit\": \"ms\"}" << std::endl;
+}
+
+/**
+ * @brief Writes the recorded spans to a file, in the Chrome trace format if
+ * format is "chrome" and as JSON if it is "json".
+ *
+ * @param filename Output file
+ * @param format "chrome" or "json"
+ */
+void writeTrace(std::string filename, std::string format)
+{
+	if(format == "chrome")
+		writeChromeTrace(filename);
+	else if(format == "json")
+		writeTraceJSON(filename);
+	else
+		throw INVALID_ARGUMENT("Unknown trace format " + format);
+}
+
+}
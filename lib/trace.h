@@ -0,0 +1,219 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * NPL is free software: you can redistribute it and/or modify it under the
+ * terms of the BSD 2-Clause License available in LICENSE or at
+ * http://opensource.org/licenses/BSD-2-Clause
+ *
+ * @file trace.h Lightweight timing instrumentation. Timed spans are collected
+ * in memory (only while tracing is enabled) and can be written as JSON or in
+ * the Chrome trace event format (chrome://tracing, Perfetto).
+ *
+ *****************************************************************************/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <atomic>
+
+namespace npl {
+
+/** \defgroup Tracing Timing instrumentation
+ *
+ * Library functions record spans with TraceScope or TracePhases. When tracing
+ * is disabled (the default) these only test a flag, so they can be left in
+ * hot code. Spans are recorded with the thread that ran them.
+ *
+ * @{
+ */
+
+extern std::atomic<bool> g_tracing;
+
+/**
+ * @brief Returns whether spans are currently being recorded
+ */
+inline bool tracing()
+{
+	return g_tracing.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief Enables or disables recording of spans. Spans already recorded are
+ * kept until clearTrace() is called.
+ *
+ * @param enable Whether to record spans
+ */
+void setTracing(bool enable);
+
+/**
+ * @brief Removes all recorded spans
+ */
+void clearTrace();
+
+/**
+ * @brief Current time, in seconds since the first call
+ */
+double traceClock();
+
+/**
+ * @brief Records a span (if tracing is enabled)
+ *
+ * @param name Name of the span (what was done)
+ * @param cat Category (which function or class did it)
+ * @param start Start time, from traceClock()
+ * @param dur Duration in seconds
+ * @param args Named values to attach to the span
+ * @param note Free-form text to attach to the span
+ */
+void traceSpan(std::string name, std::string cat, double start, double dur,
+		const std::vector<std::pair<std::string,double>>& args = {},
+		std::string note = "");
+
+/**
+ * @brief Writes the recorded spans as JSON:
+ * {"spans": [{"name", "cat", "thread", "start", "dur", "args", "note"}]},
+ * with times in seconds.
+ *
+ * @param filename Output file
+ */
+void writeTraceJSON(std::string filename);
+
+/**
+ * @brief Writes the recorded spans in the Chrome trace event format (complete
+ * events, times in microseconds), for chrome://tracing or Perfetto.
+ *
+ * @param filename Output file
+ */
+void writeChromeTrace(std::string filename);
+
+/**
+ * @brief Writes the recorded spans to a file, in the Chrome trace format if
+ * format is "chrome" and as JSON if it is "json".
+ *
+ * @param filename Output file
+ * @param format "chrome" or "json"
+ */
+void writeTrace(std::string filename, std::string format);
+
+/**
+ * @brief Records a span covering the lifetime of the object, if tracing was
+ * enabled when it was created.
+ */
+class TraceScope
+{
+public:
+	/**
+	 * @brief Starts the span
+	 *
+	 * @param name Name of the span
+	 * @param cat Category of the span
+	 */
+	TraceScope(const char* name, const char* cat) : m_on(tracing()),
+		m_name(name), m_cat(cat), m_start(m_on ? traceClock() : 0)
+	{ };
+
+	/**
+	 * @brief Ends and records the span
+	 */
+	~TraceScope()
+	{
+		if(m_on)
+			traceSpan(m_name, m_cat, m_start, traceClock()-m_start, m_args,
+					m_note);
+	};
+
+	/**
+	 * @brief Attaches a named value to the span
+	 */
+	void arg(const char* key, double value)
+	{
+		if(m_on)
+			m_args.push_back(std::make_pair(std::string(key), value));
+	};
+
+	/**
+	 * @brief Attaches text to the span
+	 */
+	void note(std::string text)
+	{
+		if(m_on)
+			m_note = text;
+	};
+
+	/**
+	 * @brief Whether the span is being recorded
+	 */
+	bool on() const { return m_on; };
+
+private:
+	bool m_on;
+	const char* m_name;
+	const char* m_cat;
+	double m_start;
+	std::vector<std::pair<std::string,double>> m_args;
+	std::string m_note;
+};
+
+/**
+ * @brief Records consecutive spans, each starting where the previous one
+ * ended, for the stages of a function. Calling phase() ends the current
+ * stage (if any) and starts the next, the last stage ends with the object.
+ */
+class TracePhases
+{
+public:
+	/**
+	 * @brief Constructor, no stage is started until phase() is called
+	 *
+	 * @param cat Category of the spans
+	 */
+	TracePhases(const char* cat) : m_on(tracing()), m_cat(cat),
+		m_name(NULL), m_start(0)
+	{ };
+
+	~TracePhases()
+	{
+		end();
+	};
+
+	/**
+	 * @brief Ends the current stage and starts the next
+	 *
+	 * @param name Name of the next stage
+	 */
+	void phase(const char* name)
+	{
+		if(!m_on)
+			return;
+		double now = traceClock();
+		if(m_name)
+			traceSpan(m_name, m_cat, m_start, now-m_start);
+		m_name = name;
+		m_start = now;
+	};
+
+	/**
+	 * @brief Ends the current stage
+	 */
+	void end()
+	{
+		if(m_on && m_name)
+			traceSpan(m_name, m_cat, m_start, traceClock()-m_start);
+		m_name = NULL;
+	};
+
+private:
+	bool m_on;
+	const char* m_cat;
+	const char* m_name;
+	double m_start;
+};
+
+/** @} */
+
+}
+
+#endif // TRACE_H
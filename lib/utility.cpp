@@ -33,6 +33,9 @@
 #include <cassert>
 #include <list>
 #include <vector>
+#include <thread>
+#include <atomic>
+#include <exception>
 
 using std::endl;
 using std::string;
@@ -605,6 +608,89 @@ void convolve(std::vector<double>& signal, double(*foo)(double),
 	}
 }
 
+namespace {
+std::atomic<size_t> g_nthreads(0);
+thread_local bool t_inparallel = false;
+}
+
+size_t numThreads()
+{
+	size_t n = g_nthreads;
+	if(n == 0) {
+		const char* env = getenv("NPL_NUM_THREADS");
+		if(env)
+			n = strtoul(env, NULL, 10);
+		if(n == 0)
+			n = std::thread::hardware_concurrency();
+		if(n == 0)
+			n = 1;
+		g_nthreads = n;
+	}
+	return n;
+}
+
+void setNumThreads(size_t nthreads)
+{
+	g_nthreads = nthreads;
+}
+
+bool inParallel()
+{
+	return t_inparallel;
+}
+
+std::mutex& fftwPlanMutex()
+{
+	static std::mutex m;
+	return m;
+}
+
+size_t parallelFor(size_t begin, size_t end,
+		const std::function<void(size_t, size_t, size_t)>& func,
+		size_t nthreads)
+{
+	if(end <= begin)
+		return 0;
+
+	size_t len = end-begin;
+	if(nthreads == 0)
+		nthreads = numThreads();
+	if(nthreads > len)
+		nthreads = len;
+
+	// Nested calls and single threads just run in the current thread
+	if(nthreads <= 1 || t_inparallel) {
+		func(0, begin, end);
+		return 1;
+	}
+
+	vector<std::exception_ptr> errors(nthreads);
+	auto worker = [&](size_t ii)
+	{
+		t_inparallel = true;
+		try {
+			func(ii, begin+ii*len/nthreads, begin+(ii+1)*len/nthreads);
+		} catch(...) {
+			errors[ii] = std::current_exception();
+		}
+		t_inparallel = false;
+	};
+
+	vector<std::thread> threads;
+	threads.reserve(nthreads-1);
+	for(size_t ii=1; ii<nthreads; ii++)
+		threads.emplace_back(worker, ii);
+	worker(0);
+	for(auto& t : threads)
+		t.join();
+
+	for(auto& e : errors) {
+		if(e)
+			std::rethrow_exception(e);
+	}
+	return nthreads;
+}
+
 MemMap::MemMap(std::string fn, size_t bsize) :
 	m_size(0), m_fd(0), m_data(NULL)
 {
@@ -690,6 +776,12 @@ int64_t MemMap::openExisting(string fn, bool writeable, bool quiet)
 		std::cerr<<"Error opening memory map of size "<<m_size<<endl;
 		return -1;
 	}
+
+	// Read-only maps have nothing to sync, so don't hold the descriptor
+	if(!writeable) {
+		::close(m_fd);
+		m_fd = -1;
+	}
 	return m_size;
 };
 
@@ -697,8 +789,10 @@ void MemMap::close()
 {
 	if(m_size > 0) {
 		munmap(m_data, m_size);
-		fsync(m_fd);
-		::close(m_fd);
+		if(m_fd >= 0) {
+			fsync(m_fd);
+			::close(m_fd);
+		}
 	}
 	m_data = NULL;
 	m_fd = -1;
@@ -16,6 +16,8 @@
 #include <cmath>
 #include <list>
 #include <vector>
+#include <functional>
+#include <mutex>
 
 #define __FUNCTION_STR__ std::string(__PRETTY_FUNCTION__)
 
@@ -267,6 +269,63 @@ double sd_to_fwhm(double sd)
   return sd*(2*sqrt(2*log(2)));
 }
 
+/**
+ * @brief Returns the number of threads that parallelFor will use by default.
+ * This is initialized from the NPL_NUM_THREADS environment variable if it is
+ * set, otherwise from std::thread::hardware_concurrency().
+ *
+ * @return Number of worker threads (always >= 1)
+ */
+size_t numThreads();
+
+/**
+ * @brief Sets the number of threads that parallelFor will use by default. A
+ * value of 0 resets to the hardware concurrency.
+ *
+ * @param nthreads Number of threads to use
+ */
+void setNumThreads(size_t nthreads);
+
+/**
+ * @brief Splits [begin, end) into contiguous chunks and calls func once per
+ * chunk, each on its own thread. Chunk ii is always [begin+ii*len/n,
+ * begin+(ii+1)*len/n), so for a fixed thread count the partition (and thus any
+ * reduction that combines per-chunk results in chunk order) is deterministic.
+ *
+ * Calls from inside a running parallelFor are executed serially on the calling
+ * thread (as a single chunk 0) to avoid over-subscription. The first exception
+ * thrown by any chunk is rethrown after all threads have joined.
+ *
+ * @param begin First index
+ * @param end One past the last index
+ * @param func Function called as func(chunk, chunkbegin, chunkend)
+ * @param nthreads Number of chunks/threads, 0 uses numThreads()
+ *
+ * @return Number of chunks actually used (chunk ids are [0, return))
+ */
+size_t parallelFor(size_t begin, size_t end,
+		const std::function<void(size_t, size_t, size_t)>& func,
+		size_t nthreads = 0);
+
+/**
+ * @brief Whether the calling thread is running a chunk of a multi-threaded
+ * parallelFor. Code that must not run alongside other threads (such as
+ * fork()) can use this to refuse.
+ *
+ * @return True inside parallelFor
+ */
+bool inParallel();
+
+/**
+ * @brief Returns the mutex that guards the FFTW planner. Creating and
+ * destroying FFTW plans is not thread-safe, so any code that may be called
+ * from inside parallelFor must hold this lock while doing so. Executing an
+ * existing plan does not require it.
+ *
+ * @return Global FFTW planner mutex
+ */
+std::mutex& fftwPlanMutex();
+
 /**
  * @brief Memory map class. The basic gyst is that this works like a malloc
  * except that data may be initialized by file contents or left empty. This
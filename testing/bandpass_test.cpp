@@ -0,0 +1,97 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * NPL is free software: you can redistribute it and/or modify it under the
+ * terms of the BSD 2-Clause License available in LICENSE or at
+ * http://opensource.org/licenses/BSD-2-Clause
+ *
+ * @file bandpass_test.cpp Compares the batched, multi-threaded fmriBandPass
+ * against a simple one-voxel-at-a-time FFT filter.
+ *
+ *****************************************************************************/
+
+#include <version.h>
+#include <string>
+#include <stdexcept>
+
+#include "fftw3.h"
+
+#include "mrimage.h"
+#include "mrimage_utils.h"
+#include "ndarray_utils.h"
+#include "iterators.h"
+#include "utility.h"
+#include "npltypes.h"
+#include "fmri_inference.h"
+
+using namespace npl;
+using namespace std;
+
+/**
+ * @brief Reference band pass, same butterworth filter as fmriBandPass but
+ * computed one voxel at a time
+ */
+void refBandPass(ptr<MRImage> img, double cuton, double cutoff)
+{
+	size_t tlen = img->tlen();
+	int psize = round2(tlen);
+	double T = (double)psize*img->spacing(3);
+
+	auto rbuffer = (double*)fftw_malloc(sizeof(double)*psize);
+	auto ibuffer = (fftw_complex*)fftw_malloc(sizeof(fftw_complex)*psize);
+	fftw_plan fwd = fftw_plan_dft_r2c_1d(psize, rbuffer, ibuffer, FFTW_MEASURE);
+	fftw_plan rev = fftw_plan_dft_c2r_1d(psize, ibuffer, rbuffer, FFTW_MEASURE);
+
+	for(Vector3DIter<double> it(img); !it.eof(); ++it) {
+		for(size_t tt = 0 ; tt < psize; tt++)
+			rbuffer[tt] = tt < tlen ? it[tt] : 0;
+
+		fftw_execute(fwd);
+		for(size_t ii=0; ii<psize/2+1; ii++) {
+			double ff = (double)ii/T;
+			double w = 1.0/(1.0+pow(ff/cutoff, 4)) -
+				1.0/(1.0+pow(-ff/cuton, 4));
+			ibuffer[ii][0] *= w/psize;
+			ibuffer[ii][1] *= w/psize;
+		}
+		fftw_execute(rev);
+
+		for(size_t tt = 0 ; tt < tlen; tt++)
+			it.set(tt, rbuffer[tt]);
+	}
+
+	fftw_destroy_plan(fwd);
+	fftw_destroy_plan(rev);
+	fftw_free(rbuffer);
+	fftw_free(ibuffer);
+}
+
+int main()
+{
+	// odd sizes so that neither the batches nor the slabs divide evenly
+	vector<size_t> fdim({13,7,5,217});
+	auto fmri = createMRImage(fdim.size(), fdim.data(), FLOAT64);
+	fillGaussian(fmri);
+	fmri->spacing(3) = 0.7;
+
+	auto ref = dPtrCast<MRImage>(fmri->copy());
+	refBandPass(ref, 0.01, 0.1);
+
+	for(size_t nthreads = 1; nthreads < 5; nthreads++) {
+		setNumThreads(nthreads);
+		auto test = dPtrCast<MRImage>(fmri->copy());
+		fmriBandPass(test, 0.01, 0.1);
+
+		for(Vector3DIter<double> it(test), rit(ref); !it.eof(); ++it, ++rit) {
+			for(size_t tt=0; tt<fdim[3]; tt++) {
+				if(fabs(it[tt] - rit[tt]) > 1e-10) {
+					cerr << "Mismatch with " << nthreads << " threads: "
+						<< it[tt] << " vs " << rit[tt] << endl;
+					return -1;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
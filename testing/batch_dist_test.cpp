@@ -0,0 +1,126 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * NPL is free software: you can redistribute it and/or modify it under the
+ * terms of the BSD 2-Clause License available in LICENSE or at
+ * http://opensource.org/licenses/BSD-2-Clause
+ *
+ * @file batch_dist_test.cpp Tests that the array versions of the Student's T
+ * and Gaussian distribution functions match the scalar versions to within
+ * their documented accuracy, with and without threads
+ *
+ *****************************************************************************/
+
+#include <string>
+#include <iostream>
+#include <random>
+#include <vector>
+#include <cmath>
+#include <limits>
+
+#include "statistics.h"
+#include "utility.h"
+
+using namespace std;
+using namespace npl;
+
+int main()
+{
+	setNumThreads(4);
+
+	// t values covering both tails, zero, the table ends and beyond
+	std::mt19937 rng(4321);
+	std::uniform_real_distribution<double> unif(-30, 30);
+	vector<double> t(100000);
+	for(size_t ii=0; ii<t.size(); ii++)
+		t[ii] = unif(rng);
+	t[0] = 0;
+	t[1] = 20;
+	t[2] = -20;
+	t[3] = 19.95;
+	t[4] = 1e10;
+	t[5] = -1e10;
+	vector<double> out(t.size());
+	vector<double> pvals(t.size());
+
+	for(int dof : {3, 40}) {
+		StudentsT distrib(dof, 0.1, 20);
+
+		distrib.cdf(t.size(), t.data(), out.data());
+		distrib.twoSided(t.size(), t.data(), pvals.data());
+		for(size_t ii=0; ii<t.size(); ii++) {
+			double c = distrib.cdf(t[ii]);
+			double p = 2*(t[ii] > 0 ? 1-c : c);
+			if(fabs(out[ii] - c) > 1e-14 || fabs(pvals[ii] - p) > 1e-14) {
+				cerr << "Mismatch at t = " << t[ii] << ": cdf " << out[ii]
+					<< " vs " << c << ", p " << pvals[ii] << " vs " << p
+					<< endl;
+				return -1;
+			}
+		}
+
+		// inverse
+		vector<double> prob(1000);
+		for(size_t ii=0; ii<prob.size(); ii++)
+			prob[ii] = (ii+0.5)/prob.size();
+		vector<double> tinv(prob.size());
+		distrib.icdf(prob.size(), prob.data(), tinv.data());
+		for(size_t ii=0; ii<prob.size(); ii++) {
+			if(tinv[ii] != distrib.icdf(prob[ii])) {
+				cerr << "Inverse mismatch at p = " << prob[ii] << endl;
+				return -1;
+			}
+		}
+	}
+
+	// Gaussian, including far enough in the tails that erf() gives 0
+	std::normal_distribution<double> gauss(1, 4);
+	vector<double> x(t.size());
+	for(size_t ii=0; ii<x.size(); ii++)
+		x[ii] = gauss(rng);
+	x[0] = -40;
+	x[1] = 1;
+	gaussianCDFBatch(1, 4, x.size(), x.data(), out.data());
+	for(size_t ii=0; ii<x.size(); ii++) {
+		double c = gaussianCDF(1, 4, x[ii]);
+		if(fabs(out[ii] - c) > 6e-8) {
+			cerr << "Gaussian CDF mismatch at " << x[ii] << ": " << out[ii]
+				<< " vs " << c << endl;
+			return -1;
+		}
+	}
+	double lowtail = 0.5*erfc(41/(4*sqrt(2)));
+	if(fabs(out[0] - lowtail) > 1.2e-7*lowtail) {
+		cerr << "Gaussian CDF inaccurate in the tail " << out[0] << " vs "
+			<< lowtail << endl;
+		return -1;
+	}
+
+	gaussianPDFBatch(1, 4, x.size(), x.data(), out.data());
+	for(size_t ii=0; ii<x.size(); ii++) {
+		if(fabs(out[ii] - gaussianPDF(1, 4, x[ii])) > 1e-15) {
+			cerr << "Gaussian PDF mismatch at " << x[ii] << endl;
+			return -1;
+		}
+	}
+
+	// two sided z
+	vector<double> z({0, 1.959963984540054, -3, 8,
+			std::numeric_limits<double>::quiet_NaN()});
+	vector<double> zp(z.size());
+	gaussianTwoSided(z.size(), z.data(), zp.data());
+	for(size_t ii=0; ii+1<z.size(); ii++) {
+		double p = erfc(fabs(z[ii])/sqrt(2));
+		if(fabs(zp[ii] - p) > 1.2e-7*p) {
+			cerr << "Two sided p mismatch at z = " << z[ii] << ": " << zp[ii]
+				<< " vs " << p << endl;
+			return -1;
+		}
+	}
+	if(!std::isnan(zp.back())) {
+		cerr << "NaN z-score should give NaN p-value" << endl;
+		return -1;
+	}
+
+	return 0;
+}
@@ -71,36 +71,40 @@ int testTallPCAJoin(const MatrixReorg& reorg, std::string prefix, double svt,
 	const auto& fullS = fullsvd.singularValues();
 	const auto& fullU = fullsvd.matrixU();
 
-	MatrixXd mergeU, mergeV;
-	VectorXd mergeS = onDiskSVD(reorg, estrank, poweriters, 0.1, svt,
-			&mergeU, &mergeV);
-
-	size_t rank = mergeS.rows();
-	cerr << "SVD Rank: " << rank << endl;
-
-	cerr<<"Comparing Full S with Merge S"<<endl;
-	cerr<<"Full S\n"<<fullS.transpose()<<endl;
-	cerr<<"Full U\n"<<fullU.transpose()<<endl;
-	cerr<<"Merge S\n"<<mergeS.transpose()<<endl;
-	cerr<<"Merge U\n"<<mergeU.transpose()<<endl;
-	for(size_t ii=0; ii<rank; ++ii) {
-		cerr << fullS[ii] << " vs " << mergeS[ii] << endl;
-		if(2*fabs(mergeS[ii] - fullS[ii])/fabs(mergeS[ii]+fullS[ii]) > thresh) {
-			cerr<<"Difference in Singular Value "<<ii<<": "<<mergeS[ii]<<" vs "
-				<<fullS[ii]<<endl;
-			return -1;
+	// With fused passes over the data, and with the in-memory Gram matrix
+	for(bool gram : {false, true}) {
+		cerr<<"Using Gram Matrix: "<<gram<<endl;
+		MatrixXd mergeU, mergeV;
+		VectorXd mergeS = onDiskSVD(reorg, estrank, poweriters, 0.1, svt,
+				&mergeU, &mergeV, gram);
+
+		size_t rank = mergeS.rows();
+		cerr << "SVD Rank: " << rank << endl;
+
+		cerr<<"Comparing Full S with Merge S"<<endl;
+		cerr<<"Full S\n"<<fullS.transpose()<<endl;
+		cerr<<"Full U\n"<<fullU.transpose()<<endl;
+		cerr<<"Merge S\n"<<mergeS.transpose()<<endl;
+		cerr<<"Merge U\n"<<mergeU.transpose()<<endl;
+		for(size_t ii=0; ii<rank; ++ii) {
+			cerr << fullS[ii] << " vs " << mergeS[ii] << endl;
+			if(2*fabs(mergeS[ii] - fullS[ii])/fabs(mergeS[ii]+fullS[ii]) > thresh) {
+				cerr<<"Difference in Singular Value "<<ii<<": "<<mergeS[ii]<<" vs "
+					<<fullS[ii]<<endl;
+				return -1;
+			}
 		}
-	}
 
-	cerr<<"Comparing Full U with Merge U"<<endl;
-	cerr<<fullS.rows()<<endl;
-	cerr<<mergeS.rows()<<endl;
-	for(size_t ii=0; ii<rank;  ++ii) {
-		cerr<<"Dot "<<ii<<":"<<(mergeU.col(ii).dot(fullU.col(ii)))<<endl;
-		if(1-fabs(mergeU.col(ii).dot(fullU.col(ii))) > thresh) {
-			cerr<<"Difference in U col "<<ii<<": "<<mergeU.col(ii)<<" vs "
-				<<fullU.col(ii)<<endl;
-			return -1;
+		cerr<<"Comparing Full U with Merge U"<<endl;
+		cerr<<fullS.rows()<<endl;
+		cerr<<mergeS.rows()<<endl;
+		for(size_t ii=0; ii<rank;  ++ii) {
+			cerr<<"Dot "<<ii<<":"<<(mergeU.col(ii).dot(fullU.col(ii)))<<endl;
+			if(1-fabs(mergeU.col(ii).dot(fullU.col(ii))) > thresh) {
+				cerr<<"Difference in U col "<<ii<<": "<<mergeU.col(ii)<<" vs "
+					<<fullU.col(ii)<<endl;
+				return -1;
+			}
 		}
 	}
 
@@ -0,0 +1,99 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * NPL is free software: you can redistribute it and/or modify it under the
+ * terms of the BSD 2-Clause License available in LICENSE or at
+ * http://opensource.org/licenses/BSD-2-Clause
+ *
+ * @file clean_fmri_test.cpp Tests that the fused cleanFMRI matches
+ * regressOut followed by fmriBandPass, and that normalization gives unit
+ * variance time series
+ *
+ *****************************************************************************/
+
+#include <string>
+#include <stdexcept>
+#include <random>
+
+#include <Eigen/Dense>
+#include "statistics.h"
+#include "mrimage.h"
+#include "mrimage_utils.h"
+#include "iterators.h"
+#include "utility.h"
+#include "fmri_inference.h"
+
+using std::string;
+using Eigen::MatrixXd;
+
+using namespace npl;
+
+int main()
+{
+	setNumThreads(4);
+
+	vector<size_t> fdim({9,8,5,100});
+	std::mt19937 rng(11);
+	std::normal_distribution<double> gauss(0, 1);
+
+	MatrixXd X(fdim[3], 2);
+	for(size_t rr=0; rr<X.rows(); rr++) {
+		X(rr, 0) = gauss(rng);
+		X(rr, 1) = rr/100.;
+	}
+
+	auto fmri = createMRImage(fdim.size(), fdim.data(), INT16);
+	fmri->spacing(3) = 2;
+	int64_t index[3];
+	for(Vector3DIter<double> it(fmri); !it.eof(); ++it) {
+		it.index(3, index);
+		for(size_t tt=0; tt<fdim[3]; tt++) {
+			if(index[0] == 0)
+				it.set(tt, 1000);
+			else
+				it.set(tt, round(1000 + 50*X(tt, 0) + 100*X(tt, 1) +
+							30*sin(tt/4.) + 10*gauss(rng)));
+		}
+	}
+
+	// sequential pipeline, in double precision
+	auto seq = dPtrCast<MRImage>(fmri->copyCast(FLOAT64));
+	regressOut(fmri, X, seq);
+	fmriBandPass(seq, 0.01, 0.1);
+
+	auto clean = cleanFMRI(fmri, X, 0.01, 0.1);
+	if(clean->type() != FLOAT32) {
+		cerr << "Output should be FLOAT32" << endl;
+		return -1;
+	}
+	for(Vector3DConstIter<double> it(seq), cit(clean); !it.eof(); ++it, ++cit) {
+		for(size_t tt=0; tt<fdim[3]; tt++) {
+			if(fabs(it[tt] - cit[tt]) > 1e-4*(1+fabs(it[tt]))) {
+				cerr << "Mismatch with regressOut+fmriBandPass: " << cit[tt]
+					<< " vs " << it[tt] << endl;
+				return -1;
+			}
+		}
+	}
+
+	// no regression or filtering, just normalization
+	auto norm = cleanFMRI(fmri, MatrixXd(fdim[3], 0), NAN, INFINITY, true);
+	for(Vector3DConstIter<double> it(norm); !it.eof(); ++it) {
+		it.index(3, index);
+		double sum = 0, sumsq = 0;
+		for(size_t tt=0; tt<fdim[3]; tt++) {
+			sum += it[tt];
+			sumsq += it[tt]*it[tt];
+		}
+		double mean = sum/fdim[3];
+		double var = (sumsq - sum*mean)/(fdim[3]-1);
+		double expected = index[0] == 0 ? 0 : 1;
+		if(fabs(mean) > 1e-5 || fabs(var - expected) > 1e-4) {
+			cerr << "Normalization failed, mean " << mean << " var " << var
+				<< endl;
+			return -1;
+		}
+	}
+
+	return 0;
+}
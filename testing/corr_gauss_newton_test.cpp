@@ -0,0 +1,106 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * NPL is free software: you can redistribute it and/or modify it under the
+ * terms of the BSD 2-Clause License available in LICENSE or at
+ * http://opensource.org/licenses/BSD-2-Clause
+ *
+ * @file corr_gauss_newton_test.cpp Tests that the Gauss-Newton solver for
+ * correlation registration recovers a rigid transform in a few passes, and
+ * agrees with L-BFGS
+ *
+ *****************************************************************************/
+
+#include "mrimage.h"
+#include "iterators.h"
+#include "ndarray_utils.h"
+#include "mrimage_utils.h"
+#include "registration.h"
+
+#include <string>
+#include <iostream>
+#include <memory>
+
+using namespace std;
+using namespace npl;
+
+shared_ptr<MRImage> blobImage()
+{
+	// create test image
+	int64_t index[3];
+	size_t sz[] = {32, 30, 28};
+	auto in = createMRImage(sizeof(sz)/sizeof(size_t), sz, FLOAT64);
+
+	// fill with blob with some texture
+	for(NDIter<double> it(in); !it.eof(); ++it) {
+		it.index(3, index);
+		double x = index[0]-15;
+		double y = index[1]-14;
+		double z = index[2]-13;
+		double r = x*x/100+y*y/64+z*z/49;
+		it.set(r < 1 ? 100+20*sin(0.4*x)*cos(0.3*z)+x : 0);
+	}
+	return in;
+}
+
+int main()
+{
+	auto img = blobImage();
+	double trueshift[3] = {1.5, -1, 0.7};
+	double truerotate[3] = {0.05, -0.04, 0.06};
+
+	// rotate then shift it
+	auto moved = dPtrCast<MRImage>(img->copy());
+	rotateImageShearKern(moved, truerotate[0], truerotate[1], truerotate[2]);
+	for(size_t ii=0; ii<3; ii++)
+		shiftImageKern(moved, ii, trueshift[ii]);
+
+	// single level, directly
+	ImagePyramid fixpyr(img, {1});
+	ImagePyramid movpyr(moved, {1}, 1, true);
+	RigidCorrComp comp(true);
+	comp.setFixed(fixpyr.level(0));
+	comp.setMoving(movpyr.level(0), movpyr.deriv(0));
+
+	VectorXd x = VectorXd::Zero(6);
+	double v0, v1;
+	comp.value(x, v0);
+	size_t passes = comp.gaussNewton(x, 1e-4);
+	comp.value(x, v1);
+	cerr << "Gauss-Newton: " << x.transpose() << " (" << passes
+		<< " passes), correlation " << -v0 << " -> " << -v1 << endl;
+	if(passes > 15) {
+		cerr << "Too many passes" << endl;
+		return -1;
+	}
+	if(!(v1 < v0)) {
+		cerr << "Correlation did not improve" << endl;
+		return -1;
+	}
+
+	// full registration, with both optimizers
+	auto gn = corReg3D(img, moved, {2, 1}, false, true);
+	auto lbfgs = corReg3D(img, moved, {2, 1});
+	gn.toIndexCoords(moved, true);
+	lbfgs.toIndexCoords(moved, true);
+	cerr << "Gauss-Newton: " << gn << endl;
+	cerr << "L-BFGS: " << lbfgs << endl;
+
+	for(size_t dd=0; dd<3; dd++) {
+		if(fabs(truerotate[dd] - gn.rotation[dd]) > 0.01) {
+			cerr << "Rotate " << dd << " differs!" << endl;
+			return -1;
+		}
+		if(fabs(trueshift[dd] - gn.shift[dd]) > 0.1) {
+			cerr << "Shift " << dd << " differs!" << endl;
+			return -1;
+		}
+		if(fabs(lbfgs.rotation[dd] - gn.rotation[dd]) > 0.005 ||
+				fabs(lbfgs.shift[dd] - gn.shift[dd]) > 0.05) {
+			cerr << "Gauss-Newton and L-BFGS differ!" << endl;
+			return -1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,140 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * NPL is free software: you can redistribute it and/or modify it under the
+ * terms of the BSD 2-Clause License available in LICENSE or at
+ * http://opensource.org/licenses/BSD-2-Clause
+ *
+ * @file dc_basis_cache_test.cpp Tests that the distortion correction metrics
+ * give the same results with a cached B-spline basis as when the basis is
+ * computed on the fly, and that the basis matches BSplineView
+ *
+ *****************************************************************************/
+
+#include "mrimage.h"
+#include "iterators.h"
+#include "accessors.h"
+#include "ndarray_utils.h"
+#include "mrimage_utils.h"
+#include "registration.h"
+
+#include <string>
+#include <iostream>
+#include <memory>
+
+using namespace std;
+using namespace npl;
+
+shared_ptr<MRImage> blobImage(double shift)
+{
+	// create test image
+	int64_t index[3];
+	size_t sz[] = {27, 23, 19};
+	auto in = createMRImage(sizeof(sz)/sizeof(size_t), sz, FLOAT64);
+
+	// fill with smooth blob and some texture
+	for(NDIter<double> it(in); !it.eof(); ++it) {
+		it.index(3, index);
+		double x = index[0]-13;
+		double y = index[1]-11+shift;
+		double z = index[2]-9;
+		it.set(100*exp(-(x*x+2*y*y+z*z)/60.) + 20*sin(0.3*x+0.2*z) +
+				30*cos(0.25*y+shift));
+	}
+
+	return in;
+};
+
+/**
+ * @brief Evaluates comp with the default budget, then with no cache and with
+ * a budget too small for the cache, results should be identical.
+ */
+template <typename T>
+int checkCache(T& comp, const VectorXd& params, string name)
+{
+	double refval = 0;
+	VectorXd refgrad(params.rows());
+	comp.valueGrad(params, refval, refgrad);
+
+	for(size_t budget : {0, 1000}) {
+		comp.setBasisBudget(budget);
+		double val1, val2;
+		VectorXd grad(params.rows());
+		comp.valueGrad(params, val1, grad);
+		comp.value(params, val2);
+		if(val1 != refval || val2 != refval || grad != refgrad) {
+			cerr << name << ": Results with budget " << budget << " differ "
+				"from cached: " << val1 << ", " << val2 << " vs " << refval
+				<< endl;
+			return -1;
+		}
+	}
+	comp.setBasisBudget(1024*1024*1024);
+	return 0;
+}
+
+int main()
+{
+	auto fixed = blobImage(0);
+	auto moving = blobImage(1.3);
+
+	/*
+	 * The basis should reproduce BSplineView, with ZEROFLUX boundaries
+	 */
+	BSplineView<double> b_vw;
+	b_vw.m_ras = true;
+	b_vw.m_boundmethod = ZEROFLUX;
+	b_vw.createOverlay(fixed, 6);
+	auto knots = b_vw.getParams();
+	size_t ii = 0;
+	for(FlatIter<double> it(knots); !it.eof(); ++it, ++ii)
+		it.set(sin(ii*0.37));
+
+	int64_t kind[BSplineBasisCache::MAXSUPPORT];
+	double w[BSplineBasisCache::MAXSUPPORT];
+	double dw[BSplineBasisCache::MAXSUPPORT];
+	NDConstView<double> k_vw(knots);
+	for(double x : {-3., 0., 4.5, 13.2, 26., 30.}) {
+		double cind[3] = {x, 11.5, 0.2};
+		double pt[3], dcind[3];
+		fixed->indexToPoint(3, cind, pt);
+		knots->pointToIndex(3, pt, dcind);
+
+		double val, dval;
+		b_vw.get(3, pt, 1, val, dval);
+
+		double cval = 0, cdval = 0;
+		int n = BSplineBasisCache::compute(knots, dcind, 1, kind, w, dw);
+		for(int kk = 0; kk < n; kk++) {
+			cval += w[kk]*k_vw[kind[kk]];
+			cdval += dw[kk]*k_vw[kind[kk]];
+		}
+		if(fabs(val-cval) > 1e-12 || fabs(dval-cdval) > 1e-12) {
+			cerr << "Basis at " << x << " gives " << cval << ", " << cdval
+				<< " BSplineView gives " << val << ", " << dval << endl;
+			return -1;
+		}
+	}
+
+	/*
+	 * Cached and on the fly basis should give the same metric
+	 */
+	DistCorrInfoComp dcomp(true);
+	dcomp.m_metric = METRIC_MI;
+	dcomp.setBins(64, 4);
+	dcomp.setFixed(fixed);
+	dcomp.initializeKnots(6);
+	dcomp.setMoving(moving, 1);
+
+	VectorXd params(dcomp.nparam());
+	for(int64_t ii = 0; ii < params.rows(); ii++)
+		params[ii] = 0.3*sin(ii*0.7);
+	if(checkCache(dcomp, params, "DistCorrInfoComp (full)") != 0)
+		return -1;
+
+	dcomp.setSampling(SAMPLE_STRATIFIED, 0.3);
+	if(checkCache(dcomp, params, "DistCorrInfoComp (sampled)") != 0)
+		return -1;
+
+	return 0;
+}
@@ -0,0 +1,81 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * NPL is free software: you can redistribute it and/or modify it under the
+ * terms of the BSD 2-Clause License available in LICENSE or at
+ * http://opensource.org/licenses/BSD-2-Clause
+ *
+ * @file fourier_init_test.cpp Tests that the fourier (rotation from
+ * pseudo-polar magnitude spectra, shift from phase correlation) initializer
+ * recovers a large rigid transform
+ *
+ *****************************************************************************/
+
+#include "mrimage.h"
+#include "iterators.h"
+#include "ndarray_utils.h"
+#include "mrimage_utils.h"
+#include "registration.h"
+
+#include <string>
+#include <iostream>
+#include <memory>
+
+using namespace std;
+using namespace npl;
+
+shared_ptr<MRImage> blobImage()
+{
+	// create test image
+	int64_t index[3];
+	size_t sz[] = {40, 40, 40};
+	auto in = createMRImage(sizeof(sz)/sizeof(size_t), sz, FLOAT64);
+
+	// fill with a few blobs of different sizes, so that no rotation looks the
+	// same
+	double blobs[][5] = {{19, 20, 19, 40, 100}, {12, 24, 18, 8, 60},
+		{24, 14, 22, 5, 80}, {20, 22, 28, 12, 50}};
+	for(NDIter<double> it(in); !it.eof(); ++it) {
+		it.index(3, index);
+		double v = 0;
+		for(auto& b : blobs) {
+			double x = index[0]-b[0];
+			double y = index[1]-b[1];
+			double z = index[2]-b[2];
+			v += b[4]*exp(-(x*x+y*y+z*z)/b[3]);
+		}
+		it.set(v);
+	}
+
+	return in;
+};
+
+int main()
+{
+	auto img = blobImage();
+	double trueshift[3] = {3,-4,2};
+	double truerotate[3] = {0.3,-0.2,0.35};
+
+	// rotate then shift it
+	auto moved = dPtrCast<MRImage>(img->copy());
+	rotateImageShearKern(moved, truerotate[0], truerotate[1], truerotate[2]);
+	for(size_t ii=0; ii<3; ii++)
+		shiftImageKern(moved, ii, trueshift[ii]);
+
+	auto out = fourierInit3D(img, moved);
+	out.toIndexCoords(moved, true);
+	cerr << "Estimate: " << out << endl;
+
+	for(size_t dd=0; dd<3; dd++) {
+		if(fabs(truerotate[dd] - out.rotation[dd]) > 0.05) {
+			cerr << "Rotate " << dd << " differs!" << endl;
+			return -1;
+		}
+		if(fabs(trueshift[dd] - out.shift[dd]) > 1) {
+			cerr << "Shift " << dd << " differs!" << endl;
+			return -1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,118 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * NPL is free software: you can redistribute it and/or modify it under the
+ * terms of the BSD 2-Clause License available in LICENSE or at
+ * http://opensource.org/licenses/BSD-2-Clause
+ *
+ * @file glm_permute_test.cpp Tests the GLM permutation engine on a simulated
+ * group analysis: a blob of activation should survive max-T and cluster mass
+ * correction, noise should not, and results should not depend on the number
+ * of threads.
+ *
+ *****************************************************************************/
+
+#include <string>
+#include <stdexcept>
+#include <random>
+
+#include <Eigen/Dense>
+#include "statistics.h"
+#include "mrimage.h"
+#include "mrimage_utils.h"
+#include "ndarray_utils.h"
+#include "iterators.h"
+#include "utility.h"
+#include "fmri_inference.h"
+
+using std::string;
+using Eigen::MatrixXd;
+
+using namespace npl;
+
+bool inBlob(int64_t x, int64_t y, int64_t z)
+{
+	return (x-6)*(x-6)+(y-5)*(y-5)+(z-3)*(z-3) <= 4;
+}
+
+int main()
+{
+	// 24 subjects, an intercept and an age covariate with no effect
+	vector<size_t> fdim({14,12,7,24});
+	vector<size_t> odim({14,12,7,2});
+	std::mt19937 rng(99);
+	std::normal_distribution<double> gauss(0, 1);
+
+	MatrixXd X(fdim[3], 2);
+	for(size_t rr=0; rr<X.rows(); rr++) {
+		X(rr, 0) = 1;
+		X(rr, 1) = gauss(rng);
+	}
+
+	auto fmri = createMRImage(fdim.size(), fdim.data(), FLOAT32);
+	int64_t index[3];
+	for(Vector3DIter<double> it(fmri); !it.eof(); ++it) {
+		it.index(3, index);
+		double effect = inBlob(index[0], index[1], index[2]) ? 1.5 : 0;
+		for(size_t tt=0; tt<fdim[3]; tt++)
+			it.set(tt, effect + gauss(rng));
+	}
+
+	const size_t NPERM = 500;
+	ptr<MRImage> fwe[2];
+	ptr<MRImage> clust[2];
+	size_t threads[2] = {1, 4};
+	for(size_t ii=0; ii<2; ii++) {
+		setNumThreads(threads[ii]);
+		fwe[ii] = createMRImage(odim.size(), odim.data(), FLOAT64);
+		clust[ii] = createMRImage(odim.size(), odim.data(), FLOAT64);
+		fmriGLMPermute(fmri, X, NPERM, PERMUTE_SIGNS, fwe[ii], clust[ii],
+				2.5, 1234, 64);
+	}
+
+	size_t falsepos = 0;
+	size_t truepos = 0;
+	size_t blobsize = 0;
+	Vector3DIter<double> fit(fwe[0]), cit(clust[0]);
+	Vector3DIter<double> fit4(fwe[1]), cit4(clust[1]);
+	for(; !fit.eof(); ++fit, ++cit, ++fit4, ++cit4) {
+		fit.index(3, index);
+		for(size_t cc=0; cc<2; cc++) {
+			if(fit[cc] != fit4[cc] || cit[cc] != cit4[cc]) {
+				cerr << "Result depends on the number of threads" << endl;
+				return -1;
+			}
+			double scaled = fit[cc]*NPERM;
+			if(fit[cc] < 1./NPERM || fit[cc] > 1 ||
+					fabs(scaled-round(scaled)) > 1e-9) {
+				cerr << "Invalid permutation p-value " << fit[cc] << endl;
+				return -1;
+			}
+		}
+
+		if(inBlob(index[0], index[1], index[2])) {
+			blobsize++;
+			if(fit[0] < 0.05)
+				truepos++;
+			if(cit[0] > 0.05) {
+				cerr << "Blob not found by cluster mass" << endl;
+				return -1;
+			}
+		} else if(fit[0] < 0.05) {
+			falsepos++;
+		}
+
+		// covariate has no effect
+		if(fit[1] < 0.05)
+			falsepos++;
+	}
+
+	cerr << "Detected " << truepos << " of " << blobsize << " voxels, "
+		<< falsepos << " false positives" << endl;
+	if(truepos < blobsize/2 || falsepos > 2) {
+		cerr << "Poor detection" << endl;
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,103 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * NPL is free software: you can redistribute it and/or modify it under the
+ * terms of the BSD 2-Clause License available in LICENSE or at
+ * http://opensource.org/licenses/BSD-2-Clause
+ *
+ * @file glm_tile_test.cpp Tests that the tiled, multi-threaded fmriGLM gives
+ * the same betas, t-scores and p-values as regressing each voxel with
+ * regress()
+ *
+ *****************************************************************************/
+
+#include <string>
+#include <stdexcept>
+#include <random>
+
+#include <Eigen/Dense>
+#include "statistics.h"
+#include "mrimage.h"
+#include "mrimage_utils.h"
+#include "ndarray_utils.h"
+#include "iterators.h"
+#include "utility.h"
+#include "fmri_inference.h"
+
+using std::string;
+using Eigen::MatrixXd;
+
+using namespace npl;
+
+int testType(PixelT type)
+{
+	// 1105 voxels, so the last tile is partial
+	vector<size_t> fdim({13,17,5,120});
+	vector<size_t> odim({13,17,5,4});
+
+	std::mt19937 rng(1234);
+	std::normal_distribution<double> gauss(0, 1);
+
+	MatrixXd X(fdim[3], odim[3]);
+	for(size_t rr=0; rr<X.rows(); rr++ ) {
+		for(size_t cc=0; cc+1<X.cols(); cc++)
+			X(rr,cc) = cos(M_PI*rr*(1+cc)/50);
+		X(rr, X.cols()-1) = 1;
+	}
+
+	auto fmri = createMRImage(fdim.size(), fdim.data(), type);
+	for(Vector3DIter<double> it(fmri); !it.eof(); ++it) {
+		VectorXd b(X.cols());
+		for(size_t cc=0; cc<X.cols(); cc++)
+			b[cc] = gauss(rng);
+		VectorXd y = X*b;
+		for(size_t tt=0; tt<fdim[3]; tt++)
+			it.set(tt, y[tt] + gauss(rng));
+	}
+
+	auto b_est = createMRImage(odim.size(), odim.data(), FLOAT64);
+	auto t_est = createMRImage(odim.size(), odim.data(), FLOAT64);
+	auto p_est = createMRImage(odim.size(), odim.data(), FLOAT32);
+	fmriGLM(fmri, X, b_est, t_est, p_est);
+
+	// compare with regressing each voxel separately
+	MatrixXd Xinv = pseudoInverse(X);
+	VectorXd covInv = pseudoInverse(X.transpose()*X).diagonal();
+	StudentsT distrib(X.rows()-1, 0.1, 100);
+	RegrResult ret;
+	VectorXd y(fdim[3]);
+	Vector3DConstIter<double> it(fmri);
+	Vector3DConstIter<double> bit(b_est), tit(t_est), pit(p_est);
+	for(; !it.eof(); ++it, ++bit, ++tit, ++pit) {
+		for(size_t tt=0; tt<fdim[3]; tt++)
+			y[tt] = it[tt];
+		regress(&ret, y, X, covInv, Xinv, distrib);
+
+		for(size_t cc=0; cc<X.cols(); cc++) {
+			if(fabs(bit[cc] - ret.bhat[cc]) > 1e-10 ||
+					fabs(tit[cc] - ret.t[cc]) > 1e-8*(1+fabs(ret.t[cc])) ||
+					fabs(pit[cc] - ret.p[cc]) > 1e-6) {
+				cerr << "Mismatch in regressor " << cc << ": beta "
+					<< bit[cc] << " vs " << ret.bhat[cc] << ", t " << tit[cc]
+					<< " vs " << ret.t[cc] << ", p " << pit[cc] << " vs "
+					<< ret.p[cc] << endl;
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+int main()
+{
+	setNumThreads(4);
+	if(testType(FLOAT64) != 0) {
+		cerr << "Failed for FLOAT64 input" << endl;
+		return -1;
+	}
+	if(testType(FLOAT32) != 0) {
+		cerr << "Failed for FLOAT32 input" << endl;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,134 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * NPL is free software: you can redistribute it and/or modify it under the
+ * terms of the BSD 2-Clause License available in LICENSE or at
+ * http://opensource.org/licenses/BSD-2-Clause
+ *
+ * @file image_pyramid_test.cpp Tests that the incrementally built levels of
+ * an ImagePyramid match smoothing from full resolution
+ *
+ *****************************************************************************/
+
+#include "mrimage.h"
+#include "iterators.h"
+#include "accessors.h"
+#include "ndarray_utils.h"
+#include "mrimage_utils.h"
+#include "registration.h"
+
+#include <string>
+#include <iostream>
+#include <memory>
+
+using namespace std;
+using namespace npl;
+
+shared_ptr<MRImage> blobImage()
+{
+	// create test image
+	int64_t index[3];
+	size_t sz[] = {40, 36, 32};
+	auto in = createMRImage(sizeof(sz)/sizeof(size_t), sz, FLOAT64);
+
+	// fill with a blob with some texture
+	for(NDIter<double> it(in); !it.eof(); ++it) {
+		it.index(3, index);
+		double x = index[0]-18;
+		double y = index[1]-17;
+		double z = index[2]-15;
+		double r = x*x/144+y*y/100+z*z/81;
+		it.set(r < 1 ? 100+20*sin(0.4*x)*cos(0.3*z)+x : 0);
+	}
+
+	return in;
+};
+
+/**
+ * @brief Returns the RMS difference between two images relative to the RMS
+ * of the first, or -1 if they have different sizes
+ */
+double relDiff(ptr<const MRImage> a, ptr<const MRImage> b)
+{
+	if(a->ndim() != b->ndim())
+		return -1;
+	for(size_t dd=0; dd<a->ndim(); dd++) {
+		if(a->dim(dd) != b->dim(dd))
+			return -1;
+	}
+
+	double diff = 0, norm = 0;
+	NDConstIter<double> ait(a), bit(b);
+	for(; !ait.eof(); ++ait, ++bit) {
+		diff += (*ait-*bit)*(*ait-*bit);
+		norm += (*ait)*(*ait);
+	}
+	return sqrt(diff/norm);
+}
+
+/**
+ * @brief Returns the largest relative difference in spacing
+ */
+double spaceDiff(ptr<const MRImage> a, ptr<const MRImage> b)
+{
+	double out = 0;
+	for(size_t dd=0; dd<a->ndim() && dd<b->ndim(); dd++)
+		out = max(out, fabs(a->spacing(dd)-b->spacing(dd))/a->spacing(dd));
+	return out;
+}
+
+int main()
+{
+	auto img = blobImage();
+
+	// unsorted with a repeated level
+	vector<double> sigmas({2, 0, 4, 1, 2});
+	for(double factor : {1., 2.355}) {
+		ImagePyramid pyr(img, sigmas, factor, true);
+		if(pyr.levels() != sigmas.size()) {
+			cerr << "Wrong number of levels" << endl;
+			return -1;
+		}
+
+		for(size_t ii=0; ii<sigmas.size(); ii++) {
+			/*
+			 * Levels are downsampled from the previous level, so spacing may
+			 * drift slightly from direct smoothing at coarse levels, when it
+			 * doesn't values should match
+			 */
+			auto direct = smoothDownsample(img, sigmas[ii], sigmas[ii]*factor);
+			double err = relDiff(direct, pyr.level(ii));
+			double serr = spaceDiff(direct, pyr.level(ii));
+			cerr << "Sigma " << sigmas[ii] << " (spacing factor " << factor
+				<< ") relative error: " << err << ", spacing error: " << serr
+				<< endl;
+			if(err < 0 || serr > 0.1 || (serr < 1e-6 && err > 0.02)) {
+				cerr << "Pyramid level differs from direct smoothing" << endl;
+				return -1;
+			}
+
+			auto deriv = derivative(pyr.level(ii));
+			if(relDiff(dPtrCast<MRImage>(deriv), pyr.deriv(ii)) != 0) {
+				cerr << "Cached derivative differs" << endl;
+				return -1;
+			}
+		}
+	}
+
+	// registering with pyramids should match registering with images
+	auto moved = dPtrCast<MRImage>(img->copy());
+	shiftImageKern(moved, 0, 1.5);
+	shiftImageKern(moved, 2, -1);
+	vector<double> regsigmas({2, 1});
+	auto r1 = corReg3D(img, moved, regsigmas);
+	ImagePyramid fixpyr(img, regsigmas);
+	ImagePyramid movpyr(moved, regsigmas, 1, true);
+	auto r2 = corReg3D(fixpyr, movpyr);
+	if((r1.shift-r2.shift).norm() > 1e-10 ||
+			(r1.rotation-r2.rotation).norm() > 1e-10) {
+		cerr << "Pyramid registration differs" << endl;
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,121 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * NPL is free software: you can redistribute it and/or modify it under the
+ * terms of the BSD 2-Clause License available in LICENSE or at
+ * http://opensource.org/licenses/BSD-2-Clause
+ *
+ * @file info_sampling_test.cpp Tests that rigid information-based
+ * registration with a sample of the fixed voxels converges as well as
+ * registration using every voxel
+ *
+ *****************************************************************************/
+
+#include "mrimage.h"
+#include "iterators.h"
+#include "accessors.h"
+#include "ndarray_utils.h"
+#include "mrimage_utils.h"
+#include "registration.h"
+
+#include <string>
+#include <iostream>
+#include <memory>
+
+using namespace std;
+using namespace npl;
+
+shared_ptr<MRImage> blobImage()
+{
+	// create test image
+	int64_t index[3];
+	size_t sz[] = {40, 40, 40};
+	auto in = createMRImage(sizeof(sz)/sizeof(size_t), sz, FLOAT64);
+
+	// fill with a blob with some texture that is unique when rotated
+	for(NDIter<double> it(in); !it.eof(); ++it) {
+		it.index(3, index);
+		double x = index[0]-18;
+		double y = index[1]-21;
+		double z = index[2]-20;
+		double r = x*x/100+y*y/64+z*z/144;
+		it.set(r < 1 ? 100+20*sin(0.4*x)*cos(0.3*z)+x : 0);
+	}
+
+	return in;
+};
+
+int main()
+{
+	auto img = blobImage();
+	double trueshift[3] = {2,-1.5,1};
+	double truerotate[3] = {.05,-.03,.08};
+
+	// move it
+	auto moved = dPtrCast<MRImage>(img->copy());
+	rotateImageShearKern(moved, truerotate[0], truerotate[1], truerotate[2]);
+	for(size_t ii=0; ii<3; ii++)
+		shiftImageKern(moved, ii, trueshift[ii]);
+
+	/*
+	 * A mask covering the whole image at full fraction visits the same voxels
+	 * in the same order as full sampling, the results should be identical
+	 */
+	auto mask = dPtrCast<MRImage>(img->createAnother());
+	for(NDIter<double> it(mask); !it.eof(); ++it)
+		it.set(1);
+
+	VectorXd params(6);
+	params << 1, -2, 3, 0.5, 1, -1;
+	double fullval, maskval;
+	VectorXd fullgrad(6), maskgrad(6);
+
+	RigidInfoComp comp(true);
+	comp.setBins(64, 4);
+	comp.setFixed(img);
+	comp.setMoving(moved);
+	comp.valueGrad(params, fullval, fullgrad);
+
+	comp.setSampling(SAMPLE_MASK, 1, false, mask);
+	comp.valueGrad(params, maskval, maskgrad);
+	if(fullval != maskval || fullgrad != maskgrad) {
+		cerr << "Full mask sampling differs from full sampling" << endl;
+		return -1;
+	}
+
+	/*
+	 * Registration with 20% of the voxels should get as close to the true
+	 * transform as registration with all of them
+	 */
+	std::vector<double> sigmas({2,1,0});
+	auto full = informationReg3D(img, moved, sigmas, 64, 4, "MI", 0.001);
+	full.toIndexCoords(moved, true);
+	cerr << "Full Sampling: " << full << endl;
+
+	for(string mode : {"STRATIFIED", "UNIFORM"}) {
+		auto sampled = informationReg3D(img, moved, sigmas, 64, 4, "MI",
+				0.001, mode, 0.2);
+		sampled.toIndexCoords(moved, true);
+		cerr << mode << " Sampling: " << sampled << endl;
+
+		for(size_t dd=0; dd<3; dd++) {
+			double ferr = fabs(truerotate[dd] - full.rotation[dd]);
+			double serr = fabs(truerotate[dd] - sampled.rotation[dd]);
+			if(serr > ferr + 0.01) {
+				cerr << mode << " rotation " << dd << " error " << serr
+					<< " vs " << ferr << " with full sampling" << endl;
+				return -1;
+			}
+
+			ferr = fabs(trueshift[dd] - full.shift[dd]);
+			serr = fabs(trueshift[dd] - sampled.shift[dd]);
+			if(serr > ferr + 0.25) {
+				cerr << mode << " shift " << dd << " error " << serr
+					<< " vs " << ferr << " with full sampling" << endl;
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,124 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * NPL is free software: you can redistribute it and/or modify it under the
+ * terms of the BSD 2-Clause License available in LICENSE or at
+ * http://opensource.org/licenses/BSD-2-Clause
+ *
+ * @file info_threads_test.cpp Tests that the parallel joint histograms of the
+ * mutual information metrics give the same results regardless of the number
+ * of threads
+ *
+ *****************************************************************************/
+
+#include "mrimage.h"
+#include "iterators.h"
+#include "ndarray_utils.h"
+#include "mrimage_utils.h"
+#include "registration.h"
+#include "utility.h"
+
+#include <string>
+#include <iostream>
+#include <memory>
+
+using namespace std;
+using namespace npl;
+
+shared_ptr<MRImage> blobImage(double shift)
+{
+	// create test image
+	int64_t index[3];
+	size_t sz[] = {31, 23, 19};
+	auto in = createMRImage(sizeof(sz)/sizeof(size_t), sz, FLOAT64);
+
+	// fill with smooth blob and some texture
+	for(NDIter<double> it(in); !it.eof(); ++it) {
+		it.index(3, index);
+		double x = index[0]-15+shift;
+		double y = index[1]-11;
+		double z = index[2]-9;
+		it.set(100*exp(-(x*x+2*y*y+z*z)/60.) + 20*sin(0.3*x+0.2*z) +
+				30*cos(0.25*y+shift));
+	}
+
+	return in;
+};
+
+/**
+ * @brief Evaluates comp with 1 to 5 threads and checks that results for the
+ * same thread count are identical and results for different thread counts
+ * only differ by round off.
+ */
+template <typename T>
+int checkThreads(T& comp, const VectorXd& params, string name)
+{
+	double refval = 0;
+	VectorXd refgrad(params.rows());
+	setNumThreads(1);
+	comp.valueGrad(params, refval, refgrad);
+
+	for(size_t nthreads = 1; nthreads < 6; nthreads++) {
+		setNumThreads(nthreads);
+
+		double val1, val2, val3;
+		VectorXd grad1(params.rows()), grad2(params.rows());
+		comp.valueGrad(params, val1, grad1);
+		comp.valueGrad(params, val2, grad2);
+		comp.value(params, val3);
+
+		if(val1 != val2 || grad1 != grad2) {
+			cerr << name << ": Results differ between calls with " << nthreads
+				<< " threads" << endl;
+			return -1;
+		}
+
+		if(fabs(val1-refval) > 1e-12 || fabs(val3-refval) > 1e-12 ||
+				(grad1-refgrad).norm() > 1e-12*refgrad.norm()) {
+			cerr << name << ": Results with " << nthreads << " threads "
+				"differ from single threaded: " << val1 << ", " << val3
+				<< " vs " << refval << endl;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main()
+{
+	auto fixed = blobImage(0);
+	auto moving = blobImage(1.3);
+
+	RigidInfoComp rcomp(true);
+	rcomp.m_metric = METRIC_MI;
+	rcomp.setBins(64, 4);
+	rcomp.setFixed(fixed);
+	rcomp.setMoving(moving);
+
+	VectorXd params(6);
+	params << 3, -2, 1, 0.4, -0.7, 0.3;
+	if(checkThreads(rcomp, params, "RigidInfoComp") != 0)
+		return -1;
+
+	DistCorrInfoComp dcomp(true);
+	dcomp.m_metric = METRIC_MI;
+	dcomp.setBins(64, 4);
+	dcomp.setFixed(fixed);
+	dcomp.initializeKnots(6);
+	dcomp.setMoving(moving, 1);
+
+	params.resize(dcomp.nparam());
+	for(int64_t ii = 0; ii < params.rows(); ii++)
+		params[ii] = 0.3*sin(ii*0.7);
+	if(checkThreads(dcomp, params, "DistCorrInfoComp") != 0)
+		return -1;
+
+	// with regularization, and computing the basis on the fly
+	dcomp.m_tps_reg = 0.1;
+	dcomp.m_jac_reg = 0.1;
+	dcomp.setBasisBudget(0);
+	if(checkThreads(dcomp, params, "Regularized DistCorrInfoComp") != 0)
+		return -1;
+
+	return 0;
+}
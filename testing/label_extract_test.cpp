@@ -0,0 +1,128 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * NPL is free software: you can redistribute it and/or modify it under the
+ * terms of the BSD 2-Clause License available in LICENSE or at
+ * http://opensource.org/licenses/BSD-2-Clause
+ *
+ * @file label_extract_test.cpp Tests that extractLabelAVG and extractLabelPCA
+ * reduce each label group separately, matching averages and SVDs computed
+ * one label at a time
+ *
+ *****************************************************************************/
+
+#include <string>
+#include <stdexcept>
+#include <random>
+
+#include <Eigen/Dense>
+#include "statistics.h"
+#include "mrimage.h"
+#include "mrimage_utils.h"
+#include "iterators.h"
+#include "utility.h"
+#include "fmri_inference.h"
+
+using std::string;
+using Eigen::MatrixXd;
+
+using namespace npl;
+
+/**
+ * @brief Gathers the time series of a single label, optionally normalized
+ */
+MatrixXd gather(ptr<const MRImage> fmri, ptr<const MRImage> labelmap,
+		int64_t label, bool normalize)
+{
+	size_t tlen = fmri->tlen();
+	MatrixXd Y(tlen, 0);
+	Vector3DConstIter<double> it(fmri);
+	NDConstIter<int64_t> lit(labelmap);
+	for(; !it.eof(); ++it, ++lit) {
+		if(*lit != label)
+			continue;
+		Y.conservativeResize(tlen, Y.cols()+1);
+		for(size_t tt=0; tt<tlen; tt++)
+			Y(tt, Y.cols()-1) = it[tt];
+		if(normalize) {
+			double mean = Y.col(Y.cols()-1).mean();
+			double sd = sqrt((Y.col(Y.cols()-1).array()-mean).square().sum()/
+					(tlen-1));
+			Y.col(Y.cols()-1) = (Y.col(Y.cols()-1).array()-mean)/sd;
+		}
+	}
+	return Y;
+}
+
+int main()
+{
+	// labels are sparse enough that they have to be compressed
+	vector<int64_t> labels({3, 7, 1000000});
+	vector<size_t> fdim({10,9,6,60});
+	std::mt19937 rng(3);
+	std::normal_distribution<double> gauss(0, 1);
+
+	MatrixXd S(fdim[3], 3);
+	for(size_t rr=0; rr<S.rows(); rr++) {
+		for(size_t cc=0; cc<S.cols(); cc++)
+			S(rr, cc) = gauss(rng);
+	}
+
+	auto fmri = createMRImage(fdim.size(), fdim.data(), FLOAT32);
+	auto labelmap = createMRImage(3, fdim.data(), INT32);
+	int64_t index[3];
+	Vector3DIter<double> it(fmri);
+	NDIter<int64_t> lit(labelmap);
+	for(; !it.eof(); ++it, ++lit) {
+		it.index(3, index);
+		int64_t label = index[0] < 3 ? 0 : labels[index[1]%3];
+		lit.set(label);
+		for(size_t tt=0; tt<fdim[3]; tt++) {
+			double v = 100 + gauss(rng);
+			if(label != 0)
+				v += (1+index[2])*S(tt, index[1]%3) + index[0]*S(tt, 2);
+			it.set(tt, v);
+		}
+	}
+
+	// Averages should not depend on the number of threads
+	setNumThreads(1);
+	MatrixXd avg1 = extractLabelAVG(fmri, labelmap);
+	setNumThreads(4);
+	MatrixXd avg = extractLabelAVG(fmri, labelmap);
+	if(avg.cols() != 3 || avg != avg1) {
+		cerr << "Averages have wrong size or depend on threads" << endl;
+		return -1;
+	}
+
+	size_t outsz = 2;
+	MatrixXd pca = extractLabelPCA(fmri, labelmap, outsz);
+	if(pca.cols() != 3*outsz) {
+		cerr << "Expected " << 3*outsz << " PCA columns" << endl;
+		return -1;
+	}
+
+	for(size_t ll=0; ll<labels.size(); ll++) {
+		MatrixXd Y = gather(fmri, labelmap, labels[ll], false);
+		if((avg.col(ll) - Y.rowwise().mean()).norm() > 1e-8*Y.norm()) {
+			cerr << "Average of label " << labels[ll] << " is wrong" << endl;
+			return -1;
+		}
+
+		// Each component should be a singular vector scaled by its value
+		Y = gather(fmri, labelmap, labels[ll], true);
+		Eigen::JacobiSVD<MatrixXd> svd(Y, Eigen::ComputeThinU);
+		for(size_t cc=0; cc<outsz; cc++) {
+			double s = svd.singularValues()[cc];
+			double proj = pca.col(ll*outsz+cc).dot(svd.matrixU().col(cc));
+			if(fabs(fabs(proj) - s) > 1e-6*s ||
+					fabs(pca.col(ll*outsz+cc).norm() - s) > 1e-6*s) {
+				cerr << "Component " << cc << " of label " << labels[ll]
+					<< " does not match SVD" << endl;
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
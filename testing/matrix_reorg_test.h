@@ -136,6 +136,44 @@ int testProducts(size_t nrows, size_t ncols,
 		return -1;
 	}
 
+	m.resize(reorg.rows(), 3);
+	m.setRandom();
+	b = full*(full.transpose()*m);
+	a.resize(b.rows(), b.cols());
+	reorg.gramMult(a, m);
+	err = (b - a).cwiseAbs().sum()/(a.rows()*a.cols());
+	if(err > 0.00000001)  {
+		cerr << "Mismatch of fused A*A^T product"<<endl;
+		cerr<<"Err: " << err << endl;
+		return -1;
+	}
+
+	MatrixXd p(3, reorg.rows());
+	p.setRandom();
+	MatrixXd c = p*full;
+	MatrixXd d(c.rows(), c.cols());
+	double sqnorm = 0;
+	a.setZero();
+	reorg.rangeMult(a, m, d, p, &sqnorm);
+	err = (b - a).cwiseAbs().sum()/(a.rows()*a.cols()) +
+		(c - d).cwiseAbs().sum()/(d.rows()*d.cols()) +
+		fabs(sqnorm - full.squaredNorm())/full.squaredNorm();
+	if(err > 0.00000001)  {
+		cerr << "Mismatch of fused range finder product"<<endl;
+		cerr<<"Err: " << err << endl;
+		return -1;
+	}
+
+	b = full*full.transpose();
+	a.resize(b.rows(), b.cols());
+	reorg.gram(a);
+	err = (b - a).cwiseAbs().sum()/(a.rows()*a.cols());
+	if(err > 0.00000001)  {
+		cerr << "Mismatch of gram matrix"<<endl;
+		cerr<<"Err: " << err << endl;
+		return -1;
+	}
+
 	return 0;
 }
 
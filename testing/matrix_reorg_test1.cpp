@@ -56,6 +56,8 @@ int main()
 		}
 	}
 
+	// multiply blocks on several threads
+	setNumThreads(4);
 	MatrixReorg reorg(pref, 45000, true);
 	if(reorg.createMats(nrows, ncols, fn_masks, fn_inputs, false) != 0)
 		return -1;
@@ -61,4 +61,22 @@ int main()
 
 	if(testProducts(nrows, ncols, reorg, masks, inputs) != 0)
 		return -1;
+
+	// split the blocks between worker processes
+	reorg.setProcesses(3);
+	if(testProducts(nrows, ncols, reorg, masks, inputs) != 0)
+		return -1;
+
+	// forking from a worker thread should be refused
+	try {
+		MatrixXd gram(reorg.rows(), reorg.rows());
+		parallelFor(0, 2, [&](size_t, size_t, size_t)
+		{
+			reorg.gram(gram);
+		}, 2);
+		cerr << "Products inside parallelFor should throw" << endl;
+		return -1;
+	} catch(std::exception& e) {
+		cerr << "Expected error: " << e.what() << endl;
+	}
 }
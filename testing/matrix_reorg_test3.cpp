@@ -0,0 +1,141 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * NPL is free software: you can redistribute it and/or modify it under the
+ * terms of the BSD 2-Clause License available in LICENSE or at
+ * http://opensource.org/licenses/BSD-2-Clause
+ *
+ * @file matrix_reorg_test3.cpp Test reorganization of MRImages into float and
+ * compressed float matrices. Inputs are float, so storage is exact and
+ * products should match the double version. Also checks that read errors
+ * in the loading threads are reported.
+ *
+ *****************************************************************************/
+
+#include <string>
+
+#include "matrix_reorg_test.h"
+#include "fmri_inference.h"
+#include "mrimage_utils.h"
+#include "mrimage.h"
+#include "iterators.h"
+#include "utility.h"
+#include "nplio.h"
+
+using namespace npl;
+using namespace std;
+
+/**
+ * @brief Reads the tall matrices back (in whatever storage) and compares with
+ * the input images
+ */
+int testLoadTall(size_t nrows, size_t ncols, const MatrixReorg& reorg,
+		const vector<ptr<MRImage>>& masks, const vector<ptr<MRImage>>& inputs)
+{
+	MatrixXd full(reorg.rows(), reorg.cols());
+	MatrixXd block;
+	for(size_t ii=0, curcol=0; ii<reorg.ntall(); ++ii) {
+		reorg.loadTall(ii, block);
+		full.middleCols(curcol, reorg.tallMatCols()[ii]) = block;
+		curcol += reorg.tallMatCols()[ii];
+	}
+
+	size_t globcol = 0;
+	for(size_t cc=0; cc<ncols; cc++) {
+		size_t globrow = 0;
+		size_t localcols = 0;
+		for(size_t rr=0; rr<nrows; rr++) {
+			auto img = inputs[cc*nrows + rr];
+			size_t tlen = img->tlen();
+			NDIter<int> mit(masks[cc]);
+			Vector3DIter<double> it(img);
+			localcols = 0;
+			for(; !it.eof(); ++it, ++mit) {
+				if(*mit == 0)
+					continue;
+				for(size_t t=0; t<tlen; t++) {
+					if(full(globrow+t, globcol+localcols) != it[t]) {
+						cerr << "Mismatch in tall mats! " <<
+							full(globrow+t, globcol+localcols) << " vs " <<
+							it[t] << endl;
+						return -1;
+					}
+				}
+				localcols++;
+			}
+			globrow += tlen;
+		}
+		globcol += localcols;
+	}
+	return 0;
+}
+
+int main()
+{
+	std::string pref = "reorg_test3";
+	size_t timepoints = 15;
+	size_t ncols = 3;
+	size_t nrows = 4;
+	setNumThreads(4);
+
+	// create random images
+	vector<ptr<MRImage>> inputs(ncols*nrows);
+	vector<ptr<MRImage>> masks(ncols);
+	vector<std::string> fn_inputs(ncols*nrows);
+	vector<std::string> fn_masks(ncols);
+	for(size_t cc = 0; cc<ncols; cc++) {
+		masks[cc] = randImage(INT8, 0, 1, 11, 12, 13, 0);
+
+		fn_masks[cc] = pref+"mask_"+to_string(cc)+".nii.gz";
+		masks[cc]->write(fn_masks[cc]);
+
+		for(size_t rr = 0; rr<nrows; rr++) {
+			inputs[rr+cc*nrows] = randImage(FLOAT32, 0, 1, 11, 12, 13, timepoints);
+
+			fn_inputs[rr+cc*nrows] = pref+to_string(cc)+"_"+
+						to_string(rr)+".nii.gz";
+			inputs[rr+cc*nrows]->write(fn_inputs[rr+cc*nrows]);
+		}
+	}
+
+	for(MatStorageT storage : {STORE_FLOAT32, STORE_FLOAT32_GZ}) {
+		MatrixReorg reorg(pref, 15000, true, storage);
+		if(reorg.createMats(nrows, ncols, fn_masks, fn_inputs, false) != 0)
+			return -1;
+
+		// Storage type should come from the information file
+		MatrixReorg loaded(pref, 15000, true);
+		loaded.checkMats();
+		if(loaded.storage() != storage) {
+			cerr << "Storage type not recorded" << endl;
+			return -1;
+		}
+
+		if(testLoadTall(nrows, ncols, loaded, masks, inputs) != 0)
+			return -1;
+
+		if(testProducts(nrows, ncols, loaded, masks, inputs) != 0)
+			return -1;
+
+		// Worker processes, with too little memory for a gram() partial sum
+		// per process
+		MatrixReorg banded(pref, 1000, true);
+		banded.checkMats();
+		banded.setProcesses(2);
+		if(testProducts(nrows, ncols, banded, masks, inputs) != 0)
+			return -1;
+	}
+
+	// A missing image (read by a reader thread) should be reported, not hang
+	fn_inputs.back() = pref+"missing.nii.gz";
+	try {
+		MatrixReorg reorg(pref, 15000, true);
+		reorg.createMats(nrows, ncols, fn_masks, fn_inputs, false);
+		cerr << "Missing input should throw" << endl;
+		return -1;
+	} catch(std::exception& e) {
+		cerr << "Expected error: " << e.what() << endl;
+	}
+
+	return 0;
+}
@@ -0,0 +1,114 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * NPL is free software: you can redistribute it and/or modify it under the
+ * terms of the BSD 2-Clause License available in LICENSE or at
+ * http://opensource.org/licenses/BSD-2-Clause
+ *
+ * @file motion_threads_test.cpp Tests that parallel motion estimation gives
+ * the same parameters for any number of threads, and that applying them
+ * moves each volume back towards the reference
+ *
+ *****************************************************************************/
+
+#include "mrimage.h"
+#include "iterators.h"
+#include "accessors.h"
+#include "ndarray_utils.h"
+#include "mrimage_utils.h"
+#include "registration.h"
+#include "utility.h"
+
+#include <string>
+#include <iostream>
+#include <memory>
+
+using namespace std;
+using namespace npl;
+
+shared_ptr<MRImage> blobImage()
+{
+	// create test image
+	int64_t index[3];
+	size_t sz[] = {24, 24, 24};
+	auto in = createMRImage(sizeof(sz)/sizeof(size_t), sz, FLOAT64);
+
+	// fill with a blob with some texture that is unique when rotated
+	for(NDIter<double> it(in); !it.eof(); ++it) {
+		it.index(3, index);
+		double x = index[0]-11;
+		double y = index[1]-12;
+		double z = index[2]-12;
+		double r = x*x/49+y*y/36+z*z/64;
+		it.set(r < 1 ? 100+20*sin(0.5*x)*cos(0.4*z)+x : 0);
+	}
+
+	return in;
+};
+
+/**
+ * @brief Sum of squared differences between volumes t1 and t2
+ */
+double ssd(ptr<const MRImage> img, size_t t1, size_t t2)
+{
+	double out = 0;
+	for(Vector3DConstIter<double> it(img); !it.eof(); ++it)
+		out += (it[t1]-it[t2])*(it[t1]-it[t2]);
+	return out;
+}
+
+int main()
+{
+	auto vol = blobImage();
+	double shifts[][3] = {{0,0,0}, {1,-0.5,0.5}, {-1,1,0}, {0.5,0.5,-1},
+		{2,0,-0.5}};
+	size_t ntimes = sizeof(shifts)/sizeof(shifts[0]);
+
+	// create 4D image from shifted copies of the volume
+	size_t sz[] = {vol->dim(0), vol->dim(1), vol->dim(2), ntimes};
+	auto fmri = createMRImage(4, sz, FLOAT64);
+	for(size_t tt=0; tt<ntimes; tt++) {
+		auto moved = dPtrCast<MRImage>(vol->copy());
+		for(size_t dd=0; dd<3; dd++)
+			shiftImageKern(moved, dd, shifts[tt][dd]);
+
+		Vector3DIter<double> oit(fmri);
+		NDIter<double> it(moved);
+		for(; !it.eof(); ++it, ++oit)
+			oit.set(tt, *it);
+	}
+
+	vector<double> sigmas({1, 0});
+	setNumThreads(1);
+	auto motion1 = computeMotion(fmri, 0, sigmas);
+	for(size_t nthreads = 2; nthreads <= 4; nthreads++) {
+		setNumThreads(nthreads);
+		auto motion = computeMotion(fmri, 0, sigmas);
+		if(motion != motion1) {
+			cerr << "Motion with " << nthreads << " threads differs from "
+				"single threaded result" << endl;
+			return -1;
+		}
+	}
+
+	for(size_t tt=0; tt<ntimes; tt++) {
+		cerr << tt << ":";
+		for(size_t dd=0; dd<9; dd++)
+			cerr << " " << motion1[tt][dd];
+		cerr << endl;
+	}
+
+	// the corrected volumes should be closer to the reference than the input
+	auto corrected = applyMotion(fmri, motion1);
+	for(size_t tt=1; tt<ntimes; tt++) {
+		double before = ssd(fmri, 0, tt);
+		double after = ssd(corrected, 0, tt);
+		cerr << "Volume " << tt << " SSD " << before << " -> " << after << endl;
+		if(after > 0.25*before) {
+			cerr << "Motion correction did not reduce difference enough" << endl;
+			return -1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,132 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * NPL is free software: you can redistribute it and/or modify it under the
+ * terms of the BSD 2-Clause License available in LICENSE or at
+ * http://opensource.org/licenses/BSD-2-Clause
+ *
+ * @file online_motion_test.cpp Tests that motion correcting volumes one at a
+ * time gives the same parameters as batch motion estimation
+ *
+ *****************************************************************************/
+
+#include "mrimage.h"
+#include "iterators.h"
+#include "accessors.h"
+#include "ndarray_utils.h"
+#include "mrimage_utils.h"
+#include "registration.h"
+
+#include <string>
+#include <iostream>
+#include <memory>
+
+using namespace std;
+using namespace npl;
+
+shared_ptr<MRImage> blobImage()
+{
+	// create test image
+	int64_t index[3];
+	size_t sz[] = {24, 24, 24};
+	auto in = createMRImage(sizeof(sz)/sizeof(size_t), sz, FLOAT64);
+
+	// fill with a blob with some texture that is unique when rotated
+	for(NDIter<double> it(in); !it.eof(); ++it) {
+		it.index(3, index);
+		double x = index[0]-11;
+		double y = index[1]-12;
+		double z = index[2]-12;
+		double r = x*x/49+y*y/36+z*z/64;
+		it.set(r < 1 ? 100+20*sin(0.5*x)*cos(0.4*z)+x : 0);
+	}
+
+	return in;
+};
+
+int main()
+{
+	auto vol = blobImage();
+	double shifts[][3] = {{0,0,0}, {0.5,-0.5,0}, {1,-0.5,0.5}, {1,0,0.5},
+		{1.5,0,0}};
+	size_t ntimes = sizeof(shifts)/sizeof(shifts[0]);
+
+	// create 4D image and separate volumes from shifted copies of the volume
+	size_t sz[] = {vol->dim(0), vol->dim(1), vol->dim(2), ntimes};
+	auto fmri = createMRImage(4, sz, FLOAT64);
+	vector<ptr<MRImage>> vols;
+	for(size_t tt=0; tt<ntimes; tt++) {
+		auto moved = dPtrCast<MRImage>(vol->copy());
+		for(size_t dd=0; dd<3; dd++)
+			shiftImageKern(moved, dd, shifts[tt][dd]);
+		vols.push_back(moved);
+
+		Vector3DIter<double> oit(fmri);
+		NDIter<double> it(moved);
+		for(; !it.eof(); ++it, ++oit)
+			oit.set(tt, *it);
+	}
+
+	vector<double> sigmas({1, 0});
+	auto batch = computeMotion(fmri, 0, sigmas);
+
+	OnlineMotionCorr moco(vols[0], sigmas);
+	for(size_t tt=0; tt<ntimes; tt++) {
+		auto corrected = moco.correct(vols[tt]);
+		auto& m = moco.motion();
+
+		cerr << tt << ":";
+		for(size_t dd=0; dd<9; dd++)
+			cerr << " " << m[dd];
+		cerr << " FD: " << moco.fd() << endl;
+
+		for(size_t dd=0; dd<3; dd++) {
+			if(fabs(m[dd+3]-batch[tt][dd+3]) > 1e-3 ||
+					fabs(m[dd+6]-batch[tt][dd+6]) > 0.1) {
+				cerr << "Streaming motion differs from batch motion" << endl;
+				return -1;
+			}
+		}
+
+		double fd = tt == 0 ? 0 : framewiseDisplacement(batch[tt-1], batch[tt]);
+		if(fabs(moco.fd() - fd) > 0.2) {
+			cerr << "Framewise displacement " << moco.fd() << " differs from "
+				"batch " << fd << endl;
+			return -1;
+		}
+
+		// the corrected volume should match the reference
+		double before = 0, after = 0;
+		NDIter<double> rit(vols[0]), vit(vols[tt]), cit(corrected);
+		for(; !rit.eof(); ++rit, ++vit, ++cit) {
+			before += (*rit-*vit)*(*rit-*vit);
+			after += (*rit-*cit)*(*rit-*cit);
+		}
+		if(tt > 0 && after > 0.25*before) {
+			cerr << "Motion correction did not reduce difference enough: "
+				<< before << " -> " << after << endl;
+			return -1;
+		}
+	}
+
+	// framewise displacement should not depend on the center
+	vector<double> m1({0,0,0, 0.01,0.02,0, 1,0,0});
+	vector<double> m2({0,0,0, 0.02,0.02,0.01, 1,1,0});
+	vector<double> m2c(m2);
+	Rigid3DTrans rigid;
+	for(size_t dd=0; dd<3; dd++)
+		rigid.rotation[dd] = m2[dd+3];
+	Vector3d c(10, -5, 3);
+	Vector3d s = (rigid.rotMatrix()-Matrix3d::Identity())*c;
+	for(size_t dd=0; dd<3; dd++) {
+		m2c[dd] = c[dd];
+		m2c[dd+6] = m2[dd+6] + s[dd];
+	}
+	if(fabs(framewiseDisplacement(m1, m2) - framewiseDisplacement(m1, m2c))
+			> 1e-10) {
+		cerr << "Framewise displacement depends on center" << endl;
+		return -1;
+	}
+
+	return 0;
+}
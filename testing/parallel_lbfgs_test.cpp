@@ -0,0 +1,124 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * NPL is free software: you can redistribute it and/or modify it under the
+ * terms of the BSD 2-Clause License available in LICENSE or at
+ * http://opensource.org/licenses/BSD-2-Clause
+ *
+ * @file parallel_lbfgs_test.cpp Tests that the L-BFGS optimizer with
+ * speculative line search converges, gives the same result regardless of the
+ * number of functions it spreads trials over, and works for registration
+ * with the same result for any number of threads
+ *
+ *****************************************************************************/
+
+#include "parallel_lbfgs.h"
+#include "mrimage.h"
+#include "iterators.h"
+#include "ndarray_utils.h"
+#include "mrimage_utils.h"
+#include "registration.h"
+#include "utility.h"
+
+#include <string>
+#include <iostream>
+#include <memory>
+
+using namespace std;
+using namespace npl;
+
+/**
+ * @brief Extended Rosenbrock function, minimum is 0 at (1, 1, ..., 1)
+ */
+int rosenbrock(const VectorXd& x, double& v, VectorXd& g)
+{
+	v = 0;
+	g.setZero(x.rows());
+	for(int64_t ii = 0; ii+1 < x.rows(); ii++) {
+		double a = x[ii+1]-x[ii]*x[ii];
+		double b = 1-x[ii];
+		v += 100*a*a + b*b;
+		g[ii] += -400*a*x[ii] - 2*b;
+		g[ii+1] += 200*a;
+	}
+	return 0;
+}
+
+shared_ptr<MRImage> blobImage()
+{
+	// create test image
+	int64_t index[3];
+	size_t sz[] = {32, 30, 28};
+	auto in = createMRImage(sizeof(sz)/sizeof(size_t), sz, FLOAT64);
+
+	// fill with blob with some texture
+	for(NDIter<double> it(in); !it.eof(); ++it) {
+		it.index(3, index);
+		double x = index[0]-15;
+		double y = index[1]-14;
+		double z = index[2]-13;
+		double r = x*x/100+y*y/64+z*z/49;
+		it.set(r < 1 ? 100+20*sin(0.4*x)*cos(0.3*z)+x : 0);
+	}
+	return in;
+}
+
+int main()
+{
+	setNumThreads(4);
+
+	VectorXd result;
+	for(size_t nfunc : {1, 2, 4}) {
+		vector<ValGradFunc> funcs(nfunc, rosenbrock);
+		ParallelLBFGSOpt opt(6, funcs);
+		opt.opt_ls_trials = 4;
+		opt.stop_X = 1e-10;
+		opt.stop_G = 1e-8;
+		opt.stop_F = 0;
+		opt.stop_Its = 10000;
+		opt.state_x.fill(-1);
+		opt.optimize();
+		cerr << nfunc << " functions: " << opt.state_x.transpose() << " ("
+			<< opt.evals << " evaluations)" << endl;
+
+		if((opt.state_x - VectorXd::Ones(6)).norm() > 1e-4) {
+			cerr << "Failed to find the minimum" << endl;
+			return -1;
+		}
+		if(nfunc == 1)
+			result = opt.state_x;
+		else if(result != opt.state_x) {
+			cerr << "Result depends on the number of functions" << endl;
+			return -1;
+		}
+	}
+
+	// registration with speculative line search on the (small) levels
+	auto img = blobImage();
+	auto moved = dPtrCast<MRImage>(img->copy());
+	shiftImageKern(moved, 0, 1.5);
+	shiftImageKern(moved, 2, -1);
+	auto rigid = corReg3D(img, moved, {2, 1});
+	rigid.toIndexCoords(moved, true);
+	cerr << rigid << endl;
+	if(fabs(rigid.shift[0]-1.5) > 0.05 || fabs(rigid.shift[1]) > 0.05 ||
+			fabs(rigid.shift[2]+1) > 0.05 || rigid.rotation.norm() > 0.01) {
+		cerr << "Registration failed" << endl;
+		return -1;
+	}
+
+	// the number of line search trials doesn't depend on the thread count,
+	// so neither should the result (beyond round off in the metric)
+	setNumThreads(1);
+	auto rigid1 = corReg3D(img, moved, {2, 1});
+	rigid1.toIndexCoords(moved, true);
+	setNumThreads(4);
+	if((rigid1.shift-rigid.shift).norm() > 1e-6 ||
+			(rigid1.rotation-rigid.rotation).norm() > 1e-8) {
+		cerr << "Registration depends on the number of threads: " << endl
+			<< rigid1 << endl;
+		return -1;
+	}
+
+	return 0;
+}
@@ -354,6 +354,33 @@ int testJacobi(size_t rows, size_t cols, size_t rank)
 	return 0;
 }
 
+/**
+ * @brief Checks that rpiPCA does not compute a full rank SVD of a matrix with
+ * a flat spectrum (noise), which never reaches the range finder tolerance
+ *
+ * @return 0 if the number of components stays within the bound
+ */
+int testPCABound()
+{
+	MatrixXd X(200, 150);
+	fillGaussian<MatrixXd>(X);
+
+	MatrixXd pcs = rpiPCA(X, 1, 0);
+	if(pcs.rows() != X.rows() || pcs.cols() > 64) {
+		cerr << "rpiPCA should stop at 64 components, got " << pcs.cols()
+			<< endl;
+		return -1;
+	}
+
+	pcs = rpiPCA(X, 1, 5, 20);
+	if(pcs.cols() > 20) {
+		cerr << "rpiPCA should stop at 20 components, got " << pcs.cols()
+			<< endl;
+		return -1;
+	}
+	return 0;
+}
+
 int main(int argc, char** argv)
 {
 	cerr << "Version: " << __version__ << endl;
@@ -418,6 +445,9 @@ int main(int argc, char** argv)
 	c = clock()-c;
 	cerr << "Jacobi\n" << c <<endl;
 
+	if(testPCABound() != 0)
+		return -1;
+
 	} catch (TCLAP::ArgException &e)  // catch any exceptions
 	{ std::cerr<<"error: "<<e.error()<<" for arg "<<e.argId()<<std::endl;}
 
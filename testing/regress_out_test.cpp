@@ -0,0 +1,113 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * NPL is free software: you can redistribute it and/or modify it under the
+ * terms of the BSD 2-Clause License available in LICENSE or at
+ * http://opensource.org/licenses/BSD-2-Clause
+ *
+ * @file regress_out_test.cpp Tests that the tiled regressOut matches
+ * regressing each voxel separately, zeros constant voxels, and works in place
+ *
+ *****************************************************************************/
+
+#include <string>
+#include <stdexcept>
+#include <random>
+
+#include <Eigen/Dense>
+#include "statistics.h"
+#include "mrimage.h"
+#include "mrimage_utils.h"
+#include "iterators.h"
+#include "utility.h"
+#include "fmri_inference.h"
+
+using std::string;
+using Eigen::MatrixXd;
+
+using namespace npl;
+
+/**
+ * @brief Compares residuals to regressing each voxel separately
+ */
+int check(ptr<const MRImage> orig, ptr<const MRImage> resid,
+		const MatrixXd& X, double tol)
+{
+	MatrixXd prebeta = pseudoInverse(X.transpose()*X)*X.transpose();
+	VectorXd y(X.rows());
+	int64_t index[3];
+	Vector3DConstIter<double> it(orig), rit(resid);
+	for(; !it.eof(); ++it, ++rit) {
+		it.index(3, index);
+		for(size_t tt=0; tt<X.rows(); tt++)
+			y[tt] = it[tt];
+
+		// constant voxels should be zero
+		if(index[0] == 3) {
+			for(size_t tt=0; tt<X.rows(); tt++) {
+				if(rit[tt] != 0) {
+					cerr << "Constant voxel not zeroed" << endl;
+					return -1;
+				}
+			}
+			continue;
+		}
+
+		y -= X*(prebeta*y);
+		for(size_t tt=0; tt<X.rows(); tt++) {
+			if(fabs(rit[tt] - y[tt]) > tol) {
+				cerr << "Mismatch: " << rit[tt] << " vs " << y[tt] << endl;
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+int main()
+{
+	setNumThreads(4);
+
+	// 1015 voxels, so the last tile is partial
+	vector<size_t> fdim({7,29,5,80});
+	std::mt19937 rng(7);
+	std::normal_distribution<double> gauss(0, 1);
+
+	MatrixXd X(fdim[3], 3);
+	for(size_t rr=0; rr<X.rows(); rr++) {
+		X(rr, 0) = sin(rr/5.);
+		X(rr, 1) = gauss(rng);
+		X(rr, 2) = 1;
+	}
+
+	auto fmri = createMRImage(fdim.size(), fdim.data(), FLOAT32);
+	int64_t index[3];
+	for(Vector3DIter<double> it(fmri); !it.eof(); ++it) {
+		it.index(3, index);
+		for(size_t tt=0; tt<fdim[3]; tt++) {
+			// slice 3 is constant (negative, to check the guard)
+			if(index[0] == 3)
+				it.set(tt, -5);
+			else
+				it.set(tt, 2*X(tt, 0) - X(tt, 1) + 10 + gauss(rng));
+		}
+	}
+
+	// new FLOAT32 output
+	auto resid = regressOut(fmri, X);
+	if(resid->type() != FLOAT32) {
+		cerr << "Output should be FLOAT32" << endl;
+		return -1;
+	}
+	if(check(fmri, resid, X, 1e-4) != 0)
+		return -1;
+
+	// in place, FLOAT64
+	auto fmri64 = dPtrCast<MRImage>(fmri->copyCast(FLOAT64));
+	auto inplace = dPtrCast<MRImage>(fmri->copyCast(FLOAT64));
+	regressOut(inplace, X, inplace);
+	if(check(fmri64, inplace, X, 1e-10) != 0)
+		return -1;
+
+	return 0;
+}
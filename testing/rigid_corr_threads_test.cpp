@@ -0,0 +1,201 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * NPL is free software: you can redistribute it and/or modify it under the
+ * terms of the BSD 2-Clause License available in LICENSE or at
+ * http://opensource.org/licenses/BSD-2-Clause
+ *
+ * @file rigid_corr_threads_test.cpp Tests that the parallel correlation metric
+ * is bit-reproducible for a fixed number of threads, consistent across thread
+ * counts and matches the serial, voxel-by-voxel computation
+ *
+ *****************************************************************************/
+
+#include "mrimage.h"
+#include "iterators.h"
+#include "ndarray_utils.h"
+#include "mrimage_utils.h"
+#include "registration.h"
+#include "accessors.h"
+#include "statistics.h"
+#include "utility.h"
+
+#include <string>
+#include <iostream>
+#include <memory>
+
+using namespace std;
+using namespace npl;
+
+using Eigen::Matrix3d;
+using Eigen::Vector3d;
+
+shared_ptr<MRImage> squareImage()
+{
+	// create test image
+	int64_t index[3];
+	size_t sz[] = {37, 41, 29};
+	auto in = createMRImage(sizeof(sz)/sizeof(size_t), sz, FLOAT64);
+
+	// fill with square
+	OrderIter<double> sit(in);
+	while(!sit.eof()) {
+		sit.index(3, index);
+		if(index[0] > sz[0]/4 && index[0] < 2*sz[0]/3 &&
+				index[1] > sz[1]/5 && index[1] < sz[1]/2 &&
+				index[2] > sz[2]/3 && index[2] < 2*sz[2]/3) {
+			sit.set(1);
+		} else {
+			sit.set(0);
+		}
+		++sit;
+	}
+
+	return in;
+};
+
+/**
+ * @brief Serial correlation and gradient, computed voxel by voxel with
+ * LinInterp3DView as RigidCorrComp did before it was parallelized
+ */
+void serialCorr(ptr<const MRImage> fixed, ptr<const MRImage> moving,
+		const VectorXd& params, double& val, VectorXd& grad)
+{
+	double rx = params[0]*M_PI/180.;
+	double ry = params[1]*M_PI/180.;
+	double rz = params[2]*M_PI/180.;
+	Vector3d shift(params[3]/moving->spacing(0),
+			params[4]/moving->spacing(1), params[5]/moving->spacing(2));
+	Vector3d center;
+	for(size_t ii=0; ii<3; ii++)
+		center[ii] = (moving->dim(ii)-1)/2.;
+
+	Matrix3d Rinv;
+	Rinv(0, 0) = cos(ry)*cos(rz);;
+	Rinv(0, 1) = cos(rz)*sin(rx)*sin(ry)+cos(rx)*sin(rz);
+	Rinv(0, 2) = -cos(rx)*cos(rz)*sin(ry)+sin(rx)*sin(rz);
+	Rinv(1, 0) = -cos(ry)*sin(rz);
+	Rinv(1, 1) = cos(rx)*cos(rz)-sin(rx)*sin(ry)*sin(rz);
+	Rinv(1, 2) = cos(rz)*sin(rx)+cos(rx)*sin(ry)*sin(rz);
+	Rinv(2, 0) = sin(ry);
+	Rinv(2, 1) = -cos(ry)*sin(rx);
+	Rinv(2, 2) = cos(rx)*cos(ry);
+
+	Matrix3d ddRx, ddRy, ddRz;
+	ddRx <<0,0,0,cos(rx)*cos(rz)*sin(ry)-sin(rx)*sin(rz),
+		-(cos(rz)*sin(rx))-cos(rx)*sin(ry)*sin(rz),
+		-(cos(rx)*cos(ry)),cos(rz)*sin(rx)*sin(ry)+cos(rx)*sin(rz),
+		cos(rx)*cos(rz)-sin(rx)*sin(ry)*sin(rz),-(cos(ry)*sin(rx));
+	ddRy <<-(cos(rz)*sin(ry)),sin(ry)*sin(rz),cos(ry),cos(ry)*cos(rz)*sin(rx),
+		-(cos(ry)*sin(rx)*sin(rz)),sin(rx)*sin(ry),-(cos(rx)*cos(ry)*cos(rz)),
+		cos(rx)*cos(ry)*sin(rz),-(cos(rx)*sin(ry));
+	ddRz <<-(cos(ry)*sin(rz)),-(cos(ry)*cos(rz)),0,
+		cos(rx)*cos(rz)-sin(rx)*sin(ry)*sin(rz),
+		-(cos(rz)*sin(rx)*sin(ry))-cos(rx)*sin(rz),0,
+		cos(rz)*sin(rx)+cos(rx)*sin(ry)*sin(rz),
+		cos(rx)*cos(rz)*sin(ry)-sin(rx)*sin(rz),0;
+
+	double mov_sum = 0, fix_sum = 0, mov_ss = 0, fix_ss = 0, corr = 0;
+	grad.setZero(6);
+	Vector3d ind, cind, gradG, dgdR;
+	Matrix3d dR;
+	auto dmoving = derivative(moving);
+	NDConstIter<double> mit(moving);
+	Vector3DConstIter<double> dmit(dmoving);
+	LinInterp3DView<double> fix_vw(fixed);
+	for(; !mit.eof() && !dmit.eof(); ++mit, ++dmit) {
+		mit.index(3, ind.array().data());
+		cind = Rinv*(ind-shift-center) + center;
+		gradG << dmit[0], dmit[1], dmit[2];
+		dR.row(0) = ddRx*(cind-center);
+		dR.row(1) = ddRy*(cind-center);
+		dR.row(2) = ddRz*(cind-center);
+		dgdR = dR*gradG;
+
+		double g = *mit;
+		double f = fix_vw(cind[0], cind[1], cind[2]);
+		mov_sum += g;
+		fix_sum += f;
+		mov_ss += g*g;
+		fix_ss += f*f;
+		corr += g*f;
+		grad.head<3>() += f*dgdR;
+		grad.tail<3>() += f*gradG;
+	}
+
+	grad[0] *= M_PI/180.;
+	grad[1] *= M_PI/180.;
+	grad[2] *= M_PI/180.;
+	grad[3] /= moving->spacing(0);
+	grad[4] /= moving->spacing(1);
+	grad[5] /= moving->spacing(2);
+
+	size_t count = moving->elements();
+	val = sample_corr(count, mov_sum, fix_sum, mov_ss, fix_ss, corr);
+	double sd1 = sqrt(sample_var(count, mov_sum, mov_ss));
+	double sd2 = sqrt(sample_var(count, fix_sum, fix_ss));
+	grad /= (count-1)*sd1*sd2;
+
+	// minimizing
+	val = -val;
+	grad = -grad;
+}
+
+int main()
+{
+	auto fixed = dPtrCast<MRImage>(smoothDownsample(squareImage(), 1));
+	auto moving = dPtrCast<MRImage>(fixed->copy());
+	shiftImageFFT(moving, 0, 2);
+
+	RigidCorrComp comp(true);
+	comp.setFixed(fixed);
+	comp.setMoving(moving);
+
+	VectorXd params(6);
+	params << 3, -2, 5, 1.5, -0.5, 2;
+
+	double refval = 0;
+	VectorXd refgrad(6);
+	setNumThreads(1);
+	comp.valueGrad(params, refval, refgrad);
+
+	// Matches the serial, voxel-by-voxel computation
+	double serval;
+	VectorXd sergrad(6);
+	serialCorr(fixed, moving, params, serval, sergrad);
+	if(fabs(serval-refval) > 1e-10 ||
+			(sergrad-refgrad).norm() > 1e-8*sergrad.norm()) {
+		cerr << "Results differ from serial computation: " << refval << " vs "
+			<< serval << ", " << refgrad.transpose() << " vs "
+			<< sergrad.transpose() << endl;
+		return -1;
+	}
+
+	for(size_t nthreads = 1; nthreads < 6; nthreads++) {
+		setNumThreads(nthreads);
+
+		double val1, val2, val3;
+		VectorXd grad1(6), grad2(6);
+		comp.valueGrad(params, val1, grad1);
+		comp.valueGrad(params, val2, grad2);
+		comp.value(params, val3);
+
+		// Same thread count, must be identical
+		if(val1 != val2 || val1 != val3 || grad1 != grad2) {
+			cerr << "Results differ between calls with " << nthreads
+				<< " threads" << endl;
+			return -1;
+		}
+
+		// Different thread count, should only differ by round off
+		if(fabs(val1-refval) > 1e-12 ||
+				(grad1-refgrad).norm() > 1e-12*refgrad.norm()) {
+			cerr << "Results with " << nthreads << " threads differ from "
+				"single threaded: " << val1 << " vs " << refval << ", "
+				<< grad1.transpose() << " vs " << refgrad.transpose() << endl;
+			return -1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,130 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * NPL is free software: you can redistribute it and/or modify it under the
+ * terms of the BSD 2-Clause License available in LICENSE or at
+ * http://opensource.org/licenses/BSD-2-Clause
+ *
+ * @file trace_test.cpp Tests that registration records a span per pyramid
+ * level (with timing and evaluation counts) only while tracing is enabled,
+ * and that traces are written in both formats
+ *
+ *****************************************************************************/
+
+#include "mrimage.h"
+#include "iterators.h"
+#include "ndarray_utils.h"
+#include "mrimage_utils.h"
+#include "registration.h"
+#include "trace.h"
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <memory>
+
+using namespace std;
+using namespace npl;
+
+shared_ptr<MRImage> blobImage()
+{
+	// create test image
+	int64_t index[3];
+	size_t sz[] = {24, 22, 20};
+	auto in = createMRImage(sizeof(sz)/sizeof(size_t), sz, FLOAT64);
+
+	// fill with blob with some texture
+	for(NDIter<double> it(in); !it.eof(); ++it) {
+		it.index(3, index);
+		double x = index[0]-11;
+		double y = index[1]-10;
+		double z = index[2]-9;
+		double r = x*x/64+y*y/49+z*z/36;
+		it.set(r < 1 ? 100+20*sin(0.4*x)*cos(0.3*z)+x : 0);
+	}
+	return in;
+}
+
+/**
+ * @brief Reads a whole file and counts the occurences of a string in it
+ */
+size_t countInFile(string filename, string needle)
+{
+	ifstream ifs(filename);
+	stringstream ss;
+	ss << ifs.rdbuf();
+	string text = ss.str();
+
+	size_t count = 0;
+	for(size_t pos = text.find(needle); pos != string::npos;
+			pos = text.find(needle, pos+1))
+		count++;
+	return count;
+}
+
+int main()
+{
+	auto img = blobImage();
+	auto moved = dPtrCast<MRImage>(img->copy());
+	shiftImageKern(moved, 0, 1.2);
+
+	// nothing is recorded while tracing is disabled
+	corReg3D(img, moved, {2, 1});
+	writeTraceJSON("trace_test_off.json");
+	if(countInFile("trace_test_off.json", "\"name\"") != 0) {
+		cerr << "Spans recorded with tracing disabled" << endl;
+		return -1;
+	}
+
+	setTracing(true);
+	corReg3D(img, moved, {2, 1, 0.5});
+	corReg3D(img, moved, {2, 1}, false, true);
+	setTracing(false);
+
+	writeTraceJSON("trace_test.json");
+	writeChromeTrace("trace_test_chrome.json");
+
+	// one span per level, each with the timing and counts
+	size_t nlevel = countInFile("trace_test.json", "\"name\": \"level\"");
+	if(nlevel != 5) {
+		cerr << "Expected 5 level spans, found " << nlevel << endl;
+		return -1;
+	}
+	for(string arg : {"\"smooth_time\"", "\"optimize_time\"",
+			"\"final_metric\"", "\"voxels\""}) {
+		if(countInFile("trace_test.json", arg) != 5) {
+			cerr << "Missing " << arg << " in level spans" << endl;
+			return -1;
+		}
+	}
+	if(countInFile("trace_test.json", "\"grad_evals\"") != 3 ||
+			countInFile("trace_test.json", "\"line_search_time\"") != 3 ||
+			countInFile("trace_test.json", "\"passes\"") != 2) {
+		cerr << "Missing evaluation counts" << endl;
+		return -1;
+	}
+	if(countInFile("trace_test.json", "\"name\": \"valueGrad\"") == 0 ||
+			countInFile("trace_test.json", "\"name\": \"smooth\"") == 0 ||
+			countInFile("trace_test.json",
+				"\"name\": \"normalEquations\"") == 0) {
+		cerr << "Missing evaluation or smoothing spans" << endl;
+		return -1;
+	}
+
+	// same spans in the chrome trace
+	if(countInFile("trace_test_chrome.json", "\"ph\": \"X\"") !=
+			countInFile("trace_test.json", "\"name\"")) {
+		cerr << "Chrome trace has a different number of spans" << endl;
+		return -1;
+	}
+
+	clearTrace();
+	writeTraceJSON("trace_test_off.json");
+	if(countInFile("trace_test_off.json", "\"name\"") != 0) {
+		cerr << "Spans remain after clearTrace()" << endl;
+		return -1;
+	}
+
+	return 0;
+}
@@ -23,6 +23,7 @@
 #include "iterators.h"
 #include "accessors.h"
 #include "registration.h"
+#include "trace.h"
 
 using namespace npl;
 using namespace std;
@@ -114,7 +115,18 @@ int main(int argc, char** argv)
 			"is important for applying motion correction to the distortion "
 			"field.", false, "", "*.rtm", cmd);
 
+	vector<string> traceformats({"chrome", "json"});
+	TCLAP::ValuesConstraint<string> vc_traceformats(traceformats);
+	TCLAP::ValueArg<string> a_trace("", "trace", "Write the time spent at "
+			"each level of the registration (smoothing, metric and gradient "
+			"evaluations, optimizer, line search), evaluation counts and final "
+			"metric to this file. See --trace-format.", false, "", "*.json", cmd);
+	TCLAP::ValueArg<string> a_traceformat("", "trace-format", "Format of "
+			"--trace, chrome (for chrome://tracing or Perfetto) or json.",
+			false, "chrome", &vc_traceformats, cmd);
+
 	cmd.parse(argc, argv);
+	setTracing(a_trace.isSet());
 
 	// set up sigmas
 
@@ -206,6 +218,8 @@ int main(int argc, char** argv)
 		}
 
 		cout << "Finished\nWriting output.";
+		if(a_trace.isSet())
+			writeTrace(a_trace.getValue(), a_traceformat.getValue());
 		if(a_transform.isSet())
 			transform->write(a_transform.getValue());
 
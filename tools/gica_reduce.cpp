@@ -58,7 +58,8 @@ int main(int argc, char** argv)
 			"2*i more computation time. Not applicable for full SVD",
 			false, 0, "iters", cmd);
 	TCLAP::ValueArg<int> a_rank("", "rank", "Maximum output rank. If "
-			"randomized SVD is applied, then this is the initial reduction. "
+			"randomized SVD is applied, then this is the largest basis the "
+			"adaptive range finder may grow to. "
 			"If full SVD is being performed then this is the maximum number of "
 			"rows to save. ", false, 100, "rank", cmd);
 
@@ -68,6 +69,10 @@ int main(int argc, char** argv)
 			"UEV matrices.", true, "", "*.nii.gz", cmd);
 	TCLAP::SwitchArg a_full("F", "full-svd", "Perform full SVD rather than "
 			"probabilistic one", cmd);
+	TCLAP::ValueArg<size_t> a_procs("", "procs", "Number of processes to "
+			"split each pass over the data between. Threads are divided "
+			"evenly between them. Useful on machines with several NUMA "
+			"domains.", false, 1, "procs", cmd);
 
 	cmd.add(a_verbose);
 	cmd.parse(argc, argv);
@@ -78,12 +83,12 @@ int main(int argc, char** argv)
 	if(a_full.isSet()) {
 		gicaReduceFull(a_reorgprefix.getValue(), a_reduceprefix.getValue(),
 				a_varthresh.getValue(), cvarthresh, a_rank.getValue(),
-				a_verbose.isSet());
+				a_verbose.isSet(), a_procs.getValue());
 	} else {
 		gicaReduceProb(a_reorgprefix.getValue(), a_reduceprefix.getValue(),
 				a_varthresh.getValue(), cvarthresh,
 				a_rank.getValue(), a_poweriters.getValue(),
-				a_verbose.isSet());
+				a_verbose.isSet(), a_procs.getValue());
 	}
 
 	} catch (TCLAP::ArgException &e)  // catch any exceptions
@@ -74,6 +74,14 @@ int main(int argc, char** argv)
 	TCLAP::SwitchArg a_no_norm_ts("N", "no-norm-ts", "Do not normalize each "
 			"timeseries.", cmd);
 
+	TCLAP::SwitchArg a_float("", "float", "Store tall matrices in single "
+			"precision, halving disk space and bandwidth. Products are still "
+			"accumulated in double precision.", cmd);
+	TCLAP::SwitchArg a_compress("", "compress", "Store tall matrices in "
+			"single precision and gzip compress them. Saves disk space, but "
+			"blocks must be decompressed into memory each time they are used "
+			"(implies --float).", cmd);
+
 	cmd.add(a_verbose);
 	cmd.parse(argc, argv);
 
@@ -95,10 +103,16 @@ int main(int argc, char** argv)
 		sb = a_space_append.isSet();
 	}
 
+	MatStorageT storage = STORE_FLOAT64;
+	if(a_compress.isSet())
+		storage = STORE_FLOAT32_GZ;
+	else if(a_float.isSet())
+		storage = STORE_FLOAT32;
+
 	cerr << "Reorganizing data into matrices..."<<endl;
 	gicaCreateMatrices(tb, sb, a_masks.getValue(), a_in.getValue(),
 			a_prefix.getValue(), a_gbram.getValue(), !a_no_norm_ts.isSet(),
-			a_verbose.isSet());
+			a_verbose.isSet(), storage);
 
 	} catch (TCLAP::ArgException &e)  // catch any exceptions
 	{ std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl; }
@@ -15,9 +15,8 @@
 
 #include <tclap/CmdLine.h>
 
-#include "gradient.h"
-#include "lbfgs.h"
 #include "registration.h"
+#include "trace.h"
 
 #include "nplio.h"
 #include "mrimage.h"
@@ -31,177 +30,6 @@
 using namespace std;
 using namespace npl;
 
-/**
- * @brief Computes motion parameters from an fMRI image
- *
- * @param fmri Input fMRI
- * @param reftime Volume to use for reference
- * @param sigmas Standard deviation (in phyiscal space)
- * @param hardstops Lower bound on negative correlation  -1 would mean that it
- * stops when it hits -1
- *
- * @return Vector of motion parameters. Elements are (C = center, R = rotation
- * in radians, S = shift in index units): [CX, CY, CZ, RX, RY, RZ, SX, SY, SZ]
- */
-vector<vector<double>> computeMotion(ptr<const MRImage> fmri, int reftime,
-		const vector<double>& sigmas, double minstep, double maxstep,
-		int histsize, double beta, int padsize)
-{
-	assert(fmri->ndim());
-    using namespace std::placeholders;
-    using std::bind;
-
-	// Initialize Variables
-	if(padsize < 0)
-		padsize = 0;
-
-	Vector3DConstIter<double> iit(fmri);
-	vector<vector<double>> motion;
-	double thresh = otsuThresh(fmri);
-
-	// extract reference volumes and pre-smooth
-	vector<size_t> vsize(fmri->dim(), fmri->dim()+fmri->ndim());
-	for(size_t dd=0; dd<vsize.size(); dd++) {
-		vsize[dd] += padsize;
-	}
-	vsize[3] = 0;
-
-	vector<pair<int64_t,int64_t>> roi(fmri->ndim()-1);
-	for(size_t dd=0; dd<vsize.size()-1; dd++) {
-		roi[dd].first = padsize/2;
-		roi[dd].second = roi[dd].first + fmri->dim(dd)-1;
-	}
-
-	// Registration Tools, create with placeholder images
-	auto vol = dPtrCast<MRImage>(fmri->createAnother(3, vsize.data(), FLOAT32));
-	RigidCorrComp comp(true);
-
-	// Pre-Compute Fixed Smoothing
-	vector<ptr<MRImage>> fixed;
-	for(size_t ii=0; ii<sigmas.size(); ii++) {
-		NDIter<double> fit(vol);
-		fit.setROI(roi);
-		for(iit.goBegin(), fit.goBegin(); !fit.eof() && !iit.eof();
-					++iit, ++fit) {
-			double v = iit[reftime];
-			if(v < thresh)
-				fit.set(0);
-			else
-				fit.set(v);
-		}
-
-		// create another padded image, then smooth
-		fixed.push_back(smoothDownsample(vol, sigmas[ii]));
-	}
-
-	// create value and gradient functions
-	auto vfunc = bind(&RigidCorrComp::value, &comp, _1, _2);
-	auto vgfunc = bind(&RigidCorrComp::valueGrad, &comp, _1, _2, _3);
-	auto gfunc = bind(&RigidCorrComp::grad, &comp, _1, _2);
-
-	// initialize optimizer
-	LBFGSOpt opt(6, vfunc, gfunc, vgfunc);
-	opt.stop_Its = 10000000;
-	opt.stop_X = minstep;
-	opt.stop_G = 0;
-	opt.stop_F = 0;
-	opt.opt_histsize = histsize;
-	opt.opt_ls_beta = beta;
-	opt.opt_ls_s = maxstep;
-	opt.state_x.setZero();
-
-	Rigid3DTrans rigid;
-	for(size_t tt=0; tt<fmri->tlen(); tt++) {
-		cerr << "Time " << tt << " / " << fmri->tlen() << endl;
-		if(tt == reftime) {
-			motion.push_back(vector<double>());
-			motion.back().resize(9, 0);
-		} else {
-
-			/****************************************************************
-			 * Registration
-			 ***************************************************************/
-			for(size_t ii=0; ii<sigmas.size(); ii++) {
-
-				/*
-				 * Extract, threshold and Smooth Moving Volume, Set Fixed in
-				 * computer to Pre-Smoothed Version
-				 */
-				NDIter<double> mit(vol);
-				mit.setROI(roi);
-				for(iit.goBegin(), mit.goBegin(); !iit.eof() && !mit.eof();
-								++iit, ++mit) {
-					double v = iit[tt];
-					if(v < thresh)
-						mit.set(0);
-					else
-						mit.set(v);
-				}
-				auto sm_moving = smoothDownsample(vol, sigmas[ii]);
-
-				comp.setFixed(fixed[ii]);
-				comp.setMoving(sm_moving);
-
-				// grab the parameters from the previous iteration (or initialized)
-				rigid.toIndexCoords(sm_moving, true);
-				for(size_t ii=0; ii<3; ii++) {
-					opt.state_x[ii] = radToDeg(rigid.rotation[ii]);
-					opt.state_x[ii+3] = rigid.shift[ii]*sm_moving->spacing(ii);
-					assert(rigid.center[ii] == (sm_moving->dim(ii)-1.)/2.);
-				}
-
-				// run the optimizer
-				opt.reset_history();
-				StopReason stopr = opt.optimize();
-				cerr << Optimizer::explainStop(stopr) << endl;
-
-				// set values from parameters, and convert to RAS coordinate so that no
-				// matter the sampling after smoothing the values remain
-				for(size_t ii=0; ii<3; ii++) {
-					rigid.rotation[ii] = degToRad(opt.state_x[ii]);
-					rigid.shift[ii] = opt.state_x[ii+3]/sm_moving->spacing(ii);
-					rigid.center[ii] = (sm_moving->dim(ii)-1)/2.;
-				}
-
-				rigid.toRASCoords(sm_moving);
-
-			}
-
-			/******************************************************************
-			 * Results
-			 *****************************************************************/
-			motion.push_back(vector<double>());
-			auto& m = motion.back();
-			m.resize(9, 0);
-
-			// Convert to RAS
-			rigid.ras_coord = false;
-			for(size_t dd=0; dd<3; dd++) {
-				rigid.center[dd] = (vol->dim(dd)-1)/2.;
-				rigid.rotation[dd] = opt.state_x[dd]*M_PI/180;
-				rigid.shift[dd] = opt.state_x[dd+3]/vol->spacing(dd);
-			}
-
-			rigid.invert();
-			rigid.toRASCoords(vol);
-			for(size_t dd=0; dd<3; dd++) {
-				m[dd] = rigid.center[dd];
-				m[dd+3] = rigid.rotation[dd];
-				m[dd+6] = rigid.shift[dd];
-			}
-
-			for(size_t dd=0; dd<9; dd++) {
-				if(dd != 0) cout << ", ";
-				cout << m[dd];
-			}
-			cout << "\n==========================================" << endl;
-
-		}
-	}
-
-	return motion;
-}
-
 int main(int argc, char** argv)
 {
 	cerr << "Version: " << __version__ << endl;
@@ -254,8 +82,23 @@ int main(int argc, char** argv)
 	TCLAP::SwitchArg a_invert("I", "invert", "Invert motion parameters before "
 			"applying them. This mostly just for simulating motion, don't do "
 			"it unless you know what you are doing.", cmd);
+	TCLAP::SwitchArg a_gaussnewton("G", "gauss-newton", "Use a Gauss-Newton "
+			"solver, which builds the normal equations in a single pass per "
+			"iteration, rather than L-BFGS. --maxstep, --hist and "
+			"--reduction are ignored.", cmd);
+
+	vector<string> traceformats({"chrome", "json"});
+	TCLAP::ValuesConstraint<string> vc_traceformats(traceformats);
+	TCLAP::ValueArg<string> a_trace("", "trace", "Write the time spent at "
+			"each level of the registration (smoothing, metric and gradient "
+			"evaluations, optimizer, line search), evaluation counts and final "
+			"metric to this file. See --trace-format.", false, "", "*.json", cmd);
+	TCLAP::ValueArg<string> a_traceformat("", "trace-format", "Format of "
+			"--trace, chrome (for chrome://tracing or Perfetto) or json.",
+			false, "chrome", &vc_traceformats, cmd);
 
 	cmd.parse(argc, argv);
+	setTracing(a_trace.isSet());
 
 	/**********
 	 * Input
@@ -333,7 +176,10 @@ int main(int argc, char** argv)
 		// Compute Motion
 		motion = computeMotion(fmri, ref, sigmas, a_minstep.getValue(),
 				a_maxstep.getValue(), a_lbfgs_hist.getValue(),
-				a_beta.getValue(), a_padsize.getValue());
+				a_beta.getValue(), a_padsize.getValue(),
+				a_gaussnewton.isSet());
+		if(a_trace.isSet())
+			writeTrace(a_trace.getValue(), a_traceformat.getValue());
 	}
 
 	// Write to Motion File
@@ -358,52 +204,11 @@ int main(int argc, char** argv)
 	/*****************************************************
 	 * apply motion parameters
 	 ****************************************************/
-
-	// Create working Buffer, iterators
-	auto vol = dPtrCast<MRImage>(fmri->createAnother(3,fmri->dim(),FLOAT64));
-	Vector3DIter<double> iit(fmri);
-	NDIter<double> vit(vol);
-	Rigid3DTrans rigid;
-
-	// apply each time point then copy back into fMRI
-	LanczosInterp3DView<double> interp(fmri);
-	for(size_t tt=0; tt<fmri->tlen(); tt++) {
-
-		// extract timepoint
-		for(iit.goBegin(), vit.goBegin(); !iit.eof(); ++iit, ++vit)
-			vit.set(iit[tt]);
-
-		// Convert from RAS to index
-		rigid.ras_coord = true;
-		for(size_t dd=0; dd<3; dd++) {
-			rigid.center[dd] = motion[tt][dd];
-			rigid.rotation[dd] = motion[tt][dd+3];
-			rigid.shift[dd] = motion[tt][dd+6];
-		}
-		if(!a_invert.isSet())
-			rigid.invert();
-
-		cerr << "vol: " << endl << *vol << endl;
-		cerr << "Rigid Transform: " << tt << "\n" << rigid <<endl;
-
-		Matrix3d R = rigid.rotMatrix();
-		Vector3d ind;
-		for(vit.goBegin(); !vit.eof(); ++vit) {
-			vit.index(3, ind.array().data());
-			vol->indexToPoint(3, ind.array().data(), ind.array().data());
-			ind = R*(ind-rigid.center) + rigid.center + rigid.shift;
-			vol->pointToIndex(3, ind.array().data(), ind.array().data());
-			vit.set(interp(ind[0], ind[1], ind[2], tt));
-		}
-
-		// Copy Result Back to input image
-		for(iit.goBegin(), vit.goBegin(); !iit.eof(); ++iit, ++vit)
-			iit.set(tt, *vit);
+	if(a_out.isSet()) {
+		auto corrected = applyMotion(fmri, motion, a_invert.isSet());
+		corrected->write(a_out.getValue());
 	}
 
-	if(a_out.isSet())
-		fmri->write(a_out.getValue());
-
 	} catch (TCLAP::ArgException &e)  // catch any exceptions
 	{ std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl; }
 }
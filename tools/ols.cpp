@@ -33,6 +33,7 @@
 #include "mrimage.h"
 #include "mrimage_utils.h"
 #include "iterators.h"
+#include "fmri_inference.h"
 #include "version.h"
 
 using std::list;
@@ -73,8 +74,32 @@ int main(int argc, char* argv[])
 	TCLAP::ValueArg<std::string> a_regressors("r","regressor",
 			"Input Regressor.", false,"", "*.csv", cmd);
 
+	// permutation testing
+	TCLAP::ValueArg<int> a_perms("n","perms","Number of permutations for "
+			"nonparametric, family-wise error corrected p-values (0 for "
+			"none).", false, 0, "int", cmd);
+	TCLAP::SwitchArg a_signflip("S","sign-flip","Flip the signs of rows "
+			"instead of reordering them when permuting (for one-sample "
+			"tests, assumes symmetric errors).", cmd);
+	TCLAP::ValueArg<std::string> a_fwep("p","fwe-p","Output 4D Image, "
+			"containing max-T corrected p-values. One volume per regressor "
+			"(and intercept). Requires --perms", false, "", "4D Image", cmd);
+	TCLAP::ValueArg<std::string> a_clusterp("c","cluster-p","Output 4D "
+			"Image, containing cluster mass corrected p-values. One volume "
+			"per regressor (and intercept). Requires --perms", false, "",
+			"4D Image", cmd);
+	TCLAP::ValueArg<double> a_clustert("T","cluster-t","Threshold on |t| "
+			"for forming clusters. Requires --perms", false, 3, "t", cmd);
+	TCLAP::ValueArg<unsigned int> a_seed("s","seed","Random seed for "
+			"permutations.", false, 0, "int", cmd);
+
 	// parse arguments
 	cmd.parse(argc, argv);
+	if(a_perms.getValue() <= 0 && (a_fwep.isSet() || a_clusterp.isSet() ||
+				a_clustert.isSet())) {
+		cerr << "--fwe-p, --cluster-p and --cluster-t require --perms" << endl;
+		return -1;
+	}
 
 	auto fmri = readMRImage(a_input.getValue());
 	size_t tlen = fmri->tlen();
@@ -114,30 +139,10 @@ int main(int argc, char* argv[])
 	statsz[3] = X.cols();
 	auto timg = dPtrCast<MRImage>(fmri->createAnother(4, statsz, FLOAT32));
 	auto betaimg = dPtrCast<MRImage>(fmri->createAnother(4, statsz, FLOAT32));
+	auto pimg = dPtrCast<MRImage>(fmri->createAnother(4, statsz, FLOAT32));
 
-	// Load Each Timeseries and perform regression
-	auto Xinv = pseudoInverse(X);
-	auto covInv = pseudoInverse(X.transpose()*X);
-	VectorXd y(tlen);
-
-	const double MAX_T = 100;
-	const double STEP_T = 0.1;
-	StudentsT distrib(X.rows(), STEP_T, MAX_T);
-
-	RegrResult result;
-	Vector3DIter<double> tit(timg);
-	Vector3DIter<double> bit(betaimg);
-	Vector3DIter<double> iit(fmri);
-	for(; !iit.eof(); ++iit, ++bit, ++tit) {
-		for(size_t tt=0; tt<tlen; tt++)
-			y[tt] = iit[tt];
-
-		regress(&result, y, X, covInv, Xinv, distrib);
-		for(size_t cc=0; cc<nregr; cc++) {
-			tit.set(cc, result.t[cc]);
-			bit.set(cc, result.bhat[cc]);
-		}
-	}
+	// Regress all the timeseries
+	fmriGLM(fmri, X, betaimg, timg, pimg);
 
 	if(a_beta.isSet())
 		betaimg->write(a_beta.getValue());
@@ -145,6 +150,24 @@ int main(int argc, char* argv[])
 	if(a_tscore.isSet())
 		timg->write(a_tscore.getValue());
 
+	if(a_perms.getValue() > 0) {
+		auto fweimg = dPtrCast<MRImage>(fmri->createAnother(4, statsz,
+					FLOAT32));
+		ptr<MRImage> clusterimg;
+		if(a_clusterp.isSet())
+			clusterimg = dPtrCast<MRImage>(fmri->createAnother(4, statsz,
+						FLOAT32));
+
+		fmriGLMPermute(fmri, X, a_perms.getValue(), a_signflip.isSet() ?
+				PERMUTE_SIGNS : PERMUTE_ROWS, fweimg, clusterimg,
+				a_clustert.getValue(), a_seed.getValue());
+
+		if(a_fwep.isSet())
+			fweimg->write(a_fwep.getValue());
+		if(a_clusterp.isSet())
+			clusterimg->write(a_clusterp.getValue());
+	}
+
 	// done, catch all argument errors
 	} catch (TCLAP::ArgException &e)  // catch any exceptions
 	{ std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl; }
@@ -158,6 +158,8 @@ int main(int argc, char* argv[])
 				"Remove signal above the given frequency in hz. If not set "
 				"then all high frequency will be kept", false, INFINITY, "hz",
 				cmd);
+	TCLAP::SwitchArg a_normalize("Z", "normalize", "Scale each cleaned "
+			"timeseries to zero mean and unit variance.", cmd);
 
 	cmd.add(a_verbose);
 
@@ -315,27 +317,22 @@ int main(int argc, char* argv[])
 		}
 	}
 
-	cerr << "Performing Regression...";
-	if(X.cols() > 0) {
-		try {
-			fmri = regressOut(fmri, X);
-		} catch(...) {
-			std::cerr << "Error problems regressing out a parameter" << endl;
-			return -1;
-		}
-		if(!fmri) {
-			std::cerr << "Error problems regressing out a parameter" << endl;
-			return -1;
-		}
+	/* Regression, Time Filter and Normalization in a single pass */
+	cerr << "Cleaning fMRI...";
+	double cuton = NAN;
+	double cutoff = INFINITY;
+	if(a_minfreq.isSet() || a_maxfreq.isSet()) {
+		cuton = a_minfreq.getValue();
+		cutoff = a_maxfreq.getValue();
+	}
+	try {
+		fmri = cleanFMRI(fmri, X, cuton, cutoff, a_normalize.isSet());
+	} catch(...) {
+		std::cerr << "Error problems regressing out a parameter" << endl;
+		return -1;
 	}
 	cerr << "Done!" << endl;
 
-	/* Time Filter */
-	cerr << "Performing Bandpass fileter...";
-	if(a_minfreq.isSet() || a_maxfreq.isSet())
-		fmriBandPass(fmri, a_minfreq.getValue(), a_maxfreq.getValue());
-	cerr << "Done" << endl;
-
 	if(a_output.isSet()) {
 		fmri->write(a_output.getValue());
 	}
@@ -26,6 +26,7 @@
 #include "iterators.h"
 #include "accessors.h"
 #include "registration.h"
+#include "trace.h"
 #include "lbfgs.h"
 
 using namespace npl;
@@ -83,8 +84,45 @@ try {
 	TCLAP::ValueArg<int> a_parzen("r", "radius", "Radius in parzen window "
 			"for bins", false, 5, "n", cmd);
 
+	vector<string> samplers({"FULL", "UNIFORM", "STRATIFIED", "MASK"});
+	TCLAP::ValuesConstraint<string> vc_samplers(samplers);
+	TCLAP::ValueArg<string> a_sampling("S", "sampling", "Voxels of the fixed "
+			"image to use in the information metrics. FULL uses all voxels, "
+			"UNIFORM a uniformly random subset, STRATIFIED one random voxel "
+			"from each cell of a regular grid and MASK a random subset of "
+			"the voxels inside --sample-mask. See --sample-frac",
+			false, "FULL", &vc_samplers, cmd);
+	TCLAP::ValueArg<double> a_sampfrac("F", "sample-frac", "Fraction of "
+			"voxels to use when sampling (in (0,1])", false, 1, "frac", cmd);
+	TCLAP::SwitchArg a_resampleit("E", "resample-each", "Draw new samples "
+			"for every iteration of the optimizer rather than once per "
+			"smoothing level", cmd);
+	TCLAP::ValueArg<string> a_sampmask("k", "sample-mask", "Mask to sample "
+			"fixed voxels from (with -S MASK)", false, "", "*.nii.gz", cmd);
+	TCLAP::SwitchArg a_fftinit("I", "fft-init", "Initialize the "
+			"registration with an FFT based estimate (rotation from the "
+			"magnitude spectra, shift from phase correlation) rather than "
+			"the identity. Helps with large initial misalignments.", cmd);
+	TCLAP::SwitchArg a_gaussnewton("G", "gauss-newton", "Use a Gauss-Newton "
+			"solver rather than L-BFGS (COR metric only).", cmd);
+
+
+	vector<string> traceformats({"chrome", "json"});
+	TCLAP::ValuesConstraint<string> vc_traceformats(traceformats);
+	TCLAP::ValueArg<string> a_trace("", "trace", "Write the time spent at "
+			"each level of the registration (smoothing, metric and gradient "
+			"evaluations, optimizer, line search), evaluation counts and final "
+			"metric to this file. See --trace-format.", false, "", "*.json", cmd);
+	TCLAP::ValueArg<string> a_traceformat("", "trace-format", "Format of "
+			"--trace, chrome (for chrome://tracing or Perfetto) or json.",
+			false, "chrome", &vc_traceformats, cmd);
 
 	cmd.parse(argc, argv);
+	setTracing(a_trace.isSet());
+	if(a_gaussnewton.isSet() && a_metric.getValue() != "COR") {
+		cerr << "--gauss-newton requires the COR metric" << endl;
+		return -1;
+	}
 
 	/*************************************************************************
 	 * Read Inputs
@@ -184,14 +222,22 @@ try {
 		 */
 		if(a_metric.getValue() == "COR") {
 			cout << "Done\nRigidly Registering with correlation..." << endl;
-			rigid = corReg3D(fixed, moving, sigmas);
+			rigid = corReg3D(fixed, moving, sigmas, a_fftinit.isSet(),
+					a_gaussnewton.isSet());
 		} else {
 			cout << "Done\nRigidly Registering with " << a_metric.getValue()
 				<< "..." << endl;
+			ptr<MRImage> sampmask;
+			if(a_sampmask.isSet())
+				sampmask = readMRImage(a_sampmask.getValue());
 			rigid = informationReg3D(fixed, moving, sigmas, a_bins.getValue(),
-					a_parzen.getValue(), a_metric.getValue());
+					a_parzen.getValue(), a_metric.getValue(), 0.001,
+					a_sampling.getValue(), a_sampfrac.getValue(),
+					a_resampleit.isSet(), sampmask, a_fftinit.isSet());
 		}
 		cout << "Finished\n.";
+		if(a_trace.isSet())
+			writeTrace(a_trace.getValue(), a_traceformat.getValue());
 		rigid.invert();
 	} else {
 		cerr << "Either --fixed or --apply must be set but not both!" << endl;
@@ -0,0 +1,234 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * NPL is free software: you can redistribute it and/or modify it under the
+ * terms of the BSD 2-Clause License available in LICENSE or at
+ * http://opensource.org/licenses/BSD-2-Clause
+ *
+ * @file rtmotioncorr.cpp Motion corrects volumes as they are written to a
+ * directory (a stand-in for a real-time scanner feed)
+ *
+ *****************************************************************************/
+
+#include <string>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <set>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <tclap/CmdLine.h>
+
+#include "registration.h"
+#include "trace.h"
+
+#include "nplio.h"
+#include "mrimage.h"
+#include "version.h"
+#include "macros.h"
+
+using namespace std;
+using namespace npl;
+
+/**
+ * @brief Returns true if the name ends with a NIfTI extension
+ */
+bool isNifti(string name)
+{
+	for(string ext : {".nii", ".nii.gz"}) {
+		if(name.size() > ext.size() &&
+				name.compare(name.size()-ext.size(), ext.size(), ext) == 0)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * @brief Lists the NIfTI files in a directory along with their sizes
+ *
+ * @param dir Directory to list
+ *
+ * @return Map from file name to size in bytes
+ */
+map<string, off_t> listNifti(string dir)
+{
+	map<string, off_t> out;
+	DIR* dp = opendir(dir.c_str());
+	if(!dp)
+		throw RUNTIME_ERROR("Could not open directory " + dir);
+
+	struct stat st;
+	while(struct dirent* ent = readdir(dp)) {
+		string name = ent->d_name;
+		if(!isNifti(name))
+			continue;
+		if(stat((dir+"/"+name).c_str(), &st) == 0 && S_ISREG(st.st_mode))
+			out[name] = st.st_size;
+	}
+	closedir(dp);
+	return out;
+}
+
+int main(int argc, char** argv)
+{
+	cerr << "Version: " << __version__ << endl;
+	try {
+	/*
+	 * Command Line
+	 */
+
+	TCLAP::CmdLine cmd("Motion corrects 3D volumes as they arrive in a "
+			"directory. Volumes are processed in name order, once their size "
+			"has stopped changing.", ' ', __version__ );
+
+	TCLAP::ValueArg<string> a_watch("w", "watch", "Directory to watch for "
+			"incoming volumes (*.nii, *.nii.gz).", true, "", "dir", cmd);
+	TCLAP::ValueArg<string> a_ref("r", "ref", "Reference volume. If this is "
+			"not set, then the first volume to arrive is the reference.",
+			false, "", "*.nii.gz", cmd);
+	TCLAP::ValueArg<string> a_outdir("o", "outdir", "Directory to write "
+			"motion corrected volumes to (with the same names as the inputs).",
+			false, "", "dir", cmd);
+	TCLAP::ValueArg<string> a_motion("m", "motion", "Append one line per "
+			"volume to this file: the 9 motion parameters (see "
+			"nplMotionCorr), framewise displacement (mm) and latency (ms).",
+			false, "", "*.txt", cmd);
+	TCLAP::MultiArg<double> a_sigmas("s", "sigmas", "Smoothing standard "
+			"deviations. These are the steps of the registration.", false,
+			"sd", cmd);
+	TCLAP::ValueArg<int> a_maxits("", "maxits", "Maximum optimizer "
+			"iterations per level, bounds the time per volume.", false, 50,
+			"int", cmd);
+	TCLAP::ValueArg<double> a_minstep("", "minstep", "Minimum step",
+			false, 1e-3, "float", cmd);
+	TCLAP::ValueArg<double> a_maxstep("", "maxstep", "Maximum step",
+			false, 1, "float", cmd);
+	TCLAP::ValueArg<int> a_poll("", "poll", "Polling interval (ms).",
+			false, 50, "ms", cmd);
+	TCLAP::ValueArg<int> a_count("n", "count", "Stop after this many "
+			"volumes (0 for no limit).", false, 0, "N", cmd);
+	TCLAP::ValueArg<double> a_idle("", "idle", "Stop after this many seconds "
+			"without a new volume (0 for no limit).", false, 0, "s", cmd);
+	TCLAP::ValueArg<double> a_fdthresh("", "fd-warn", "Warn when framewise "
+			"displacement exceeds this (mm).", false, 0.5, "mm", cmd);
+
+	vector<string> traceformats({"chrome", "json"});
+	TCLAP::ValuesConstraint<string> vc_traceformats(traceformats);
+	TCLAP::ValueArg<string> a_trace("", "trace", "Write the time spent at "
+			"each level of the registration (smoothing, metric and gradient "
+			"evaluations, optimizer, line search), evaluation counts and final "
+			"metric to this file. See --trace-format.", false, "", "*.json", cmd);
+	TCLAP::ValueArg<string> a_traceformat("", "trace-format", "Format of "
+			"--trace, chrome (for chrome://tracing or Perfetto) or json.",
+			false, "chrome", &vc_traceformats, cmd);
+
+	cmd.parse(argc, argv);
+	setTracing(a_trace.isSet());
+
+	vector<double> sigmas({2,1,0.5});
+	if(a_sigmas.isSet())
+		sigmas.assign(a_sigmas.begin(), a_sigmas.end());
+
+	ofstream ofs;
+	if(a_motion.isSet()) {
+		ofs.open(a_motion.getValue(), ios_base::app);
+		if(!ofs.is_open()) {
+			cerr<<"Error opening "<< a_motion.getValue()<<" for writing\n";
+			return -1;
+		}
+	}
+
+	ptr<OnlineMotionCorr> moco;
+	if(a_ref.isSet()) {
+		auto ref = readMRImage(a_ref.getValue());
+		moco.reset(new OnlineMotionCorr(ref, sigmas, a_maxits.getValue(),
+					a_minstep.getValue(), a_maxstep.getValue()));
+	}
+
+	/*
+	 * Poll the directory, a file is ready once its size is unchanged between
+	 * two polls
+	 */
+	using clock = std::chrono::steady_clock;
+	string dir = a_watch.getValue();
+	set<string> done;
+	map<string, off_t> pending;
+	auto lastvol = clock::now();
+	while(a_count.getValue() <= 0 || moco == NULL ||
+			(int)moco->count() < a_count.getValue()) {
+		auto files = listNifti(dir);
+
+		vector<string> ready;
+		for(auto& f : files) {
+			if(done.count(f.first))
+				continue;
+			auto it = pending.find(f.first);
+			if(it != pending.end() && it->second == f.second && f.second > 0)
+				ready.push_back(f.first);
+			else
+				pending[f.first] = f.second;
+		}
+
+		for(auto& name : ready) {
+			auto start = clock::now();
+			done.insert(name);
+			pending.erase(name);
+
+			ptr<MRImage> vol = readMRImage(dir + "/" + name);
+			if(!vol->floatType())
+				vol = dPtrCast<MRImage>(vol->copyCast(FLOAT32));
+
+			if(!moco) {
+				cerr << "Using " << name << " as reference" << endl;
+				moco.reset(new OnlineMotionCorr(vol, sigmas,
+							a_maxits.getValue(), a_minstep.getValue(),
+							a_maxstep.getValue()));
+			}
+
+			auto corrected = moco->correct(vol);
+			if(a_outdir.isSet())
+				corrected->write(a_outdir.getValue() + "/" + name);
+
+			double ms = std::chrono::duration<double, std::milli>(
+					clock::now()-start).count();
+
+			auto& m = moco->motion();
+			cout << name;
+			for(size_t dd=0; dd<9; dd++)
+				cout << " " << m[dd];
+			cout << " FD: " << moco->fd() << " Time: " << ms << "ms" << endl;
+			if(moco->fd() > a_fdthresh.getValue())
+				cerr << "Warning: " << name << " framewise displacement "
+					<< moco->fd() << "mm" << endl;
+
+			if(ofs.is_open()) {
+				for(size_t dd=0; dd<9; dd++)
+					ofs << setw(15) << setprecision(10) << m[dd] << " ";
+				ofs << setw(15) << moco->fd() << " " << setw(15) << ms << endl;
+			}
+
+			lastvol = clock::now();
+			if(a_count.getValue() > 0 && (int)moco->count() >=
+					a_count.getValue())
+				break;
+		}
+
+		if(a_idle.getValue() > 0 && std::chrono::duration<double>(
+					clock::now()-lastvol).count() > a_idle.getValue())
+			break;
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(
+					a_poll.getValue()));
+	}
+
+	if(a_trace.isSet())
+		writeTrace(a_trace.getValue(), a_traceformat.getValue());
+
+	} catch (TCLAP::ArgException &e)  // catch any exceptions
+	{ std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl; }
+}